@@ -29,8 +29,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <immintrin.h>
 
 #include "c-ray.h"
+#include "../vm_perf_timer.h"
+#include "../vm_perf_page.h"
 
 #define VER_MAJOR	1
 #define VER_MINOR	1
@@ -87,12 +91,13 @@ struct camera {
 
 struct thread_data {
 	pthread_t tid;
-	int sl_start, sl_count;
+	unsigned long busy_ns;	/* time spent rendering tiles */
+	int tiles;
 
 	uint32_t *pixels;
 };
 
-static void render_scanline(int xsz, int ysz, int sl, uint32_t *fb, int samples);
+static void render_scanline(int xsz, int ysz, int sl, int x0, int x1, uint32_t *fb, int samples);
 static struct vec3 trace(struct ray ray, int depth);
 static struct vec3 shade(struct sphere *obj, struct spoint *sp, int depth);
 static struct vec3 reflect(struct vec3 v, struct vec3 n);
@@ -143,6 +148,12 @@ static int lnum = 0;
 static struct camera cam;
 static struct thread_data *threads;
 
+/* dynamic tile scheduler, threads grab the next tile from a shared counter */
+#define TILE_W			32
+#define TILE_H			8
+static int tiles_x, num_tiles;
+static int next_tile;
+
 static int start = 0;
 static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
@@ -152,12 +163,12 @@ static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
 static struct vec3 urand[NRAN];
 static int irand[NRAN];
 
-/* render a frame of xsz/ysz dimensions into the provided framebuffer */
-static void render_scanline(int xsz, int ysz, int sl, uint32_t *fb, int samples) {
+/* render pixels [x0, x1) of scanline sl into the provided framebuffer */
+static void render_scanline(int xsz, int ysz, int sl, int x0, int x1, uint32_t *fb, int samples) {
 	int i, s;
 	double rcp_samples = 1.0 / (double)samples;
 
-	for(i=0; i<xsz; i++) {
+	for(i=x0; i<x1; i++) {
 		double r, g, b;
 		r = g = b = 0.0;
 
@@ -430,6 +441,7 @@ static void load_scene() {
 
 	obj_list = malloc(sizeof(struct sphere));
 	obj_list->next = 0;
+	lnum = 0;	/* the scene is reloaded by every render */
 
 	int l;
 	for(l = 0 ; l < sizeof(scene_lines)/sizeof(char*); l++){
@@ -495,31 +507,17 @@ static void load_scene() {
 }
 
 
-/* provide a millisecond-resolution timer for each system */
-#if defined(unix) || defined(__unix__)
-#include <time.h>
-#include <sys/time.h>
+/* millisecond and nanosecond timers on the shared vm_perf clock */
 static unsigned long get_msec(void) {
-	static struct timeval timeval, first_timeval;
-
-	gettimeofday(&timeval, 0);
-	if(first_timeval.tv_sec == 0) {
-		first_timeval = timeval;
-		return 0;
-	}
-	return (timeval.tv_sec - first_timeval.tv_sec) * 1000 + (timeval.tv_usec - first_timeval.tv_usec) / 1000;
+	return timer_now_ns() / 1000000UL;
 }
-#elif defined(__WIN32__) || defined(WIN32)
-#include <windows.h>
-static unsigned long get_msec(void) {
-	return GetTickCount();
+
+static unsigned long get_nsec(void) {
+	return timer_now_ns();
 }
-#else
-#error "I don't know how to measure time on your platform"
-#endif
 
 static void *thread_func(void *tdata) {
-	int i;
+	int tile, y;
 	struct thread_data *td = (struct thread_data*)tdata;
 
 	pthread_mutex_lock(&start_mutex);
@@ -528,8 +526,18 @@ static void *thread_func(void *tdata) {
 	}
 	pthread_mutex_unlock(&start_mutex);
 
-	for(i=0; i<td->sl_count; i++) {
-		render_scanline(xres, yres, i + td->sl_start, td->pixels, rays_per_pixel);
+	while((tile = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED)) < num_tiles) {
+		unsigned long t0 = get_nsec();
+		int x0 = (tile % tiles_x) * TILE_W;
+		int y0 = (tile / tiles_x) * TILE_H;
+		int x1 = MIN(x0 + TILE_W, xres);
+		int y1 = MIN(y0 + TILE_H, yres);
+
+		for(y=y0; y<y1; y++) {
+			render_scanline(xres, yres, y, x0, x1, td->pixels, rays_per_pixel);
+		}
+		td->busy_ns += get_nsec() - t0;
+		td->tiles++;
 	}
 
 	return 0;
@@ -569,6 +577,239 @@ static void render(int xsz, int ysz, uint32_t *fb, int samples) {
 	}
 }
 
+/*
+ * vm_perf: data oriented SIMD renderer. The spheres are copied into a
+ * structure of arrays and primary rays are traced in packets of 4 (AVX2) or
+ * 8 (AVX-512) lanes, see c-ray_packet.h.
+ */
+static struct {
+	int num;
+	double *x, *y, *z, *rad, *pos_sq, *rad_sq;
+	double *r, *g, *b, *spow, *refl;
+} soa;
+
+static int soa_load(void) {
+	struct sphere *iter;
+	double *mem;
+	int i = 0;
+
+	soa.num = 0;
+	for(iter = obj_list->next; iter; iter = iter->next) soa.num++;
+	if(!(mem = page_alloc(11 * soa.num * sizeof *mem))) {
+		perror("malloc");
+		return -1;
+	}
+	soa.x = mem; soa.y = soa.x + soa.num; soa.z = soa.y + soa.num;
+	soa.rad = soa.z + soa.num; soa.pos_sq = soa.rad + soa.num; soa.rad_sq = soa.pos_sq + soa.num;
+	soa.r = soa.rad_sq + soa.num; soa.g = soa.r + soa.num; soa.b = soa.g + soa.num;
+	soa.spow = soa.b + soa.num; soa.refl = soa.spow + soa.num;
+
+	for(iter = obj_list->next; iter; iter = iter->next, i++) {
+		soa.x[i] = iter->pos.x; soa.y[i] = iter->pos.y; soa.z[i] = iter->pos.z;
+		soa.rad[i] = iter->rad;
+		soa.pos_sq[i] = SQ(iter->pos.x) + SQ(iter->pos.y) + SQ(iter->pos.z);
+		soa.rad_sq[i] = SQ(iter->rad);
+		soa.r[i] = iter->mat.col.x; soa.g[i] = iter->mat.col.y; soa.b[i] = iter->mat.col.z;
+		soa.spow[i] = iter->mat.spow; soa.refl[i] = iter->mat.refl;
+	}
+	return 0;
+}
+
+/* AVX2, 4 lanes, masks are vectors */
+#define CRAY_TARGET		__attribute__((target("avx2")))
+#define CRAY_FN(name)	name##_avx2
+#define W				4
+#define VEC				__m256d
+#define VMASK			__m256d
+#define SET1			_mm256_set1_pd
+#define LOADU			_mm256_loadu_pd
+#define STOREU			_mm256_storeu_pd
+#define ADD				_mm256_add_pd
+#define SUB				_mm256_sub_pd
+#define MUL				_mm256_mul_pd
+#define DIV				_mm256_div_pd
+#define SQRT			_mm256_sqrt_pd
+#define VMAX			_mm256_max_pd
+#define VMIN			_mm256_min_pd
+#define CMPLT(a, b)		_mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define CMPGT(a, b)		_mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define CMPGE(a, b)		_mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define MAND			_mm256_and_pd
+#define MOR				_mm256_or_pd
+#define MANDNOT(a, b)	_mm256_andnot_pd(b, a)			/* a & ~b */
+#define MANY(m)			(_mm256_movemask_pd(m) != 0)
+#define MNONE			_mm256_setzero_pd()
+#define BLEND(m, a, b)	_mm256_blendv_pd(a, b, m)		/* b where m is set */
+#define LANES(n)		CMPLT(_mm256_set_pd(3, 2, 1, 0), SET1((double)(n)))
+#include "c-ray_packet.h"
+#undef CRAY_TARGET
+#undef CRAY_FN
+#undef W
+#undef VEC
+#undef VMASK
+#undef SET1
+#undef LOADU
+#undef STOREU
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef SQRT
+#undef VMAX
+#undef VMIN
+#undef CMPLT
+#undef CMPGT
+#undef CMPGE
+#undef MAND
+#undef MOR
+#undef MANDNOT
+#undef MANY
+#undef MNONE
+#undef BLEND
+#undef LANES
+
+/* AVX-512, 8 lanes, masks are k registers */
+#define CRAY_TARGET		__attribute__((target("avx512f")))
+#define CRAY_FN(name)	name##_avx512
+#define W				8
+#define VEC				__m512d
+#define VMASK			__mmask8
+#define SET1			_mm512_set1_pd
+#define LOADU			_mm512_loadu_pd
+#define STOREU			_mm512_storeu_pd
+#define ADD				_mm512_add_pd
+#define SUB				_mm512_sub_pd
+#define MUL				_mm512_mul_pd
+#define DIV				_mm512_div_pd
+#define SQRT			_mm512_sqrt_pd
+#define VMAX			_mm512_max_pd
+#define VMIN			_mm512_min_pd
+#define CMPLT(a, b)		_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#define CMPGT(a, b)		_mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)
+#define CMPGE(a, b)		_mm512_cmp_pd_mask(a, b, _CMP_GE_OQ)
+#define MAND(a, b)		((VMASK)((a) & (b)))
+#define MOR(a, b)		((VMASK)((a) | (b)))
+#define MANDNOT(a, b)	((VMASK)((a) & ~(b)))
+#define MANY(m)			((m) != 0)
+#define MNONE			((VMASK)0)
+#define BLEND(m, a, b)	_mm512_mask_blend_pd(m, a, b)
+#define LANES(n)		((VMASK)((1u << (n)) - 1))
+#include "c-ray_packet.h"
+#undef CRAY_TARGET
+#undef CRAY_FN
+#undef W
+#undef VEC
+#undef VMASK
+#undef SET1
+#undef LOADU
+#undef STOREU
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef SQRT
+#undef VMAX
+#undef VMIN
+#undef CMPLT
+#undef CMPGT
+#undef CMPGE
+#undef MAND
+#undef MOR
+#undef MANDNOT
+#undef MANY
+#undef MNONE
+#undef BLEND
+#undef LANES
+
+/* compare every CRAY_CHECK_STRIDE-th scanline of fb with the scalar renderer */
+#define CRAY_CHECK_STRIDE	16
+#define CRAY_CHECK_TOL		2	/* per channel, the packet code sums reflections in another order */
+
+static void cray_check(const uint32_t *fb, int samples, struct cray_simd_check *check) {
+	uint32_t *ref;
+	int x, y, sh;
+
+	if(!(ref = page_alloc(xres * yres * sizeof *ref))) {
+		perror("malloc");
+		return;
+	}
+	for(y=0; y<yres; y+=CRAY_CHECK_STRIDE) {
+		render_scanline(xres, yres, y, 0, xres, ref, samples);
+		for(x=0; x<xres; x++) {
+			const uint32_t p = fb[y * xres + x], q = ref[y * xres + x];
+			check->pixels_checked++;
+			for(sh=0; sh<=16; sh+=8) {
+				if(abs((int)((p >> sh) & 0xff) - (int)((q >> sh) & 0xff)) > CRAY_CHECK_TOL) {
+					check->mismatched++;
+					break;
+				}
+			}
+		}
+	}
+	page_free(ref);
+}
+
+int cray_simd(const int _xres, const int _yres, const int _rays_per_pixel, struct cray_simd_check *check) {
+	int i;
+	unsigned long rend_time, start_time;
+	uint32_t *pixels;
+	struct cray_simd_check chk = {0};
+
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) {
+		chk.isa = "avx512f";
+		chk.lanes = 8;
+	} else if(__builtin_cpu_supports("avx2")) {
+		chk.isa = "avx2";
+		chk.lanes = 4;
+	} else {
+		chk.isa = "none";
+		if(check) *check = chk;
+		return -1;
+	}
+
+	xres = _xres;
+	yres = _yres;
+	rays_per_pixel = _rays_per_pixel;
+
+	if(!(pixels = page_alloc(xres * yres * sizeof *pixels))) {
+		perror("pixel buffer allocation failed");
+		return -1;
+	}
+	load_scene();
+	if(soa_load() == -1) {
+		page_free(pixels);
+		return -1;
+	}
+
+	/* initialize the random number tables for the jitter */
+	for(i=0; i<NRAN; i++) urand[i].x = (double)rand() / RAND_MAX - 0.5;
+	for(i=0; i<NRAN; i++) urand[i].y = (double)rand() / RAND_MAX - 0.5;
+	for(i=0; i<NRAN; i++) irand[i] = (int)(NRAN * ((double)rand() / RAND_MAX));
+
+	start_time = get_msec();
+	if(chk.lanes == 8)
+		render_simd_avx512(xres, yres, pixels, rays_per_pixel);
+	else
+		render_simd_avx2(xres, yres, pixels, rays_per_pixel);
+	rend_time = get_msec() - start_time;
+
+	cray_check(pixels, rays_per_pixel, &chk);
+	if(check) *check = chk;
+
+	page_free(soa.x);
+	page_free(pixels);
+	struct sphere *iter = obj_list->next;
+	while(iter){
+		struct sphere *s = iter;
+		iter = iter->next;
+		free(s);
+	}
+	free(obj_list);
+
+	return rend_time;
+}
+
 int cray_f(const int _xres, const int _yres, const int _rays_per_pixel) {
 	int i;
 	unsigned long rend_time, start_time;
@@ -584,7 +825,7 @@ int cray_f(const int _xres, const int _yres, const int _rays_per_pixel) {
 		return 0;
 	}
 
-	if(!(pixels = malloc(xres * yres * sizeof *pixels))) {
+	if(!(pixels = page_alloc(xres * yres * sizeof *pixels))) {
 		perror("pixel buffer allocation failed");
 		return EXIT_FAILURE;
 	}
@@ -612,7 +853,7 @@ int cray_f(const int _xres, const int _yres, const int _rays_per_pixel) {
 	fflush(outfile);
 	if(outfile != stdout) fclose(outfile);
 
-	free(pixels);
+	page_free(pixels);
 	struct sphere *iter = obj_list->next;
 	while(iter){
 		struct sphere *s = iter;
@@ -624,11 +865,10 @@ int cray_f(const int _xres, const int _yres, const int _rays_per_pixel) {
 	return rend_time;
 };
 
-int cray_mt(int thread_num, const int _xres, const int _yres, const int _rays_per_pixel) {
+int cray_mt(int thread_num, const int *cpus, const int _xres, const int _yres, const int _rays_per_pixel, struct cray_stats *stats) {
 	int i;
 	unsigned long rend_time, start_time;
 	uint32_t *pixels;
-	double sl, sl_per_thread;
 
 	xres = _xres;
 	yres = _yres;
@@ -640,7 +880,7 @@ int cray_mt(int thread_num, const int _xres, const int _yres, const int _rays_pe
 		return 0;
 	}
 
-	if(!(pixels = malloc(xres * yres * sizeof *pixels))) {
+	if(!(pixels = page_alloc(xres * yres * sizeof *pixels))) {
 		perror("pixel buffer allocation failed");
 		return EXIT_FAILURE;
 	}
@@ -651,30 +891,39 @@ int cray_mt(int thread_num, const int _xres, const int _yres, const int _rays_pe
 	for(i=0; i<NRAN; i++) urand[i].y = (double)rand() / RAND_MAX - 0.5;
 	for(i=0; i<NRAN; i++) irand[i] = (int)(NRAN * ((double)rand() / RAND_MAX));
 
-	if(thread_num > yres) {
-		fprintf(stderr, "more threads than scanlines specified, reducing number of threads to %d\n", yres);
-		thread_num = yres;
+	tiles_x = (xres + TILE_W - 1) / TILE_W;
+	num_tiles = tiles_x * ((yres + TILE_H - 1) / TILE_H);
+	next_tile = 0;
+	start = 0;
+
+	if(thread_num > num_tiles) {
+		fprintf(stderr, "more threads than tiles specified, reducing number of threads to %d\n", num_tiles);
+		thread_num = num_tiles;
 	}
 
-	if(!(threads = malloc(thread_num * sizeof *threads))) {
+	if(!(threads = calloc(thread_num, sizeof *threads))) {
 		perror("failed to allocate thread table");
 		return EXIT_FAILURE;
 	}
 
-	sl = 0.0;
-	sl_per_thread = (double)yres / (double)thread_num;
 	for(i=0; i<thread_num; i++) {
-		threads[i].sl_start = (int)sl;
-		sl += sl_per_thread;
-		threads[i].sl_count = (int)sl - threads[i].sl_start;
+		pthread_attr_t attr;
 		threads[i].pixels = pixels;
 
-		if(pthread_create(&threads[i].tid, 0, thread_func, &threads[i]) != 0) {
+		/* optionally pin thread i to cpus[i] */
+		pthread_attr_init(&attr);
+		if(cpus) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+		}
+		if(pthread_create(&threads[i].tid, &attr, thread_func, &threads[i]) != 0) {
 			perror("failed to spawn thread");
 			return EXIT_FAILURE;
 		}
+		pthread_attr_destroy(&attr);
 	}
-	threads[thread_num - 1].sl_count = yres - threads[thread_num - 1].sl_start;
 
 	//fprintf(stderr, VER_STR, VER_MAJOR, VER_MINOR);
 
@@ -689,6 +938,25 @@ int cray_mt(int thread_num, const int _xres, const int _yres, const int _rays_pe
 	}
 	rend_time = get_msec() - start_time;
 
+	/* per thread busy time, the spread shows load imbalance and descheduled vCPUs */
+	if(stats) {
+		unsigned long busy_sum = 0;
+		memset(stats, 0, sizeof *stats);
+		stats->num_threads = thread_num;
+		stats->num_tiles = num_tiles;
+		stats->busy_min = (float)threads[0].busy_ns / 1e6f;
+		stats->tiles_min = threads[0].tiles;
+		for(i=0; i<thread_num; i++) {
+			float busy = (float)threads[i].busy_ns / 1e6f;
+			busy_sum += threads[i].busy_ns;
+			stats->busy_min = MIN(stats->busy_min, busy);
+			stats->busy_max = MAX(stats->busy_max, busy);
+			stats->tiles_min = MIN(stats->tiles_min, threads[i].tiles);
+			stats->tiles_max = MAX(stats->tiles_max, threads[i].tiles);
+		}
+		stats->busy_avg = ((float)busy_sum / 1e6f) / thread_num;
+	}
+
 	/* output statistics to stderr */
 	//fprintf(stderr, "Rendering took: %lu seconds (%lu milliseconds)\n", rend_time / 1000, rend_time);
 
@@ -702,7 +970,7 @@ int cray_mt(int thread_num, const int _xres, const int _yres, const int _rays_pe
 	fflush(outfile);
 	if(outfile != stdout) fclose(outfile);
 
-	free(pixels);
+	page_free(pixels);
 	free(threads);
 	struct sphere *iter = obj_list->next;
 	while(iter){
@@ -1,5 +1,24 @@
+#ifndef C_RAY_H
+#define C_RAY_H
 
 #define FILE_OUT "/dev/null"
 
-int cray_mt(int thread_num, const int xres, const int yres, const int rays_per_pixel);
+struct cray_stats {
+	int num_threads;
+	int num_tiles;
+	float busy_min, busy_avg, busy_max;	/* milliseconds each thread spent rendering tiles */
+	int tiles_min, tiles_max;
+};
+
+struct cray_simd_check {
+	const char *isa;			/* widest ISA the packets were traced with */
+	int lanes;
+	long pixels_checked;		/* pixels of the sampled scanlines compared with the scalar render */
+	long mismatched;
+};
+
+int cray_simd(const int xres, const int yres, const int rays_per_pixel, struct cray_simd_check *check);
+int cray_mt(int thread_num, const int *cpus, const int xres, const int yres, const int rays_per_pixel, struct cray_stats *stats);
 int cray_f(const int xres, const int yres, const int rays_per_pixel);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * vm_perf: ray packet tracer, included once per ISA by c-ray.c after it has
+ * defined the vector macros (VEC, VMASK, W, SET1, ADD, ...), CRAY_TARGET and
+ * CRAY_FN. Each lane of a packet is one primary ray. The spheres come from
+ * the structure of arrays copy in soa, and the reflection recursion of trace()
+ * becomes a loop that carries a per lane weight.
+ */
+
+/* lanes of the packet (o, d) that hit sphere s, with the nearest valid distance in dist */
+CRAY_TARGET static inline VMASK CRAY_FN(packet_sphere)(const VEC o[3], const VEC d[3], const VEC a, int s, VEC *dist) {
+	const VEC px = SET1(soa.x[s]), py = SET1(soa.y[s]), pz = SET1(soa.z[s]);
+	const VEC zero = SET1(0.0), one = SET1(1.0), two = SET1(2.0), eps = SET1(ERR_MARGIN);
+	VEC b, c, disc, sq, t1, t2;
+	VMASK hit, miss;
+
+	b = ADD(ADD(MUL(MUL(two, d[0]), SUB(o[0], px)), MUL(MUL(two, d[1]), SUB(o[1], py))), MUL(MUL(two, d[2]), SUB(o[2], pz)));
+	c = ADD(SET1(soa.pos_sq[s]), ADD(ADD(MUL(o[0], o[0]), MUL(o[1], o[1])), MUL(o[2], o[2])));
+	c = SUB(SUB(c, MUL(two, ADD(ADD(MUL(px, o[0]), MUL(py, o[1])), MUL(pz, o[2])))), SET1(soa.rad_sq[s]));
+
+	disc = SUB(MUL(b, b), MUL(MUL(SET1(4.0), a), c));
+	hit = CMPGE(disc, zero);
+	if(!MANY(hit)) {
+		if(dist) *dist = zero;
+		return hit;
+	}
+
+	sq = SQRT(VMAX(disc, zero));
+	t1 = DIV(ADD(SUB(zero, b), sq), MUL(two, a));
+	t2 = DIV(SUB(SUB(zero, b), sq), MUL(two, a));
+
+	miss = MOR(MAND(CMPLT(t1, eps), CMPLT(t2, eps)), MAND(CMPGT(t1, one), CMPGT(t2, one)));
+	hit = MANDNOT(hit, miss);
+
+	if(dist) {
+		t1 = BLEND(CMPLT(t1, eps), t1, t2);
+		t2 = BLEND(CMPLT(t2, eps), t2, t1);
+		*dist = VMIN(t1, t2);
+	}
+	return hit;
+}
+
+#define DOT3(a, b)	ADD(ADD(MUL((a)[0], (b)[0]), MUL((a)[1], (b)[1])), MUL((a)[2], (b)[2]))
+
+/* trace count (<= W) primary rays starting at pixel (x0, y) into fb */
+CRAY_TARGET static void CRAY_FN(render_packet)(int xsz, int x0, int y, int count, uint32_t *fb, int samples) {
+	const VEC zero = SET1(0.0), two = SET1(2.0);
+	double acc[3][W] = {{0}};
+	double lane_d[W];
+	int i, l, s, sph, depth;
+
+	for(s=0; s<samples; s++) {
+		double ro[3][W], rd[3][W];
+		VEC o[3], d[3], col[3], weight = SET1(1.0);
+		VMASK active = LANES(count);
+
+		for(l=0; l<W; l++) {
+			struct ray ray = get_primary_ray(x0 + (l < count ? l : 0), y, s);
+			ro[0][l] = ray.orig.x; ro[1][l] = ray.orig.y; ro[2][l] = ray.orig.z;
+			rd[0][l] = ray.dir.x; rd[1][l] = ray.dir.y; rd[2][l] = ray.dir.z;
+		}
+		for(i=0; i<3; i++) {
+			o[i] = LOADU(ro[i]);
+			d[i] = LOADU(rd[i]);
+			col[i] = zero;
+		}
+
+		for(depth=0; depth<MAX_RAY_DEPTH && MANY(active); depth++) {
+			const VEC a = DOT3(d, d);
+			VEC best = zero, idx = SET1(-1.0), pos[3], cen[3], n[3], vref[3], mat[3], spow, refl, len, dot;
+			double g[9][W];
+			VMASK hit = MNONE;
+
+			/* nearest intersection of every lane */
+			for(sph=0; sph<soa.num; sph++) {
+				VEC t;
+				VMASK h = MAND(CRAY_FN(packet_sphere)(o, d, a, sph, &t), active);
+				VMASK closer = MANDNOT(h, MANDNOT(hit, CMPLT(t, best)));
+				best = BLEND(closer, best, t);
+				idx = BLEND(closer, idx, SET1((double)sph));
+				hit = MOR(hit, closer);
+			}
+			active = hit;
+			if(!MANY(active)) break;
+
+			/* gather the hit sphere of every lane */
+			STOREU(lane_d, idx);
+			for(l=0; l<W; l++) {
+				int k = lane_d[l] < 0.0 ? 0 : (int)lane_d[l];
+				g[0][l] = soa.x[k]; g[1][l] = soa.y[k]; g[2][l] = soa.z[k];
+				g[3][l] = soa.rad[k];
+				g[4][l] = soa.r[k]; g[5][l] = soa.g[k]; g[6][l] = soa.b[k];
+				g[7][l] = soa.spow[k]; g[8][l] = soa.refl[k];
+			}
+			for(i=0; i<3; i++) {
+				cen[i] = LOADU(g[i]);
+				mat[i] = LOADU(g[4 + i]);
+				pos[i] = ADD(o[i], MUL(d[i], best));
+				n[i] = DIV(SUB(pos[i], cen[i]), LOADU(g[3]));
+			}
+			spow = LOADU(g[7]);
+			refl = LOADU(g[8]);
+
+			/* reflect(), then NORMALIZE() */
+			dot = DOT3(d, n);
+			for(i=0; i<3; i++)
+				vref[i] = SUB(d[i], MUL(MUL(two, dot), n[i]));
+			len = SQRT(DOT3(vref, vref));
+			for(i=0; i<3; i++)
+				vref[i] = DIV(vref[i], len);
+
+			/* direct illumination, as in shade() */
+			for(i=0; i<lnum; i++) {
+				VEC ldir[3], idiff, rdot, ispec;
+				double rdot_d[W], spow_d[W], ispec_d[W];
+				VMASK shadow = MNONE, lit;
+
+				ldir[0] = SUB(SET1(lights[i].x), pos[0]);
+				ldir[1] = SUB(SET1(lights[i].y), pos[1]);
+				ldir[2] = SUB(SET1(lights[i].z), pos[2]);
+
+				const VEC la = DOT3(ldir, ldir);
+				for(sph=0; sph<soa.num; sph++) {
+					shadow = MOR(shadow, CRAY_FN(packet_sphere)(pos, ldir, la, sph, NULL));
+				}
+				lit = MANDNOT(active, shadow);
+				if(!MANY(lit)) continue;
+
+				len = SQRT(la);
+				for(l=0; l<3; l++)
+					ldir[l] = DIV(ldir[l], len);
+
+				idiff = VMAX(DOT3(n, ldir), zero);
+				rdot = VMAX(DOT3(vref, ldir), zero);
+
+				/* there is no vector pow(), take it per lane */
+				STOREU(rdot_d, rdot);
+				STOREU(spow_d, spow);
+				for(l=0; l<W; l++)
+					ispec_d[l] = spow_d[l] > 0.0 ? pow(rdot_d[l], spow_d[l]) : 0.0;
+				ispec = LOADU(ispec_d);
+
+				for(l=0; l<3; l++)
+					col[l] = ADD(col[l], BLEND(lit, zero, MUL(weight, ADD(MUL(idiff, mat[l]), ispec))));
+			}
+
+			/* continue along the reflection ray of the reflective lanes */
+			active = MAND(active, CMPGT(refl, zero));
+			weight = MUL(weight, refl);
+			for(i=0; i<3; i++) {
+				o[i] = pos[i];
+				d[i] = MUL(vref[i], SET1(RAY_MAG));
+			}
+		}
+
+		for(i=0; i<3; i++) {
+			STOREU(lane_d, col[i]);
+			for(l=0; l<W; l++)
+				acc[i][l] += lane_d[l];
+		}
+	}
+
+	for(l=0; l<count; l++) {
+		const double rcp_samples = 1.0 / (double)samples;
+		double r = acc[0][l] * rcp_samples, gr = acc[1][l] * rcp_samples, b = acc[2][l] * rcp_samples;
+		fb[y * xsz + x0 + l] = ((uint32_t)(MIN(r, 1.0) * 255.0) & 0xff) << RSHIFT |
+								((uint32_t)(MIN(gr, 1.0) * 255.0) & 0xff) << GSHIFT |
+								((uint32_t)(MIN(b, 1.0) * 255.0) & 0xff) << BSHIFT;
+	}
+}
+
+CRAY_TARGET static void CRAY_FN(render_simd)(int xsz, int ysz, uint32_t *fb, int samples) {
+	int x, y;
+	for(y=0; y<ysz; y++) {
+		for(x=0; x<xsz; x+=W) {
+			CRAY_FN(render_packet)(xsz, x, y, MIN(W, xsz - x), fb, samples);
+		}
+	}
+}
+
+#undef DOT3
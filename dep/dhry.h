@@ -434,4 +434,16 @@ typedef struct record
       } Rec_Type, *Rec_Pointer;
 
 
-int dhry (int duration);
+#define DHRY_VAX_MIPS 1757
+                /* Dhrystones per second of the VAX 11/780, 1 DMIPS */
+
+struct dhry_stats {
+  int num_threads;
+  double time_s;
+  unsigned long loops;          /* all threads */
+  unsigned long loops_min;      /* per thread spread */
+  unsigned long loops_max;
+};
+
+int dhry (int duration);		/* vm_perf: milliseconds */
+int dhry_mt (int thread_num, const int *cpus, int duration, struct dhry_stats *stats);
@@ -37,30 +37,34 @@ char SCCSid[] = "@(#) @(#)dhry_1.c:3.4 -- 5/15/91 19:30:21";
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include "dhry.h"
+#include "../vm_perf_timer.h"
 
-unsigned long Run_Index;
-int Run_Index_Stop = 0;
+/*
+ * vm_perf: every "global" is thread local so one instance can run per vCPU,
+ * and the runs stop at a shared deadline instead of on SIGALRM.
+ */
+#define DHRY_CHECK_MASK 0xfff
+                /* read the clock once every 4096 runs */
 
-void report()
-{
-	//fprintf(stderr,"COUNT|%ld|1|lps\n", Run_Index);
-	//exit(0);
-	Run_Index_Stop = 1;
-}
+static uint64_t dhry_deadline;
+                /* end of the run in timer_now_ns() time */
+
+__thread unsigned long Run_Index;
 
 /* Global Variables: */
 
-Rec_Pointer     Ptr_Glob,
-                Next_Ptr_Glob;
-int             Int_Glob;
-Boolean         Bool_Glob;
-char            Ch_1_Glob,
-                Ch_2_Glob;
-int             Arr_1_Glob [50];
-int             Arr_2_Glob [50] [50];
+__thread Rec_Pointer     Ptr_Glob,
+                         Next_Ptr_Glob;
+__thread int             Int_Glob;
+__thread Boolean         Bool_Glob;
+__thread char            Ch_1_Glob,
+                         Ch_2_Glob;
+__thread int             Arr_1_Glob [50];
+__thread int             Arr_2_Glob [50] [50];
 
 Enumeration     Func_1 ();
   /* forward declaration necessary since Enumeration may not simply be int */
@@ -109,18 +113,11 @@ extern void Proc_6(Enumeration, Enumeration *);
 extern void Proc_7(One_Fifty, One_Fifty, One_Fifty *);
 extern void Proc_8(Arr_1_Dim, Arr_2_Dim, int, int);
 
-void wake_me(seconds, func)
-	int seconds;
-	void (*func)();
-{
-	/* set up the signal handler */
-	signal(SIGALRM, func);
-	/* get the clock running */
-	alarm(seconds);
-}
+static int dhry_start = 0;
+static pthread_mutex_t dhry_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dhry_start_cond = PTHREAD_COND_INITIALIZER;
 
-int dhry (duration)
-int	duration;
+static unsigned long dhry_run (void)
   /* main program, corresponds to procedures        */
   /* Main and Proc_0 in the Ada version             */
 {
@@ -177,7 +174,6 @@ int	duration;
 #endif /* PRATTLE */
 
   Run_Index = 0;
-  wake_me(duration, report);
 
   /***************/
   /* Start timer */
@@ -193,7 +189,9 @@ int	duration;
 #endif
 #endif /* SELF_TIMED */
 
-  for (Run_Index = 1; !Run_Index_Stop; ++Run_Index)
+  for (Run_Index = 1;
+       (Run_Index & DHRY_CHECK_MASK) || timer_now_ns() < __atomic_load_n(&dhry_deadline, __ATOMIC_RELAXED);
+       ++Run_Index)
   {
 
     Proc_5();
@@ -339,6 +337,83 @@ int	duration;
 	return Run_Index;
 }
 
+/* vm_perf: duration in milliseconds */
+int dhry (duration)
+int	duration;
+{
+  __atomic_store_n(&dhry_deadline, timer_now_ns() + duration * 1000000ULL, __ATOMIC_RELAXED);
+  return (int) dhry_run();
+}
+
+struct dhry_thread {
+  pthread_t tid;
+  unsigned long loops;
+};
+
+static void *dhry_thread_func (void *arg)
+{
+  struct dhry_thread *t = (struct dhry_thread*) arg;
+
+  pthread_mutex_lock(&dhry_start_mutex);
+  while (!dhry_start)
+    pthread_cond_wait(&dhry_start_cond, &dhry_start_mutex);
+  pthread_mutex_unlock(&dhry_start_mutex);
+
+  t->loops = dhry_run();
+  return NULL;
+}
+
+/* One Dhrystone instance per thread, thread i pinned to cpus[i] when cpus is given */
+int dhry_mt (int thread_num, const int *cpus, int duration, struct dhry_stats *stats)
+{
+  struct dhry_thread *threads;
+  int i, started = 0;
+
+  if (!(threads = calloc(thread_num, sizeof *threads))) {
+    perror("calloc");
+    return 1;
+  }
+
+  dhry_start = 0;
+  for (i = 0; i < thread_num; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpus) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i], &set);
+      pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+    }
+    if (pthread_create(&threads[i].tid, &attr, dhry_thread_func, &threads[i]) != 0) {
+      perror("pthread_create");
+      pthread_attr_destroy(&attr);
+      break;
+    }
+    pthread_attr_destroy(&attr);
+    started++;
+  }
+
+  pthread_mutex_lock(&dhry_start_mutex);
+  const uint64_t start = timer_now_ns();
+  __atomic_store_n(&dhry_deadline, start + duration * 1000000ULL, __ATOMIC_RELAXED);
+  dhry_start = 1;
+  pthread_cond_broadcast(&dhry_start_cond);
+  pthread_mutex_unlock(&dhry_start_mutex);
+
+  memset(stats, 0, sizeof *stats);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i].tid, NULL);
+    stats->loops += threads[i].loops;
+    if (i == 0 || threads[i].loops < stats->loops_min) stats->loops_min = threads[i].loops;
+    if (threads[i].loops > stats->loops_max) stats->loops_max = threads[i].loops;
+  }
+  stats->time_s = (timer_now_ns() - start) / 1e9;
+  stats->num_threads = started;
+
+  free(threads);
+  return started == thread_num ? 0 : 1;
+}
+
 
 void Proc_1 (REG Rec_Pointer Ptr_Val_Par)
     /* executed once */
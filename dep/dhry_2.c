@@ -40,8 +40,8 @@
         /* i.e. no register variables   */
 #endif
 
-extern  int     Int_Glob;
-extern  char    Ch_1_Glob;
+extern  __thread int     Int_Glob;
+extern  __thread char    Ch_1_Glob;
 
 void Proc_6(Enumeration, Enumeration *);
 void Proc_7(One_Fifty, One_Fifty, One_Fifty *);
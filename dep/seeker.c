@@ -1,59 +1,166 @@
+/*
+ * Random and sequential read test of a raw block device, derived from
+ * Seeker v2.0 http://www.linuxinsight.com/how_fast_is_your_disk.html
+ *
+ * The device is only ever opened read-only. Random and sequential reads use
+ * O_DIRECT from SEEKER_THREADS workers, every read is timed individually and
+ * recorded in a log-bucketed latency histogram.
+ */
 #define _LARGEFILE64_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
-#include <signal.h>
+#include <pthread.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 
 #include "seeker.h"
+#include "../vm_perf_hist.h"
+#include "../vm_perf_timer.h"
 
-static int seeker_done = 0;
-static time_t start, end;
-void done(){
-	time(&end);
+struct seeker_worker{
+	pthread_t tid;
+	int fd;
+	size_t io_size;
+	int random;
+	off64_t start;				// Region of the device this worker reads, in bytes
+	off64_t size;
+	unsigned int seed;
+	volatile int *stop;
+
+	unsigned long ios;
+	struct lat_hist hist;
+};
+
+static int seeker_start = 0;
+static pthread_mutex_t seeker_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seeker_start_cond = PTHREAD_COND_INITIALIZER;
 
-	if (end < start + SEEKER_TIMEOUT) {
-		//printf(".");
-		alarm(1);
-		return;
+static void *seeker_thread(void *arg){
+	struct seeker_worker *w = (struct seeker_worker*) arg;
+	const off64_t num_ios = w->size / w->io_size;
+	off64_t next = 0;
+	void *buffer;
+
+	if(posix_memalign(&buffer, 4096, w->io_size) != 0){	// Needed by O_DIRECT
+		return NULL;
 	}
 
-	seeker_done = 1;
+	pthread_mutex_lock(&seeker_start_mutex);
+	while(!seeker_start) {
+		pthread_cond_wait(&seeker_start_cond, &seeker_start_mutex);
+	}
+	pthread_mutex_unlock(&seeker_start_mutex);
+
+	while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+		off64_t idx;
+		if(w->random){
+			idx = (((off64_t)rand_r(&w->seed) << 31) | rand_r(&w->seed)) % num_ios;
+		}else{
+			idx = next++;
+			if(next >= num_ios)
+				next = 0;
+		}
 
-};
+		const uint64_t t0 = timer_now_ns();
+		if(pread64(w->fd, buffer, w->io_size, w->start + idx * (off64_t)w->io_size) < 0){
+			perror("pread");
+			break;
+		}
+		hist_add(&w->hist, timer_now_ns() - t0);
+		w->ios++;
+	}
 
-int seeker(struct disk_stat * r, const char * devname, const int disk_io_size[DISK_NUM_IO_TYPES]){
-	int fd;
-	unsigned long count=0, dev_size=0, block_size=0, num_blocks=0;
-	char * buffer;
-	off64_t offset=0, offset_saved=0;
+	free(buffer);
+	return NULL;
+}
 
-	//setvbuf(stdout, NULL, _IONBF, 0);
+static int seeker_run(struct disk_stat * r, const int t, const int fd, const off64_t start, const off64_t size,
+					  const size_t io_size, const int random, const int num_threads){
+	struct seeker_worker *w;
+	volatile int stop = 0;
+	int i, started = 0;
 
-	/*
-	printf("Seeker v2.0, 2007-01-15, "
-	       "http://www.linuxinsight.com/how_fast_is_your_disk.html\n");
+	if((w = calloc(num_threads, sizeof(struct seeker_worker))) == NULL){
+		perror("calloc");
+		return 1;
+	}
+
+	// Random workers share the whole region, sequential workers each stream their own stripe
+	const off64_t stripe = random ? size : (size / num_threads) & ~((off64_t)io_size - 1);
+	for(i=0; i < num_threads; ++i){
+		w[i].fd = fd;
+		w[i].io_size = io_size;
+		w[i].random = random;
+		w[i].start = random ? start : start + i * stripe;
+		w[i].size = stripe;
+		w[i].seed = (unsigned int) timer_now_ns() + i;
+		w[i].stop = &stop;
+		hist_init(&w[i].hist);
+	}
+	if(stripe < (off64_t)io_size){
+		free(w);
+		return 1;
+	}
+
+	seeker_start = 0;
+	for(i=0; i < num_threads; ++i){
+		if(pthread_create(&w[i].tid, NULL, seeker_thread, &w[i]) != 0){
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	pthread_mutex_lock(&seeker_start_mutex);
+	const uint64_t t0 = timer_now_ns();
+	seeker_start = 1;
+	pthread_cond_broadcast(&seeker_start_cond);
+	pthread_mutex_unlock(&seeker_start_mutex);
+
+	const double timeout = timer_scaled(SEEKER_TIMEOUT);
+	struct timespec ts = {(time_t)timeout, (long)((timeout - (time_t)timeout) * 1e9)};
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	struct lat_hist hist;
+	unsigned long ios = 0;
+	hist_init(&hist);
+	for(i=0; i < started; ++i){
+		pthread_join(w[i].tid, NULL);
+		hist_merge(&hist, &w[i].hist);
+		ios += w[i].ios;
+	}
+	const double elapsed = (timer_now_ns() - t0) / 1e9;
 
-	if (argc != 2) {
-		printf("Usage: seeker <raw disk device>\n");
-		exit(EXIT_SUCCESS);
-	}*/
+	r->seeks[t]		  = (int)(ios / elapsed);
+	r->access_time[t] = hist_mean(&hist) / 1e6;
+	r->lat_p50[t]	  = hist_percentile(&hist, 0.50)  / 1e6;
+	r->lat_p99[t]	  = hist_percentile(&hist, 0.99)  / 1e6;
+	r->lat_p999[t]	  = hist_percentile(&hist, 0.999) / 1e6;
 
-	if((fd = open(devname, O_RDONLY)) < 0){
+	free(w);
+	return 0;
+}
+
+int seeker(struct disk_stat * r, const char * devname, const int disk_io_size[DISK_NUM_IO_TYPES], const int num_threads){
+	int fd, cached_fd;
+	unsigned long long dev_size=0;
+	int block_size=0;
+
+	if((fd = open(devname, O_RDONLY|O_DIRECT)) < 0){
 		perror("open");
 		return 1;
 	}
 
-#if defined(BLKGETSIZE64)
 	if(ioctl(fd, BLKGETSIZE64, &dev_size) == -1){
-#else
-	if(ioctl(fd, BLKGETSIZE, &dev_size) == -1){
-#endif
 		perror("ioctl");
 		close(fd);
 		return 1;
@@ -65,78 +172,36 @@ int seeker(struct disk_stat * r, const char * devname, const int disk_io_size[DI
 		return 1;
 	}
 
-	num_blocks = dev_size / block_size;
 	r->block_size = block_size;
-	r->num_blocks = num_blocks;
-	offset = offset_saved = (off64_t) random() % num_blocks;
-
-	int t;
-	for(t=0; t < 3; t++){ //random, sequential, cached sequential read
-
-		buffer = (char*) malloc(disk_io_size[t]);
-		if(buffer == NULL){
-			perror("malloc");
-			break;
-		}
-		int buffer_blocks = disk_io_size[t] / block_size;
-
-		if(t == 1){ //sequential read
-			//clear caching, because we want to read directly from disk
-			//we also want to put data in cache, since the next measure is cached read
-			system("echo 3 > /proc/sys/vm/drop_caches");
-		}
+	r->num_blocks = dev_size / block_size;
 
-		if(t > 0){ //seq and cached seq
-			//TODO: start reading from middle of disk, to hav average speed ?
-			offset = offset_saved;
-			if(lseek64(fd, offset*block_size, SEEK_SET) == (off64_t) -1){
-				perror("lseek64");
-				break;
-			}
-		}
-		time(&start);
-		srand(start);
-		signal(SIGALRM, &done);
-		alarm(1);
-
-		count = 0;
-		seeker_done = 0; //reset
-
-		while(seeker_done == 0){
-			if(t == 0){ //if random
-				//seek to block
-				offset = (off64_t) random() % (num_blocks - buffer_blocks);
-				if(lseek64(fd, block_size * offset, SEEK_SET) == (off64_t) -1){
-					perror("lseek64");
-					break;
-				}
-			}
+	seeker_run(r, 0, fd, 0, dev_size, disk_io_size[0], 1, num_threads);		// Random read
+	seeker_run(r, 1, fd, 0, dev_size, disk_io_size[1], 0, num_threads);		// Sequential read
+	close(fd);
 
-			if(read(fd, buffer, buffer_blocks*block_size) < 0){
-				perror("read");
+	// Cached sequential read, warm a small region of the page cache through a buffered descriptor first
+	if((cached_fd = open(devname, O_RDONLY)) < 0){
+		perror("open");
+		return 1;
+	}
+	off64_t cached_size = SEEKER_CACHED_SIZE;
+	if((unsigned long long)cached_size > dev_size)
+		cached_size = dev_size;
+	off64_t cached_start = (off64_t)(((unsigned long long)random() * 4096) % (dev_size - cached_size + 1)) & ~(off64_t)4095;
+
+	char *buffer = malloc(disk_io_size[2]);
+	if(buffer != NULL){
+		off64_t off;
+		for(off=0; off + disk_io_size[2] <= cached_size; off += disk_io_size[2]){
+			if(pread64(cached_fd, buffer, disk_io_size[2], cached_start + off) < 0){
+				perror("pread");
 				break;
 			}
-			count += buffer_blocks;
-
-			if(t > 0){
-				//if we are at the end, return to start
-				if((offset + count) >= dev_size){
-					if(lseek64(fd, 0, SEEK_SET) == (off64_t) -1){
-						perror("lseek64");
-						break;
-					}
-				}
-			}
-		}
-
-		if (count) {
-			r->seeks[t] 	  = count / SEEKER_TIMEOUT;
-			r->access_time[t] = (1000.0f * SEEKER_TIMEOUT) / (float)count;
 		}
-
 		free(buffer);
+		seeker_run(r, 2, cached_fd, cached_start, cached_size, disk_io_size[2], 0, num_threads);
 	}
-	close(fd);
+	close(cached_fd);
 
 	return 0;
 }
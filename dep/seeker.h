@@ -3,8 +3,10 @@
 
 #include "../vm_perf_disk.h"
 
-#define SEEKER_TIMEOUT 10
+#define SEEKER_TIMEOUT 2						// Seconds per access pattern
+#define SEEKER_THREADS 4						// Concurrent readers, i.e. queue depth seen by the device
+#define SEEKER_CACHED_SIZE (64*1024*1024)		// Region re-read by the cached sequential test
 
-int seeker(struct disk_stat * r, const char * devname, const int disk_io_size[DISK_NUM_IO_TYPES]);
+int seeker(struct disk_stat * r, const char * devname, const int disk_io_size[DISK_NUM_IO_TYPES], const int num_threads);
 
 #endif
@@ -46,6 +46,9 @@
 # include <float.h>
 # include <limits.h>
 # include <sys/time.h>
+# include <sys/mman.h>
+# include <sched.h>
+# include <omp.h>
 # include "stream.h"
 
 /*-----------------------------------------------------------------------
@@ -91,6 +94,11 @@
  *          will override the default size of 10M with a new size of 100M elements
  *          per array.
  */
+/*
+ *      vm_perf: the array size is chosen at run time by mem_bench() from the
+ *          last level cache and RAM size and passed in struct stream_config,
+ *          STREAM_ARRAY_SIZE below is only the default.
+ */
 #ifndef STREAM_ARRAY_SIZE
 #   define STREAM_ARRAY_SIZE	10000000
 #endif
@@ -112,6 +120,7 @@
 #ifndef NTIMES
 #   define NTIMES	10
 #endif
+#define STREAM_MIN_TIMES	3	/* vm_perf: the warmup and two timed iterations */
 
 /*  Users are allowed to modify the "OFFSET" variable, which *may* change the
  *         relative alignment of the arrays (though compilers may change the
@@ -177,23 +186,14 @@
 #define STREAM_TYPE double
 #endif
 
-static STREAM_TYPE	a[STREAM_ARRAY_SIZE+OFFSET],
-			b[STREAM_ARRAY_SIZE+OFFSET],
-			c[STREAM_ARRAY_SIZE+OFFSET];
-
-static double	avgtime[4] = {0}, maxtime[4] = {0},
-		mintime[4] = {FLT_MAX,FLT_MAX,FLT_MAX,FLT_MAX};
+static STREAM_TYPE	*a, *b, *c;
+static ssize_t		array_size = STREAM_ARRAY_SIZE;
+static int		stream_nthreads = 1;
+static const struct stream_kernels *stream_kernels;	/* vm_perf: used by the TUNED hooks */
 
 //static char	*label[4] = {"Copy:      ", "Scale:     ",
 //    "Add:       ", "Triad:     "};
 
-static double	bytes[4] = {
-    2 * sizeof(STREAM_TYPE) * STREAM_ARRAY_SIZE,
-    2 * sizeof(STREAM_TYPE) * STREAM_ARRAY_SIZE,
-    3 * sizeof(STREAM_TYPE) * STREAM_ARRAY_SIZE,
-    3 * sizeof(STREAM_TYPE) * STREAM_ARRAY_SIZE
-    };
-
 extern double mysecond();
 extern void checkSTREAMresults();
 #ifdef TUNED
@@ -205,8 +205,33 @@ extern void tuned_STREAM_Triad(STREAM_TYPE scalar);
 #ifdef _OPENMP
 extern int omp_get_num_threads();
 #endif
+/*
+ * vm_perf: pin the calling member of the OpenMP team, thread i runs on
+ * cpus[i]. Called at the top of every parallel region, OpenMP does not
+ * promise the same OS thread for a thread number from one region to the
+ * next. The CPU an OS thread was pinned to is remembered, so only a
+ * thread that moved pays for the syscall.
+ */
+static __thread int	stream_cpu = -1;
+static const int	*stream_run_cpus;
+
+static void
+stream_pin(const int *cpus)
+    {
+    const int cpu = cpus[omp_get_thread_num()];
+    cpu_set_t set;
+
+    if (stream_cpu == cpu)
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+	perror("sched_setaffinity");
+    stream_cpu = cpu;
+    }
+
 int
-stream(struct mem_result* r)
+stream(const struct stream_config *cfg, double rate[4], struct timer_stats stats[4])
     {
     int			quantum, checktick();
     //int			BytesPerWord;
@@ -214,6 +239,41 @@ stream(struct mem_result* r)
     ssize_t		j;
     STREAM_TYPE		scalar;
     double		t, times[4][NTIMES];
+    double		avgtime[4] = {0}, maxtime[4] = {0},
+			mintime[4] = {FLT_MAX,FLT_MAX,FLT_MAX,FLT_MAX};
+    double		bytes[4];
+    size_t		array_bytes;
+    struct page_mapping	arrays;
+    const int		nthreads = cfg->num_run;
+    int			ntimes;
+
+    cpu_set_t		saved_affinity;
+
+    /* vm_perf: the master thread is part of the pinned team, give it back its mask at the end */
+    sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    stream_cpu = -1;
+
+    array_size = cfg->array_size > 0 ? cfg->array_size : STREAM_ARRAY_SIZE;
+    /* vm_perf: fewer iterations under a time budget, never fewer than STREAM_MIN_TIMES */
+    ntimes = (int)(NTIMES * timer_scaled(1.0) + 0.5);
+    if (ntimes < STREAM_MIN_TIMES)
+	ntimes = STREAM_MIN_TIMES;
+    if (ntimes > NTIMES)
+	ntimes = NTIMES;
+    stream_nthreads = nthreads;
+    stream_run_cpus = cfg->run_cpus;
+    stream_kernels = cfg->kernels;
+    bytes[0] = bytes[1] = 2 * sizeof(STREAM_TYPE) * array_size;
+    bytes[2] = bytes[3] = 3 * sizeof(STREAM_TYPE) * array_size;
+
+    /* Untouched anonymous memory, pages get placed on first touch below */
+    array_bytes = (array_size + OFFSET) * sizeof(STREAM_TYPE);
+    if (page_map(&arrays, 3 * array_bytes, cfg->pages) != 0)
+	return 1;
+    a = arrays.ptr;
+    b = (STREAM_TYPE*)((char*)a + array_bytes);
+    c = (STREAM_TYPE*)((char*)b + array_bytes);
+    omp_set_dynamic(0);
 
     /* --- SETUP --- determine precision and check timing --- */
 
@@ -265,12 +325,19 @@ stream(struct mem_result* r)
 #endif
 
     /* Get initial value for system clock. */
-#pragma omp parallel for
-    for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+    /* vm_perf: first touch from the pinned init team places each page on its NUMA node */
+#pragma omp parallel num_threads(cfg->num_init)
+    {
+    stream_pin(cfg->init_cpus);
+#pragma omp for schedule(static)
+    for (j=0; j<array_size; j++) {
 	    a[j] = 1.0;
 	    b[j] = 2.0;
 	    c[j] = 0.0;
 	}
+    }
+    if (cfg->huge_kb != NULL)
+	*cfg->huge_kb = page_huge_kb(&arrays);
 
     //printf(HLINE);
 
@@ -285,9 +352,13 @@ stream(struct mem_result* r)
     }
 
     t = mysecond();
-#pragma omp parallel for
-    for (j = 0; j < STREAM_ARRAY_SIZE; j++)
+#pragma omp parallel num_threads(nthreads)
+    {
+    stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+    for (j = 0; j < array_size; j++)
 		a[j] = 2.0E0 * a[j];
+    }
     t = 1.0E6 * (mysecond() - t);
 
    /*
@@ -307,15 +378,19 @@ stream(struct mem_result* r)
     /*	--- MAIN LOOP --- repeat test cases NTIMES times --- */
 
     scalar = 3.0;
-    for (k=0; k<NTIMES; k++)
+    for (k=0; k<ntimes; k++)
 	{
 	times[0][k] = mysecond();
 #ifdef TUNED
         tuned_STREAM_Copy();
 #else
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
+#pragma omp parallel num_threads(nthreads)
+	{
+	stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	for (j=0; j<array_size; j++)
 	    c[j] = a[j];
+	}
 #endif
 	times[0][k] = mysecond() - times[0][k];
 
@@ -323,9 +398,13 @@ stream(struct mem_result* r)
 #ifdef TUNED
         tuned_STREAM_Scale(scalar);
 #else
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
+#pragma omp parallel num_threads(nthreads)
+	{
+	stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	for (j=0; j<array_size; j++)
 	    b[j] = scalar*c[j];
+	}
 #endif
 	times[1][k] = mysecond() - times[1][k];
 
@@ -333,9 +412,13 @@ stream(struct mem_result* r)
 #ifdef TUNED
         tuned_STREAM_Add();
 #else
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
+#pragma omp parallel num_threads(nthreads)
+	{
+	stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	for (j=0; j<array_size; j++)
 	    c[j] = a[j]+b[j];
+	}
 #endif
 	times[2][k] = mysecond() - times[2][k];
 
@@ -343,16 +426,20 @@ stream(struct mem_result* r)
 #ifdef TUNED
         tuned_STREAM_Triad(scalar);
 #else
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
+#pragma omp parallel num_threads(nthreads)
+	{
+	stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	for (j=0; j<array_size; j++)
 	    a[j] = b[j]+scalar*c[j];
+	}
 #endif
 	times[3][k] = mysecond() - times[3][k];
 	}
 
     /*	--- SUMMARY --- */
 
-    for (k=1; k<NTIMES; k++) /* note -- skip first iteration */
+    for (k=1; k<ntimes; k++) /* note -- skip first iteration */
 	{
 	for (j=0; j<4; j++)
 	    {
@@ -364,9 +451,9 @@ stream(struct mem_result* r)
 
     //printf("Function    Best Rate MB/s  Avg time     Min time     Max time\n");
     for (j=0; j<4; j++) {
-		r->rate[j] = 1.0E-06 * bytes[j]/mintime[j];
+		rate[j] = 1.0E-06 * bytes[j]/mintime[j];
 
-		avgtime[j] = avgtime[j]/(double)(NTIMES-1);
+		avgtime[j] = avgtime[j]/(double)(ntimes-1);
 
 		/*printf("%s%12.1f  %11.6f  %11.6f  %11.6f\n", label[j],
 	       1.0E-06 * bytes[j]/mintime[j],
@@ -374,6 +461,14 @@ stream(struct mem_result* r)
 	       mintime[j],
 	       maxtime[j]);
 	    */
+
+		/* vm_perf: spread of the per trial rates, the first trial is warmup */
+		if (stats != NULL) {
+		    double trial_rate[NTIMES];
+		    for (k=1; k<ntimes; k++)
+			trial_rate[k-1] = 1.0E-06 * bytes[j]/times[j][k];
+		    timer_stats(&stats[j], trial_rate, ntimes-1);
+		}
     }
     //printf(HLINE);
 
@@ -381,9 +476,97 @@ stream(struct mem_result* r)
     //checkSTREAMresults();
     //printf(HLINE);
 
+    page_unmap(&arrays);
+    a = b = c = NULL;
+    sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    stream_cpu = -1;
+
     return 0;
 }
 
+/*
+ * vm_perf: single threaded Copy and Triad over a working set of ws_bytes (all
+ * three arrays), pinned to cpu. Each kernel is repeated until a trial lasts
+ * at least SWEEP_MIN_TIME and the best of SWEEP_TRIALS trials is reported,
+ * so small working sets are timed from cache rather than from the clock.
+ */
+# define SWEEP_MIN_TIME	2.0E-3
+# define SWEEP_TRIALS	5
+
+int
+stream_sweep(size_t ws_bytes, int cpu, double *copy_rate, double *triad_rate)
+    {
+    cpu_set_t		set, saved_affinity;
+    STREAM_TYPE		*sa, *sb, *sc, scalar = 3.0;
+    ssize_t		j, n = ws_bytes / (3 * sizeof(STREAM_TYPE));
+    long		reps, r;
+    int			k, kernel;
+    double		t, best;
+
+    if (n < 16)
+	n = 16;
+    sa = page_alloc(3 * n * sizeof(STREAM_TYPE));
+    if (sa == NULL) {
+	perror("mmap");
+	return 1;
+	}
+    sb = sa + n;
+    sc = sb + n;
+
+    sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    for (j=0; j<n; j++) {
+	sa[j] = 1.0;
+	sb[j] = 2.0;
+	sc[j] = 0.0;
+	}
+
+    for (kernel=0; kernel<2; kernel++) {
+	/* calibrate the number of repetitions per trial */
+	reps = 1;
+	while (1) {
+	    t = mysecond();
+	    for (r=0; r<reps; r++) {
+		if (kernel == 0)
+		    for (j=0; j<n; j++) sc[j] = sa[j];
+		else
+		    for (j=0; j<n; j++) sa[j] = sb[j]+scalar*sc[j];
+		__asm__ __volatile__("" ::: "memory");
+		}
+	    t = mysecond() - t;
+	    if (t >= SWEEP_MIN_TIME || reps >= (1L << 30))
+		break;
+	    reps *= 2;
+	    }
+
+	best = FLT_MAX;
+	for (k=0; k<SWEEP_TRIALS; k++) {
+	    t = mysecond();
+	    for (r=0; r<reps; r++) {
+		if (kernel == 0)
+		    for (j=0; j<n; j++) sc[j] = sa[j];
+		else
+		    for (j=0; j<n; j++) sa[j] = sb[j]+scalar*sc[j];
+		__asm__ __volatile__("" ::: "memory");
+		}
+	    t = mysecond() - t;
+	    best = MIN(best, t);
+	    }
+
+	if (kernel == 0)
+	    *copy_rate = 1.0E-06 * (2 * sizeof(STREAM_TYPE) * n * (double)reps) / best;
+	else
+	    *triad_rate = 1.0E-06 * (3 * sizeof(STREAM_TYPE) * n * (double)reps) / best;
+	}
+
+    sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    page_free(sa);
+    return 0;
+    }
+
 # define	M	20
 
 int
@@ -418,19 +601,11 @@ checktick()
 
 
 
-/* A gettimeofday routine to give access to the wall
-   clock timer on most UNIX-like systems.  */
-
-#include <sys/time.h>
+/* vm_perf: seconds on the shared monotonic clock instead of gettimeofday */
 
 double mysecond()
 {
-        struct timeval tp;
-        struct timezone tzp;
-        //int i;
-
-        /*i = */gettimeofday(&tp,&tzp);
-        return ( (double) tp.tv_sec + (double) tp.tv_usec * 1.e-6 );
+        return timer_now();
 }
 
 #ifndef abs
@@ -465,15 +640,15 @@ void checkSTREAMresults ()
 	aSumErr = 0.0;
 	bSumErr = 0.0;
 	cSumErr = 0.0;
-	for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+	for (j=0; j<array_size; j++) {
 		aSumErr += abs(a[j] - aj);
 		bSumErr += abs(b[j] - bj);
 		cSumErr += abs(c[j] - cj);
 		// if (j == 417) printf("Index 417: c[j]: %f, cj: %f\n",c[j],cj);	// MCCALPIN
 	}
-	aAvgErr = aSumErr / (STREAM_TYPE) STREAM_ARRAY_SIZE;
-	bAvgErr = bSumErr / (STREAM_TYPE) STREAM_ARRAY_SIZE;
-	cAvgErr = cSumErr / (STREAM_TYPE) STREAM_ARRAY_SIZE;
+	aAvgErr = aSumErr / (STREAM_TYPE) array_size;
+	bAvgErr = bSumErr / (STREAM_TYPE) array_size;
+	cAvgErr = cSumErr / (STREAM_TYPE) array_size;
 
 	if (sizeof(STREAM_TYPE) == 4) {
 		epsilon = 1.e-6;
@@ -492,7 +667,7 @@ void checkSTREAMresults ()
 		printf ("Failed Validation on array a[], AvgRelAbsErr > epsilon (%e)\n",epsilon);
 		printf ("     Expected Value: %e, AvgAbsErr: %e, AvgRelAbsErr: %e\n",aj,aAvgErr,abs(aAvgErr)/aj);
 		ierr = 0;
-		for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+		for (j=0; j<array_size; j++) {
 			if (abs(a[j]/aj-1.0) > epsilon) {
 				ierr++;
 #ifdef VERBOSE
@@ -511,7 +686,7 @@ void checkSTREAMresults ()
 		printf ("     Expected Value: %e, AvgAbsErr: %e, AvgRelAbsErr: %e\n",bj,bAvgErr,abs(bAvgErr)/bj);
 		printf ("     AvgRelAbsErr > Epsilon (%e)\n",epsilon);
 		ierr = 0;
-		for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+		for (j=0; j<array_size; j++) {
 			if (abs(b[j]/bj-1.0) > epsilon) {
 				ierr++;
 #ifdef VERBOSE
@@ -530,7 +705,7 @@ void checkSTREAMresults ()
 		printf ("     Expected Value: %e, AvgAbsErr: %e, AvgRelAbsErr: %e\n",cj,cAvgErr,abs(cAvgErr)/cj);
 		printf ("     AvgRelAbsErr > Epsilon (%e)\n",epsilon);
 		ierr = 0;
-		for (j=0; j<STREAM_ARRAY_SIZE; j++) {
+		for (j=0; j<array_size; j++) {
 			if (abs(c[j]/cj-1.0) > epsilon) {
 				ierr++;
 #ifdef VERBOSE
@@ -555,37 +730,104 @@ void checkSTREAMresults ()
 }
 
 #ifdef TUNED
-/* stubs for "tuned" versions of the kernels */
+/*
+ * vm_perf: the "tuned" kernels run the SIMD kernels selected in the config on
+ * a 64 byte aligned static partition of the arrays, or the plain loops when
+ * there are none.
+ */
+static void stream_chunk(ssize_t *lo, ssize_t *hi)
+{
+	const ssize_t per = ((array_size / omp_get_num_threads()) + 7) & ~(ssize_t)7;
+	*lo = MIN(array_size, omp_get_thread_num() * per);
+	*hi = MIN(array_size, *lo + per);
+}
+
 void tuned_STREAM_Copy()
 {
 	ssize_t j;
-#pragma omp parallel for
-        for (j=0; j<STREAM_ARRAY_SIZE; j++)
-            c[j] = a[j];
+	if (stream_kernels == NULL) {
+#pragma omp parallel num_threads(stream_nthreads)
+	    {
+	    stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	    for (j=0; j<array_size; j++)
+		c[j] = a[j];
+	    }
+	    return;
+	}
+#pragma omp parallel num_threads(stream_nthreads)
+	{
+	    ssize_t lo, hi;
+	    stream_pin(stream_run_cpus);
+	    stream_chunk(&lo, &hi);
+	    stream_kernels->copy(c+lo, a+lo, hi-lo);
+	}
 }
 
 void tuned_STREAM_Scale(STREAM_TYPE scalar)
 {
 	ssize_t j;
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
-	    b[j] = scalar*c[j];
+	if (stream_kernels == NULL) {
+#pragma omp parallel num_threads(stream_nthreads)
+	    {
+	    stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	    for (j=0; j<array_size; j++)
+		b[j] = scalar*c[j];
+	    }
+	    return;
+	}
+#pragma omp parallel num_threads(stream_nthreads)
+	{
+	    ssize_t lo, hi;
+	    stream_pin(stream_run_cpus);
+	    stream_chunk(&lo, &hi);
+	    stream_kernels->scale(b+lo, c+lo, scalar, hi-lo);
+	}
 }
 
 void tuned_STREAM_Add()
 {
 	ssize_t j;
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
-	    c[j] = a[j]+b[j];
+	if (stream_kernels == NULL) {
+#pragma omp parallel num_threads(stream_nthreads)
+	    {
+	    stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	    for (j=0; j<array_size; j++)
+		c[j] = a[j]+b[j];
+	    }
+	    return;
+	}
+#pragma omp parallel num_threads(stream_nthreads)
+	{
+	    ssize_t lo, hi;
+	    stream_pin(stream_run_cpus);
+	    stream_chunk(&lo, &hi);
+	    stream_kernels->add(c+lo, a+lo, b+lo, hi-lo);
+	}
 }
 
 void tuned_STREAM_Triad(STREAM_TYPE scalar)
 {
 	ssize_t j;
-#pragma omp parallel for
-	for (j=0; j<STREAM_ARRAY_SIZE; j++)
-	    a[j] = b[j]+scalar*c[j];
+	if (stream_kernels == NULL) {
+#pragma omp parallel num_threads(stream_nthreads)
+	    {
+	    stream_pin(stream_run_cpus);
+#pragma omp for schedule(static)
+	    for (j=0; j<array_size; j++)
+		a[j] = b[j]+scalar*c[j];
+	    }
+	    return;
+	}
+#pragma omp parallel num_threads(stream_nthreads)
+	{
+	    ssize_t lo, hi;
+	    stream_pin(stream_run_cpus);
+	    stream_chunk(&lo, &hi);
+	    stream_kernels->triad(a+lo, b+lo, c+lo, scalar, hi-lo);
+	}
 }
 /* end of stubs for the "tuned" versions of the kernels */
 #endif
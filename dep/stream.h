@@ -1,8 +1,24 @@
 #ifndef STREAM_H
 #define STREAM_H
 
+#include <sys/types.h>
 #include "../vm_perf_mem.h"
+#include "../vm_perf_timer.h"
+#include "../vm_perf_page.h"
+#include "stream_simd.h"
 
-int stream(struct mem_result* r);
+struct stream_config{
+	ssize_t array_size;			// Elements per array
+	const int *init_cpus;		// CPUs of the threads that first touch (place) the arrays
+	int num_init;
+	const int *run_cpus;		// CPUs of the threads that run the kernels
+	int num_run;
+	const struct stream_kernels *kernels;	// SIMD kernels, NULL for the plain C loops
+	enum page_policy pages;		// Page size of the arrays, the run fails when the guest cannot provide it
+	long *huge_kb;				// Where to put the KB of the arrays in huge pages after first touch, may be NULL
+};
+
+int stream(const struct stream_config *cfg, double rate[NUM_MEM_TESTS], struct timer_stats stats[NUM_MEM_TESTS]);
+int stream_sweep(size_t ws_bytes, int cpu, double *copy_rate, double *triad_rate);
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * vm_perf: SIMD versions of the STREAM kernels for the TUNED hooks of
+ * stream.c. Every function is compiled for its own ISA through the target
+ * attribute, so the build needs no -march and the binary still runs on CPUs
+ * without AVX. Callers must check stream_isa_supported() first.
+ *
+ * The destination is peeled to vector alignment so streaming stores are
+ * legal, sources are loaded unaligned.
+ */
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "stream_simd.h"
+
+#define STREAM_KERNELS(isa, TARGET, V, W, LOAD, STORE, SET1, ADD, MUL, FENCE)		\
+__attribute__((target(TARGET))) static void						\
+isa##_copy(double *c, const double *a, ssize_t n)					\
+    {											\
+    ssize_t j = 0;									\
+    for (; j < n && ((uintptr_t)(c + j) & (W * sizeof(double) - 1)); j++)		\
+	c[j] = a[j];									\
+    for (; j + W <= n; j += W)								\
+	STORE(c + j, LOAD(a + j));							\
+    for (; j < n; j++)									\
+	c[j] = a[j];									\
+    FENCE;										\
+    }											\
+__attribute__((target(TARGET))) static void						\
+isa##_scale(double *b, const double *c, double scalar, ssize_t n)			\
+    {											\
+    const V s = SET1(scalar);								\
+    ssize_t j = 0;									\
+    for (; j < n && ((uintptr_t)(b + j) & (W * sizeof(double) - 1)); j++)		\
+	b[j] = scalar*c[j];								\
+    for (; j + W <= n; j += W)								\
+	STORE(b + j, MUL(s, LOAD(c + j)));						\
+    for (; j < n; j++)									\
+	b[j] = scalar*c[j];								\
+    FENCE;										\
+    }											\
+__attribute__((target(TARGET))) static void						\
+isa##_add(double *c, const double *a, const double *b, ssize_t n)			\
+    {											\
+    ssize_t j = 0;									\
+    for (; j < n && ((uintptr_t)(c + j) & (W * sizeof(double) - 1)); j++)		\
+	c[j] = a[j]+b[j];								\
+    for (; j + W <= n; j += W)								\
+	STORE(c + j, ADD(LOAD(a + j), LOAD(b + j)));					\
+    for (; j < n; j++)									\
+	c[j] = a[j]+b[j];								\
+    FENCE;										\
+    }											\
+__attribute__((target(TARGET))) static void						\
+isa##_triad(double *a, const double *b, const double *c, double scalar, ssize_t n)	\
+    {											\
+    const V s = SET1(scalar);								\
+    ssize_t j = 0;									\
+    for (; j < n && ((uintptr_t)(a + j) & (W * sizeof(double) - 1)); j++)		\
+	a[j] = b[j]+scalar*c[j];							\
+    for (; j + W <= n; j += W)								\
+	STORE(a + j, ADD(LOAD(b + j), MUL(s, LOAD(c + j))));				\
+    for (; j < n; j++)									\
+	a[j] = b[j]+scalar*c[j];							\
+    FENCE;										\
+    }
+
+STREAM_KERNELS(sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_store_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd, (void)0)
+STREAM_KERNELS(sse2_nt, "sse2", __m128d, 2, _mm_loadu_pd, _mm_stream_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd, _mm_sfence())
+STREAM_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_store_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd, (void)0)
+STREAM_KERNELS(avx2_nt, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_stream_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd, _mm_sfence())
+STREAM_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_store_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_mul_pd, (void)0)
+STREAM_KERNELS(avx512_nt, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_stream_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_mul_pd, _mm_sfence())
+
+#define STREAM_KERNEL_ENTRY(isa, id, nt) {#isa, id, nt, isa##_copy, isa##_scale, isa##_add, isa##_triad}
+
+const struct stream_kernels stream_kernel_table[STREAM_NUM_KERNELS] = {
+    STREAM_KERNEL_ENTRY(sse2,      STREAM_ISA_SSE2,   0),
+    STREAM_KERNEL_ENTRY(sse2_nt,   STREAM_ISA_SSE2,   1),
+    STREAM_KERNEL_ENTRY(avx2,      STREAM_ISA_AVX2,   0),
+    STREAM_KERNEL_ENTRY(avx2_nt,   STREAM_ISA_AVX2,   1),
+    STREAM_KERNEL_ENTRY(avx512,    STREAM_ISA_AVX512, 0),
+    STREAM_KERNEL_ENTRY(avx512_nt, STREAM_ISA_AVX512, 1)
+};
+
+/* libgcc only reports AVX and AVX-512 when XCR0 shows the OS saves their state */
+int
+stream_isa_supported(enum stream_isa isa)
+    {
+    __builtin_cpu_init();
+    switch (isa) {
+	case STREAM_ISA_SSE2:	return __builtin_cpu_supports("sse2");
+	case STREAM_ISA_AVX2:	return __builtin_cpu_supports("avx2");
+	case STREAM_ISA_AVX512:	return __builtin_cpu_supports("avx512f");
+	default:		return 0;
+	}
+    }
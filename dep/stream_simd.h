@@ -0,0 +1,35 @@
+#ifndef STREAM_SIMD_H
+#define STREAM_SIMD_H
+
+#include <sys/types.h>
+
+/*
+ * vm_perf: hand vectorised STREAM kernels, selected at run time from what
+ * CPUID and the OS (XCR0) say is usable. Each ISA comes with regular and
+ * non-temporal (streaming) stores.
+ */
+
+enum stream_isa{
+    STREAM_ISA_SSE2 = 0,
+    STREAM_ISA_AVX2,
+    STREAM_ISA_AVX512,
+    STREAM_NUM_ISA
+};
+
+struct stream_kernels{
+    const char		*name;
+    enum stream_isa	isa;
+    int			nt;		/* non-temporal stores */
+    void (*copy)(double *c, const double *a, ssize_t n);
+    void (*scale)(double *b, const double *c, double scalar, ssize_t n);
+    void (*add)(double *c, const double *a, const double *b, ssize_t n);
+    void (*triad)(double *a, const double *b, const double *c, double scalar, ssize_t n);
+};
+
+#define STREAM_NUM_KERNELS (2 * STREAM_NUM_ISA)
+
+extern const struct stream_kernels stream_kernel_table[STREAM_NUM_KERNELS];
+
+int stream_isa_supported(enum stream_isa isa);
+
+#endif
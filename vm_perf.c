@@ -5,71 +5,522 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 
 #include "vm_perf.h"
+#include "vm_perf_monitor.h"
+#include "vm_perf_fleet.h"
+#include "vm_perf_sustain.h"
+#include "vm_perf_corun.h"
 
-/*
 struct vm_perf_options{
-	int time_limit;		// Maximum time to run tests
-	int verbose;		// Output
+	int cpu_scaling;	// Run the C-RAY MT thread scaling sweep
+	int retries;		// Extra runs of a module measured under contention
+	const char *peer;	// vm_perf responder (or TCP sink) for the peer network tests
+	int streams;		// Parallel TCP streams to the peer
+	int busy_poll;		// SO_BUSY_POLL microseconds of the ping-pong sockets
+	const char *listen;	// Port to run as the responder on instead of testing
+	int workload;		// Run the mixed read/write file workload
+	struct workload_job workload_job;
+	float monitor;		// Seconds between the probes of the monitor, 0 to run the suite once
+	float sustain;		// Seconds of sustained load instead of the suite, 0 to run the suite
+	float corun;		// Seconds per run of the co-run interference matrix instead of the suite
+	const char *output;		// Results store to write
+	const char *baseline;	// Results store to compare against
+	const char *current;	// Compare this store with the baseline instead of testing
+	int fleet_agents;		// Coordinate a fleet run of this many agents instead of testing
+	const char *fleet_port;
+	struct fleet_plan fleet_plan;
+	const char *coordinator;	// Run as a fleet agent of this coordinator
+	enum page_policy pages;		// Page size of the test buffers
+	float budget;				// Seconds the whole run should take, 0 for full length tests
+	int selected;				// -m picked the modules of a local run
+};
+
+// A benchmark module, run returns the window its interference is recorded in
+struct vm_perf_module{
+	const char * name;
+	const char * label;			// Of its interference window
+	float nominal;				// Seconds a full length run takes, its share of a time budget
+	const char * converge;		// Tests whose trials stop once they converge, the others only shrink to fit a budget
+	struct sampler_window * (*run)(struct vm_perf_result *bm, const struct vm_perf_options *options);
+	void (*store)(const struct vm_perf_result *bm, struct store *s);
+	void (*report)(const struct vm_perf_result *bm);
 };
 
+// Returns 0 to run the tests, 1 on error and 2 when only help was requested
 static int parse_options(struct vm_perf_options *options, const int argc, char * const argv[]){
 	int opt;
-	while((opt = getopt(argc, argv, "hvt:")) != -1){
+
+	bzero(options, sizeof(struct vm_perf_options));
+	options->streams = TCP_DEFAULT_STREAMS;
+	workload_defaults(&options->workload_job);
+	fleet_parse(&options->fleet_plan, "cpu,net,mem,disk");
+	options->fleet_port = FLEET_DEFAULT_PORT;
+	while((opt = getopt(argc, argv, "hsr:p:n:b:l::w::M::S::I::o:c:F:m:A:P:t:")) != -1){
 		switch(opt){
-			case 'v': options->verbose = 1;				 break;
-			case 't': options->time_limit = atoi(optarg); break;
+			case 's': options->cpu_scaling = 1;			 break;
+			case 'r': options->retries = atoi(optarg);	 break;
+			case 'p': options->peer = optarg;			 break;
+			case 'n': options->streams = atoi(optarg);	 break;
+			case 'b': options->busy_poll = atoi(optarg); break;
+			case 'l': options->listen = optarg ? optarg : PEER_DEFAULT_PORT; break;
+			case 'w':
+				options->workload = 1;
+				if(optarg && workload_parse(&options->workload_job, optarg) != 0){
+					fprintf(stderr, "Bad workload %s, expected size[,threads[,read%%[,block_size]]]\n", optarg);
+					return 1;
+				}
+				break;
+			case 'M':
+				options->monitor = optarg ? atof(optarg) : MONITOR_INTERVAL;
+				if(options->monitor <= 0.0f){
+					fprintf(stderr, "Bad monitor interval %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'S':
+				options->sustain = optarg ? atof(optarg) : SUSTAIN_WINDOW;
+				if(options->sustain < 1.0f){
+					fprintf(stderr, "Bad sustained load window %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'I':
+				options->corun = optarg ? atof(optarg) : CORUN_TIME;
+				if(options->corun <= 0.0f){
+					fprintf(stderr, "Bad co-run time %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'o': options->output = optarg;		 break;
+			case 'c': options->baseline = optarg;	 break;
+			case 'F':
+				options->fleet_agents = atoi(optarg);
+				if(strchr(optarg, '@'))
+					options->fleet_port = strchr(optarg, '@') + 1;
+				break;
+			case 'm':
+				if(fleet_parse(&options->fleet_plan, optarg) != 0){
+					fprintf(stderr, "Bad module list %s, expected module[,module...][:hold_seconds]\n", optarg);
+					return 1;
+				}
+				options->selected = 1;
+				break;
+			case 'A': options->coordinator = optarg;	 break;
+			case 'P':
+				if(page_parse(&options->pages, optarg) != 0){
+					fprintf(stderr, "Bad page policy %s, expected default, 4K, thp, 2M or 1G\n", optarg);
+					return 1;
+				}
+				page_set_policy(options->pages);
+				break;
+			case 't':
+				if((options->budget = atof(optarg)) <= 0.0f){
+					fprintf(stderr, "Bad time budget %s\n", optarg);
+					return 1;
+				}
+				break;
 			case 'h':
 				printf("%s-%s\n", argv[0], VERSION);
 				printf("Options:\n");
-				printf("-v \t Enable verbose output\n");
-				printf("-t 20 \t Time limit for testing in seconds\n");
-				printf("-h help");
-				break;
+				printf("-s \t Run the CPU thread scaling sweep\n");
+				printf("-r 2 \t Retry a module up to 2 times when steal time shows contention\n");
+				printf("-p host[:port] \t Measure latency and TCP throughput to a responder on the peer, port %s by default\n", PEER_DEFAULT_PORT);
+				printf("-n 4 \t Parallel TCP streams of the throughput test\n");
+				printf("-b 50 \t Busy poll the ping-pong sockets for 50us\n");
+				printf("-l[port] \t Run as the responder for -p on another VM\n");
+				printf("-w[size,threads,read%%,block_size] \t Run the mixed file workload, e.g. -w64G,%i,%i,16k, twice the RAM by default\n", WORKLOAD_THREADS, WORKLOAD_READ_PCT);
+				printf("-M[seconds] \t Monitor instead of testing, one NDJSON line of light probes every %is by default, SIGUSR1 prints the kept ones again\n", MONITOR_INTERVAL);
+				printf("-S[seconds] \t Sustained CPU and disk load instead of testing, %is by default, finds where burst credits run out\n", SUSTAIN_WINDOW);
+				printf("-I[seconds] \t Co-run pairs of CPU, memory, disk and -p network loads on disjoint vCPUs instead of testing, %is per run by default\n", CORUN_TIME);
+				printf("-o run.vmps \t Save the trial samples of this run as a results store\n");
+				printf("-c base.vmps [run.vmps] \t Compare with a baseline of the same instance type, exit %i on a regression, metrics of single runs are not judged\n", STORE_EXIT_REGRESSION);
+				printf("-F 20[@port] \t Coordinate a fleet run of 20 agents on port %s by default, prints the fleet percentiles\n", FLEET_DEFAULT_PORT);
+				printf("-m cpu,disk[:60] \t Modules to run and their order, each rerun for 60s and the last run reported, all of them by default or cpu,net,mem,disk on every agent under -F\n");
+				printf("-A host[:port] \t Run as a fleet agent of a coordinator\n");
+				printf("-P thp \t Page size of the test buffers: 4K, thp, 2M or 1G hugetlbfs, the kernel's choice by default\n");
+				printf("-t 10 \t Time budget in seconds, CPU and syscall trials stop once they converge, every other test shrinks to fit\n");
+				printf("-h \t Help\n");
+				return 2;
 			default:
-				fprintf(stderr, "Unknown option '%c'\n", opt);
 				return 1;
 		}
 	}
+	if(options->baseline && optind < argc)
+		options->current = argv[optind];
+
+	return 0;
+};
+
+static struct sampler_window * run_sys(struct vm_perf_result *bm, const struct vm_perf_options *options){
+	sys_bench(&bm->sys);
+	return &bm->sys.window;
+}
+
+static struct sampler_window * run_cpu(struct vm_perf_result *bm, const struct vm_perf_options *options){
+	cpu_bench(&bm->cpu);
+	if(options->cpu_scaling)
+		cpu_scaling(&bm->cpu);
+	return &bm->cpu.window;
+}
+
+static struct sampler_window * run_net(struct vm_perf_result *bm, const struct vm_perf_options *options){
+	net_bench(&bm->net);
+	if(options->peer){
+		net_peer_rtt(&bm->net, options->peer, options->busy_poll);
+		net_throughput(&bm->net, options->peer, options->streams);
+	}
+	return &bm->net.window;
+}
+
+static struct sampler_window * run_mem(struct vm_perf_result *bm, const struct vm_perf_options *options){
+	mem_bench(&bm->mem, &bm->sys);
+	return &bm->mem.window;
+}
+
+static struct sampler_window * run_disk(struct vm_perf_result *bm, const struct vm_perf_options *options){
+	disk_bench(&bm->disk, options->workload ? &options->workload_job : NULL);
+	return &bm->disk.window;
+}
+
+static void store_sys(const struct vm_perf_result *bm, struct store *s){
+	sys_store(&bm->sys, s);
+}
+
+static void store_cpu(const struct vm_perf_result *bm, struct store *s){
+	cpu_store(&bm->cpu, s);
+}
+
+static void store_net(const struct vm_perf_result *bm, struct store *s){
+	net_store(&bm->net, s);
+}
+
+static void store_mem(const struct vm_perf_result *bm, struct store *s){
+	mem_store(&bm->mem, s);
+}
+
+static void store_disk(const struct vm_perf_result *bm, struct store *s){
+	disk_store(&bm->disk, s);
+}
+
+static void report_sys(const struct vm_perf_result *bm){
+	sys_report(&bm->sys);
+}
+
+static void report_cpu(const struct vm_perf_result *bm){
+	cpu_report(&bm->cpu);
+}
+
+static void report_net(const struct vm_perf_result *bm){
+	net_report(&bm->net);
+}
+
+static void report_mem(const struct vm_perf_result *bm){
+	mem_report(&bm->mem);
+}
+
+static void report_disk(const struct vm_perf_result *bm){
+	disk_report(&bm->disk);
+}
+
+static const struct vm_perf_module modules[VM_PERF_NUM_MODULES] = {
+	{"sys", "system", 6, "syscalls", run_sys, store_sys, report_sys},
+	{"cpu", "cpu", 60, "all", run_cpu, store_cpu, report_cpu},
+	{"net", "network", 20, "none", run_net, store_net, report_net},
+	{"mem", "memory", 30, "none", run_mem, store_mem, report_mem},
+	{"disk", "storage", 120, "none", run_disk, store_disk, report_disk}
+};
+#define NUM_MODULES (sizeof(modules) / sizeof(modules[0]))
+
+static const struct vm_perf_module * find_module(const char *name){
+	unsigned int m;
+	for(m=0; m < NUM_MODULES; ++m)
+		if(strcmp(modules[m].name, name) == 0)
+			return &modules[m];
+	return NULL;
+}
+
+// Modules of a run in their order, -m or all of them. Returns how many, -1 on an unknown name
+static int select_modules(const struct vm_perf_options *options, const struct vm_perf_module **selected){
+	int p;
+
+	if(!options->selected && !options->fleet_agents){
+		for(p=0; p < (int)NUM_MODULES; ++p)
+			selected[p] = &modules[p];
+		return NUM_MODULES;
+	}
+	for(p=0; p < options->fleet_plan.num_phases; ++p){
+		if((selected[p] = find_module(options->fleet_plan.module[p])) == NULL){
+			fprintf(stderr, "Unknown module %s\n", options->fleet_plan.module[p]);
+			return -1;
+		}
+	}
+	return p;
+}
+
+/*
+ * Run a module under the interference sampler, again while contended and
+ * retries are left. Under a budget every attempt gets a fresh slice of
+ * seconds, the modules after it get less of what is left.
+ */
+static struct sampler_window * run_module(const struct vm_perf_module *m, struct vm_perf_result *bm, const struct vm_perf_options *options, const float slice){
+	struct sampler_window window;
+	struct sampler_window *w;
+	int attempt;
+
+	for(attempt=1; ; ++attempt){
+		if(slice > 0.0f && attempt > 1)
+			timer_slice(slice, m->nominal);
+		sampler_start();
+		w = m->run(bm, options);
+		sampler_stop(&window);
+		window.attempts = attempt;
+		*w = window;
+		if(!window.contended || attempt > options->retries)
+			break;
+		fprintf(stderr, "%s: %.1f%% steal, retrying\n", m->name, window.steal);
+	}
+	return w;
+}
+
+/*
+ * Run the modules in order. Under a time budget each gets the share of what
+ * is left that its nominal length has of the nominal length of all modules
+ * still to run, so whatever one module leaves goes to the ones after it.
+ * What the last one leaves goes to extra trials of the tests that did not
+ * converge, only the timer_trials() tests of cpu and sys stop early. A -m module:seconds hold reruns each module until that long
+ * passed, every run with a fresh slice.
+ */
+static void run_modules(const struct vm_perf_module **selected, const int num, struct vm_perf_result *bm, const struct vm_perf_options *options){
+	const double start = timer_now();
+	int p, q;
 
+	bm->budget = options->budget;
+	for(p=0; p < num; ++p){
+		const struct vm_perf_module *m = selected[p];
+		struct vm_perf_run *run = &bm->run[m - modules];
+		if(options->budget > 0.0f){
+			float nominal = 0.0f;
+			for(q=p; q < num; ++q)
+				nominal += selected[q]->nominal;
+			run->slice = (options->budget - (timer_now() - start)) * m->nominal / nominal;
+			if(run->slice < 0.0f)
+				run->slice = 0.0f;
+			timer_slice(run->slice, m->nominal);
+		}
+		const double t0 = timer_now();
+		do{
+			if(run->slice > 0.0f && run->runs > 0)
+				timer_slice(run->slice, m->nominal);
+			run->window = run_module(m, bm, options, run->slice);
+			run->runs++;
+		}while(timer_now() - t0 < options->fleet_plan.hold);
+		run->time = timer_now() - t0;
+		run->ran = 1;
+		timer_slice_end();
+	}
+	if(options->budget > 0.0f){
+		const double t0 = timer_now();
+		bm->topup_trials = timer_topup(options->budget - (t0 - start));
+		bm->topup_time = timer_now() - t0;
+	}
+	bm->time = timer_now() - start;
+}
+
+// Store of the metrics every module measured, what -o writes and -c compares
+static void vm_perf_store(struct vm_perf_result *bm){
+	unsigned int m;
+
+	store_init(&bm->store, &bm->sys);
+	for(m=0; m < NUM_MODULES; ++m)
+		if(bm->run[m].ran)
+			modules[m].store(bm, &bm->store);
+}
+
+// One phase of a fleet run on this agent, the module runs under the sampler as it would alone
+static int fleet_run(const char *module, struct store *s, void *arg){
+	static struct vm_perf_result bm;		// Kept over the phases, sys_info() runs once
+	const struct vm_perf_module *m = find_module(module);
+
+	if(m == NULL)
+		return 1;
+	if(bm.sys.cpu_count == 0)
+		sys_info(&bm.sys);
+	run_module(m, &bm, (const struct vm_perf_options*) arg, 0.0f);
+	store_init(s, &bm.sys);
+	m->store(&bm, s);
 	return 0;
-};*/
+}
+
+// -c base.vmps run.vmps, no tests run
+static int vm_perf_compare(const char *baseline, const char *current){
+	static struct store base, cur;
+	static struct store_compare cmp;
+
+	if(store_read(&base, baseline) != 0 || store_read(&cur, current) != 0 || store_compare(&base, &cur, &cmp) != 0)
+		return 1;
+	printf("{\"vm_perf\":\"%s\",", VERSION);
+	store_report(&base, &cur, &cmp);
+	printf("}");
+	fflush(stdout);
+	return cmp.regressions ? STORE_EXIT_REGRESSION : 0;
+}
 
 void vm_perf_report(const struct vm_perf_result *bm){
+	unsigned int m;
+	char delim = ' ';
+
 	printf("{\"vm_perf\":\"%s\",", VERSION);
+	printf("\"timer\":{\"clock\":\"%s\",\"resolution\":\"%lins\",\"overhead\":\"%.1fns\"},",
+		timer_clock_name(), timer_resolution_ns(), timer_overhead_ns());
+	page_report(&bm->pages);	putchar(',');
+	if(bm->budget > 0.0f)
+		printf("\"schedule\":{\"budget\":\"%.1fs\",", bm->budget);
+	else
+		printf("\"schedule\":{\"budget\":\"none\",");
+	printf("\"time\":\"%.1fs\",", bm->time);
+	if(bm->budget > 0.0f)
+		printf("\"overrun\":\"%.1fs\",\"topup\":{\"trials\":\"%i\",\"time\":\"%.1fs\"},",
+			bm->time > bm->budget ? bm->time - bm->budget : 0.0f, bm->topup_trials, bm->topup_time);
+	printf("\"modules\":[");
+	for(m=0; m < NUM_MODULES; ++m){
+		const struct vm_perf_run *run = &bm->run[m];
+		if(!run->ran)
+			continue;
+		printf("%c{\"module\":\"%s\",\"slice\":\"%.1fs\",\"time\":\"%.1fs\"", delim, modules[m].name, run->slice, run->time);
+		if(bm->budget > 0.0f)
+			printf(",\"overrun\":\"%.1fs\",\"converge\":\"%s\"", run->time > run->slice * run->runs ? run->time - run->slice * run->runs : 0.0f, modules[m].converge);
+		if(run->runs > 1)
+			printf(",\"runs\":\"%i\"", run->runs);
+		printf("}");
+		delim = ',';
+	}
+	printf("]},");
 	printf("\"modules\":{");
 
 
 	//printf("Memory:%s\n", bm->mem_info);
 	//printf("Disk:%s\n", bm->disk_info);
 
-	sys_report(&bm->sys);	putchar(',');
-	cpu_report(&bm->cpu);	putchar(',');
-	net_report(&bm->net);	putchar(',');
-	mem_report(&bm->mem);	putchar(',');
-	disk_report(&bm->disk);
+	delim = ' ';
+	for(m=0; m < NUM_MODULES; ++m){
+		if(!bm->run[m].ran)
+			continue;
+		if(delim == ',')
+			putchar(',');
+		modules[m].report(bm);
+		delim = ',';
+	}
+	printf("},");
+
+	printf("\"interference\":{");
+	delim = ' ';
+	for(m=0; m < NUM_MODULES; ++m){
+		if(!bm->run[m].ran)
+			continue;
+		if(delim == ',')
+			putchar(',');
+		sampler_report(modules[m].label, bm->run[m].window);
+		delim = ',';
+	}
+	printf("}");
 
-	printf("}}");
+	if(bm->baseline){
+		putchar(',');
+		store_report(bm->baseline, &bm->store, &bm->compare);
+	}
+	printf("}");
 	fflush(stdout);
 }
 
 int main(const int argc, char * const argv[]){
 	struct vm_perf_result benchmark;
+	struct vm_perf_options options;
+
+	int ret = parse_options(&options, argc, argv);
+	if(ret != 0)
+		return ret == 2 ? 0 : 1;
+
+	if(options.listen)
+		return peer_serve(options.listen, options.busy_poll);
+
+	if(options.current)
+		return vm_perf_compare(options.baseline, options.current);
+
+	const struct vm_perf_module *selected[FLEET_MAX_PHASES > NUM_MODULES ? FLEET_MAX_PHASES : NUM_MODULES];
+	const int num_selected = select_modules(&options, selected);
+	if(num_selected < 0)
+		return 1;
+
+	if(options.fleet_agents){
+		static struct fleet_result fleet;
+		if(fleet_coordinate(options.fleet_port, options.fleet_agents, &options.fleet_plan, &fleet) != 0)
+			return 1;
+		printf("{\"vm_perf\":\"%s\",", VERSION);
+		fleet_report(&fleet);
+		printf("}");
+		fflush(stdout);
+		fleet_free(&fleet);
+		return 0;
+	}
 
 	if(geteuid() != 0){
 		fprintf(stderr, "Error: test must be run as root\n");
 		return 1;
 	}
 
-	//if(parse_options(&options, argc, argv) == 1)
-	//	return 1;
+	if(options.monitor > 0.0f){
+		const struct monitor_config cfg = {options.monitor, 0, NULL};
+		return monitor_run(&cfg);
+	}
+
+	if(options.sustain > 0.0f){
+		static struct sustain_result sustained;
+		if(sustain_run(options.sustain, &sustained) != 0)
+			return 1;
+		printf("{\"vm_perf\":\"%s\",", VERSION);
+		sustain_report(&sustained);
+		printf("}");
+		fflush(stdout);
+		return 0;
+	}
+
+	if(options.corun > 0.0f){
+		const struct corun_config cfg = {options.corun, options.peer, options.streams};
+		static struct corun_result corun;
+		if(corun_run(&cfg, &corun) != 0)
+			return 1;
+		printf("{\"vm_perf\":\"%s\",", VERSION);
+		corun_report(&corun);
+		printf("}");
+		fflush(stdout);
+		return 0;
+	}
+
+	if(options.coordinator)
+		return fleet_agent(options.coordinator, fleet_run, &options);
 
+	// Read the baseline first, a bad path should not wait for the whole suite
+	static struct store baseline;
+	if(options.baseline && store_read(&baseline, options.baseline) != 0)
+		return 1;
+
+	bzero(&benchmark, sizeof(struct vm_perf_result));
 	sys_info(&benchmark.sys);
-	cpu_bench(&benchmark.cpu);
-	net_bench(&benchmark.net);
-	mem_bench(&benchmark.mem);
-	disk_bench(&benchmark.disk);
+
+	run_modules(selected, num_selected, &benchmark, &options);
+	page_info(&benchmark.pages);
+
+	vm_perf_store(&benchmark);
+	if(options.output && store_write(&benchmark.store, options.output) != 0)
+		ret = 1;
+	if(options.baseline){
+		if(store_compare(&baseline, &benchmark.store, &benchmark.compare) != 0)
+			ret = 1;
+		else
+			benchmark.baseline = &baseline;
+	}
 	vm_perf_report(&benchmark);
 
 	int i;
@@ -78,5 +529,7 @@ int main(const int argc, char * const argv[]){
 
 	free(benchmark.disk.disk_stats);
 
-	return 0;
+	if(ret == 0 && benchmark.compare.regressions)
+		ret = STORE_EXIT_REGRESSION;
+	return ret;
 }
@@ -12,6 +12,19 @@
 #include "vm_perf_mem.h"
 #include "vm_perf_disk.h"
 #include "vm_perf_sys.h"
+#include "vm_perf_store.h"
+#include "vm_perf_page.h"
+
+#define VM_PERF_NUM_MODULES 5
+
+// How a module ran under the time budget
+struct vm_perf_run{
+	int ran;
+	int runs;							// More than one under a -m module:seconds hold, the last is reported
+	float slice;						// Seconds of the budget it was given, 0 without a budget
+	float time;							// Seconds it took
+	const struct sampler_window *window;	// Its interference, inside this result
+};
 
 struct vm_perf_result{
 	struct sys_result sys;
@@ -19,5 +32,16 @@ struct vm_perf_result{
 	struct net_result net;
 	struct mem_result mem;
 	struct disk_result disk;
+	struct page_info pages;				// Page policy and what the guest gave the test buffers
+
+	float budget;						// Seconds, 0 when every test ran its full length
+	float time;
+	int topup_trials;					// Extra trials of unconverged tests in what the modules left of the budget
+	float topup_time;
+	struct vm_perf_run run[VM_PERF_NUM_MODULES];	// Same order as modules[]
+
+	struct store store;					// Samples of this run for -o and -c
+	const struct store *baseline;		// Set when compared against a baseline
+	struct store_compare compare;
 };
 #endif
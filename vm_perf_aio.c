@@ -0,0 +1,493 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/aio_abi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_aio.h"
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_page.h"
+
+static const char * aio_engine_names[] = {"none", "io_uring", "linux_aio", "sync"};
+
+struct aio_completion{
+	unsigned int slot;
+	long res;
+};
+
+struct aio_ctx{
+	enum aio_engine engine;
+	unsigned int depth;
+
+	// io_uring
+	int ring_fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct iovec *iov;
+
+	// Linux AIO
+	aio_context_t aio;
+	struct iocb *iocbs;
+	struct iocb **queued;
+	struct io_event *events;
+
+	// Sync
+	int sync_fd, sync_write;
+	void **sync_buf;
+	size_t *sync_len;
+	off_t *sync_off;
+	unsigned int *sync_slot;
+
+	unsigned int num_queued;
+};
+
+/* io_uring, driven through raw syscalls so there is no liburing dependency */
+
+static int uring_setup(struct aio_ctx *c){
+	struct io_uring_params p;
+	bzero(&p, sizeof(p));
+
+	c->ring_fd = syscall(__NR_io_uring_setup, c->depth, &p);
+	if(c->ring_fd < 0)
+		return 1;
+
+	c->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	c->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(c->cq_len > c->sq_len)
+			c->sq_len = c->cq_len;
+		c->cq_len = c->sq_len;
+	}
+
+	c->sq_ptr = mmap(NULL, c->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, c->ring_fd, IORING_OFF_SQ_RING);
+	if(c->sq_ptr == MAP_FAILED)
+		goto err_ring;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		c->cq_ptr = c->sq_ptr;
+	}else{
+		c->cq_ptr = mmap(NULL, c->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, c->ring_fd, IORING_OFF_CQ_RING);
+		if(c->cq_ptr == MAP_FAILED)
+			goto err_sq;
+	}
+
+	c->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	c->sqes = mmap(NULL, c->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, c->ring_fd, IORING_OFF_SQES);
+	if(c->sqes == MAP_FAILED)
+		goto err_cq;
+
+	c->sq_head  = (unsigned*)((char*)c->sq_ptr + p.sq_off.head);
+	c->sq_tail  = (unsigned*)((char*)c->sq_ptr + p.sq_off.tail);
+	c->sq_mask  = (unsigned*)((char*)c->sq_ptr + p.sq_off.ring_mask);
+	c->sq_array = (unsigned*)((char*)c->sq_ptr + p.sq_off.array);
+	c->cq_head  = (unsigned*)((char*)c->cq_ptr + p.cq_off.head);
+	c->cq_tail  = (unsigned*)((char*)c->cq_ptr + p.cq_off.tail);
+	c->cq_mask  = (unsigned*)((char*)c->cq_ptr + p.cq_off.ring_mask);
+	c->cqes     = (struct io_uring_cqe*)((char*)c->cq_ptr + p.cq_off.cqes);
+	return 0;
+
+err_cq:
+	if(c->cq_ptr != c->sq_ptr)
+		munmap(c->cq_ptr, c->cq_len);
+err_sq:
+	munmap(c->sq_ptr, c->sq_len);
+err_ring:
+	close(c->ring_fd);
+	return 1;
+}
+
+static void uring_exit(struct aio_ctx *c){
+	munmap(c->sqes, c->sqes_len);
+	if(c->cq_ptr != c->sq_ptr)
+		munmap(c->cq_ptr, c->cq_len);
+	munmap(c->sq_ptr, c->sq_len);
+	close(c->ring_fd);
+}
+
+static void uring_queue(struct aio_ctx *c, const unsigned int slot, const int fd, void *buf, const size_t len, const off_t off, const int write){
+	const unsigned tail = *c->sq_tail;
+	const unsigned idx = tail & *c->sq_mask;
+	struct io_uring_sqe *sqe = &c->sqes[idx];
+
+	c->iov[slot].iov_base = buf;
+	c->iov[slot].iov_len = len;
+
+	bzero(sqe, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) &c->iov[slot];
+	sqe->len = 1;
+	sqe->off = off;
+	sqe->user_data = slot;
+
+	c->sq_array[idx] = idx;
+	__atomic_store_n(c->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	c->num_queued++;
+}
+
+static int uring_submit_reap(struct aio_ctx *c, const unsigned int min_complete, struct aio_completion *out){
+	if((c->num_queued > 0) || (min_complete > 0)){
+		int ret = syscall(__NR_io_uring_enter, c->ring_fd, c->num_queued, min_complete,
+						  min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if(ret < 0){
+			if(errno == EINTR)
+				return 0;
+			perror("io_uring_enter");
+			return -1;
+		}
+		c->num_queued -= ret;
+	}
+
+	int n = 0;
+	unsigned head = *c->cq_head;
+	const unsigned tail = __atomic_load_n(c->cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail){
+		const struct io_uring_cqe *cqe = &c->cqes[head & *c->cq_mask];
+		out[n].slot = (unsigned int) cqe->user_data;
+		out[n].res = cqe->res;
+		n++;
+		head++;
+	}
+	__atomic_store_n(c->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Linux native AIO, only asynchronous with O_DIRECT */
+
+static int linux_aio_setup(struct aio_ctx *c){
+	c->aio = 0;
+	if(syscall(__NR_io_setup, c->depth, &c->aio) < 0)
+		return 1;
+	return 0;
+}
+
+static void linux_aio_exit(struct aio_ctx *c){
+	syscall(__NR_io_destroy, c->aio);
+}
+
+static void linux_aio_queue(struct aio_ctx *c, const unsigned int slot, const int fd, void *buf, const size_t len, const off_t off, const int write){
+	struct iocb *cb = &c->iocbs[slot];
+
+	bzero(cb, sizeof(*cb));
+	cb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	cb->aio_fildes = fd;
+	cb->aio_buf = (unsigned long) buf;
+	cb->aio_nbytes = len;
+	cb->aio_offset = off;
+	cb->aio_data = slot;
+
+	c->queued[c->num_queued++] = cb;
+}
+
+static int linux_aio_submit_reap(struct aio_ctx *c, const unsigned int min_complete, struct aio_completion *out){
+	unsigned int submitted = 0;
+	while(submitted < c->num_queued){
+		int ret = syscall(__NR_io_submit, c->aio, c->num_queued - submitted, &c->queued[submitted]);
+		if(ret < 0){
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("io_submit");
+			return -1;
+		}
+		submitted += ret;
+	}
+	c->num_queued = 0;
+
+	int n = syscall(__NR_io_getevents, c->aio, min_complete, c->depth, c->events, NULL);
+	if(n < 0){
+		if(errno == EINTR)
+			return 0;
+		perror("io_getevents");
+		return -1;
+	}
+
+	int i;
+	for(i=0; i < n; ++i){
+		out[i].slot = (unsigned int) c->events[i].data;
+		out[i].res = c->events[i].res;
+	}
+	return n;
+}
+
+/* Synchronous fallback, every queued I/O is completed on submission */
+
+static void sync_queue(struct aio_ctx *c, const unsigned int slot, const int fd, void *buf, const size_t len, const off_t off, const int write){
+	const unsigned int q = c->num_queued++;
+	c->sync_fd = fd;
+	c->sync_write = write;
+	c->sync_slot[q] = slot;
+	c->sync_buf[q] = buf;
+	c->sync_len[q] = len;
+	c->sync_off[q] = off;
+}
+
+static int sync_submit_reap(struct aio_ctx *c, const unsigned int min_complete, struct aio_completion *out){
+	unsigned int i;
+	for(i=0; i < c->num_queued; ++i){
+		out[i].slot = c->sync_slot[i];
+		out[i].res = c->sync_write ? pwrite(c->sync_fd, c->sync_buf[i], c->sync_len[i], c->sync_off[i])
+								   : pread (c->sync_fd, c->sync_buf[i], c->sync_len[i], c->sync_off[i]);
+		if(out[i].res < 0)
+			out[i].res = -errno;
+	}
+	c->num_queued = 0;
+	return i;
+}
+
+static int aio_ctx_init(struct aio_ctx *c, const enum aio_engine engine, const unsigned int depth){
+	bzero(c, sizeof(struct aio_ctx));
+	c->engine = engine;
+	c->depth = depth;
+
+	switch(engine){
+		case AIO_ENGINE_IO_URING:
+			c->iov = calloc(depth, sizeof(struct iovec));
+			if(c->iov == NULL)
+				return 1;
+			if(uring_setup(c) != 0){
+				free(c->iov);
+				return 1;
+			}
+			break;
+		case AIO_ENGINE_LINUX_AIO:
+			c->iocbs  = calloc(depth, sizeof(struct iocb));
+			c->queued = calloc(depth, sizeof(struct iocb*));
+			c->events = calloc(depth, sizeof(struct io_event));
+			if((c->iocbs == NULL) || (c->queued == NULL) || (c->events == NULL) || (linux_aio_setup(c) != 0)){
+				free(c->iocbs);
+				free(c->queued);
+				free(c->events);
+				return 1;
+			}
+			break;
+		case AIO_ENGINE_SYNC:
+			c->sync_slot = calloc(depth, sizeof(unsigned int));
+			c->sync_buf  = calloc(depth, sizeof(void*));
+			c->sync_len  = calloc(depth, sizeof(size_t));
+			c->sync_off  = calloc(depth, sizeof(off_t));
+			if((c->sync_slot == NULL) || (c->sync_buf == NULL) || (c->sync_len == NULL) || (c->sync_off == NULL)){
+				free(c->sync_slot);
+				free(c->sync_buf);
+				free(c->sync_len);
+				free(c->sync_off);
+				return 1;
+			}
+			break;
+		default:
+			return 1;
+	}
+	return 0;
+}
+
+static void aio_ctx_exit(struct aio_ctx *c){
+	switch(c->engine){
+		case AIO_ENGINE_IO_URING:
+			uring_exit(c);
+			free(c->iov);
+			break;
+		case AIO_ENGINE_LINUX_AIO:
+			linux_aio_exit(c);
+			free(c->iocbs);
+			free(c->queued);
+			free(c->events);
+			break;
+		case AIO_ENGINE_SYNC:
+			free(c->sync_slot);
+			free(c->sync_buf);
+			free(c->sync_len);
+			free(c->sync_off);
+			break;
+		default:
+			break;
+	}
+}
+
+static void aio_ctx_queue(struct aio_ctx *c, const unsigned int slot, const int fd, void *buf, const size_t len, const off_t off, const int write){
+	switch(c->engine){
+		case AIO_ENGINE_IO_URING:	uring_queue(c, slot, fd, buf, len, off, write);		break;
+		case AIO_ENGINE_LINUX_AIO:	linux_aio_queue(c, slot, fd, buf, len, off, write);	break;
+		case AIO_ENGINE_SYNC:		sync_queue(c, slot, fd, buf, len, off, write);		break;
+		default: break;
+	}
+}
+
+// Submit everything queued and wait for at least min_complete completions
+static int aio_ctx_submit_reap(struct aio_ctx *c, const unsigned int min_complete, struct aio_completion *out){
+	switch(c->engine){
+		case AIO_ENGINE_IO_URING:	return uring_submit_reap(c, min_complete, out);
+		case AIO_ENGINE_LINUX_AIO:	return linux_aio_submit_reap(c, min_complete, out);
+		case AIO_ENGINE_SYNC:		return sync_submit_reap(c, min_complete, out);
+		default:					return -1;
+	}
+}
+
+enum aio_engine aio_detect_engine(void){
+	static enum aio_engine engine = AIO_ENGINE_NONE;
+	if(engine != AIO_ENGINE_NONE)
+		return engine;
+
+	// io_uring may be compiled out or disabled through kernel.io_uring_disabled
+	struct aio_ctx c;
+	if(aio_ctx_init(&c, AIO_ENGINE_IO_URING, 4) == 0){
+		aio_ctx_exit(&c);
+		engine = AIO_ENGINE_IO_URING;
+	}else if(aio_ctx_init(&c, AIO_ENGINE_LINUX_AIO, 4) == 0){
+		aio_ctx_exit(&c);
+		engine = AIO_ENGINE_LINUX_AIO;
+	}else{
+		engine = AIO_ENGINE_SYNC;
+	}
+	return engine;
+}
+
+const char * aio_engine_name(const enum aio_engine engine){
+	return aio_engine_names[engine];
+}
+
+static off_t aio_next_offset(const struct aio_job *job, off_t *seq, unsigned int *seed){
+	const off_t num_blocks = job->size / job->block_size;
+	off_t block;
+
+	if(job->random){
+		block = (((off_t)rand_r(seed) << 31) | rand_r(seed)) % num_blocks;
+	}else{
+		block = (*seq)++;
+		if(*seq >= num_blocks)
+			*seq = 0;
+	}
+	return job->offset + block * job->block_size;
+}
+
+/*
+ * Keep job->queue_depth I/Os in flight against job->fd until max_bytes were
+ * transferred or max_time elapsed, timing every completion individually.
+ * A failed submit or reap or an errored completion fails the whole run, what
+ * is still in flight then finishes when the context is torn down.
+ */
+int aio_run(const struct aio_job *job, struct aio_job_result *r){
+	struct aio_ctx c;
+	struct lat_hist hist;
+	struct aio_completion *done;
+	uint64_t *submit_ns;
+	char *bufs = NULL;
+	unsigned int depth = job->queue_depth, i;
+	int ret = 1;
+
+	bzero(r, sizeof(struct aio_job_result));
+
+	enum aio_engine engine = aio_detect_engine();
+	if(engine == AIO_ENGINE_SYNC)
+		depth = 1;
+	if(depth < 1) depth = 1;
+	if(depth > AIO_MAX_DEPTH) depth = AIO_MAX_DEPTH;
+	if(job->size < job->block_size)
+		return 1;
+	r->queue_depth = depth;
+
+	if(aio_ctx_init(&c, engine, depth) != 0){
+		perror("aio_ctx_init");
+		return 1;
+	}
+
+	done = calloc(depth, sizeof(struct aio_completion));
+	submit_ns = calloc(depth, sizeof(uint64_t));
+	if((done == NULL) || (submit_ns == NULL)){
+		perror("calloc");
+		goto out;
+	}
+	if((bufs = page_alloc((size_t)job->block_size * depth)) == NULL){ // Page aligned for O_DIRECT
+		perror("mmap");
+		goto out;
+	}
+	memset(bufs, 'x', (size_t)job->block_size * depth);
+	hist_init(&hist);
+
+	unsigned int seed = (unsigned int) timer_now_ns();
+	off_t seq = 0;
+	unsigned long issued_bytes = 0, done_bytes = 0;
+	unsigned int inflight = 0;
+	const uint64_t start = timer_now_ns();
+	const uint64_t deadline = start + (uint64_t)(job->max_time * 1e9);
+	int stop = 0, failed = 0;
+
+	for(i=0; i < depth; ++i){
+		submit_ns[i] = timer_now_ns();
+		aio_ctx_queue(&c, i, job->fd, bufs + (size_t)i * job->block_size, job->block_size,
+					  aio_next_offset(job, &seq, &seed), job->write);
+		issued_bytes += job->block_size;
+		inflight++;
+	}
+
+	while(inflight > 0){
+		int n = aio_ctx_submit_reap(&c, 1, done);
+		if(n < 0){
+			failed = 1;
+			break;
+		}
+
+		const uint64_t now = timer_now_ns();
+		if(now >= deadline)
+			stop = 1;
+
+		int k;
+		for(k=0; k < n; ++k){
+			const unsigned int slot = done[k].slot;
+			inflight--;
+			if(done[k].res < 0){
+				errno = -done[k].res;
+				perror("aio");
+				stop = failed = 1;
+				continue;
+			}
+			hist_add(&hist, now - submit_ns[slot]);
+			done_bytes += done[k].res;
+			r->ios++;
+
+			if(!stop && (issued_bytes < job->max_bytes)){
+				submit_ns[slot] = timer_now_ns();
+				aio_ctx_queue(&c, slot, job->fd, bufs + (size_t)slot * job->block_size, job->block_size,
+							  aio_next_offset(job, &seq, &seed), job->write);
+				issued_bytes += job->block_size;
+				inflight++;
+			}
+		}
+	}
+
+	r->time_s = (float)(timer_now_ns() - start) / 1e9f;
+	if(r->time_s > 0.0f){
+		r->iops = r->ios / r->time_s;
+		r->rate = (done_bytes / r->time_s) / (1024.0f*1024.0f);
+	}
+	r->lat_avg  = hist_mean(&hist) / 1e6;
+	r->lat_p50  = hist_percentile(&hist, 0.50)  / 1e6;
+	r->lat_p99  = hist_percentile(&hist, 0.99)  / 1e6;
+	r->lat_p999 = hist_percentile(&hist, 0.999) / 1e6;
+	ret = failed;
+
+out:
+	aio_ctx_exit(&c);		// Waits for or cancels what is in flight, before its buffers go
+	page_free(bufs);
+	free(submit_ns);
+	free(done);
+	return ret;
+}
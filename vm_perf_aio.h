@@ -0,0 +1,48 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_AIO_H
+#define VM_PERF_AIO_H
+
+#include <sys/types.h>
+
+#define AIO_MAX_DEPTH 256
+
+enum aio_engine{
+	AIO_ENGINE_NONE = 0,
+	AIO_ENGINE_IO_URING,		// io_uring (5.1+)
+	AIO_ENGINE_LINUX_AIO,		// Kernel native AIO, what libaio wraps
+	AIO_ENGINE_SYNC				// pread/pwrite, queue depth is always 1
+};
+
+struct aio_job{
+	int fd;
+	int write;					// Write instead of read
+	int random;					// Random block aligned offsets instead of sequential
+	unsigned int block_size;
+	unsigned int queue_depth;
+	off_t offset;				// Region of the file the job works on
+	off_t size;
+	unsigned long max_bytes;	// Stop after this much I/O or max_time, whichever comes first
+	float max_time;				// Seconds
+};
+
+struct aio_job_result{
+	unsigned int queue_depth;	// In flight, 1 with the sync engine whatever the job asked for
+	unsigned long ios;
+	float time_s;
+	float iops;
+	float rate;					// MB/s
+	float lat_avg;				// Completion latency in ms
+	float lat_p50;
+	float lat_p99;
+	float lat_p999;
+};
+
+int aio_run(const struct aio_job *job, struct aio_job_result *r);
+enum aio_engine aio_detect_engine(void);
+const char * aio_engine_name(const enum aio_engine engine);
+
+#endif
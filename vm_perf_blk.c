@@ -0,0 +1,217 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Block devices behind the mounted filesystems. Mount sources are resolved
+ * to a device number and looked up in /sys/dev/block rather than parsed by
+ * name, which copes with nvme0n1p1, /dev/root, device mapper and LVM alike.
+ * Partitions fold into their disk, the unit a cloud volume limit applies
+ * to, and device mapper volumes into the disk under them so two LVs of one
+ * volume are not taken for two devices. blk_run_concurrent() starts a
+ * batch of aio jobs together so the devices can be loaded one at a time
+ * and all at once.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <mntent.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vm_perf_blk.h"
+
+static int blk_start;
+static pthread_mutex_t blk_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blk_start_cond = PTHREAD_COND_INITIALIZER;
+
+static void blk_read_line(const char *path, char *value, const size_t size){
+	FILE * fin = fopen(path, "r");
+	value[0] = '\0';
+	if(fin == NULL)
+		return;
+	if(fgets(value, size, fin) != NULL)
+		value[strcspn(value, "\n")] = '\0';
+	fclose(fin);
+	// Trailing padding of SCSI model strings
+	size_t n = strlen(value);
+	while(n > 0 && value[n - 1] == ' ')
+		value[--n] = '\0';
+}
+
+static void blk_read_attributes(struct blk_device *d, const char *sysfs){
+	char path[PATH_MAX], line[64], *open, *close;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/queue/rotational", d->name);
+	blk_read_line(path, line, sizeof(line));
+	d->rotational = atoi(line);
+	snprintf(path, sizeof(path), "/sys/block/%s/device/model", d->name);
+	blk_read_line(path, d->model, sizeof(d->model));
+	if(d->model[0] == '\0'){
+		snprintf(path, sizeof(path), "/sys/block/%s/dm/name", d->name);
+		blk_read_line(path, d->model, sizeof(d->model));
+	}
+
+	// The active scheduler is the bracketed one, "[none] mq-deadline"
+	snprintf(path, sizeof(path), "/sys/block/%s/queue/scheduler", d->name);
+	blk_read_line(path, line, sizeof(line));
+	if((open = strchr(line, '[')) && (close = strchr(open, ']'))){
+		*close = '\0';
+		snprintf(d->scheduler, sizeof(d->scheduler), "%s", open + 1);
+	}else
+		snprintf(d->scheduler, sizeof(d->scheduler), "%s", line);
+
+	// In 512 byte sectors whatever the logical block size
+	snprintf(path, sizeof(path), "%s/size", sysfs);
+	blk_read_line(path, line, sizeof(line));
+	d->size = strtoull(line, NULL, 10) * 512ULL;
+}
+
+// Whole disk of the block device name, partitions fold into their parent, put in disk
+static void blk_whole_disk(const char *name, char *disk, const size_t size){
+	char path[PATH_MAX], sysfs[PATH_MAX];
+
+	snprintf(disk, size, "%s", name);
+	snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+	if(access(path, F_OK) != 0)
+		return;
+	snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+	if(realpath(path, sysfs) != NULL)
+		snprintf(disk, size, "%s", basename(dirname(sysfs)));
+}
+
+// Follow device mapper down its first slave to the disk under it, LVM on dm-crypt takes two steps
+static void blk_underlying_disk(char *disk, const size_t size){
+	char path[PATH_MAX], slave[256];
+	int depth;
+
+	for(depth=0; depth < 8; ++depth){
+		struct dirent *e;
+		DIR *dir;
+
+		snprintf(path, sizeof(path), "/sys/block/%s/slaves", disk);
+		if((dir = opendir(path)) == NULL)
+			return;
+		slave[0] = '\0';
+		while((e = readdir(dir)) != NULL)
+			if(e->d_name[0] != '.'){
+				snprintf(slave, sizeof(slave), "%s", e->d_name);
+				break;
+			}
+		closedir(dir);
+		if(slave[0] == '\0')
+			return;
+		blk_whole_disk(slave, disk, size);
+	}
+}
+
+// Disk of device number dev filled into d, non zero for devices without one or not worth testing
+static int blk_resolve(const dev_t dev, struct blk_device *d){
+	char path[PATH_MAX + 16], sysfs[PATH_MAX], parent[PATH_MAX];
+	const char *name, *disk;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if(realpath(path, sysfs) == NULL)
+		return 1;
+	snprintf(parent, sizeof(parent), "%s", sysfs);
+	name = basename(sysfs);
+	disk = name;
+	snprintf(path, sizeof(path), "%s/partition", sysfs);
+	if(access(path, F_OK) == 0)
+		disk = basename(dirname(parent));
+
+	if(strncmp(disk, "loop", 4) == 0 || strncmp(disk, "ram", 3) == 0 || strncmp(disk, "zram", 4) == 0)
+		return 1;
+
+	bzero(d, sizeof(struct blk_device));
+	snprintf(d->name, sizeof(d->name), "%s", disk);
+	blk_underlying_disk(d->name, sizeof(d->name));
+	snprintf(d->devname, sizeof(d->devname), "/dev/%s", name);
+	d->major = major(dev);
+	d->minor = minor(dev);
+	blk_read_attributes(d, sysfs);
+	return 0;
+}
+
+int blk_discover(struct blk_device *devices, const int max){
+	struct blk_device d;
+	struct mntent *m;
+	struct stat st;
+	int n = 0, i;
+	dev_t dev;
+	FILE *f;
+
+	if((f = setmntent("/proc/mounts", "r")) == NULL){
+		perror("setmntent");
+		return 0;
+	}
+	while((m = getmntent(f)) != NULL && n < max){
+		if(strncmp(m->mnt_fsname, "/dev/", 5) != 0)
+			continue;
+		// /dev/root and similar aliases have no node, the mounted filesystem knows its device
+		if(stat(m->mnt_fsname, &st) == 0 && S_ISBLK(st.st_mode))
+			dev = st.st_rdev;
+		else if(stat(m->mnt_dir, &st) == 0 && major(st.st_dev) != 0)
+			dev = st.st_dev;
+		else
+			continue;
+		if(blk_resolve(dev, &d) != 0)
+			continue;
+
+		for(i=0; i < n && strcmp(devices[i].name, d.name) != 0; ++i)
+			;
+		if(i < n)
+			continue;
+		snprintf(d.mount, sizeof(d.mount), "%s", m->mnt_dir);
+		d.writable = (hasmntopt(m, "ro") == NULL) && (access(m->mnt_dir, W_OK) == 0);
+		devices[n++] = d;
+	}
+	endmntent(f);
+	return n;
+}
+
+static void *blk_thread(void *arg){
+	struct blk_job *j = (struct blk_job*) arg;
+
+	pthread_mutex_lock(&blk_start_mutex);
+	while(!blk_start)
+		pthread_cond_wait(&blk_start_cond, &blk_start_mutex);
+	pthread_mutex_unlock(&blk_start_mutex);
+
+	j->ret = aio_run(&j->job, &j->result);
+	return NULL;
+}
+
+// Run every job at the same time, non zero if any of them failed
+int blk_run_concurrent(struct blk_job *jobs, const int num_jobs){
+	int i, started = 0, ret = 0;
+
+	aio_detect_engine();		// Its cached result is not set thread safe
+	blk_start = 0;
+	for(i=0; i < num_jobs; ++i){
+		jobs[i].ret = 1;
+		if(pthread_create(&jobs[i].tid, NULL, blk_thread, &jobs[i]) != 0){
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	pthread_mutex_lock(&blk_start_mutex);
+	blk_start = 1;
+	pthread_cond_broadcast(&blk_start_cond);
+	pthread_mutex_unlock(&blk_start_mutex);
+
+	for(i=0; i < started; ++i){
+		pthread_join(jobs[i].tid, NULL);
+		ret |= jobs[i].ret;
+	}
+	return ret || (started < num_jobs);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_BLK_H
+#define VM_PERF_BLK_H
+
+#include <limits.h>
+#include <pthread.h>
+#include "vm_perf_aio.h"
+
+#define BLK_MAX_DEVICES 32
+
+// A mounted block device, one per disk however many of its partitions are mounted
+struct blk_device{
+	char name[32];				// Kernel name of the whole disk, nvme0n1, xvdf, under any device mapper
+	char devname[48];			// Node of the mounted device, /dev/nvme0n1p1
+	char mount[256];			// First mount point of the disk
+	int writable;				// Mounted read-write and writable by this user
+	unsigned int major, minor;	// Of the mounted device
+	unsigned long long size;	// Bytes of the mounted device
+	int rotational;
+	char model[64];
+	char scheduler[64];
+};
+
+// One aio_run() of a concurrent batch
+struct blk_job{
+	struct aio_job job;
+	struct aio_job_result result;
+	int ret;
+	pthread_t tid;
+};
+
+int blk_discover(struct blk_device *devices, const int max);
+int blk_run_concurrent(struct blk_job *jobs, const int num_jobs);
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Co-run interference. Production nodes compress, stream memory, write to
+ * disk and send over the network at once, and under a hypervisor those
+ * contend: virtio interrupts take vCPU time and storage traffic can share
+ * the NIC. The usable vCPUs are split into two disjoint halves of equal
+ * size, whole cores on each side where possible. Every load first runs
+ * alone on each half, then every pair runs at once, one load on each half,
+ * and the slowdown of each against its solo run on the same half makes the
+ * matrix. The same load is not paired with itself, C-RAY keeps its scene in
+ * globals. The memory load touches its arrays before a run starts, so
+ * page faults are not part of it.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vm_perf_corun.h"
+#include "vm_perf_aio.h"
+#include "vm_perf_page.h"
+#include "vm_perf_sys.h"
+#include "vm_perf_tcp.h"
+#include "vm_perf_timer.h"
+#include "dep/c-ray.h"
+
+static const char * corun_load_names[CORUN_NUM_LOADS] = {"cpu", "mem", "disk", "net"};
+static const char * corun_load_units[CORUN_NUM_LOADS] = {"Mpx/s", "MB/s", "MB/s", "Gbit/s"};
+
+// One load of a run on one half
+struct corun_task{
+	enum corun_load load;
+	const int *cpus;
+	int num_cpus;
+	const struct corun_config *cfg;
+	int fd;						// Of the disk load
+	size_t mem_size;			// Bytes per array of the memory load
+	struct corun_triad *triad;	// Threads of the memory load, waiting on their arrays
+	int num_triad;
+	uint64_t deadline;
+	double rate;				// In the unit of the load, < 0 on failure
+	pthread_t tid;
+};
+
+struct corun_triad{
+	int cpu;
+	size_t n;					// Doubles per array
+	uint64_t deadline;
+	uint64_t end;				// When its last pass finished
+	double bytes;
+	pthread_t tid;
+};
+
+// The tasks of a run start together once all are ready, the memory load is never paired with itself
+static int corun_start, corun_ready, corun_triad_ready, corun_triad_go;
+static pthread_mutex_t corun_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t corun_start_cond = PTHREAD_COND_INITIALIZER;
+
+static void corun_pin(pthread_attr_t *attr, const int *cpus, const int num_cpus){
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for(i=0; i < num_cpus; ++i)
+		CPU_SET(cpus[i], &set);
+	pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+// Seconds to the deadline of the task
+static double corun_left(const struct corun_task *t){
+	const uint64_t now = timer_now_ns();
+	return now < t->deadline ? (t->deadline - now) / 1e9 : 0.0;
+}
+
+static double corun_cpu(const struct corun_task *t){
+	const uint64_t start = timer_now_ns();
+	unsigned long frames = 0;
+	uint64_t now;
+
+	do{
+		cray_mt(t->num_cpus, t->cpus, CORUN_XRES, CORUN_YRES, 1, NULL);
+		frames++;
+	}while((now = timer_now_ns()) < t->deadline);
+	return (double)frames * CORUN_XRES * CORUN_YRES / 1e6 / ((now - start) / 1e9);
+}
+
+// Bytes per triad array, like the STREAM arrays of mem well beyond every last level cache and within RAM
+static size_t corun_mem_size(void){
+	const struct sys_topology *t = sys_topology();
+	const size_t ram = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / (CORUN_MEM_RAM_FRACTION * 3);
+	size_t size = 0;
+
+	if(t->llc >= 0)
+		size = CORUN_MEM_LLC_FACTOR * t->cache[t->llc].size * t->cache[t->llc].instances * 1024UL;
+	if(size < CORUN_MEM_MIN)
+		size = CORUN_MEM_MIN;
+	if(ram > 0 && size > ram)
+		size = ram;
+	return size;
+}
+
+static void *corun_triad_thread(void *arg){
+	struct corun_triad *w = (struct corun_triad*) arg;
+	double *a = page_alloc(w->n * sizeof(double));
+	double *b = page_alloc(w->n * sizeof(double));
+	double *c = page_alloc(w->n * sizeof(double));
+	const int ok = (a != NULL && b != NULL && c != NULL);
+	size_t i;
+
+	if(ok){
+		for(i=0; i < w->n; ++i){
+			a[i] = 0.0;
+			b[i] = 1.0;
+			c[i] = 2.0;
+		}
+	}else
+		perror("mmap");
+
+	pthread_mutex_lock(&corun_start_mutex);
+	corun_triad_ready++;
+	pthread_cond_broadcast(&corun_start_cond);
+	while(!corun_triad_go)
+		pthread_cond_wait(&corun_start_cond, &corun_start_mutex);
+	pthread_mutex_unlock(&corun_start_mutex);
+
+	if(ok){
+		do{
+			for(i=0; i < w->n; ++i)
+				a[i] = b[i] + 3.0 * c[i];
+			w->bytes += 3.0 * sizeof(double) * w->n;
+		}while(timer_now_ns() < w->deadline);
+	}
+	w->end = timer_now_ns();
+	page_free(a);
+	page_free(b);
+	page_free(c);
+	return NULL;
+}
+
+// One thread per vCPU of the half first touches its arrays, then waits for corun_mem()
+static int corun_mem_prepare(struct corun_task *t){
+	pthread_attr_t attr;
+	int i;
+
+	if((t->triad = calloc(t->num_cpus, sizeof(struct corun_triad))) == NULL){
+		perror("calloc");
+		return 1;
+	}
+	corun_triad_ready = corun_triad_go = 0;
+	for(i=0; i < t->num_cpus; ++i){
+		t->triad[i].cpu = t->cpus[i];
+		t->triad[i].n = t->mem_size / sizeof(double) / t->num_cpus;
+		pthread_attr_init(&attr);
+		corun_pin(&attr, &t->cpus[i], 1);
+		if(pthread_create(&t->triad[i].tid, &attr, corun_triad_thread, &t->triad[i]) != 0){
+			perror("pthread_create");
+			pthread_attr_destroy(&attr);
+			break;
+		}
+		pthread_attr_destroy(&attr);
+		t->num_triad++;
+	}
+	pthread_mutex_lock(&corun_start_mutex);
+	while(corun_triad_ready < t->num_triad)
+		pthread_cond_wait(&corun_start_cond, &corun_start_mutex);
+	pthread_mutex_unlock(&corun_start_mutex);
+	return t->num_triad == 0;
+}
+
+// Triad MB/s summed over the threads of the half, from the start of the run to the end of the last pass
+static double corun_mem(struct corun_task *t){
+	uint64_t start, end = 0;
+	double bytes = 0.0;
+	int i;
+
+	if(t->triad == NULL)
+		return -1.0;
+	pthread_mutex_lock(&corun_start_mutex);
+	for(i=0; i < t->num_triad; ++i)
+		t->triad[i].deadline = t->deadline;
+	start = timer_now_ns();
+	corun_triad_go = 1;
+	pthread_cond_broadcast(&corun_start_cond);
+	pthread_mutex_unlock(&corun_start_mutex);
+
+	for(i=0; i < t->num_triad; ++i){
+		pthread_join(t->triad[i].tid, NULL);
+		bytes += t->triad[i].bytes;
+		if(t->triad[i].end > end)
+			end = t->triad[i].end;
+	}
+	free(t->triad);
+	t->triad = NULL;
+	return end > start ? bytes / 1e6 / ((end - start) / 1e9) : -1.0;
+}
+
+static double corun_disk(const struct corun_task *t){
+	struct aio_job_result res;
+	struct aio_job job;
+
+	bzero(&job, sizeof(job));
+	job.fd = t->fd;
+	job.write = 1;
+	job.block_size = CORUN_DISK_BLOCK;
+	job.queue_depth = CORUN_DISK_DEPTH;
+	job.size = CORUN_DISK_FILE_SIZE;
+	job.max_bytes = ULONG_MAX;
+	job.max_time = corun_left(t);
+	if(aio_run(&job, &res) != 0)
+		return -1.0;
+	return res.rate;
+}
+
+static double corun_net(const struct corun_task *t){
+	const struct tcp_job job = {t->cfg->peer, t->cfg->streams, corun_left(t)};
+	static struct tcp_result res;
+
+	if(tcp_throughput(&job, &res) != 0)
+		return -1.0;
+	return res.gbps;
+}
+
+// Threads the loads create inherit the affinity of this one
+static void *corun_thread(void *arg){
+	struct corun_task *t = (struct corun_task*) arg;
+
+	if(t->load == CORUN_MEM)
+		corun_mem_prepare(t);
+	pthread_mutex_lock(&corun_start_mutex);
+	corun_ready++;
+	pthread_cond_broadcast(&corun_start_cond);
+	while(!corun_start)
+		pthread_cond_wait(&corun_start_cond, &corun_start_mutex);
+	pthread_mutex_unlock(&corun_start_mutex);
+
+	t->deadline = timer_now_ns() + (uint64_t)(t->cfg->time * 1e9);
+	switch(t->load){
+		case CORUN_CPU:		t->rate = corun_cpu(t);		break;
+		case CORUN_MEM:		t->rate = corun_mem(t);		break;
+		case CORUN_DISK:	t->rate = corun_disk(t);	break;
+		default:			t->rate = corun_net(t);		break;
+	}
+	return NULL;
+}
+
+// Run the tasks together once each is ready, each pinned to its half
+static void corun_tasks(struct corun_task *tasks, const int num_tasks){
+	pthread_attr_t attr;
+	int i, started = 0;
+
+	corun_start = corun_ready = 0;
+	for(i=0; i < num_tasks; ++i){
+		tasks[i].rate = -1.0;
+		pthread_attr_init(&attr);
+		corun_pin(&attr, tasks[i].cpus, tasks[i].num_cpus);
+		if(pthread_create(&tasks[i].tid, &attr, corun_thread, &tasks[i]) != 0){
+			perror("pthread_create");
+			pthread_attr_destroy(&attr);
+			break;
+		}
+		pthread_attr_destroy(&attr);
+		started++;
+	}
+
+	pthread_mutex_lock(&corun_start_mutex);
+	while(corun_ready < started)
+		pthread_cond_wait(&corun_start_cond, &corun_start_mutex);
+	corun_start = 1;
+	pthread_cond_broadcast(&corun_start_cond);
+	pthread_mutex_unlock(&corun_start_mutex);
+
+	for(i=0; i < started; ++i)
+		pthread_join(tasks[i].tid, NULL);
+}
+
+/*
+ * Two halves of num_cpus vCPUs each. Cores go alternately to either half
+ * with all their SMT siblings, so no core is shared, and the larger half
+ * is cut down to the size of the smaller one.
+ */
+static void corun_halves(struct corun_result *r){
+	const struct sys_topology *t = sys_topology();
+	int n[2] = {0, 0}, core = 0, i, j;
+
+	if(t->num_cpus < 2){
+		r->shared = 1;
+		r->num_cpus = 1;
+		r->cpus[0][0] = r->cpus[1][0] = t->num_cpus ? t->cpu[0].id : 0;
+		return;
+	}
+	if(t->num_cores < 2){
+		for(i=0; i < t->num_cpus; ++i){
+			const int h = i % 2;
+			r->cpus[h][n[h]++] = t->cpu[i].id;
+		}
+	}else{
+		for(i=0; i < t->num_cpus; ++i){
+			if(t->cpu[i].sibling != t->cpu[i].id)
+				continue;
+			const int h = core++ % 2;
+			for(j=0; j < t->num_cpus; ++j)
+				if(t->cpu[j].sibling == t->cpu[i].id)
+					r->cpus[h][n[h]++] = t->cpu[j].id;
+		}
+	}
+	r->num_cpus = n[0] < n[1] ? n[0] : n[1];
+}
+
+static int corun_disk_open(char *filename){
+	char *home;
+	int fd;
+
+	if((home = getenv("HOME")) == NULL)
+		return -1;
+	snprintf(filename, PATH_MAX, "%s/vm_perf.corun", home);
+	if((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1){
+		perror("open");
+		return -1;
+	}
+	if(posix_fallocate(fd, 0, CORUN_DISK_FILE_SIZE) != 0)
+		perror("posix_fallocate");
+	close(fd);
+	if((fd = open(filename, O_WRONLY|O_DIRECT)) == -1){
+		perror("open O_DIRECT");
+		unlink(filename);
+	}
+	return fd;
+}
+
+static void corun_task(struct corun_task *t, const enum corun_load load, const int half, const struct corun_config *cfg, const struct corun_result *r, const int fd){
+	bzero(t, sizeof(struct corun_task));
+	t->load = load;
+	t->cpus = r->cpus[half];
+	t->num_cpus = r->num_cpus;
+	t->cfg = cfg;
+	t->fd = fd;
+	t->mem_size = r->mem_size;
+}
+
+int corun_run(const struct corun_config *cfg, struct corun_result *r){
+	struct corun_task tasks[2];
+	char filename[PATH_MAX];
+	int i, j, h, fd;
+
+	bzero(r, sizeof(struct corun_result));
+	r->time = cfg->time;
+	r->mem_size = corun_mem_size();
+	corun_halves(r);
+	aio_detect_engine();		// Its cached result is not set thread safe
+
+	fd = corun_disk_open(filename);
+	r->available[CORUN_CPU] = r->available[CORUN_MEM] = 1;
+	r->available[CORUN_DISK] = (fd != -1);
+	r->available[CORUN_NET] = (cfg->peer != NULL);
+
+	// On both halves, in a pair the lower load runs on the first and the higher one on the second
+	for(i=0; i < CORUN_NUM_LOADS; ++i){
+		for(h=0; h < 2 && r->available[i]; ++h){
+			if(h == 1 && r->shared){
+				r->solo[1][i] = r->solo[0][i];
+				continue;
+			}
+			corun_task(&tasks[0], i, h, cfg, r, fd);
+			corun_tasks(tasks, 1);
+			r->solo[h][i] = tasks[0].rate;
+			if(r->solo[h][i] <= 0.0f){
+				fprintf(stderr, "corun: %s load failed, left out of the matrix\n", corun_load_names[i]);
+				r->available[i] = 0;
+			}
+		}
+	}
+
+	for(i=0; i < CORUN_NUM_LOADS; ++i){
+		for(j=i+1; j < CORUN_NUM_LOADS; ++j){
+			if(!r->available[i] || !r->available[j])
+				continue;
+			corun_task(&tasks[0], i, 0, cfg, r, fd);
+			corun_task(&tasks[1], j, 1, cfg, r, fd);
+			sampler_start();
+			corun_tasks(tasks, 2);
+			sampler_stop(&r->window[i][j]);
+			r->window[i][j].attempts = 1;
+			r->paired[i][j] = tasks[0].rate;
+			r->paired[j][i] = tasks[1].rate;
+			if(r->paired[i][j] > 0.0f)
+				r->slowdown[i][j] = (1.0f - r->paired[i][j] / r->solo[0][i]) * 100.0f;
+			else
+				fprintf(stderr, "corun: %s load failed next to %s\n", corun_load_names[i], corun_load_names[j]);
+			if(r->paired[j][i] > 0.0f)
+				r->slowdown[j][i] = (1.0f - r->paired[j][i] / r->solo[1][j]) * 100.0f;
+			else
+				fprintf(stderr, "corun: %s load failed next to %s\n", corun_load_names[j], corun_load_names[i]);
+		}
+	}
+
+	if(fd != -1){
+		close(fd);
+		unlink(filename);
+	}
+	return 0;
+}
+
+// Throughput of load i in its pair with j, failed when it did not run
+static void corun_paired_report(const struct corun_result *r, const int i, const int j){
+	if(r->paired[i][j] > 0.0f)
+		printf("\"%s\":\"%.2f%s\"", corun_load_names[i], r->paired[i][j], corun_load_units[i]);
+	else
+		printf("\"%s\":\"failed\"", corun_load_names[i]);
+}
+
+static void corun_cpu_list(const int *cpus, const int n){
+	int i;
+	for(i=0; i < n; ++i)
+		printf("%s%i", i ? "," : "", cpus[i]);
+}
+
+void corun_report(const struct corun_result *r){
+	char delim = ' ', inner;
+	int i, j, h;
+
+	printf("\"corun\":{\"time\":\"%.1fs\",\"shared\":\"%s\",\"cpus\":[\"", r->time, r->shared ? "yes" : "no");
+	corun_cpu_list(r->cpus[0], r->num_cpus);
+	printf("\",\"");
+	corun_cpu_list(r->cpus[1], r->num_cpus);
+	printf("\"],\"mem_size\":\"%.1fMB\",\"solo\":[", r->mem_size / (1024.0*1024.0));
+	for(h=0; h < 2; ++h){
+		printf("%s{", h ? "," : "");
+		delim = ' ';
+		for(i=0; i < CORUN_NUM_LOADS; ++i){
+			if(!r->available[i])
+				continue;
+			printf("%c\"%s\":\"%.2f%s\"", delim, corun_load_names[i], r->solo[h][i], corun_load_units[i]);
+			delim = ',';
+		}
+		printf("}");
+	}
+
+	// Row i, column j: how much slower i ran next to j, against i alone on the same half
+	printf("],\"slowdown\":{");
+	delim = ' ';
+	for(i=0; i < CORUN_NUM_LOADS; ++i){
+		if(!r->available[i])
+			continue;
+		printf("%c\"%s\":{", delim, corun_load_names[i]);
+		inner = ' ';
+		for(j=0; j < CORUN_NUM_LOADS; ++j){
+			if(j == i || !r->available[j] || r->paired[i][j] <= 0.0f)
+				continue;
+			printf("%c\"%s\":\"%.1f%%\"", inner, corun_load_names[j], r->slowdown[i][j]);
+			inner = ',';
+		}
+		printf("}");
+		delim = ',';
+	}
+
+	printf("},\"pairs\":[");
+	delim = ' ';
+	for(i=0; i < CORUN_NUM_LOADS; ++i){
+		for(j=i+1; j < CORUN_NUM_LOADS; ++j){
+			if(!r->available[i] || !r->available[j])
+				continue;
+			printf("%c{\"loads\":\"%s+%s\",", delim, corun_load_names[i], corun_load_names[j]);
+			corun_paired_report(r, i, j);	putchar(',');
+			corun_paired_report(r, j, i);	putchar(',');
+			sampler_report("window", &r->window[i][j]);
+			printf("}");
+			delim = ',';
+		}
+	}
+	printf("]}");
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_CORUN_H
+#define VM_PERF_CORUN_H
+
+#include <sched.h>
+#include "vm_perf_sampler.h"
+
+#define CORUN_TIME 5						// Default seconds of every solo and paired run
+#define CORUN_XRES 640						// C-RAY frame of the CPU load
+#define CORUN_YRES 360
+#define CORUN_MEM_MIN (64*1024*1024)		// Bytes per triad array at least, split over the threads of the memory load
+#define CORUN_MEM_LLC_FACTOR 4				// Each array at least 4 times the size of all last level caches
+#define CORUN_MEM_RAM_FRACTION 4			// All three arrays use at most 1/4 of RAM
+#define CORUN_DISK_FILE_SIZE (256*1024*1024)
+#define CORUN_DISK_BLOCK (256*1024)
+#define CORUN_DISK_DEPTH 16
+
+enum corun_load{
+	CORUN_CPU = 0,				// cray_mt frames
+	CORUN_MEM,					// STREAM triad, one thread per vCPU
+	CORUN_DISK,					// O_DIRECT sequential writes through the aio engine
+	CORUN_NET,					// TCP streams to the -p peer, only with one
+	CORUN_NUM_LOADS
+};
+
+struct corun_config{
+	float time;					// Seconds per run
+	const char *peer;
+	int streams;
+};
+
+struct corun_result{
+	float time;
+	int shared;					// Fewer than two vCPUs, the loads of a pair share them
+	int num_cpus;				// vCPUs of either half
+	int cpus[2][CPU_SETSIZE];	// Disjoint halves, whole cores where there are two or more
+	unsigned long mem_size;		// Bytes per triad array of the memory load
+	int available[CORUN_NUM_LOADS];
+	float solo[2][CORUN_NUM_LOADS];						// Throughput alone on either half
+	float paired[CORUN_NUM_LOADS][CORUN_NUM_LOADS];		// [i][j] throughput of i while j ran on the other half, <= 0 when i failed
+	float slowdown[CORUN_NUM_LOADS][CORUN_NUM_LOADS];	// % below solo, only where paired is set
+	struct sampler_window window[CORUN_NUM_LOADS][CORUN_NUM_LOADS];	// Of each pair, [i][j] with i < j
+};
+
+int corun_run(const struct corun_config *cfg, struct corun_result *r);
+void corun_report(const struct corun_result *r);
+
+#endif
@@ -3,34 +3,246 @@
  * Use of this program or parts thereof is subject to the GPLv3 licence
  */
 
-#include <omp.h>
+#include <sched.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include "vm_perf_cpu.h"
+#include "vm_perf_sys.h"
 #include "dep/c-ray.h"
 #include "dep/dhry.h"
 
-#include "vm_perf_cpu.h"
 
 static const char * cpu_test_labels[NUM_CPU_TESTS] = {
 	"DHRYSTONE",
 	"C-RAY F",
-	"C-RAY MT"
+	"C-RAY MT",
+	"DHRYSTONE MT",
+	"C-RAY SIMD"
+};
+
+static const char * cpu_test_units[NUM_CPU_TESTS] = {"loops/s", "ms", "ms", "loops/s", "ms"};
+
+static int cpu_online[CPU_SETSIZE];
+static int cpu_num_online;
+
+static const char * cpu_pinning_labels[CPU_NUM_PINNINGS] = {"vcpu", "core"};
+
+// Milliseconds of a Dhrystone trial under the current slice
+static int cpu_dhry_time(void){
+	const int ms = (int)(timer_scaled(CPU_DHRY_TRIAL_TIME) * 1000.0 + 0.5);
+	return ms > CPU_DHRY_MIN_MS ? ms : CPU_DHRY_MIN_MS;
+}
+
+// Frame of a C-RAY trial under the current slice, width and height shrink with the square root of the scale
+static void cpu_cray_frame(int *xres, int *yres){
+	double f = sqrt(timer_scaled(1.0));
+
+	if(f < CPU_CRAY_MIN_FRAME)
+		f = CPU_CRAY_MIN_FRAME;
+	*xres = (int)(CPU_CRAY_XRES * f) & ~7;
+	*yres = (int)(CPU_CRAY_YRES * f) & ~7;
+}
+
+// Render time of a smaller frame as ms of a full one, < 0 stays a failure
+static double cpu_cray_ms(const int ms, const int xres, const int yres){
+	if(ms < 0)
+		return -1.0;
+	return ms * ((double)CPU_CRAY_XRES * CPU_CRAY_YRES) / ((double)xres * yres);
+}
+
+static double cpu_trial_dhry(void *arg){
+	const uint64_t start = timer_now_ns();
+	const int loops = dhry(cpu_dhry_time());
+	return loops / ((timer_now_ns() - start) / 1e9);
+}
+
+static double cpu_trial_cray_f(void *arg){
+	int xres, yres;
+	cpu_cray_frame(&xres, &yres);
+	return cpu_cray_ms(cray_f(xres, yres, 1), xres, yres);
+}
+
+static double cpu_trial_cray_mt(void *arg){
+	struct cpu_result *r = (struct cpu_result*) arg;
+	struct cpu_cray_mt *c = &r->cray_mt[r->num_cray_mt];
+	int xres, yres;
+
+	if(r->num_cray_mt >= TIMER_WARMUP + TIMER_MAX_TRIALS)
+		return -1.0;
+	cpu_cray_frame(&xres, &yres);
+	if((c->ms = cpu_cray_ms(cray_mt(cpu_num_online, cpu_online, xres, yres, 1, &c->stats), xres, yres)) >= 0.0)
+		r->num_cray_mt++;
+	return c->ms;
+}
+
+// Tiles of the C-RAY MT trial closest to the median, found by its sample as the warmup has none
+static const struct cray_stats * cpu_cray_mt_median(const struct cpu_result * r){
+	static const struct cray_stats none;
+	const struct timer_stats *s = &r->stats[2];
+	int i, best = -1;
+
+	for(i=0; i < r->num_cray_mt; ++i){
+		int j;
+		for(j=0; j < s->trials && s->samples[j] != r->cray_mt[i].ms; ++j)
+			;
+		if(j < s->trials && (best < 0 || fabs(r->cray_mt[i].ms - s->median) < fabs(r->cray_mt[best].ms - s->median)))
+			best = i;
+	}
+	return best < 0 ? &none : &r->cray_mt[best].stats;
+}
+
+static double cpu_trial_dhry_mt(void *arg){
+	struct cpu_result *r = (struct cpu_result*) arg;
+	struct cpu_dhry_mt *d = &r->dhry_mt[r->num_dhry_mt];
+	struct dhry_stats s;
+
+	// No warmup, every trial that succeeds is a sample
+	if(r->num_dhry_mt >= TIMER_MAX_TRIALS || dhry_mt(cpu_num_online, cpu_online, cpu_dhry_time(), &s) != 0 || s.time_s <= 0.0)
+		return -1.0;
+
+	d->threads = s.num_threads;
+	d->dmips = s.loops / s.time_s / DHRY_VAX_MIPS;
+	d->dmips_per_thread = d->dmips / s.num_threads;
+	d->dmips_min = s.loops_min / s.time_s / DHRY_VAX_MIPS;
+	d->dmips_max = s.loops_max / s.time_s / DHRY_VAX_MIPS;
+	r->num_dhry_mt++;
+	return s.loops / s.time_s;
+}
+
+// Breakdown of the DHRYSTONE MT trial closest to the median, the one the result stands for
+static const struct cpu_dhry_mt * cpu_dhry_mt_median(const struct cpu_result * r){
+	const struct timer_stats *s = &r->stats[3];
+	int i, best = 0;
+
+	for(i=1; i < s->trials && i < r->num_dhry_mt; ++i)
+		if(fabs(s->samples[i] - s->median) < fabs(s->samples[best] - s->median))
+			best = i;
+	return &r->dhry_mt[best];
+}
+
+// Same scene and resolution as C-RAY F, traced in AVX2 or AVX-512 ray packets
+static double cpu_trial_cray_simd(void *arg){
+	struct cpu_result *r = (struct cpu_result*) arg;
+	int xres, yres;
+	cpu_cray_frame(&xres, &yres);
+	return cpu_cray_ms(cray_simd(xres, yres, 1, &r->cray_simd), xres, yres);
+}
+
+static const timer_trial_fn cpu_trials[NUM_CPU_TESTS] = {
+	cpu_trial_dhry,
+	cpu_trial_cray_f,
+	cpu_trial_cray_mt,
+	cpu_trial_dhry_mt,
+	cpu_trial_cray_simd
 };
 
 void cpu_bench(struct cpu_result * r){
-	int num_cores = omp_get_num_procs();
+	static int cpus[CPU_SETSIZE];
+	int i;
 
-	r->cpu_timing[0] = dhry(20);	// Run Dhrystone test for 20 seconds
-	r->cpu_timing[1] = cray_f(1600, 900, 1);
-	r->cpu_timing[2] = cray_mt(num_cores, 1600, 900, 1);
+	cpu_num_online = sys_online_cpus(cpu_online, CPU_SETSIZE);
+	r->num_procs = cpu_num_online;
+	r->num_cores = sys_core_cpus(cpus, CPU_SETSIZE, -1);
+	r->num_scaling = 0;
+	r->num_cray_mt = 0;
+	r->num_dhry_mt = 0;
+
+	// Dhrystone runs long enough per trial to need no warmup
+	for(i=0; i < NUM_CPU_TESTS; ++i){
+		const int dhrystone = (cpu_trials[i] == cpu_trial_dhry) || (cpu_trials[i] == cpu_trial_dhry_mt);
+		struct pmu_session pmu;
+		pmu_start(&pmu);
+		timer_trials(cpu_trials[i], r, dhrystone ? 0 : TIMER_WARMUP, TIMER_TRIALS, &r->stats[i]);
+		pmu_stop(&pmu, &r->pmu[i]);
+	}
 };
 
+/*
+ * Run C-RAY MT at 1, 2, 4, ... N threads, pinned once per vCPU and once per
+ * physical core. Comparing both curves shows whether the upper vCPUs are SMT
+ * siblings or oversubscribed cores.
+ */
+void cpu_scaling(struct cpu_result * r){
+	static int cpus[CPU_NUM_PINNINGS][CPU_SETSIZE];
+	int num_cpus[CPU_NUM_PINNINGS];
+	int p;
+
+	num_cpus[CPU_PIN_VCPU] = sys_online_cpus(cpus[CPU_PIN_VCPU], CPU_SETSIZE);
+	num_cpus[CPU_PIN_CORE] = sys_core_cpus(cpus[CPU_PIN_CORE], CPU_SETSIZE, -1);
+	r->num_scaling = 0;
+
+	for(p=0; p < CPU_NUM_PINNINGS; ++p){
+		float single = 0.0f;
+		int threads = 1;
+		while((threads <= num_cpus[p]) && (r->num_scaling < CPU_MAX_SCALING)){
+			struct cpu_scaling_point *s = &r->scaling[r->num_scaling++];
+			s->pinning = p;
+			s->threads = threads;
+			int xres, yres;
+			cpu_cray_frame(&xres, &yres);
+			s->time_ms = (int)(cpu_cray_ms(cray_mt(threads, cpus[p], xres, yres, 1, NULL), xres, yres) + 0.5);
+			s->throughput = s->time_ms > 0 ? ((float)CPU_CRAY_XRES * CPU_CRAY_YRES / 1000.0f) / s->time_ms : 0.0f;
+			if(threads == 1)
+				single = s->throughput;
+			s->efficiency = single > 0.0f ? s->throughput / (threads * single) : 0.0f;
+
+			if(threads == num_cpus[p])
+				break;
+			threads = (threads * 2 > num_cpus[p]) ? num_cpus[p] : threads * 2;
+		}
+	}
+}
+
 void cpu_report(const struct cpu_result * r){
 	printf("\"cpu\":[");
 	int i;
 	char delim = ' ';
 	for(i=0; i < NUM_CPU_TESTS; ++i){
-		printf("%c{\"test\":\"%s\",\"result\":\"%i\"}", delim, cpu_test_labels[i], r->cpu_timing[i]);
+		printf("%c{\"test\":\"%s\",\"result\":\"%li\",", delim, cpu_test_labels[i], (long)(r->stats[i].median + 0.5));
+		timer_report(&r->stats[i], cpu_test_units[i]);
+		putchar(',');
+		pmu_report("pmu", &r->pmu[i]);
+		if(i == 0)
+			printf(",\"dmips\":\"%.1f\"", r->stats[0].median / DHRY_VAX_MIPS);
+		if(i == 2){
+			const struct cray_stats *s = cpu_cray_mt_median(r);
+			printf(",\"threads\":\"%i\",\"tiles\":\"%i\",\"tiles_per_thread\":\"%i-%i\",", s->num_threads, s->num_tiles, s->tiles_min, s->tiles_max);
+			printf("\"busy_min\":\"%.1fms\",\"busy_avg\":\"%.1fms\",\"busy_max\":\"%.1fms\",", s->busy_min, s->busy_avg, s->busy_max);
+			printf("\"imbalance\":\"%.2f\"", s->busy_avg > 0.0f ? s->busy_max / s->busy_avg : 0.0f);
+		}else if(i == 3){
+			const struct cpu_dhry_mt *d = cpu_dhry_mt_median(r);
+			printf(",\"threads\":\"%i\",\"dmips\":\"%.1f\",\"dmips_per_thread\":\"%.1f\",\"dmips_min\":\"%.1f\",\"dmips_max\":\"%.1f\"",
+				d->threads, d->dmips, d->dmips_per_thread, d->dmips_min, d->dmips_max);
+		}else if(i == 4){
+			const struct cray_simd_check *c = &r->cray_simd;
+			printf(",\"isa\":\"%s\",\"lanes\":\"%i\",\"pixels_checked\":\"%li\",\"mismatched\":\"%li\",\"match\":\"%s\"",
+				c->isa ? c->isa : "none", c->lanes, c->pixels_checked, c->mismatched,
+				(c->pixels_checked > 0 && c->mismatched == 0) ? "yes" : "no");
+		}
+		printf("}");
+		delim = ',';
+	}
+	printf("],");
+
+	printf("\"cpu_scaling\":{\"cores\":\"%hu\",\"vcpus\":\"%hu\",\"points\":[", r->num_cores, r->num_procs);
+	delim = ' ';
+	for(i=0; i < r->num_scaling; ++i){
+		const struct cpu_scaling_point *s = &r->scaling[i];
+		printf("%c{\"pinning\":\"%s\",\"threads\":\"%i\",\"time\":\"%ims\",\"throughput\":\"%.2fMpixel/s\",\"efficiency\":\"%.0f%%\"}",
+			delim, cpu_pinning_labels[s->pinning], s->threads, s->time_ms, s->throughput, s->efficiency * 100.0f);
 		delim = ',';
 	}
-	printf("]");
+	printf("]}");
 };
+
+void cpu_store(const struct cpu_result * r, struct store * s){
+	char name[STORE_NAME_SIZE];
+	int i;
+
+	for(i=0; i < NUM_CPU_TESTS; ++i){
+		const int rate = strcmp(cpu_test_units[i], "ms") != 0;
+		snprintf(name, sizeof(name), "cpu/%s", cpu_test_labels[i]);
+		store_add_stats(s, name, cpu_test_units[i], rate ? STORE_HIGHER : STORE_LOWER, &r->stats[i]);
+	}
+}
@@ -6,16 +6,69 @@
 #ifndef VM_PERF_CPU_H
 #define VM_PERF_CPU_H
 
-#define NUM_CPU_TESTS 3
+#include "vm_perf_sampler.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_store.h"
+#include "vm_perf_pmu.h"
+#include "dep/c-ray.h"
+
+#define NUM_CPU_TESTS 5
+#define CPU_MAX_SCALING 64
+#define CPU_DHRY_TRIAL_TIME 2		// Seconds per Dhrystone trial
+#define CPU_DHRY_MIN_MS 100			// Shortest Dhrystone trial under a time budget
+#define CPU_CRAY_XRES 1600			// C-RAY frame, the results are ms per frame of this size
+#define CPU_CRAY_YRES 900
+#define CPU_CRAY_MIN_FRAME 0.5		// Under a time budget the frame shrinks to no less than half as wide and high
+
+enum cpu_pinning{
+	CPU_PIN_VCPU = 0,		// Thread i on the i-th online vCPU
+	CPU_PIN_CORE,			// Thread i on the i-th physical core, SMT siblings left idle
+	CPU_NUM_PINNINGS
+};
+
+struct cpu_scaling_point{
+	enum cpu_pinning pinning;
+	int threads;
+	int time_ms;
+	float throughput;		// Megapixels/s
+	float efficiency;		// Throughput relative to threads * single thread throughput
+};
+
+struct cpu_cray_mt{
+	double ms;					// The sample it returned
+	struct cray_stats stats;
+};
+
+struct cpu_dhry_mt{
+	int threads;				// One pinned instance per online vCPU
+	float dmips;				// Aggregate
+	float dmips_per_thread;
+	float dmips_min;			// Slowest and fastest instance
+	float dmips_max;
+};
 
 struct cpu_result{
-	unsigned char num_cores;	// Number of cores in processor
-	unsigned char num_procs;	// Number of processors in system
+	unsigned short num_cores;	// Number of physical cores
+	unsigned short num_procs;	// Number of online vCPUs
+
+	struct timer_stats stats[NUM_CPU_TESTS];	// Dhrystone loops/s and C-RAY render ms, the median is the result
+	struct pmu_counts pmu[NUM_CPU_TESTS];		// Hardware counters over the warmup and all trials
+	int num_cray_mt;
+	struct cpu_cray_mt cray_mt[TIMER_WARMUP + TIMER_MAX_TRIALS];	// Tile distribution per C-RAY MT trial, the warmup included
+	int num_dhry_mt;
+	struct cpu_dhry_mt dhry_mt[TIMER_MAX_TRIALS];	// Per DHRYSTONE MT trial, in the order of its samples
+	struct cray_simd_check cray_simd;		// ISA of C-RAY SIMD and how its image compared with C-RAY F
+
+	// C-RAY MT thread count sweep, only filled by cpu_scaling()
+	int num_scaling;
+	struct cpu_scaling_point scaling[CPU_MAX_SCALING];
 
-	int cpu_timing[NUM_CPU_TESTS];			// Test CPU result
+	struct sampler_window window;		// Interference seen while measuring
 };
 
 void cpu_bench(struct cpu_result * r);
+void cpu_scaling(struct cpu_result * r);
 void cpu_report(const struct cpu_result * r);
+void cpu_store(const struct cpu_result * r, struct store * s);
 
 #endif
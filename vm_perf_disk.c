@@ -5,7 +5,6 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +13,7 @@
 #include <unistd.h>
 
 #include "vm_perf_disk.h"
+#include "vm_perf_aio.h"
 #include "dep/seeker.h"
 
 static const char * disk_io_types[DISK_NUM_IO_TYPES] = {"random", "sequential", "cached_sequential"};
@@ -21,103 +21,305 @@ static const int    disk_io_size[DISK_NUM_IO_TYPES]  = {4096, 	   256*1024,	 256
 static const char * disk_io_unit[DISK_NUM_IO_TYPES]  = {"KB", "MB", "MB"};
 static const int 	disk_io_divisor[DISK_NUM_IO_TYPES]  = {1024, 1024*1024, 1024*1024};
 
-static float test_disk_write(const int size, const unsigned int buf_size, const int flags, const int random){
-	struct timeval tvStart, tvEnd;
-	char *home, filename[PATH_MAX];
-	void * buf;
+static const struct disk_write_test{
+	int type;					// Index in disk_io_types
+	unsigned int buf_size;
+	unsigned int queue_depth;
+} disk_write_tests[DISK_NUM_WRITE_TESTS] = {
+	{0, 4096, 1}, {0, 4096, 4}, {0, 4096, 16}, {0, 4096, 64},
+	{0, 256*1024, 1}, {0, 256*1024, 4}, {0, 256*1024, 16}, {0, 256*1024, 64},
+	{1, 4096, 1}, {1, 4096, 4}, {1, 4096, 16}, {1, 4096, 64},
+	{1, 256*1024, 1}, {1, 256*1024, 4}, {1, 256*1024, 16}, {1, 256*1024, 64},
+	{2, 256*1024, 1}
+};
+
+#define DISK_SYNC_WRITERS 8
+
+static const struct sync_job disk_sync_tests[DISK_NUM_SYNC_TESTS] = {
+	// One log, the group commit batch grows until the flush latency stops dominating
+	{NULL, SYNC_FDATASYNC, 4096, 1, 1}, {NULL, SYNC_FDATASYNC, 4096, 4, 1}, {NULL, SYNC_FDATASYNC, 4096, 16, 1},
+	{NULL, SYNC_FDATASYNC, 4096, 64, 1}, {NULL, SYNC_FDATASYNC, 16384, 1, 1}, {NULL, SYNC_FDATASYNC, 16384, 16, 1},
+	// Concurrent logs
+	{NULL, SYNC_FDATASYNC, 4096, 1, DISK_SYNC_WRITERS}, {NULL, SYNC_FDATASYNC, 4096, 16, DISK_SYNC_WRITERS},
+	{NULL, SYNC_FDATASYNC, 16384, 1, DISK_SYNC_WRITERS}, {NULL, SYNC_FDATASYNC, 16384, 16, DISK_SYNC_WRITERS},
+	{NULL, SYNC_ODSYNC, 4096, 1, 1}, {NULL, SYNC_ODSYNC, 4096, 4, 1}, {NULL, SYNC_ODSYNC, 4096, 16, 1},
+	{NULL, SYNC_ODSYNC, 4096, 64, 1}, {NULL, SYNC_ODSYNC, 16384, 1, 1}, {NULL, SYNC_ODSYNC, 16384, 16, 1},
+	{NULL, SYNC_ODSYNC, 4096, 1, DISK_SYNC_WRITERS}, {NULL, SYNC_ODSYNC, 4096, 16, DISK_SYNC_WRITERS},
+	{NULL, SYNC_ODSYNC, 16384, 1, DISK_SYNC_WRITERS}, {NULL, SYNC_ODSYNC, 16384, 16, DISK_SYNC_WRITERS}
+};
+
+/*
+ * Per disk tests, every disk alone and then all of them at once. Small random
+ * I/O runs into an IOPS limit and large sequential I/O into a bandwidth limit,
+ * either of the volume or of the instance.
+ */
+static const struct disk_device_test{
+	const char *name;
+	int write;
+	int random;
+	unsigned int block_size;
+	unsigned int queue_depth;
+} disk_device_tests[DISK_NUM_DEVICE_TESTS] = {
+	{"random_read", 0, 1, 4096, 32}, {"sequential_read", 0, 0, 1024*1024, 8},
+	{"random_write", 1, 1, 4096, 32}, {"sequential_write", 1, 0, 1024*1024, 8}
+};
+
+#define DISK_TEST_FILE_SIZE (100*1024*1024)
+#define DISK_TEST_TIME		2.0f		// Upper bound in seconds for every point of the write matrix
+#define DISK_VOLUME_SCALING	0.8f		// Concurrent share of the summed rates above which each volume is its own limit
+
+static void disk_io_copy(struct disk_io_result *r, const struct aio_job_result *res){
+	r->queue_depth = res->queue_depth;
+	r->iops		= res->iops;
+	r->rate		= res->rate;
+	r->lat_avg	= res->lat_avg;
+	r->lat_p50	= res->lat_p50;
+	r->lat_p99	= res->lat_p99;
+	r->lat_p999	= res->lat_p999;
+}
+
+static int test_disk_write(const char *filename, const struct disk_write_test *t, struct disk_io_result *r){
+	struct aio_job job;
+	struct aio_job_result res;
+	const int flags = (t->type == 2) ? 0 : O_DIRECT;	// Cached write to disk
 	int fd;
 
-	if((home = getenv("HOME")) == NULL){
+	if((fd = open(filename, O_WRONLY|O_CREAT|flags, 0666)) == -1){
+		perror("open");
 		return 1;
 	}
 
+	bzero(&job, sizeof(job));
+	job.fd = fd;
+	job.write = 1;
+	job.random = (t->type == 0);
+	job.block_size = t->buf_size;
+	job.queue_depth = t->queue_depth;
+	job.offset = 0;
+	job.size = DISK_TEST_FILE_SIZE;
+	job.max_bytes = DISK_TEST_FILE_SIZE;
+	job.max_time = timer_scaled(DISK_TEST_TIME);
+
+	int ret = aio_run(&job, &res);
+	close(fd);
+	if(ret != 0)
+		return 1;
+
+	disk_io_copy(r, &res);
+	return 0;
+}
+
+static void disk_bench_write(struct disk_result *r){
+	char *home, filename[PATH_MAX];
+	struct pmu_session pmu;
+	int fd, t;
+
+	if((home = getenv("HOME")) == NULL){
+		return;
+	}
 	snprintf(filename, PATH_MAX, "%s/vm_perf.temp", home);
 
-	if((fd = open(filename, O_WRONLY|O_CREAT|flags, 0666)) == -1){
+	// Preallocate the file once so the sweep does not measure block allocation
+	if((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1){
 		perror("open");
-		return 0;
+		return;
 	}
+	if(posix_fallocate(fd, 0, DISK_TEST_FILE_SIZE) != 0)
+		perror("posix_fallocate");
+	close(fd);
 
-	if(posix_memalign(&buf, 4096, buf_size) != 0){ // Needed only by O_DIRECT
-		return 0;
+	r->aio_engine = aio_engine_name(aio_detect_engine());
+	for(t=0; t < DISK_NUM_WRITE_TESTS; ++t){
+		pmu_start(&pmu);
+		test_disk_write(filename, &disk_write_tests[t], &r->write[t]);
+		pmu_stop(&pmu, &r->write[t].pmu);
 	}
-	memset(buf, 'x', buf_size);
 
-	gettimeofday(&tvStart, NULL);
-	int left = size;
-	while(left > 0){
-		if(random){
-			off64_t offset = (off64_t) rand() % ((size/buf_size)-1);
-			if(lseek64(fd, buf_size * offset, SEEK_SET) == (off64_t) -1){
-				perror("lseek64");
-				break;
-			}
-		}
+	unlink(filename);
+	snprintf(filename, PATH_MAX, "%s/vm_perf.mmap", home);
+	pmu_start(&pmu);
+	mmap_bench(filename, &r->mmap);
+	pmu_stop(&pmu, &r->mmap_pmu);
+}
 
-		int bytes = write(fd, buf, buf_size);
-		if(bytes == -1){
-			perror("write");
-			break;
-		}
-		left -= bytes;
+static void disk_bench_sync(struct disk_result *r){
+	struct pmu_session pmu;
+	char *home;
+	int t;
+
+	if((home = getenv("HOME")) == NULL){
+		return;
+	}
+	for(t=0; t < DISK_NUM_SYNC_TESTS; ++t){
+		struct sync_job job = disk_sync_tests[t];
+		job.dir = home;
+		job.max_time = timer_scaled(DISK_TEST_TIME);
+		pmu_start(&pmu);
+		sync_run(&job, &r->sync[t]);
+		pmu_stop(&pmu, &r->sync_pmu[t]);
 	}
-	gettimeofday(&tvEnd, NULL);
+}
 
-	close(fd);
-	free(buf);
-	unlink(filename);
+static void disk_bench_workload(struct disk_result *r, const struct workload_job *workload){
+	char *home, filename[PATH_MAX];
+	struct workload_job job = *workload;
+	struct pmu_session pmu;
 
-	float time_s = (float)(((tvEnd.tv_sec*1000000) + tvEnd.tv_usec) - ((tvStart.tv_sec*1000000) + tvStart.tv_usec))/1000000.0f;
-	float mb_s = (size/time_s)/(1024.0f*1024.0f);
+	if((home = getenv("HOME")) == NULL){
+		return;
+	}
+	snprintf(filename, PATH_MAX, "%s/vm_perf.workload", home);
+	job.filename = filename;
+	pmu_start(&pmu);
+	r->workload_ran = (workload_run(&job, &r->workload) == 0);
+	pmu_stop(&pmu, &r->workload_pmu);
+	r->workload.job.filename = NULL;		// Points into this frame
+}
 
-	return mb_s;
+static void disk_device_file(const struct disk_stat *d, char *filename){
+	snprintf(filename, PATH_MAX, "%s/vm_perf.%s.temp", d->dev.mount, d->dev.name);
 }
 
+// Job of test t on disk d, returns its descriptor or -1 when the test cannot run there
+static int disk_device_job(const struct disk_stat *d, const struct disk_device_test *t, struct aio_job *job){
+	char filename[PATH_MAX];
 
-static int enumerate_disks(struct disk_result *r){
-	FILE * fin = fopen("/proc/mounts", "r");
-	if(fin == NULL){
-		perror("fopen");
-		return 1;
+	bzero(job, sizeof(struct aio_job));
+	job->write = t->write;
+	job->random = t->random;
+	job->block_size = t->block_size;
+	job->queue_depth = t->queue_depth;
+	job->max_bytes = ULONG_MAX;			// Time bound, so every disk gets the same window
+	job->max_time = timer_scaled(DISK_TEST_TIME);
+
+	if(t->write){
+		if(!d->dev.writable)
+			return job->fd = -1;
+		disk_device_file(d, filename);
+		job->fd = open(filename, O_WRONLY|O_DIRECT);
+		job->size = DISK_TEST_FILE_SIZE;
+	}else{
+		job->fd = open(d->dev.devname, O_RDONLY|O_DIRECT);
+		job->size = d->dev.size & ~((off_t)t->block_size - 1);
 	}
-	size_t line_size = 1000;
-	char * line = malloc(line_size*sizeof(char));
-	if(line == NULL){
-		perror("malloc");
-		return 1;
+	if(job->fd < 0)
+		perror("open");
+	return job->fd;
+}
+
+/*
+ * Every device test on each disk alone, then on all disks it ran on at once.
+ * If the concurrent total stays near the sum of the disks alone each volume
+ * is its own limit, if it stays near one disk the instance limit binds first.
+ * A run that no longer fits the time budget is skipped, the cost of these
+ * grows with the number of disks.
+ */
+static void disk_bench_devices(struct disk_result *r){
+	char filename[PATH_MAX];
+	struct aio_job_result res;
+	struct blk_job *jobs;
+	int *owner;					// Disk of each concurrent job
+	int i, j, t, n, fd;
+
+	jobs = calloc(r->num_disks, sizeof(struct blk_job));
+	owner = calloc(r->num_disks, sizeof(int));
+	if((jobs == NULL) || (owner == NULL)){
+		perror("calloc");
+		free(jobs);
+		free(owner);
+		return;
 	}
 
-	while(getline(&line, &line_size, fin) > 0){
-		if(strncmp(line, "/dev/", 5) == 0){
-			if(strncmp(line, "/dev/xvd", 8) == 0){
-				line[9] = '\0';
-			} else if(strncmp(line, "/dev/loop", 9) == 0){
-				continue;
-			} else {
-				line[8] = '\0';
+	// Preallocated like the write matrix, a mount that refuses the file is treated as read-only
+	for(i=0; i < r->num_disks; ++i){
+		struct disk_stat *d = &r->disk_stats[i];
+		if(!d->dev.writable)
+			continue;
+		disk_device_file(d, filename);
+		if((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1 || posix_fallocate(fd, 0, DISK_TEST_FILE_SIZE) != 0){
+			if(fd != -1){
+				close(fd);
+				unlink(filename);
 			}
-			
-			int found = 0;
-			int i;
-			for(i=0; i < r->num_disks; i++){
-				if(strcmp(r->disk_stats[i].devname, line) == 0){
-					found = 1;
-					break;
-				}
+			d->dev.writable = 0;
+			continue;
+		}
+		close(fd);
+	}
+
+	for(t=0; t < DISK_NUM_DEVICE_TESTS; ++t){
+		const struct disk_device_test *test = &disk_device_tests[t];
+		struct disk_aggregate *a = &r->aggregate[t];
+
+		for(i=0; i < r->num_disks; ++i){
+			struct disk_stat *d = &r->disk_stats[i];
+			struct aio_job job;
+			if(!timer_fits(timer_scaled(DISK_TEST_TIME))){
+				r->skipped++;
+				continue;
 			}
-			if(found == 0){
-				++r->num_disks;
-				r->disk_stats = realloc(r->disk_stats, sizeof(struct disk_stat)*r->num_disks);
-				strncpy(r->disk_stats[r->num_disks-1].devname, line, 10);
+			if(disk_device_job(d, test, &job) < 0)
+				continue;
+			d->device[t].ran = (aio_run(&job, &res) == 0);
+			close(job.fd);
+			if(d->device[t].ran)
+				disk_io_copy(&d->device[t].alone, &res);
+		}
+
+		n = 0;
+		if(!timer_fits(timer_scaled(DISK_TEST_TIME)))
+			r->skipped++;
+		else
+			for(i=0; i < r->num_disks; ++i)
+				if(r->disk_stats[i].device[t].ran && disk_device_job(&r->disk_stats[i], test, &jobs[n].job) >= 0)
+					owner[n++] = i;
+		if(n > 1)
+			blk_run_concurrent(jobs, n);
+		// Both sides over the disks that ran alone and together, one that failed together would read as lost scaling
+		for(j=0; j < n; ++j){
+			if(n > 1 && jobs[j].ret == 0){
+				struct disk_device_result *dev = &r->disk_stats[owner[j]].device[t];
+				disk_io_copy(&dev->concurrent, &jobs[j].result);
+				a->iops += jobs[j].result.iops;
+				a->rate += jobs[j].result.rate;
+				a->iops_alone += dev->alone.iops;
+				a->rate_alone += dev->alone.rate;
+				a->disks++;
 			}
+			close(jobs[j].job.fd);
 		}
+		a->scaling = a->rate_alone > 0.0f ? a->rate / a->rate_alone : 0.0f;
+		if(a->disks < 2)
+			bzero(a, sizeof(struct disk_aggregate));
 	}
-	fclose(fin);
-	free(line);
+
+	for(i=0; i < r->num_disks; ++i)
+		if(r->disk_stats[i].dev.writable){
+			disk_device_file(&r->disk_stats[i], filename);
+			unlink(filename);
+		}
+	free(jobs);
+	free(owner);
+}
+
+static int enumerate_disks(struct disk_result *r){
+	static struct blk_device devices[BLK_MAX_DEVICES];
+	int i;
+
+	if((r->num_disks = blk_discover(devices, BLK_MAX_DEVICES)) == 0)
+		return 0;
+	if((r->disk_stats = calloc(r->num_disks, sizeof(struct disk_stat))) == NULL){
+		perror("calloc");
+		r->num_disks = 0;
+		return 1;
+	}
+	for(i=0; i < r->num_disks; ++i)
+		r->disk_stats[i].dev = devices[i];
 	return 0;
 };
 
-void disk_bench(struct disk_result *r){
+void disk_bench(struct disk_result *r, const struct workload_job *workload){
+	free(r->disk_stats);	// Set by a previous, retried run
 	bzero(r, sizeof(struct disk_result));
 
 	if(enumerate_disks(r) == 1)
@@ -125,33 +327,124 @@ void disk_bench(struct disk_result *r){
 
 	int i;
 	for(i=0; i < r->num_disks; ++i){
-		//seeker(&r->disk_stats[i], r->disk_stats[i].devname, disk_io_size);	// Seeks, random access time
+		struct pmu_session pmu;
+		if(!timer_fits(DISK_NUM_IO_TYPES * timer_scaled(SEEKER_TIMEOUT))){
+			r->skipped++;
+			continue;
+		}
+		pmu_start(&pmu);
+		r->disk_stats[i].read_ran = (seeker(&r->disk_stats[i], r->disk_stats[i].dev.devname, disk_io_size, SEEKER_THREADS) == 0);	// Seeks, random access time
+		pmu_stop(&pmu, &r->disk_stats[i].pmu);
 	}
 
-	r->write[0] = test_disk_write(100*1024*1024, 256*1024, O_DIRECT, 1);
-	r->write[1] = test_disk_write(100*1024*1024, 256*1024, O_DIRECT, 0);	// Direct write to disk
-	r->write[2] = test_disk_write(100*1024*1024, 256*1024, 0, 0);			// Cached write to disk
+	disk_bench_write(r);
+	disk_bench_sync(r);
+	disk_bench_devices(r);
+	if(workload){
+		if(timer_fits(timer_scaled(workload->time_s)))
+			disk_bench_workload(r, workload);
+		else
+			r->skipped++;
+	}
 };
 
+static void disk_io_report(const char *name, const struct disk_io_result *io){
+	printf("\"%s\":{\"iops\":\"%.0f\",\"rate\":\"%.2fMB/s\",\"lat_avg\":\"%.3fms\",\"lat_p99\":\"%.3fms\"}",
+		name, io->iops, io->rate, io->lat_avg, io->lat_p99);
+}
+
 void disk_report(const struct disk_result *r){
 	int t;
 	char delim = ' ';
 	printf("\"storage\":{");
+		printf("\"aio_engine\":\"%s\",\"skipped\":\"%i\",", r->aio_engine ? r->aio_engine : "none", r->skipped);
 		printf("\"write_test\":[");
-	for(t=0; t < DISK_NUM_IO_TYPES; t++){
-		printf("%c{\"type\":\"%s\",\"rate\":\"%.2fMB/s\",\"buf_size\":\"%ib\"}",
-			delim, disk_io_types[t], r->write[t], 256*1024);
+	for(t=0; t < DISK_NUM_WRITE_TESTS; t++){
+		const struct disk_write_test *w = &disk_write_tests[t];
+		const struct disk_io_result *io = &r->write[t];
+		printf("%c{\"type\":\"%s\",\"buf_size\":\"%ub\",\"queue_depth\":\"%u\",", delim, disk_io_types[w->type], w->buf_size, io->queue_depth);
+		printf("\"iops\":\"%.0f\",\"rate\":\"%.2fMB/s\",", io->iops, io->rate);
+		printf("\"lat_avg\":\"%.3fms\",\"lat_p50\":\"%.3fms\",\"lat_p99\":\"%.3fms\",\"lat_p999\":\"%.3fms\",",
+			io->lat_avg, io->lat_p50, io->lat_p99, io->lat_p999);
+		pmu_report("pmu", &io->pmu);
+		printf("}");
 		delim = ',';
 	}
 	printf("],");
 
+	printf("\"sync_test\":[");
+	delim = ' ';
+	for(t=0; t < DISK_NUM_SYNC_TESTS; t++){
+		const struct sync_job *j = &disk_sync_tests[t];
+		const struct sync_result *s = &r->sync[t];
+		printf("%c{\"mode\":\"%s\",\"record_size\":\"%ub\",\"batch\":\"%u\",\"writers\":\"%u\",", delim, sync_mode_name(j->mode), j->record_size, j->batch, j->writers);
+		printf("\"commits/s\":\"%.0f\",\"syncs/s\":\"%.0f\",\"rate\":\"%.2fMB/s\",", s->commits_s, s->syncs_s, s->rate);
+		printf("\"lat_avg\":\"%.3fms\",\"lat_p50\":\"%.3fms\",\"lat_p99\":\"%.3fms\",\"lat_p999\":\"%.3fms\",",
+			s->lat_avg, s->lat_p50, s->lat_p99, s->lat_p999);
+		pmu_report("pmu", &r->sync_pmu[t]);
+		printf("}");
+		delim = ',';
+	}
+	printf("],");
+
+	printf("\"mmap_test\":{\"file_size\":\"%lub\",\"read\":[", r->mmap.file_size);
+	delim = ' ';
+	for(t=0; t < MMAP_NUM_METHODS; ++t){
+		int p;
+		for(p=0; p < MMAP_NUM_PATTERNS; ++p){
+			const struct mmap_read_result *m = &r->mmap.read[t][p];
+			printf("%c{\"method\":\"%s\",\"type\":\"%s\",\"rate\":\"%.2fMB/s\",\"time\":\"%.3fs\",\"major_faults\":\"%lu\",\"minor_faults\":\"%lu\"}",
+				delim, mmap_method_name(t), mmap_pattern_name(p), m->rate, m->time_s, m->major_faults, m->minor_faults);
+			delim = ',';
+		}
+	}
+	printf("],\"anon_fault\":[");
+	delim = ' ';
+	for(t=0; t < r->mmap.num_fault_tests; ++t){
+		const struct mmap_fault_result *f = &r->mmap.fault[t];
+		printf("%c{\"threads\":\"%i\",\"size_per_thread\":\"%luMB\",\"thp\":\"%s\",\"faults\":\"%lu\",\"faults/s_per_thread\":\"%.0f\",\"rate\":\"%.2fGB/s\"}",
+			delim, f->threads, f->size >> 20, f->thp ? "yes" : "no", f->faults, f->faults_s, f->rate);
+		delim = ',';
+	}
+	printf("],");
+	pmu_report("pmu", &r->mmap_pmu);
+	printf("},");
+
+	printf("\"workload\":{");
+	if(r->workload_ran){
+		const struct workload_result *wl = &r->workload;
+		int d, p;
+		printf("\"size\":\"%.2fGB\",\"threads\":\"%u\",\"read_pct\":\"%u%%\",\"block_size\":\"%ub\",\"fill_rate\":\"%.2fMB/s\",\"io\":\"%s\",",
+			wl->job.size / (1024.0*1024*1024), wl->job.threads, wl->job.read_pct, wl->job.block_size, wl->fill_rate, wl->direct ? "direct" : "buffered");
+		for(d=0; d < WORKLOAD_NUM_DIRS; ++d){
+			const struct workload_io *io = &wl->io[d];
+			printf("\"%s\":{\"ops\":\"%lu\",\"iops\":\"%.0f\",\"rate\":\"%.2fMB/s\",", workload_dir_name(d), io->ops, io->iops, io->rate);
+			printf("\"lat_avg\":\"%.3fms\",\"lat_p50\":\"%.3fms\",\"lat_p99\":\"%.3fms\",\"lat_p999\":\"%.3fms\"},",
+				io->lat_avg, io->lat_p50, io->lat_p99, io->lat_p999);
+		}
+		printf("\"over_time\":[");
+		delim = ' ';
+		for(p=0; p < wl->num_points; ++p){
+			const struct workload_point *pt = &wl->point[p];
+			printf("%c{\"t\":\"%.1fs\",\"read_iops\":\"%.0f\",\"read_rate\":\"%.2fMB/s\",\"read_p99\":\"%.3fms\",", delim, pt->t,
+				pt->iops[WORKLOAD_READ], pt->rate[WORKLOAD_READ], pt->lat_p99[WORKLOAD_READ]);
+			printf("\"write_iops\":\"%.0f\",\"write_rate\":\"%.2fMB/s\",\"write_p99\":\"%.3fms\"}",
+				pt->iops[WORKLOAD_WRITE], pt->rate[WORKLOAD_WRITE], pt->lat_p99[WORKLOAD_WRITE]);
+			delim = ',';
+		}
+		printf("],");
+		pmu_report("pmu", &r->workload_pmu);
+	}
+	printf("},");
 
 	printf("\"disks\":[");
 
 	int i;
 	char disk_delim = ' ';
 	for(i=0; i < r->num_disks; ++i){
-		printf("%c{\"name\":\"%s\",", disk_delim, r->disk_stats[i].devname);
+		const struct blk_device *dev = &r->disk_stats[i].dev;
+		printf("%c{\"name\":\"%s\",\"disk\":\"%s\",\"mount\":\"%s\",\"writable\":\"%s\",", disk_delim, dev->devname, dev->name, dev->mount, dev->writable ? "yes" : "no");
+		printf("\"model\":\"%s\",\"rotational\":\"%s\",\"scheduler\":\"%s\",", dev->model, dev->rotational ? "yes" : "no", dev->scheduler);
 		printf("\"size\":\"%.2fGB\",", (float)(r->disk_stats[i].num_blocks*r->disk_stats[i].block_size)/(1024*1024*1024));
 		printf("\"blocks\":\"%lu\",", r->disk_stats[i].num_blocks);
 		printf("\"block_size\":\"%lub\"", r->disk_stats[i].block_size);
@@ -159,17 +452,109 @@ void disk_report(const struct disk_result *r){
 		printf(",\"read_tests\":[");
 
 		delim = ' ';
-		for(t=0; t < DISK_NUM_IO_TYPES; t++){
+		for(t=0; t < DISK_NUM_IO_TYPES && r->disk_stats[i].read_ran; t++){
 			printf("%c{\"type\":\"%s\",", delim, disk_io_types[t]);
 			printf("\"buf_size\":\"%ib\",", disk_io_size[t]);
 			printf("\"seek/read/s\":\"%i\",", 		r->disk_stats[i].seeks[t]);
-			printf("\"access_time\":\"%.2fms\",",	r->disk_stats[i].access_time[t]);
-			printf("\"rate\":\"%.2f%s/s\"", 		(float)(r->disk_stats[i].seeks[t]*r->disk_stats[i].block_size)/disk_io_divisor[t], disk_io_unit[t]);
+			printf("\"access_time\":\"%.3fms\",",	r->disk_stats[i].access_time[t]);
+			printf("\"lat_p50\":\"%.3fms\",",		r->disk_stats[i].lat_p50[t]);
+			printf("\"lat_p99\":\"%.3fms\",",		r->disk_stats[i].lat_p99[t]);
+			printf("\"lat_p999\":\"%.3fms\",",		r->disk_stats[i].lat_p999[t]);
+			printf("\"rate\":\"%.2f%s/s\"", 		((float)r->disk_stats[i].seeks[t]*disk_io_size[t])/disk_io_divisor[t], disk_io_unit[t]);
+			printf("}");
+			delim = ',';
+		}
+		printf("],\"device_tests\":[");
+		delim = ' ';
+		for(t=0; t < DISK_NUM_DEVICE_TESTS; t++){
+			const struct disk_device_result *dr = &r->disk_stats[i].device[t];
+			if(!dr->ran)
+				continue;
+			printf("%c{\"type\":\"%s\",\"buf_size\":\"%ub\",\"queue_depth\":\"%u\",", delim,
+				disk_device_tests[t].name, disk_device_tests[t].block_size, dr->alone.queue_depth);
+			disk_io_report("alone", &dr->alone);
+			if(r->aggregate[t].disks > 1){
+				printf(",");
+				disk_io_report("concurrent", &dr->concurrent);
+			}
 			printf("}");
 			delim = ',';
 		}
-		printf("]}");
+		printf("],");
+		pmu_report("pmu", &r->disk_stats[i].pmu);
+		printf("}");
 		disk_delim = ',';
 	}
+	printf("],");
+
+	printf("\"concurrent\":[");
+	delim = ' ';
+	for(t=0; t < DISK_NUM_DEVICE_TESTS; t++){
+		const struct disk_aggregate *a = &r->aggregate[t];
+		if(a->disks < 2)
+			continue;
+		printf("%c{\"type\":\"%s\",\"disks\":\"%i\",\"iops_alone\":\"%.0f\",\"rate_alone\":\"%.2fMB/s\",", delim,
+			disk_device_tests[t].name, a->disks, a->iops_alone, a->rate_alone);
+		printf("\"iops\":\"%.0f\",\"rate\":\"%.2fMB/s\",\"scaling\":\"%.0f%%\",\"limit\":\"%s\"}",
+			a->iops, a->rate, a->scaling * 100.0f, a->scaling >= DISK_VOLUME_SCALING ? "volume" : "instance");
+		delim = ',';
+	}
 	printf("]}");
 };
+
+void disk_store(const struct disk_result *r, struct store *s){
+	char name[STORE_NAME_SIZE];
+	int t, p;
+
+	// A depth the engine could not keep in flight is a QD1 result under another name
+	for(t=0; t < DISK_NUM_WRITE_TESTS; t++){
+		const struct disk_write_test *w = &disk_write_tests[t];
+		if(r->write[t].queue_depth != w->queue_depth)
+			continue;
+		snprintf(name, sizeof(name), "disk/write/%s/%ub/qd%u/iops", disk_io_types[w->type], w->buf_size, w->queue_depth);
+		store_add_value(s, name, "", STORE_HIGHER, r->write[t].iops);
+		snprintf(name, sizeof(name), "disk/write/%s/%ub/qd%u/lat_p99", disk_io_types[w->type], w->buf_size, w->queue_depth);
+		store_add_value(s, name, "ms", STORE_LOWER, r->write[t].lat_p99);
+	}
+	for(t=0; t < DISK_NUM_SYNC_TESTS; t++){
+		const struct sync_job *j = &disk_sync_tests[t];
+		snprintf(name, sizeof(name), "disk/sync/%s/%ub/batch%u/writers%u/commits", sync_mode_name(j->mode), j->record_size, j->batch, j->writers);
+		store_add_value(s, name, "/s", STORE_HIGHER, r->sync[t].commits_s);
+		snprintf(name, sizeof(name), "disk/sync/%s/%ub/batch%u/writers%u/lat_p99", sync_mode_name(j->mode), j->record_size, j->batch, j->writers);
+		store_add_value(s, name, "ms", STORE_LOWER, r->sync[t].lat_p99);
+	}
+	for(t=0; t < MMAP_NUM_METHODS; ++t)
+		for(p=0; p < MMAP_NUM_PATTERNS; ++p){
+			snprintf(name, sizeof(name), "disk/mmap/%s/%s", mmap_method_name(t), mmap_pattern_name(p));
+			store_add_value(s, name, "MB/s", STORE_HIGHER, r->mmap.read[t][p].rate);
+		}
+	if(r->workload_ran)
+		for(t=0; t < WORKLOAD_NUM_DIRS; ++t){
+			snprintf(name, sizeof(name), "disk/workload/%s/iops", workload_dir_name(t));
+			store_add_value(s, name, "", STORE_HIGHER, r->workload.io[t].iops);
+			snprintf(name, sizeof(name), "disk/workload/%s/lat_p99", workload_dir_name(t));
+			store_add_value(s, name, "ms", STORE_LOWER, r->workload.io[t].lat_p99);
+		}
+	for(p=0; p < r->num_disks; ++p)
+		for(t=0; t < DISK_NUM_IO_TYPES && r->disk_stats[p].read_ran; t++){
+			snprintf(name, sizeof(name), "disk/read/%s/%s", r->disk_stats[p].dev.devname, disk_io_types[t]);
+			store_add_value(s, name, "/s", STORE_HIGHER, r->disk_stats[p].seeks[t]);
+		}
+	for(p=0; p < r->num_disks; ++p)
+		for(t=0; t < DISK_NUM_DEVICE_TESTS; t++){
+			if(!r->disk_stats[p].device[t].ran)
+				continue;
+			snprintf(name, sizeof(name), "disk/device/%s/%s/iops", r->disk_stats[p].dev.name, disk_device_tests[t].name);
+			store_add_value(s, name, "", STORE_HIGHER, r->disk_stats[p].device[t].alone.iops);
+			snprintf(name, sizeof(name), "disk/device/%s/%s/rate", r->disk_stats[p].dev.name, disk_device_tests[t].name);
+			store_add_value(s, name, "MB/s", STORE_HIGHER, r->disk_stats[p].device[t].alone.rate);
+		}
+	for(t=0; t < DISK_NUM_DEVICE_TESTS; t++){
+		if(r->aggregate[t].disks < 2)
+			continue;
+		snprintf(name, sizeof(name), "disk/concurrent/%s/rate", disk_device_tests[t].name);
+		store_add_value(s, name, "MB/s", STORE_HIGHER, r->aggregate[t].rate);
+		snprintf(name, sizeof(name), "disk/concurrent/%s/iops", disk_device_tests[t].name);
+		store_add_value(s, name, "", STORE_HIGHER, r->aggregate[t].iops);
+	}
+}
@@ -5,30 +5,95 @@
 
 #ifndef VM_PERF_DISK_H
 #define VM_PERF_DISK_H
+#include "vm_perf_sampler.h"
+#include "vm_perf_sync.h"
+#include "vm_perf_workload.h"
+#include "vm_perf_mmap.h"
+#include "vm_perf_store.h"
+#include "vm_perf_pmu.h"
+#include "vm_perf_blk.h"
 
 // Random, sequential, cached_sequential
 #define DISK_NUM_IO_TYPES 3
 
+// Queue depth and block size sweep of the write tests, see disk_write_tests
+#define DISK_NUM_WRITE_TESTS 17
+
+// Commit latency sweep over mode, record size, writers and group commit batch, see disk_sync_tests
+#define DISK_NUM_SYNC_TESTS 20
+
+// Read and write tests run on every disk alone and on all of them at once, see disk_device_tests
+#define DISK_NUM_DEVICE_TESTS 4
+
+struct disk_io_result{
+	unsigned int queue_depth;	// The engine kept in flight, not the one asked for
+	float iops;
+	float rate;					// MB/s
+	float lat_avg;				// Completion latency in ms
+	float lat_p50;
+	float lat_p99;
+	float lat_p999;
+	struct pmu_counts pmu;
+};
+
+struct disk_device_result{
+	int ran;
+	struct disk_io_result alone;
+	struct disk_io_result concurrent;		// While every other disk ran the same test, if there are others
+};
+
 struct disk_stat{
-	char devname[10];			/// /dev/sda, /dev/vda, /dev/hda, ...
+	struct blk_device dev;
 	unsigned long num_blocks;
 	unsigned long block_size;
 
 	// Read data
-	int seeks[DISK_NUM_IO_TYPES];
-	float access_time[DISK_NUM_IO_TYPES];
+	int read_ran;
+	int seeks[DISK_NUM_IO_TYPES];			// Reads per second
+	float access_time[DISK_NUM_IO_TYPES];	// Mean read latency in ms
+	float lat_p50[DISK_NUM_IO_TYPES];
+	float lat_p99[DISK_NUM_IO_TYPES];
+	float lat_p999[DISK_NUM_IO_TYPES];
+	struct pmu_counts pmu;					// Hardware counters over all read tests
+
+	struct disk_device_result device[DISK_NUM_DEVICE_TESTS];
+};
+
+// A device test on all disks that ran it alone and together, against the same disks one at a time
+struct disk_aggregate{
+	int disks;
+	float iops_alone;			// Sum over the disks tested alone
+	float rate_alone;			// MB/s
+	float iops;					// All disks at once
+	float rate;
+	float scaling;				// rate / rate_alone
 };
 
 struct disk_result{
 	int num_disks;
+	int skipped;				// Disk reads, device tests and the workload left out to fit the time budget
+	const char * aio_engine;	// Submission engine used by the write tests
 
-	// Rrite data to user HOME directory
-	float write[DISK_NUM_IO_TYPES];
+	// Write data to user HOME directory
+	struct disk_io_result write[DISK_NUM_WRITE_TESTS];
+	struct sync_result sync[DISK_NUM_SYNC_TESTS];		// Small synchronous appends, database style
+	struct pmu_counts sync_pmu[DISK_NUM_SYNC_TESTS];
+
+	struct mmap_result mmap;				// read() against mmap() and page fault throughput
+	struct pmu_counts mmap_pmu;
+
+	int workload_ran;
+	struct workload_result workload;		// Mixed read/write workload, only run when asked for
+	struct pmu_counts workload_pmu;
 
 	struct disk_stat * disk_stats;
+	struct disk_aggregate aggregate[DISK_NUM_DEVICE_TESTS];	// Only with more than one disk
+
+	struct sampler_window window;		// Interference seen while measuring
 };
 
-void disk_bench(struct disk_result *r);
+void disk_bench(struct disk_result *r, const struct workload_job *workload);
 void disk_report(const struct disk_result *r);
+void disk_store(const struct disk_result *r, struct store *s);
 
 #endif
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vm_perf_dns.h"
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+
+static const char * dns_cache_names[DNS_NUM_CACHES] = {"cold", "warm"};
+
+struct dns_query{
+	unsigned char pkt[NS_PACKETSZ];
+	int len;
+	uint64_t sent_ns;		// 0 until sent
+	int done;
+};
+
+const char * dns_cache_name(const enum dns_cache cache){
+	return dns_cache_names[cache];
+}
+
+static int dns_send(const int sd, struct dns_query *q){
+	q->sent_ns = timer_now_ns();
+	return send(sd, q->pkt, q->len, 0) != q->len;
+}
+
+/*
+ * Send num queries to the resolver connected to sd, DNS_INFLIGHT at a time.
+ * The DNS id is base plus the query index, so answers are matched without a
+ * lookup and late answers from an earlier burst fall outside the range.
+ */
+static void dns_burst_run(const int sd, struct dns_query *q, const int num, const uint16_t base, struct dns_burst *b){
+	struct lat_hist hist;
+	unsigned char answer[NS_PACKETSZ];
+	int next = 0, inflight = 0, completed = 0, i;
+
+	bzero(b, sizeof(struct dns_burst));
+	hist_init(&hist);
+	b->queries = num;
+
+	const uint64_t t0 = timer_now_ns();
+	while(completed < num){
+		while(inflight < DNS_INFLIGHT && next < num){
+			if(dns_send(sd, &q[next]) != 0){
+				if(errno == ECONNREFUSED){		// Nothing listens there, give up on the resolver
+					perror("dns");
+					b->errors += num - completed;
+					b->time_s = (timer_now_ns() - t0) / 1e9;
+					return;
+				}
+				q[next].done = 1;
+				b->errors++;
+				completed++;
+			}else{
+				inflight++;
+			}
+			next++;
+		}
+
+		struct pollfd pfd = {sd, POLLIN, 0};
+		if(poll(&pfd, 1, 10) < 0 && errno != EINTR){
+			perror("poll");
+			break;
+		}
+
+		ssize_t n;
+		while((n = recv(sd, answer, sizeof(answer), MSG_DONTWAIT)) >= (ssize_t)sizeof(HEADER)){
+			const uint64_t now = timer_now_ns();
+			const HEADER *h = (const HEADER*) answer;
+			const int id = (uint16_t)(ntohs(h->id) - base);
+			if(id >= num || q[id].done || q[id].sent_ns == 0)
+				continue;		// Late answer to a query given up on
+
+			q[id].done = 1;
+			inflight--;
+			completed++;
+			if(h->rcode == NOERROR || h->rcode == NXDOMAIN){
+				b->answered++;
+				hist_add(&hist, now - q[id].sent_ns);
+			}else{
+				b->errors++;
+			}
+		}
+
+		const uint64_t now = timer_now_ns();
+		for(i=0; i < next; ++i){
+			if(!q[i].done && now - q[i].sent_ns > DNS_TIMEOUT_MS * 1000000ULL){
+				q[i].done = 1;
+				inflight--;
+				completed++;
+				b->timeouts++;
+			}
+		}
+	}
+	b->time_s = (timer_now_ns() - t0) / 1e9;
+
+	b->qps = b->time_s > 0.0f ? b->answered / b->time_s : 0.0f;
+	b->avg = hist_mean(&hist) / 1e6;
+	b->p50 = hist_percentile(&hist, 0.50) / 1e6;
+	b->p99 = hist_percentile(&hist, 0.99) / 1e6;
+	b->max = hist.count ? hist.max / 1e6 : 0.0f;
+}
+
+// Build num A queries, cold ones for unique random labels under names, warm ones for names themselves
+static int dns_build(res_state state, struct dns_query *q, const int num, const uint16_t base, const enum dns_cache cache,
+					 const char * const names[], const int num_names, unsigned int *seed){
+	char name[NS_MAXDNAME];
+	int i;
+
+	bzero(q, num * sizeof(struct dns_query));
+	for(i=0; i < num; ++i){
+		if(cache == DNS_COLD)
+			snprintf(name, sizeof(name), "vmperf-%08x%08x.%s", rand_r(seed), rand_r(seed), names[i % num_names]);
+		else
+			snprintf(name, sizeof(name), "%s", names[i % num_names]);
+
+		q[i].len = res_nmkquery(state, QUERY, name, C_IN, T_A, NULL, 0, NULL, q[i].pkt, sizeof(q[i].pkt));
+		if(q[i].len < (int)sizeof(HEADER)){
+			fprintf(stderr, "res_mkquery: %s failed\n", name);
+			return 1;
+		}
+		((HEADER*)q[i].pkt)->id = htons((uint16_t)(base + i));
+	}
+	return 0;
+}
+
+/*
+ * Load every resolver from resolv.conf (up to max) concurrently with cold
+ * and then warm queries. Before the warm burst each name is asked once,
+ * so all its answers can come from the cache.
+ */
+int dns_bench(struct dns_result *r, const int max, const char * const names[], const int num_names){
+	struct __res_state state;
+	struct dns_query *q;
+	unsigned int seed = (unsigned int) timer_now_ns();
+	uint16_t base = seed;
+	int i, num = 0;
+
+	bzero(&state, sizeof(state));
+	if(res_ninit(&state) != 0){
+		fprintf(stderr, "res_ninit failed\n");
+		return 0;
+	}
+	if((q = malloc(DNS_QUERIES * sizeof(struct dns_query))) == NULL){
+		perror("malloc");
+		res_nclose(&state);
+		return 0;
+	}
+
+	for(i=0; i < state.nscount && num < max; ++i){
+		const struct sockaddr_in *ns = &state.nsaddr_list[i];
+		struct dns_result *d = &r[num];
+		int sd, c;
+
+		if(ns->sin_family != AF_INET)
+			continue;
+		bzero(d, sizeof(struct dns_result));
+		inet_ntop(AF_INET, &ns->sin_addr, d->resolver, sizeof(d->resolver));
+
+		if((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+			perror("socket");
+			continue;
+		}
+		if(connect(sd, (const struct sockaddr*)ns, sizeof(*ns)) != 0){
+			perror("connect");
+			close(sd);
+			continue;
+		}
+
+		for(c=0; c < DNS_NUM_CACHES; ++c){
+			if(c == DNS_WARM){
+				struct dns_burst prime;
+				if(dns_build(&state, q, num_names, base, c, names, num_names, &seed) == 0)
+					dns_burst_run(sd, q, num_names, base, &prime);
+				base += num_names;
+			}
+			if(dns_build(&state, q, DNS_QUERIES, base, c, names, num_names, &seed) == 0)
+				dns_burst_run(sd, q, DNS_QUERIES, base, &d->burst[c]);
+			base += DNS_QUERIES;
+		}
+		close(sd);
+		num++;
+	}
+
+	free(q);
+	res_nclose(&state);
+	return num;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_DNS_H
+#define VM_PERF_DNS_H
+
+#include <arpa/inet.h>
+#include <resolv.h>
+
+#define DNS_MAX_RESOLVERS MAXNS
+#define DNS_QUERIES 500					// Queries per resolver and cache state
+#define DNS_INFLIGHT 32					// Queries outstanding at once
+#define DNS_TIMEOUT_MS 2000				// A query without an answer by then has timed out
+
+enum dns_cache{
+	DNS_COLD = 0,		// Unique random names, every query has to recurse
+	DNS_WARM,			// A few names asked over and over, answered from the resolver cache
+	DNS_NUM_CACHES
+};
+
+struct dns_burst{
+	unsigned int queries;
+	unsigned int answered;		// NOERROR or NXDOMAIN
+	unsigned int errors;		// Any other rcode, SERVFAIL and REFUSED are the usual rate limit answers
+	unsigned int timeouts;
+	float time_s;
+	float qps;					// Answers per second
+	float avg;					// Latency of the answered queries in ms
+	float p50;
+	float p99;
+	float max;
+};
+
+struct dns_result{
+	char resolver[INET_ADDRSTRLEN];
+	struct dns_burst burst[DNS_NUM_CACHES];
+};
+
+int dns_bench(struct dns_result *r, const int max, const char * const names[], const int num_names);
+const char * dns_cache_name(const enum dns_cache cache);
+
+#endif
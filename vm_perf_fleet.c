@@ -0,0 +1,442 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Fleet runs. A coordinator waits for a number of agents to register, then
+ * has all of them run the same module at the same instant, one phase per
+ * module of the plan, and aggregates what they measured into fleet wide
+ * percentiles. The protocol is one text line per message over TCP:
+ *
+ *   agent        HELLO <protocol> <hostname>
+ *   agent        TIME <agent ns>                 coordinator  TIME <agent ns> <coordinator ns>
+ *   agent        SYNC <offset ns> <rtt ns>
+ *   coordinator  RUN <phase> <module> <hold s> <start, coordinator ns>
+ *   agent        METRIC <run> <unit|-> <better> <value> <name>   (per metric and run)
+ *   agent        DONE <phase> <late ns> <runs> <time s>
+ *   coordinator  BYE
+ *
+ * Each agent measures the offset of its clock to the coordinator's at
+ * registration and sleeps until the start of a phase in its own clock.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_fleet.h"
+#include "vm_perf_peer.h"
+#include "vm_perf_timer.h"
+
+#define FLEET_PROTOCOL 1
+#define FLEET_LINE 512
+
+int fleet_parse(struct fleet_plan *plan, const char *spec){
+	char buf[256], *tok, *save, *hold;
+
+	bzero(plan, sizeof(struct fleet_plan));
+	snprintf(buf, sizeof(buf), "%s", spec);
+	if((hold = strchr(buf, ':')) != NULL){
+		*hold++ = '\0';
+		plan->hold = atof(hold);
+		if(plan->hold < 0.0f)
+			return 1;
+	}
+	for(tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+		if(plan->num_phases == FLEET_MAX_PHASES || strlen(tok) >= FLEET_MODULE_SIZE)
+			return 1;
+		snprintf(plan->module[plan->num_phases++], FLEET_MODULE_SIZE, "%s", tok);
+	}
+	return plan->num_phases == 0;
+}
+
+static void fleet_nodelay(const int sd){
+	const int one = 1;
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Make reads of in give up at deadline, non zero once it passed
+static int fleet_deadline(FILE *in, const uint64_t deadline){
+	const uint64_t now = timer_now_ns();
+	struct timeval tv;
+
+	if(now >= deadline)
+		return 1;
+	tv.tv_sec = (deadline - now) / 1000000000ULL;
+	tv.tv_usec = (deadline - now) % 1000000000ULL / 1000;
+	if(tv.tv_sec == 0 && tv.tv_usec == 0)		// Zero would wait forever
+		tv.tv_usec = 1;
+	return setsockopt(fileno(in), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0;
+}
+
+static void fleet_values_add(struct fleet_phase *ph, const char *name, const char *unit, const int better, const double v){
+	struct fleet_values *m = NULL;
+	int i;
+
+	for(i=0; i < ph->num_metrics && m == NULL; ++i)
+		if(strcmp(ph->metric[i].name, name) == 0)
+			m = &ph->metric[i];
+	if(m == NULL){
+		if(ph->num_metrics == STORE_MAX_METRICS)
+			return;
+		m = &ph->metric[ph->num_metrics++];
+		snprintf(m->name, sizeof(m->name), "%s", name);
+		snprintf(m->unit, sizeof(m->unit), "%s", strcmp(unit, "-") ? unit : "");
+		m->better = better;
+	}
+	if(m->n == m->size){
+		double *v = realloc(m->v, (m->size ? m->size * 2 : 32) * sizeof(double));
+		if(v == NULL){
+			perror("realloc");
+			return;
+		}
+		m->v = v;
+		m->size = m->size ? m->size * 2 : 32;
+	}
+	m->v[m->n++] = v;
+}
+
+// Read a HELLO and answer TIME probes until the agent sends its SYNC
+static int fleet_register(struct fleet_member *a){
+	const uint64_t deadline = timer_now_ns() + FLEET_REGISTER_TIMEOUT * 1000000000ULL;
+	char line[FLEET_LINE];
+	int protocol;
+
+	// A connection that never speaks must not hold up the others
+	if(fleet_deadline(a->in, deadline) != 0 || fgets(line, sizeof(line), a->in) == NULL || sscanf(line, "HELLO %i %255s", &protocol, a->host) != 2)
+		return 1;
+	if(protocol != FLEET_PROTOCOL){
+		fprintf(stderr, "fleet: %s speaks protocol %i, not %i\n", a->address, protocol, FLEET_PROTOCOL);
+		return 1;
+	}
+	while(fleet_deadline(a->in, deadline) == 0 && fgets(line, sizeof(line), a->in) != NULL){
+		unsigned long long t0, rtt;
+		long long offset;
+
+		if(sscanf(line, "TIME %llu", &t0) == 1){
+			fprintf(a->out, "TIME %llu %llu\n", t0, (unsigned long long)timer_now_ns());
+			fflush(a->out);
+		}else if(sscanf(line, "SYNC %lld %llu", &offset, &rtt) == 2){
+			a->offset = offset;
+			a->rtt = rtt;
+			a->alive = 1;
+			return 0;
+		}else{
+			return 1;
+		}
+	}
+	return 1;
+}
+
+static void fleet_phase_run(struct fleet_member *a, const int agents, const struct fleet_plan *plan, const int p, struct fleet_phase *ph){
+	const unsigned long long start = timer_now_ns() + FLEET_LEAD_MS * 1000000ULL;
+	const uint64_t deadline = start + (uint64_t)((plan->hold + FLEET_PHASE_TIMEOUT) * 1e9);
+	char line[FLEET_LINE];
+	int i;
+
+	bzero(ph, sizeof(struct fleet_phase));
+	for(i=0; i < agents; ++i){
+		if(!a[i].alive)
+			continue;
+		fprintf(a[i].out, "RUN %i %s %.3f %llu\n", p, plan->module[p], plan->hold, start);
+		if(fflush(a[i].out) != 0){
+			fprintf(stderr, "fleet: lost %s\n", a[i].host);
+			a[i].alive = 0;
+		}
+	}
+	fprintf(stderr, "fleet: phase %i, %s on every agent in %ims\n", p, plan->module[p], FLEET_LEAD_MS);
+
+	/*
+	 * Agents send their lines independently, reading them one agent after
+	 * another cannot block the others. An agent that hangs or is cut off is
+	 * given up on at the deadline of the phase and takes no part in the rest.
+	 */
+	for(i=0; i < agents; ++i){
+		int done = 0;
+		while(a[i].alive && !done){
+			char unit[STORE_UNIT_SIZE], name[STORE_NAME_SIZE];
+			int run, better, phase, runs;
+			long long late;
+			double v, time_s;
+
+			if(fleet_deadline(a[i].in, deadline) != 0 || fgets(line, sizeof(line), a[i].in) == NULL){
+				if(errno == EAGAIN || errno == EWOULDBLOCK || timer_now_ns() >= deadline)
+					fprintf(stderr, "fleet: %s did not finish phase %i in time, dropped\n", a[i].host, p);
+				else
+					fprintf(stderr, "fleet: lost %s\n", a[i].host);
+				a[i].alive = 0;
+			}else if(sscanf(line, "METRIC %i %15s %i %lf %63[^\n]", &run, unit, &better, &v, name) == 5){
+				fleet_values_add(ph, name, unit, better, v);
+			}else if(sscanf(line, "DONE %i %lld %i %lf", &phase, &late, &runs, &time_s) == 4){
+				if(ph->agents == 0 || late < ph->late_min)
+					ph->late_min = late;
+				if(ph->agents == 0 || late > ph->late_max)
+					ph->late_max = late;
+				if(time_s > ph->time_max)
+					ph->time_max = time_s;
+				ph->agents++;
+				ph->runs += runs;
+				done = 1;
+			}
+		}
+	}
+}
+
+static int cmp_double(const void *a, const void *b){
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values
+static double fleet_percentile(const double *v, const int n, const double p){
+	int rank = (int)ceil(p * n);
+	if(rank < 1) rank = 1;
+	if(rank > n) rank = n;
+	return v[rank - 1];
+}
+
+void fleet_report(const struct fleet_result *r){
+	const struct fleet_member *a = r->agent;
+	const struct fleet_phase *ph = r->phase;
+	const struct fleet_plan *plan = &r->plan;
+	const int agents = r->num_agents;
+	int i, p;
+	char delim = ' ';
+
+	printf("\"fleet\":{\"agents\":[");
+	for(i=0; i < agents; ++i){
+		printf("%c{\"host\":\"%s\",\"address\":\"%s\",\"clock_offset\":\"%.3fms\",\"rtt\":\"%.3fms\",\"finished\":\"%s\"}",
+			delim, a[i].host, a[i].address, a[i].offset / 1e6, a[i].rtt / 1e6, a[i].alive ? "yes" : "no");
+		delim = ',';
+	}
+	printf("],\"phases\":[");
+	for(p=0; p < plan->num_phases; ++p){
+		printf("%s{\"module\":\"%s\",\"hold\":\"%.1fs\",\"agents\":\"%i\",\"runs\":\"%i\",\"time_max\":\"%.2fs\",",
+			p ? "," : "", plan->module[p], plan->hold, ph[p].agents, ph[p].runs, ph[p].time_max);
+		printf("\"start_late_min\":\"%.3fms\",\"start_late_max\":\"%.3fms\",\"start_skew\":\"%.3fms\",\"metrics\":[",
+			ph[p].late_min / 1e6, ph[p].late_max / 1e6, (ph[p].late_max - ph[p].late_min) / 1e6);
+		for(i=0; i < ph[p].num_metrics; ++i){
+			const struct fleet_values *m = &ph[p].metric[i];
+			double mean = 0.0;
+			int j;
+
+			for(j=0; j < m->n; ++j)
+				mean += m->v[j];
+			mean /= m->n;
+			printf("%s{\"name\":\"%s\",\"better\":\"%s\",\"samples\":\"%i\",", i ? "," : "", m->name, m->better == STORE_LOWER ? "lower" : "higher", m->n);
+			printf("\"min\":\"%.3f%s\",\"p10\":\"%.3f%s\",\"p50\":\"%.3f%s\",\"p90\":\"%.3f%s\",\"max\":\"%.3f%s\",\"mean\":\"%.3f%s\"}",
+				m->v[0], m->unit, fleet_percentile(m->v, m->n, 0.10), m->unit, fleet_percentile(m->v, m->n, 0.50), m->unit,
+				fleet_percentile(m->v, m->n, 0.90), m->unit, m->v[m->n - 1], m->unit, mean, m->unit);
+		}
+		printf("]}");
+	}
+	printf("]}");
+}
+
+void fleet_free(struct fleet_result *r){
+	int i, p;
+	for(p=0; p < r->plan.num_phases; ++p)
+		for(i=0; i < r->phase[p].num_metrics; ++i){
+			free(r->phase[p].metric[i].v);
+			r->phase[p].metric[i].v = NULL;
+		}
+}
+
+/*
+ * Wait on port for agents to register, then run every phase of the plan on
+ * all of them at once. The values of r are sorted for fleet_report().
+ */
+int fleet_coordinate(const char *port, const int agents, const struct fleet_plan *plan, struct fleet_result *r){
+	struct fleet_member *a = r->agent;
+	struct fleet_phase *ph = r->phase;
+	int sd, n = 0, i, p;
+
+	bzero(r, sizeof(struct fleet_result));
+	r->plan = *plan;
+
+	if(agents < 1 || agents > FLEET_MAX_AGENTS){
+		fprintf(stderr, "fleet: 1 to %i agents\n", FLEET_MAX_AGENTS);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if((sd = peer_listen(SOCK_STREAM, port)) < 0)
+		return 1;
+	if(listen(sd, 64) != 0){
+		perror("listen");
+		close(sd);
+		return 1;
+	}
+	fprintf(stderr, "vm_perf coordinator on port %s, waiting for %i agents\n", port, agents);
+
+	while(n < agents){
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		const int c = accept(sd, (struct sockaddr*)&ss, &len);
+		int dc;
+
+		if(c < 0){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		bzero(&a[n], sizeof(struct fleet_member));
+		fleet_nodelay(c);
+		getnameinfo((struct sockaddr*)&ss, len, a[n].address, sizeof(a[n].address), NULL, 0, NI_NUMERICHOST);
+		if((dc = dup(c)) < 0 || (a[n].in = fdopen(c, "r")) == NULL || (a[n].out = fdopen(dc, "w")) == NULL){
+			perror("fdopen");
+			close(c);
+			if(dc >= 0)
+				close(dc);
+			continue;
+		}
+		if(fleet_register(&a[n]) != 0){
+			fprintf(stderr, "fleet: %s did not register\n", a[n].address);
+			fclose(a[n].in);
+			fclose(a[n].out);
+			continue;
+		}
+		n++;
+		fprintf(stderr, "fleet: agent %i/%i %s (%s), clock offset %.3fms, rtt %.3fms\n",
+			n, agents, a[n-1].host, a[n-1].address, a[n-1].offset / 1e6, a[n-1].rtt / 1e6);
+	}
+	close(sd);
+
+	for(p=0; p < plan->num_phases; ++p)
+		fleet_phase_run(a, n, plan, p, &ph[p]);
+
+	for(i=0; i < n; ++i){
+		if(a[i].alive){
+			fprintf(a[i].out, "BYE\n");
+			fflush(a[i].out);
+		}
+		fclose(a[i].in);
+		fclose(a[i].out);
+	}
+
+	r->num_agents = n;
+	for(p=0; p < plan->num_phases; ++p)
+		for(i=0; i < ph[p].num_metrics; ++i)
+			qsort(ph[p].metric[i].v, ph[p].metric[i].n, sizeof(double), cmp_double);
+	return 0;
+}
+
+static void fleet_sleep_until(const uint64_t target){
+	uint64_t now;
+	while((now = timer_now_ns()) < target){
+		const uint64_t left = target - now;
+		const struct timespec ts = {left / 1000000000ULL, left % 1000000000ULL};
+		nanosleep(&ts, NULL);
+	}
+}
+
+// Offset of the coordinator clock from the probe with the shortest round trip
+static int fleet_sync(FILE *in, FILE *out, int64_t *offset, uint64_t *rtt){
+	char line[FLEET_LINE];
+	int i;
+
+	*rtt = UINT64_MAX;
+	for(i=0; i < FLEET_SYNC_ROUNDS; ++i){
+		unsigned long long echo, t1;
+		const uint64_t t0 = timer_now_ns();
+
+		fprintf(out, "TIME %llu\n", (unsigned long long)t0);
+		fflush(out);
+		if(fgets(line, sizeof(line), in) == NULL || sscanf(line, "TIME %llu %llu", &echo, &t1) != 2 || echo != t0)
+			return 1;
+		const uint64_t t2 = timer_now_ns();
+		if(t2 - t0 < *rtt){
+			*rtt = t2 - t0;
+			*offset = (int64_t)t1 - (int64_t)(t0 + *rtt / 2);
+		}
+	}
+	fprintf(out, "SYNC %lld %llu\n", (long long)*offset, (unsigned long long)*rtt);
+	fflush(out);
+	return 0;
+}
+
+/*
+ * Register with the coordinator, then run every phase it sends until it says
+ * BYE. Metrics go back as they are measured.
+ */
+int fleet_agent(const char *coordinator, fleet_run_fn run, void *arg){
+	static struct store s;
+	char host[HOST_NAME_MAX + 1], line[FLEET_LINE];
+	FILE *in, *out;
+	int64_t offset = 0;
+	uint64_t rtt;
+	int sd, dsd, bye = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	if((sd = peer_connect(coordinator, FLEET_DEFAULT_PORT, SOCK_STREAM)) < 0)
+		return 1;
+	fleet_nodelay(sd);
+	if((dsd = dup(sd)) < 0 || (in = fdopen(sd, "r")) == NULL || (out = fdopen(dsd, "w")) == NULL){
+		perror("fdopen");
+		close(sd);
+		return 1;
+	}
+	if(gethostname(host, sizeof(host)) != 0)
+		snprintf(host, sizeof(host), "unknown");
+	host[strcspn(host, " \t\n")] = '\0';
+
+	fprintf(out, "HELLO %i %s\n", FLEET_PROTOCOL, host);
+	if(fleet_sync(in, out, &offset, &rtt) != 0){
+		fprintf(stderr, "fleet: %s did not answer the clock sync\n", coordinator);
+		fclose(in);
+		fclose(out);
+		return 1;
+	}
+	fprintf(stderr, "fleet: agent of %s, clock offset %.3fms, rtt %.3fms\n", coordinator, offset / 1e6, rtt / 1e6);
+
+	while(fgets(line, sizeof(line), in) != NULL){
+		char module[FLEET_MODULE_SIZE];
+		unsigned long long start;
+		int p, runs = 0;
+		float hold;
+
+		if(strncmp(line, "BYE", 3) == 0){
+			bye = 1;
+			break;
+		}
+		if(sscanf(line, "RUN %i %15s %f %llu", &p, module, &hold, &start) != 4)
+			continue;
+
+		const uint64_t target = (uint64_t)((int64_t)start - offset);
+		fleet_sleep_until(target);
+		const uint64_t t0 = timer_now_ns();
+		do{
+			int i;
+			if(run(module, &s, arg) != 0){
+				fprintf(stderr, "fleet: %s failed\n", module);
+				break;
+			}
+			runs++;
+			for(i=0; i < s.num_metrics; ++i){
+				const struct store_metric *m = &s.metric[i];
+				fprintf(out, "METRIC %i %s %i %.9g %s\n", runs, m->unit[0] ? m->unit : "-", m->better, store_median(m), m->name);
+			}
+			fflush(out);
+		}while((timer_now_ns() - t0) / 1e9 < hold);
+
+		fprintf(out, "DONE %i %lld %i %.3f\n", p, (long long)(t0 - target), runs, (timer_now_ns() - t0) / 1e9);
+		fflush(out);
+	}
+	fclose(in);
+	fclose(out);
+	return !bye;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_FLEET_H
+#define VM_PERF_FLEET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <netdb.h>
+
+#include "vm_perf_store.h"
+
+#define FLEET_DEFAULT_PORT "5202"
+#define FLEET_MAX_AGENTS 256
+#define FLEET_MAX_PHASES 8
+#define FLEET_MODULE_SIZE 16
+#define FLEET_LEAD_MS 2000			// Time between sending a phase and its start, covers the slowest agent
+#define FLEET_SYNC_ROUNDS 8			// Clock offset probes per agent, the one with the shortest round trip wins
+#define FLEET_REGISTER_TIMEOUT 10	// Seconds a connected agent has to register
+#define FLEET_PHASE_TIMEOUT 900		// Seconds past the start and hold of a phase before an agent counts as failed
+
+// Modules every agent runs, one phase each, all agents start a phase at the same instant
+struct fleet_plan{
+	int num_phases;
+	char module[FLEET_MAX_PHASES][FLEET_MODULE_SIZE];
+	float hold;					// Seconds an agent keeps rerunning the module, 0 for a single run
+};
+
+// One metric of a phase over every agent and run, sorted
+struct fleet_values{
+	char name[STORE_NAME_SIZE];
+	char unit[STORE_UNIT_SIZE];
+	int better;
+	int n, size;
+	double *v;
+};
+
+struct fleet_phase{
+	int agents;					// Agents that finished the phase
+	int runs;
+	int64_t late_min, late_max;	// ns the agents started after the barrier
+	double time_max;			// Seconds of the slowest agent
+	int num_metrics;
+	struct fleet_values metric[STORE_MAX_METRICS];
+};
+
+struct fleet_member{
+	FILE *in, *out;
+	char host[HOST_NAME_MAX + 1];
+	char address[NI_MAXHOST];
+	int64_t offset;				// Coordinator clock minus agent clock
+	uint64_t rtt;
+	int alive;					// Still connected, it finished every phase so far in time
+};
+
+struct fleet_result{
+	struct fleet_plan plan;
+	int num_agents;
+	struct fleet_member agent[FLEET_MAX_AGENTS];
+	struct fleet_phase phase[FLEET_MAX_PHASES];
+};
+
+// Run module once on an agent and put what it measured in s, non zero on failure
+typedef int (*fleet_run_fn)(const char *module, struct store *s, void *arg);
+
+int fleet_parse(struct fleet_plan *plan, const char *spec);
+int fleet_coordinate(const char *port, const int agents, const struct fleet_plan *plan, struct fleet_result *r);
+void fleet_report(const struct fleet_result *r);
+void fleet_free(struct fleet_result *r);
+int fleet_agent(const char *coordinator, fleet_run_fn run, void *arg);
+
+#endif
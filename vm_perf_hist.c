@@ -0,0 +1,98 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <stdio.h>
+#include <strings.h>
+
+#include "vm_perf_hist.h"
+
+static int hist_index(const uint64_t v){
+	if(v < HIST_SUB_BUCKETS)
+		return (int)v;
+
+	const int e = 63 - __builtin_clzll(v);
+	const int sub = (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+static uint64_t hist_lower_bound(const int idx){
+	if(idx < HIST_SUB_BUCKETS)
+		return idx;
+
+	const int e = idx / HIST_SUB_BUCKETS - 1 + HIST_SUB_BITS;
+	const uint64_t sub = idx % HIST_SUB_BUCKETS;
+	return (HIST_SUB_BUCKETS + sub) << (e - HIST_SUB_BITS);
+}
+
+void hist_init(struct lat_hist *h){
+	bzero(h, sizeof(struct lat_hist));
+	h->min = UINT64_MAX;
+}
+
+void hist_add(struct lat_hist *h, const uint64_t ns){
+	h->bucket[hist_index(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if(ns < h->min) h->min = ns;
+	if(ns > h->max) h->max = ns;
+}
+
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src){
+	int i;
+	for(i=0; i < HIST_NUM_BUCKETS; ++i)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if(src->min < dst->min) dst->min = src->min;
+	if(src->max > dst->max) dst->max = src->max;
+}
+
+// Value below which p (0..1) of the samples fall, the bucket midpoint is clamped to the observed range
+uint64_t hist_percentile(const struct lat_hist *h, const double p){
+	if(h->count == 0)
+		return 0;
+
+	unsigned long rank = (unsigned long)(p * h->count + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > h->count) rank = h->count;
+
+	unsigned long seen = 0;
+	int i;
+	for(i=0; i < HIST_NUM_BUCKETS; ++i){
+		seen += h->bucket[i];
+		if(seen >= rank)
+			break;
+	}
+
+	uint64_t lo = hist_lower_bound(i);
+	uint64_t hi = (i + 1 < HIST_NUM_BUCKETS) ? hist_lower_bound(i + 1) : h->max;
+	uint64_t v = lo + (hi - lo) / 2;
+	if(v < h->min) v = h->min;
+	if(v > h->max) v = h->max;
+	return v;
+}
+
+double hist_mean(const struct lat_hist *h){
+	return h->count ? h->sum / h->count : 0.0;
+}
+
+// Non empty power of two ranges as "histogram":[...], each entry counts the samples below "lt" microseconds
+void hist_report(const struct lat_hist *h){
+	char delim = ' ';
+	int i, e;
+
+	printf("\"histogram\":[");
+	for(i=0; i < HIST_NUM_BUCKETS; i = e){
+		unsigned long count = 0;
+		e = (i < HIST_SUB_BUCKETS) ? HIST_SUB_BUCKETS : i + HIST_SUB_BUCKETS;
+		for(; i < e; ++i)
+			count += h->bucket[i];
+		if(count == 0)
+			continue;
+		printf("%c{\"lt\":\"%.3fus\",\"count\":\"%lu\"}", delim, (e < HIST_NUM_BUCKETS ? hist_lower_bound(e) : h->max) / 1e3, count);
+		delim = ',';
+	}
+	printf("]");
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_HIST_H
+#define VM_PERF_HIST_H
+
+#include <stdint.h>
+
+// Log-bucketed latency histogram, each power of two is split in 2^HIST_SUB_BITS buckets (~12% precision)
+#define HIST_SUB_BITS		3
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS	(64 * HIST_SUB_BUCKETS)
+
+struct lat_hist{
+	unsigned long count;
+	uint64_t min;			// Nanoseconds
+	uint64_t max;
+	double sum;
+	unsigned long bucket[HIST_NUM_BUCKETS];
+};
+
+void hist_init(struct lat_hist *h);
+void hist_add(struct lat_hist *h, const uint64_t ns);
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+uint64_t hist_percentile(const struct lat_hist *h, const double p);
+double hist_mean(const struct lat_hist *h);
+void hist_report(const struct lat_hist *h);
+
+#endif
@@ -5,27 +5,403 @@
 
 #include <strings.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "vm_perf_mem.h"
+#include "vm_perf_timer.h"
 #include "dep/stream.h"
 
+#define MEM_MIN_ARRAY_SIZE	2000000		// Elements, STREAM 5.9 default
+#define MEM_LLC_FACTOR		4			// Each array at least 4 times the size of all caches
+#define MEM_RAM_FRACTION	4			// All three arrays use at most 1/4 of RAM
+#define MEM_SWEEP_MIN		(16*1024)	// Working set sweep from 16KB ...
+#define MEM_SWEEP_LLC_FACTOR 4			// ... to 4 times the last level cache, in steps of sqrt(2)
+#define MEM_LAT_LINE		64			// One node of the pointer chain per cache line
+#define MEM_LAT_TIME		0.05		// Seconds of pointer chasing per chain size
+
 static const char * mem_test_labels[NUM_MEM_TESTS] = {
 	"Copy", "Scale", "Add", "Triad" };
 
-void mem_bench(struct mem_result* r){
+static const char * mem_isa_labels[STREAM_NUM_ISA] = {
+	"sse2", "avx2", "avx512f" };
+
+static unsigned long mem_array_size(const struct sys_result *sys, const int num_nodes){
+	// Every instance of the last level cache together, one per NUMA node without cache information
+	const struct sys_topology *t = sys_topology();
+	const unsigned long llc = t->llc >= 0 ? t->cache[t->llc].size * t->cache[t->llc].instances : sys->llc_size * num_nodes;
+	unsigned long n = (MEM_LLC_FACTOR * llc * 1024UL) / sizeof(double);
+	unsigned long max = (sys->totalRAM * 1024UL * 1024UL) / (MEM_RAM_FRACTION * 3 * sizeof(double));
+
+	if(n < MEM_MIN_ARRAY_SIZE)
+		n = MEM_MIN_ARRAY_SIZE;
+	if((max > 0) && (n > max))
+		n = max;
+	return n;
+}
+
+static void mem_sweep(struct mem_result* r, const struct sys_result *sys, const int cpu){
+	unsigned long max = MEM_SWEEP_LLC_FACTOR * (sys->llc_size ? sys->llc_size : 32*1024) * 1024UL;
+	unsigned long ram = (sys->totalRAM * 1024UL * 1024UL) / MEM_RAM_FRACTION;
+	double size = MEM_SWEEP_MIN;
+
+	if((ram > 0) && (max > ram))
+		max = ram;
+
+	r->num_sweep = 0;
+	double last = 0.0;
+	while((size <= max) && (r->num_sweep < MEM_MAX_SWEEP)){
+		struct mem_sweep_point *p = &r->sweep[r->num_sweep];
+		// The next point takes at least as long as this one, larger sets are not worth starting once it does not fit
+		if(!timer_fits(last)){
+			r->skipped++;
+			size *= 1.41421356;
+			continue;
+		}
+		const double t0 = timer_now();
+		p->size = ((unsigned long)size + 4095) & ~4095UL;
+		if(stream_sweep(p->size, cpu, &p->copy, &p->triad) != 0)
+			break;
+		last = timer_now() - t0;
+		r->num_sweep++;
+		size *= 1.41421356;
+	}
+}
+
+// Follow the chain for loads dependent loads, returns the last node so the loop cannot be optimised away
+static void ** mem_chase(void **p, long loads){
+	while(loads > 0){
+		p = (void**)*p; p = (void**)*p; p = (void**)*p; p = (void**)*p;
+		p = (void**)*p; p = (void**)*p; p = (void**)*p; p = (void**)*p;
+		loads -= 8;
+	}
+	return p;
+}
+
+// Average latency in ns of a random cyclic pointer chain over size bytes at ptr
+static double mem_chain_latency(void *ptr, const size_t size){
+	const size_t n = size / MEM_LAT_LINE;
+	size_t *order, i;
+	uint64_t x = 88172645463325252ULL;
+
+	if((n < 2) || ((order = malloc(n * sizeof(size_t))) == NULL))
+		return 0.0;
+
+	// Sattolo's algorithm gives a single cycle through every line
+	for(i=0; i < n; ++i)
+		order[i] = i;
+	for(i=n-1; i > 0; --i){
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		size_t j = x % i;
+		size_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+	for(i=0; i < n; ++i)
+		*(void**)((char*)ptr + order[i] * MEM_LAT_LINE) = (char*)ptr + order[(i + 1) % n] * MEM_LAT_LINE;
+	free(order);
+
+	void **p = (void**)ptr;
+	p = mem_chase(p, n < 1000000 ? n : 1000000);	// Warm up caches and TLB
+
+	// Calibrate so every size takes about MEM_LAT_TIME
+	long loads = 1L << 16;
+	double t = timer_now();
+	p = mem_chase(p, loads);
+	t = timer_now() - t;
+	if(t > 0.0)
+		loads = (long)(loads * (timer_scaled(MEM_LAT_TIME) / t));
+	if(loads < (1L << 16))
+		loads = 1L << 16;
+
+	t = timer_now();
+	p = mem_chase(p, loads);
+	t = timer_now() - t;
+	if(p == NULL)	// Never true, keeps the chase alive
+		return 0.0;
+
+	return (t * 1e9) / loads;
+}
+
+static void mem_latency(struct mem_result* r, const struct sys_result *sys, const int cpu){
+	unsigned long max = MEM_SWEEP_LLC_FACTOR * (sys->llc_size ? sys->llc_size : 32*1024) * 1024UL;
+	unsigned long ram = (sys->totalRAM * 1024UL * 1024UL) / MEM_RAM_FRACTION;
+	unsigned long size;
+	cpu_set_t set, saved_affinity;
+
+	if((ram > 0) && (max > ram))
+		max = ram;
+
+	sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	r->num_latency = 0;
+	double last = 0.0;
+	for(size = MEM_SWEEP_MIN; (size <= max) && (r->num_latency < MEM_MAX_LATENCY); size *= 2){
+		struct mem_latency_point *p = &r->latency[r->num_latency];
+		struct page_mapping m;
+		int mode, huge[PAGE_NUM_POLICIES];
+
+		// Building a chain twice the size takes about twice as long
+		if(!timer_fits(2.0 * last)){
+			r->skipped++;
+			continue;
+		}
+		const double t0 = timer_now();
+		p->size = size;
+		for(mode = 0; mode < PAGE_NUM_POLICIES; ++mode){
+			huge[mode] = 0;
+			if(page_map(&m, size, mode) != 0)
+				continue;				// No huge pages of this kind in the guest
+			p->ns_page[mode] = mem_chain_latency(m.ptr, size);
+			// madvise() succeeds whether or not khugepaged or the fault path hand out huge pages
+			huge[mode] = (mode >= PAGE_HUGETLB_2M) || (mode == PAGE_THP && page_huge_kb(&m) > 0);
+			page_unmap(&m);
+		}
+		if(p->ns_page[PAGE_4K] == 0.0){
+			perror("mmap");
+			break;
+		}
+		p->ns = p->ns_page[PAGE_4K];
+
+		// Largest huge page size the guest hands out, transparent huge pages as last resort
+		for(mode = PAGE_HUGETLB_1G; mode > PAGE_4K && !huge[mode]; --mode)
+			;
+		p->huge_mode = mode;
+		p->ns_huge = (mode == PAGE_4K) ? 0.0 : p->ns_page[mode];
+		r->num_latency++;
+		last = timer_now() - t0;
+	}
+
+	sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+}
+
+void mem_bench(struct mem_result* r, const struct sys_result *sys){
+	static int cpus[CPU_SETSIZE], node_cpus[MEM_MAX_NODES][CPU_SETSIZE];
+	int num_node_cpus[MEM_MAX_NODES];
+	struct stream_config cfg;
+	struct pmu_session pmu;
+	int i, j;
+
 	bzero(r, sizeof(struct mem_result)); // Clear result
 
-	stream(r);
+	r->num_nodes = sys_num_nodes();
+	if(r->num_nodes > MEM_MAX_NODES)
+		r->num_nodes = MEM_MAX_NODES;
+	r->array_size = mem_array_size(sys, r->num_nodes);
+	r->num_threads = sys_core_cpus(cpus, CPU_SETSIZE, -1);
+	if(r->num_threads < 1)
+		r->num_threads = sys_online_cpus(cpus, CPU_SETSIZE);
+	if(r->num_threads < 1){
+		fprintf(stderr, "mem: no CPU to run on\n");
+		return;
+	}
+
+	// All cores, every thread first touches the part of the arrays it works on
+	cfg.array_size = r->array_size;
+	cfg.init_cpus = cfg.run_cpus = cpus;
+	cfg.num_init = cfg.num_run = r->num_threads;
+	cfg.kernels = NULL;
+	cfg.pages = page_get_policy();
+	cfg.huge_kb = &r->huge_kb;
+	const double t0 = timer_now();
+	pmu_start(&pmu);
+	if(stream(&cfg, r->rate, r->stream_stats) != 0 && cfg.pages != PAGE_DEFAULT){
+		fprintf(stderr, "mem: no %s pages for the STREAM arrays, using the default\n", page_policy_name(cfg.pages));
+		cfg.pages = PAGE_DEFAULT;
+		stream(&cfg, r->rate, r->stream_stats);
+	}
+	pmu_stop(&pmu, &r->stream_pmu);
+	r->pages = cfg.pages;
+	cfg.huge_kb = NULL;
+	const double stream_s = timer_now() - t0;		// What every further STREAM run costs
+
+	/*
+	 * Under a time budget the curves and the NUMA matrix go first, the SIMD
+	 * and page policy variants of the baseline only run while a STREAM run
+	 * still fits in the slice.
+	 */
+	pmu_start(&pmu);
+	mem_sweep(r, sys, cpus[0]);
+	pmu_stop(&pmu, &r->sweep_pmu);
+	pmu_start(&pmu);
+	mem_latency(r, sys, cpus[0]);
+	pmu_stop(&pmu, &r->latency_pmu);
+
+	if(r->num_nodes < 2){
+		for(i=0; i < NUM_MEM_TESTS; ++i)
+			r->node_rate[0][0][i] = r->rate[i];
+	}else{
+		for(i=0; i < r->num_nodes; ++i)
+			num_node_cpus[i] = sys_core_cpus(node_cpus[i], CPU_SETSIZE, i);
+
+		// Per node (local) and cross node (remote) bandwidth
+		for(i=0; i < r->num_nodes; ++i){
+			for(j=0; j < r->num_nodes; ++j){
+				if((num_node_cpus[i] == 0) || (num_node_cpus[j] == 0))
+					continue;
+				if(!timer_fits(stream_s / r->num_nodes)){
+					r->skipped++;
+					continue;
+				}
+				cfg.array_size = r->array_size / r->num_nodes;
+				cfg.run_cpus = node_cpus[i];
+				cfg.num_run = num_node_cpus[i];
+				cfg.init_cpus = node_cpus[j];
+				cfg.num_init = num_node_cpus[j];
+				stream(&cfg, r->node_rate[i][j], NULL);
+			}
+		}
+		cfg.array_size = r->array_size;
+		cfg.init_cpus = cfg.run_cpus = cpus;
+		cfg.num_init = cfg.num_run = r->num_threads;
+	}
+
+	// Same again with every SIMD kernel set the CPU exposes
+	for(i=0; i < STREAM_NUM_ISA; ++i)
+		r->simd_isa[i] = stream_isa_supported(i);
+	for(i=0; i < STREAM_NUM_KERNELS; ++i){
+		if(!r->simd_isa[stream_kernel_table[i].isa])
+			continue;
+		if(!timer_fits(stream_s)){
+			r->skipped++;
+			continue;
+		}
+		cfg.kernels = &stream_kernel_table[i];
+		r->simd[r->num_simd].kernel = stream_kernel_table[i].name;
+		stream(&cfg, r->simd[r->num_simd].rate, NULL);
+		r->num_simd++;
+	}
+	cfg.kernels = NULL;
+
+	// Same again under every page policy, to put a number on what huge pages are worth
+	for(i=0; i < PAGE_NUM_POLICIES; ++i){
+		if(!timer_fits(stream_s)){
+			r->page[i].skipped = 1;
+			r->skipped++;
+			continue;
+		}
+		cfg.pages = i;
+		cfg.huge_kb = &r->page[i].huge_kb;
+		r->page[i].ran = (stream(&cfg, r->page[i].rate, NULL) == 0);
+	}
+	cfg.pages = r->pages;
+	cfg.huge_kb = NULL;
 };
 
 void mem_report(const struct mem_result* r){
-	int i;
+	int i, j, t;
 	printf("\"mem\":{");
+	printf("\"array_size\":\"%.1fMB\",", (r->array_size * sizeof(double)) / (1024.0*1024.0));
+	printf("\"threads\":\"%i\",\"skipped\":\"%i\",", r->num_threads, r->skipped);
+	printf("\"pages\":\"%s\",\"huge_pages\":\"%liKB\",", page_policy_name(r->pages), r->huge_kb);
 	printf("\"stream\":[");
 	char delim = ' ';
 	for(i=0; i < NUM_MEM_TESTS; ++i){
-		printf("%c{\"test\":\"%s\",\"result\":\"%.1fMB/s\"}", delim, mem_test_labels[i], r->rate[i]);
+		printf("%c{\"test\":\"%s\",\"result\":\"%.1fMB/s\",", delim, mem_test_labels[i], r->rate[i]);
+		timer_report(&r->stream_stats[i], "MB/s");
+		printf("}");
+		delim = ',';
+	}
+	printf("],");
+	pmu_report("stream_pmu", &r->stream_pmu);
+	printf(",\"page_policies\":[");
+	for(i=0; i < PAGE_NUM_POLICIES; ++i){
+		const struct mem_page_point *p = &r->page[i];
+		printf("%s{\"policy\":\"%s\",\"ran\":\"%s\"", i ? "," : "", page_policy_name(i), p->ran ? "yes" : (p->skipped ? "skipped" : "no"));
+		if(p->ran){
+			printf(",\"huge_pages\":\"%liKB\"", p->huge_kb);
+			for(t=0; t < NUM_MEM_TESTS; ++t)
+				printf(",\"%s\":\"%.1fMB/s\"", mem_test_labels[t], p->rate[t]);
+		}
+		printf("}");
+	}
+	printf("]");
+	printf(",\"simd\":{\"isa\":{");
+	for(i=0; i < STREAM_NUM_ISA; ++i)
+		printf("%s\"%s\":\"%s\"", i ? "," : "", mem_isa_labels[i], r->simd_isa[i] ? "yes" : "no");
+	printf("},\"kernels\":[");
+	delim = ' ';
+	for(i=0; i < r->num_simd; ++i){
+		printf("%c{\"kernel\":\"%s\"", delim, r->simd[i].kernel);
+		for(t=0; t < NUM_MEM_TESTS; ++t)
+			printf(",\"%s\":\"%.1fMB/s\"", mem_test_labels[t], r->simd[i].rate[t]);
+		printf("}");
+		delim = ',';
+	}
+	// Best achievable bandwidth of each test over the plain C and SIMD kernels
+	printf("],\"best\":{");
+	for(t=0; t < NUM_MEM_TESTS; ++t){
+		const char *kernel = "c";
+		double best = r->rate[t];
+		for(i=0; i < r->num_simd; ++i){
+			if(r->simd[i].rate[t] > best){
+				best = r->simd[i].rate[t];
+				kernel = r->simd[i].kernel;
+			}
+		}
+		printf("%s\"%s\":{\"result\":\"%.1fMB/s\",\"kernel\":\"%s\"}", t ? "," : "", mem_test_labels[t], best, kernel);
+	}
+	printf("}},\"numa\":[");
+	delim = ' ';
+	for(i=0; i < r->num_nodes; ++i){
+		for(j=0; j < r->num_nodes; ++j){
+			printf("%c{\"cpu_node\":\"%i\",\"mem_node\":\"%i\",\"type\":\"%s\"", delim, i, j, i == j ? "local" : "remote");
+			for(t=0; t < NUM_MEM_TESTS; ++t)
+				printf(",\"%s\":\"%.1fMB/s\"", mem_test_labels[t], r->node_rate[i][j][t]);
+			printf("}");
+			delim = ',';
+		}
+	}
+	printf("],\"sweep\":[");
+	delim = ' ';
+	for(i=0; i < r->num_sweep; ++i){
+		printf("%c{\"size\":\"%luKB\",\"Copy\":\"%.1fMB/s\",\"Triad\":\"%.1fMB/s\"}",
+			delim, r->sweep[i].size / 1024, r->sweep[i].copy, r->sweep[i].triad);
+		delim = ',';
+	}
+	printf("],");
+	pmu_report("sweep_pmu", &r->sweep_pmu);
+	printf(",\"latency\":[");
+	delim = ' ';
+	for(i=0; i < r->num_latency; ++i){
+		const struct mem_latency_point *p = &r->latency[i];
+		printf("%c{\"size\":\"%luKB\",\"latency\":\"%.2fns\",", delim, p->size / 1024, p->ns);
+		if(p->huge_mode != PAGE_4K)		// Without huge pages there is no huge variant to report
+			printf("\"latency_huge\":\"%.2fns\",\"huge_pages\":\"%s\",", p->ns_huge, page_policy_name(p->huge_mode));
+		printf("\"policies\":{");
+		for(t=0, j=0; t < PAGE_NUM_POLICIES; ++t)
+			if(p->ns_page[t] > 0.0)
+				printf("%s\"%s\":\"%.2fns\"", j++ ? "," : "", page_policy_name(t), p->ns_page[t]);
+		printf("}}");
 		delim = ',';
 	}
-	printf("]}");
+	printf("],");
+	pmu_report("latency_pmu", &r->latency_pmu);
+	printf("}");
 };
+
+void mem_store(const struct mem_result* r, struct store *s){
+	char name[STORE_NAME_SIZE];
+	int i, t;
+
+	for(i=0; i < NUM_MEM_TESTS; ++i){
+		snprintf(name, sizeof(name), "mem/stream/%s", mem_test_labels[i]);
+		store_add_stats(s, name, "MB/s", STORE_HIGHER, &r->stream_stats[i]);
+	}
+	for(i=0; i < PAGE_NUM_POLICIES; ++i){
+		if(!r->page[i].ran)
+			continue;
+		for(t=0; t < NUM_MEM_TESTS; ++t){
+			snprintf(name, sizeof(name), "mem/pages/%s/%s", page_policy_name(i), mem_test_labels[t]);
+			store_add_value(s, name, "MB/s", STORE_HIGHER, r->page[i].rate[t]);
+		}
+	}
+	for(i=0; i < r->num_latency; ++i){
+		snprintf(name, sizeof(name), "mem/latency/%luKB", r->latency[i].size / 1024);
+		store_add_value(s, name, "ns", STORE_LOWER, r->latency[i].ns);
+	}
+}
@@ -5,14 +5,84 @@
 
 #ifndef VM_PERF_MEM_H
 #define VM_PERF_MEM_H
+#include "vm_perf_sampler.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_store.h"
+#include "vm_perf_pmu.h"
+#include "vm_perf_page.h"
+#include "dep/stream_simd.h"
+
+#include "vm_perf_sys.h"
 
 #define NUM_MEM_TESTS 4
+#define MEM_MAX_NODES 8
+#define MEM_MAX_SWEEP 48
+#define MEM_MAX_LATENCY 24
+
+struct mem_latency_point{
+	unsigned long size;			// Bytes covered by the pointer chain
+	double ns;					// Load to use latency with 4K pages
+	double ns_huge;				// Same chain backed by the largest huge pages obtained
+	enum page_policy huge_mode;	// Kind of huge pages actually obtained, PAGE_4K without any
+	double ns_page[PAGE_NUM_POLICIES];	// Under every page policy, 0 where the guest had none
+};
+
+// STREAM, plain C, under one page policy
+struct mem_page_point{
+	int ran;					// The guest provided the pages
+	int skipped;				// Left out to fit the time budget
+	long huge_kb;				// KB of the arrays backed by huge pages after first touch
+	double rate[NUM_MEM_TESTS];
+};
+
+struct mem_sweep_point{
+	unsigned long size;			// Working set of all three arrays in bytes
+	double copy;				// MB/s, single pinned thread
+	double triad;
+};
+
+struct mem_simd_point{
+	const char * kernel;		// ISA, "_nt" with non-temporal stores
+	double rate[NUM_MEM_TESTS];	// MB/s, same threads and arrays as the plain C run
+};
 
 struct mem_result{
-	double rate[NUM_MEM_TESTS];	// Transfer rate in GB/s
+	double rate[NUM_MEM_TESTS];	// Transfer rate in MB/s, one pinned thread per core
+	struct timer_stats stream_stats[NUM_MEM_TESTS];	// Spread of the per trial rates
+	struct pmu_counts stream_pmu;	// Hardware counters over the plain C run, all four tests
+	unsigned long array_size;	// Elements per STREAM array
+	int num_threads;
+	int skipped;				// STREAM runs, sweep and latency points left out to fit the time budget
+	enum page_policy pages;		// Policy the STREAM arrays got, the global one unless the guest lacked it
+	long huge_kb;
+
+	// STREAM under every page policy
+	struct mem_page_point page[PAGE_NUM_POLICIES];
+
+	// STREAM with the SIMD kernels the guest can run
+	int simd_isa[STREAM_NUM_ISA];	// ISA usable according to CPUID and XCR0
+	int num_simd;
+	struct mem_simd_point simd[STREAM_NUM_KERNELS];
+
+	// STREAM with threads on one node and memory first touched on another
+	int num_nodes;
+	double node_rate[MEM_MAX_NODES][MEM_MAX_NODES][NUM_MEM_TESTS];	// [cpu node][memory node]
+
+	// Bandwidth vs working set size curve
+	int num_sweep;
+	struct mem_sweep_point sweep[MEM_MAX_SWEEP];
+	struct pmu_counts sweep_pmu;
+
+	// Dependent load latency vs chain size
+	int num_latency;
+	struct mem_latency_point latency[MEM_MAX_LATENCY];
+	struct pmu_counts latency_pmu;
+
+	struct sampler_window window;		// Interference seen while measuring
 };
 
-void mem_bench(struct mem_result* r);
+void mem_bench(struct mem_result* r, const struct sys_result *sys);
 void mem_report(const struct mem_result* r);
+void mem_store(const struct mem_result* r, struct store *s);
 
 #endif
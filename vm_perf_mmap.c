@@ -0,0 +1,277 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vm_perf_mmap.h"
+#include "vm_perf_sys.h"
+#include "vm_perf_timer.h"
+
+#define MMAP_PAGE 4096
+
+static const char * mmap_method_names[MMAP_NUM_METHODS] = {"read", "mmap", "mmap_populate", "mmap_madvise"};
+static const char * mmap_pattern_names[MMAP_NUM_PATTERNS] = {"sequential", "random"};
+
+static volatile uint64_t mmap_sink;		// Keeps the page reads from being optimised away
+
+struct mmap_fault_thread{
+	pthread_t tid;
+	size_t size;
+	int thp;
+	double time_s;
+	unsigned long faults;
+};
+
+static int mmap_start = 0, mmap_ready = 0;
+static pthread_mutex_t mmap_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mmap_start_cond = PTHREAD_COND_INITIALIZER;
+
+const char * mmap_method_name(const enum mmap_method method){
+	return mmap_method_names[method];
+}
+
+const char * mmap_pattern_name(const enum mmap_pattern pattern){
+	return mmap_pattern_names[pattern];
+}
+
+// Page i of the random pattern, an affine permutation that visits every page once (n is a power of two, so any odd factor works)
+static inline size_t mmap_page(const size_t i, const size_t n, const enum mmap_pattern pattern){
+	if(pattern == MMAP_SEQUENTIAL)
+		return i;
+	return (size_t)((((size_t)(n * 0.6180339887) | 1) * i + n / 3) % n);
+}
+
+static uint64_t mmap_sum(const uint64_t *p, const size_t len){
+	uint64_t s = 0;
+	size_t i;
+	for(i=0; i < len / sizeof(uint64_t); ++i)
+		s += p[i];
+	return s;
+}
+
+static void mmap_rusage(unsigned long *major, unsigned long *minor){
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	*major = ru.ru_majflt;
+	*minor = ru.ru_minflt;
+}
+
+// Write the test file once, the read tests drop it from the page cache before every run
+static int mmap_create(const char *filename, const off_t size){
+	char *buffer;
+	off_t off;
+	int fd;
+
+	if((fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0666)) == -1){
+		perror("open");
+		return -1;
+	}
+	if((buffer = malloc(MMAP_READ_SIZE)) == NULL){
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+	for(off=0; off < size; off += MMAP_READ_SIZE){
+		memset(buffer, (int)(off >> 17), MMAP_READ_SIZE);
+		if(pwrite(fd, buffer, MMAP_READ_SIZE, off) != MMAP_READ_SIZE){
+			perror("pwrite");
+			free(buffer);
+			close(fd);
+			return -1;
+		}
+	}
+	free(buffer);
+	if(fdatasync(fd) != 0)
+		perror("fdatasync");
+	return fd;
+}
+
+static int mmap_read_test(const int fd, const size_t size, const enum mmap_method method, const enum mmap_pattern pattern, struct mmap_read_result *r){
+	const size_t pages = size / MMAP_PAGE;
+	unsigned long major0, minor0, major1, minor1;
+	uint64_t sum = 0;
+	size_t i;
+
+	bzero(r, sizeof(struct mmap_read_result));
+	posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+
+	mmap_rusage(&major0, &minor0);
+	const uint64_t t0 = timer_now_ns();
+	if(method == MMAP_READ){
+		const size_t len = (pattern == MMAP_SEQUENTIAL) ? MMAP_READ_SIZE : MMAP_PAGE;
+		void *buffer;
+		if(posix_memalign(&buffer, MMAP_PAGE, len) != 0)
+			return 1;
+		for(i=0; i < size / len; ++i){
+			const off_t off = (off_t)mmap_page(i, size / len, pattern) * len;
+			if(pread(fd, buffer, len, off) != (ssize_t)len){
+				perror("pread");
+				break;
+			}
+			sum += mmap_sum(buffer, len);
+		}
+		free(buffer);
+	}else{
+		const int flags = MAP_SHARED | (method == MMAP_POPULATE ? MAP_POPULATE : 0);
+		char *map = mmap(NULL, size, PROT_READ, flags, fd, 0);
+		if(map == MAP_FAILED){
+			perror("mmap");
+			return 1;
+		}
+		if(method == MMAP_MADVISE && madvise(map, size, pattern == MMAP_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM) != 0)
+			perror("madvise");
+		for(i=0; i < pages; ++i)
+			sum += mmap_sum((const uint64_t*)(map + mmap_page(i, pages, pattern) * MMAP_PAGE), MMAP_PAGE);
+		munmap(map, size);
+	}
+	r->time_s = (timer_now_ns() - t0) / 1e9;
+	mmap_rusage(&major1, &minor1);
+	mmap_sink += sum;
+
+	r->rate = r->time_s > 0.0f ? size / r->time_s / (1024*1024) : 0.0f;
+	r->major_faults = major1 - major0;
+	r->minor_faults = minor1 - minor0;
+	return 0;
+}
+
+static void *mmap_fault_thread(void *arg){
+	struct mmap_fault_thread *t = (struct mmap_fault_thread*) arg;
+	unsigned long major0, minor0, major1, minor1;
+	size_t off;
+	char *p;
+
+	// Reserve and advise before the clock starts, only the first touches are timed
+	if((p = mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		perror("mmap");
+	else
+		madvise(p, t->size, t->thp ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+	pthread_mutex_lock(&mmap_start_mutex);
+	mmap_ready++;
+	pthread_cond_broadcast(&mmap_start_cond);
+	if(p == MAP_FAILED){
+		pthread_mutex_unlock(&mmap_start_mutex);
+		return NULL;
+	}
+	while(!mmap_start) {
+		pthread_cond_wait(&mmap_start_cond, &mmap_start_mutex);
+	}
+	pthread_mutex_unlock(&mmap_start_mutex);
+
+	mmap_rusage(&major0, &minor0);
+	const uint64_t t0 = timer_now_ns();
+	for(off=0; off < t->size; off += MMAP_PAGE)
+		p[off] = 1;
+	t->time_s = (timer_now_ns() - t0) / 1e9;
+	mmap_rusage(&major1, &minor1);
+	t->faults = (major1 - major0) + (minor1 - minor0);
+
+	munmap(p, t->size);
+	return NULL;
+}
+
+// Every thread populates its own size bytes of anonymous memory, the faults contend on the mm
+static int mmap_fault_test(const int threads, const size_t size, const int thp, struct mmap_fault_result *r){
+	struct mmap_fault_thread *t;
+	int i, started = 0;
+	double time_s = 0.0;
+
+	bzero(r, sizeof(struct mmap_fault_result));
+	r->threads = threads;
+	r->size = size;
+	r->thp = thp;
+	if((t = calloc(threads, sizeof(struct mmap_fault_thread))) == NULL){
+		perror("calloc");
+		return 1;
+	}
+
+	mmap_start = mmap_ready = 0;
+	for(i=0; i < threads; ++i){
+		t[i].size = size;
+		t[i].thp = thp;
+		if(pthread_create(&t[i].tid, NULL, mmap_fault_thread, &t[i]) != 0){
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+	// Start once every thread has its memory mapped
+	pthread_mutex_lock(&mmap_start_mutex);
+	while(mmap_ready < started)
+		pthread_cond_wait(&mmap_start_cond, &mmap_start_mutex);
+	mmap_start = 1;
+	pthread_cond_broadcast(&mmap_start_cond);
+	pthread_mutex_unlock(&mmap_start_mutex);
+
+	for(i=0; i < started; ++i){
+		pthread_join(t[i].tid, NULL);
+		r->faults += t[i].faults;
+		if(t[i].time_s > time_s)
+			time_s = t[i].time_s;
+		if(t[i].time_s > 0.0)
+			r->faults_s += t[i].faults / t[i].time_s;
+	}
+	if(started > 0)
+		r->faults_s /= started;
+	r->rate = time_s > 0.0 ? (double)started * size / time_s / (1024*1024*1024) : 0.0f;
+
+	free(t);
+	return started == 0;
+}
+
+/*
+ * Cold reads of filename through read() and three flavours of mmap(),
+ * then the anonymous fault test on one thread and on every usable vCPU.
+ * The threads together stay within MMAP_ANON_FREE_SHARE of the free
+ * memory, each with less of it and if need be fewer of them. Under a time
+ * budget the file and the memory every thread touches shrink with the
+ * slice, the results are rates either way.
+ */
+void mmap_bench(const char *filename, struct mmap_result *r){
+	static int online[CPU_SETSIZE];
+	const size_t budget = (size_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE) / MMAP_ANON_FREE_SHARE;
+	int fd, m, p, thp, cpus;
+	size_t size;
+
+	bzero(r, sizeof(struct mmap_result));
+	// A power of two, the random pattern depends on it
+	for(r->file_size = MMAP_FILE_SIZE; r->file_size > MMAP_FILE_MIN && r->file_size > timer_scaled(MMAP_FILE_SIZE); r->file_size /= 2)
+		;
+	if((fd = mmap_create(filename, r->file_size)) >= 0){
+		unlink(filename);
+		for(m=0; m < MMAP_NUM_METHODS; ++m)
+			for(p=0; p < MMAP_NUM_PATTERNS; ++p)
+				mmap_read_test(fd, r->file_size, m, p, &r->read[m][p]);
+		close(fd);
+	}
+
+	cpus = sys_online_cpus(online, CPU_SETSIZE);
+	if(cpus > 1 && (size_t)cpus * MMAP_ANON_MIN > budget)
+		cpus = budget / MMAP_ANON_MIN;
+	size = (cpus > 1) ? budget / cpus : budget;
+	if(size > timer_scaled(MMAP_ANON_SIZE))
+		size = timer_scaled(MMAP_ANON_SIZE);
+	size &= ~((size_t)(2*1024*1024) - 1);		// Whole huge pages for the THP run
+	if(size < MMAP_ANON_MIN)
+		size = MMAP_ANON_MIN;
+
+	for(thp=0; thp < 2; ++thp){
+		mmap_fault_test(1, size, thp, &r->fault[r->num_fault_tests++]);
+		if(cpus > 1)
+			mmap_fault_test(cpus, size, thp, &r->fault[r->num_fault_tests++]);
+	}
+}
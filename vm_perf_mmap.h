@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_MMAP_H
+#define VM_PERF_MMAP_H
+
+#define MMAP_FILE_SIZE (256*1024*1024)		// Read back cold for every method and pattern
+#define MMAP_FILE_MIN (16*1024*1024)		// Smallest file under a time budget
+#define MMAP_READ_SIZE (128*1024)			// Buffer of the sequential read() path, random reads are one page
+#define MMAP_ANON_SIZE (256*1024*1024)		// Anonymous memory every thread of the fault test touches at most
+#define MMAP_ANON_MIN (16*1024*1024)		// Per thread, fewer threads run rather than less than this each
+#define MMAP_ANON_FREE_SHARE 2				// All threads together take at most 1/2 of the free memory
+#define MMAP_MAX_FAULT_TESTS 4
+
+enum mmap_method{
+	MMAP_READ = 0,				// read() into a reused buffer
+	MMAP_PLAIN,					// mmap(), demand faults
+	MMAP_POPULATE,				// mmap(MAP_POPULATE), the mmap() call is part of the time
+	MMAP_MADVISE,				// mmap() with MADV_SEQUENTIAL or MADV_RANDOM matching the pattern
+	MMAP_NUM_METHODS
+};
+
+enum mmap_pattern{
+	MMAP_SEQUENTIAL = 0,
+	MMAP_RANDOM,				// Every page once, in permuted order
+	MMAP_NUM_PATTERNS
+};
+
+struct mmap_read_result{
+	float rate;					// MB/s
+	float time_s;
+	unsigned long major_faults;
+	unsigned long minor_faults;
+};
+
+struct mmap_fault_result{
+	int threads;
+	unsigned long size;			// Bytes every thread populated
+	int thp;					// MADV_HUGEPAGE instead of MADV_NOHUGEPAGE
+	float faults_s;				// Page faults per second per thread
+	float rate;					// GB/s of memory populated by all threads
+	unsigned long faults;
+};
+
+struct mmap_result{
+	unsigned long file_size;	// Bytes, a power of two, MMAP_FILE_SIZE unless a time budget shrank it
+	struct mmap_read_result read[MMAP_NUM_METHODS][MMAP_NUM_PATTERNS];
+	int num_fault_tests;
+	struct mmap_fault_result fault[MMAP_MAX_FAULT_TESTS];
+};
+
+void mmap_bench(const char *filename, struct mmap_result *r);
+const char * mmap_method_name(const enum mmap_method method);
+const char * mmap_pattern_name(const enum mmap_pattern pattern);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Long running monitor. Every interval a few light probes run (a small STREAM
+ * triad, QD1 4KB O_DIRECT reads, an ICMP round trip) while the sampler covers
+ * the whole interval for steal, then one NDJSON line goes to stdout. All the
+ * buffers are allocated up front, samples are kept in a ring and SIGUSR1
+ * prints the ring again, oldest first, for a reader that attached late.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_monitor.h"
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_page.h"
+
+#define MONITOR_BLOCK 4096
+#define MONITOR_TRIAD_PASSES 3
+
+static volatile sig_atomic_t monitor_stop = 0, monitor_replay = 0;
+
+static struct monitor_sample monitor_ring[MONITOR_RING];
+
+static struct{
+	double *a, *b, *c;
+	void *block;
+	int fd;						// -1 when O_DIRECT is not available
+	uint64_t seed;
+	char filename[PATH_MAX];
+} probe = {.fd = -1};
+
+static void monitor_signal(int sig){
+	if(sig == SIGUSR1)
+		monitor_replay = 1;
+	else
+		monitor_stop = 1;
+}
+
+static double cpu_seconds(void){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static uint64_t monitor_rand(void){
+	probe.seed ^= probe.seed << 13;
+	probe.seed ^= probe.seed >> 7;
+	probe.seed ^= probe.seed << 17;
+	return probe.seed;
+}
+
+// Fill the read file once, through the page cache so it does not take long
+static int monitor_disk_open(void){
+	char *home;
+	off_t off;
+	int fd;
+
+	if((home = getenv("HOME")) == NULL){
+		fprintf(stderr, "monitor: HOME is not set, no disk probe\n");
+		return -1;
+	}
+	snprintf(probe.filename, PATH_MAX, "%s/vm_perf.monitor", home);
+
+	if((fd = open(probe.filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1){
+		perror("open");
+		return -1;
+	}
+	memset(probe.block, 0xA5, MONITOR_BLOCK);
+	for(off=0; off < MONITOR_DISK_FILE_SIZE; off += MONITOR_BLOCK){
+		if(pwrite(fd, probe.block, MONITOR_BLOCK, off) != MONITOR_BLOCK){
+			perror("pwrite");
+			close(fd);
+			unlink(probe.filename);
+			return -1;
+		}
+	}
+	if(fdatasync(fd) != 0)
+		perror("fdatasync");
+	close(fd);
+
+	if((fd = open(probe.filename, O_RDONLY|O_DIRECT)) == -1){
+		perror("open O_DIRECT");
+		unlink(probe.filename);
+		return -1;
+	}
+	return fd;
+}
+
+static int monitor_alloc(void){
+	probe.a = page_alloc(sizeof(double) * MONITOR_STREAM_SIZE);
+	probe.b = page_alloc(sizeof(double) * MONITOR_STREAM_SIZE);
+	probe.c = page_alloc(sizeof(double) * MONITOR_STREAM_SIZE);
+	probe.block = page_alloc(MONITOR_BLOCK);
+	if(probe.a == NULL || probe.b == NULL || probe.c == NULL || probe.block == NULL){
+		perror("mmap");
+		return 1;
+	}
+
+	size_t i;
+	for(i=0; i < MONITOR_STREAM_SIZE; ++i){
+		probe.a[i] = 1.0;
+		probe.b[i] = 2.0;
+		probe.c[i] = 0.0;
+	}
+	probe.seed = timer_now_ns() | 1;
+	probe.fd = monitor_disk_open();
+	return 0;
+}
+
+static void monitor_free(void){
+	if(probe.fd != -1){
+		close(probe.fd);
+		unlink(probe.filename);
+	}
+	page_free(probe.a);
+	page_free(probe.b);
+	page_free(probe.c);
+	page_free(probe.block);
+}
+
+// Best of a few passes of a[i] = b[i] + s * c[i], in MB/s as STREAM counts it
+static float monitor_triad(void){
+	const double s = 3.0;
+	uint64_t best = UINT64_MAX;
+	int pass;
+	size_t i;
+
+	for(pass=0; pass < MONITOR_TRIAD_PASSES; ++pass){
+		const uint64_t t0 = timer_now_ns();
+		for(i=0; i < MONITOR_STREAM_SIZE; ++i)
+			probe.a[i] = probe.b[i] + s * probe.c[i];
+		const uint64_t t = timer_now_ns() - t0;
+		if(t < best)
+			best = t;
+	}
+	return best > 0 ? 3.0 * sizeof(double) * MONITOR_STREAM_SIZE / (best / 1e9) / 1e6 : 0.0f;
+}
+
+static void monitor_disk(struct monitor_sample *s){
+	struct lat_hist h;
+	int i;
+
+	s->disk_p50 = s->disk_max = 0.0f;
+	if(probe.fd == -1)
+		return;
+
+	hist_init(&h);
+	for(i=0; i < MONITOR_DISK_READS; ++i){
+		const off_t off = (off_t)(monitor_rand() % (MONITOR_DISK_FILE_SIZE / MONITOR_BLOCK)) * MONITOR_BLOCK;
+		const uint64_t t0 = timer_now_ns();
+		if(pread(probe.fd, probe.block, MONITOR_BLOCK, off) != MONITOR_BLOCK){
+			perror("pread");
+			return;
+		}
+		hist_add(&h, timer_now_ns() - t0);
+	}
+	s->disk_p50 = hist_percentile(&h, 0.50) / 1e6;
+	s->disk_max = h.max / 1e6;
+}
+
+static void monitor_emit(const struct monitor_sample *s, const char *host, const int has_disk){
+	printf("{\"seq\":\"%lu\",\"time\":\"%.3f\",\"interval\":\"%.2fs\",\"triad\":\"%.1fMB/s\",",
+		s->seq, s->time, s->interval, s->triad);
+	if(has_disk)
+		printf("\"disk_read\":{\"block_size\":\"%iKB\",\"reads\":\"%i\",\"p50\":\"%.3fms\",\"max\":\"%.3fms\"},",
+			MONITOR_BLOCK / 1024, MONITOR_DISK_READS, s->disk_p50, s->disk_max);
+	printf("\"icmp\":{\"host\":\"%s\",\"avg\":\"%.3fms\",\"min\":\"%.3fms\",\"loss\":\"%.1f%%\"},",
+		host, s->icmp.avg, s->icmp.min, s->icmp.loss * 100.0f);
+	sampler_report("window", &s->window);
+	printf(",\"overhead\":\"%.3f%%\"}\n", s->overhead);
+	fflush(stdout);
+}
+
+// Samples up to last still in the ring, the same lines again with their original seq
+static void monitor_emit_ring(const unsigned long last, const char *host, const int has_disk){
+	unsigned long seq = last >= MONITOR_RING ? last - MONITOR_RING + 1 : 1;
+
+	for(; seq <= last; ++seq)
+		monitor_emit(&monitor_ring[seq % MONITOR_RING], host, has_disk);
+}
+
+/*
+ * Sample every cfg->interval seconds until SIGINT or SIGTERM (or cfg->count
+ * samples). The interval is stretched when the probes would use more than
+ * MONITOR_MAX_OVERHEAD % of one CPU.
+ */
+int monitor_run(const struct monitor_config *cfg){
+	const char *host = cfg->host ? cfg->host : net_test_domains[0];
+	struct sigaction sa;
+	struct timespec next;
+	unsigned long seq;
+
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = monitor_signal;		// No SA_RESTART, the sleep has to return
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if(monitor_alloc() != 0){
+		monitor_free();
+		return 1;
+	}
+
+	double cpu0 = cpu_seconds();
+	uint64_t t0 = timer_now_ns();
+	float interval;
+	sampler_start();
+
+	for(seq=1; !monitor_stop; ++seq){
+		struct monitor_sample *s = &monitor_ring[seq % MONITOR_RING];
+		struct timeval now;
+
+		// Probes first, the window then spans the sleep that follows the previous sample
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		bzero(s, sizeof(struct monitor_sample));
+		s->seq = seq;
+		s->triad = monitor_triad();
+		monitor_disk(s);
+		net_ping(host, &s->icmp);
+
+		sampler_stop(&s->window);
+		s->window.attempts = 1;
+		sampler_start();
+
+		const double cpu1 = cpu_seconds();
+		const uint64_t t1 = timer_now_ns();
+		gettimeofday(&now, NULL);
+		s->time = now.tv_sec + now.tv_usec / 1e6;
+		s->interval = (t1 - t0) / 1e9;
+		s->overhead = s->interval > 0.0f ? (cpu1 - cpu0) / s->interval * 100.0f : 0.0f;
+		monitor_emit(s, host, probe.fd != -1);
+
+		// Stretch the next interval until this much CPU stays under the limit, sleeps count from the start of the probes
+		interval = cfg->interval;
+		if((cpu1 - cpu0) * 100.0f / MONITOR_MAX_OVERHEAD > interval)
+			interval = (cpu1 - cpu0) * 100.0f / MONITOR_MAX_OVERHEAD;
+		cpu0 = cpu1;
+		t0 = t1;
+
+		if(cfg->count && seq == cfg->count)
+			break;
+		next.tv_sec += (time_t)interval;
+		next.tv_nsec += (long)((interval - (time_t)interval) * 1e9);
+		if(next.tv_nsec >= 1000000000L){
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		while(!monitor_stop){
+			if(monitor_replay){
+				monitor_replay = 0;
+				monitor_emit_ring(seq, host, probe.fd != -1);
+			}
+			if(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != EINTR)
+				break;
+		}
+	}
+
+	struct sampler_window w;
+	sampler_stop(&w);
+	monitor_free();
+	return 0;
+}
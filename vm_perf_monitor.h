@@ -0,0 +1,39 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_MONITOR_H
+#define VM_PERF_MONITOR_H
+
+#include "vm_perf_net.h"
+#include "vm_perf_sampler.h"
+
+#define MONITOR_INTERVAL 60					// Default seconds between samples
+#define MONITOR_RING 1440					// Samples kept, a day at the default interval
+#define MONITOR_MAX_OVERHEAD 1.0f			// % of one CPU the probes may use, the interval stretches beyond it
+#define MONITOR_STREAM_SIZE (2*1024*1024)	// Doubles per STREAM array, 48MB in total
+#define MONITOR_DISK_FILE_SIZE (64*1024*1024)
+#define MONITOR_DISK_READS 16				// QD1 4KB O_DIRECT reads per sample
+
+struct monitor_sample{
+	unsigned long seq;
+	double time;				// Unix time at the end of the sample
+	float interval;				// Seconds since the previous sample
+	float triad;				// MB/s, best of 3 passes
+	float disk_p50;				// ms
+	float disk_max;
+	struct net_latency icmp;
+	struct sampler_window window;	// Steal and pressure over the interval
+	float overhead;				// % of one CPU vm_perf used over the interval
+};
+
+struct monitor_config{
+	float interval;
+	unsigned long count;		// Samples to take, 0 to run until SIGINT/SIGTERM
+	const char *host;			// ICMP target
+};
+
+int monitor_run(const struct monitor_config *cfg);
+
+#endif
@@ -4,10 +4,14 @@
  */
 
 #include <time.h>
+#include <stdint.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -21,9 +25,11 @@
 #include <resolv.h>
 
 #include "vm_perf_net.h"
+#include "vm_perf_dns.h"
+#include "vm_perf_timer.h"
 
 // http://www.softlayer.com/data-centers
-const char * net_test_domains[NET_NUM_DOMAINS] = {
+const char * const net_test_domains[NET_NUM_DOMAINS] = {
 	"speedtest.ams01.softlayer.com",
 	"speedtest.dal01.softlayer.com",
 	"speedtest.fra02.softlayer.com",
@@ -38,8 +44,10 @@ const char * net_test_domains[NET_NUM_DOMAINS] = {
 	"speedtest.wdc01.softlayer.com"
 };
 
-// Number of ICMP packets to send before determining the latency
+// Number of ICMP packets to send to each host before determining the latency
 #define NET_MAX_PINGS 10
+#define NET_PING_INTERVAL_MS 10		// Gap between consecutive rounds of pings
+#define NET_PING_TIMEOUT_MS	 1000	// Wait for replies after the last round was sent
 #define MSG_SIZE	24
 
 struct packet{
@@ -47,10 +55,12 @@ struct packet{
 	char msg[MSG_SIZE];
 };
 
-struct reply_packet{
-	struct iphdr iph;
-	struct icmphdr icmphdr;
-	char msg[MSG_SIZE];
+struct ping_target{
+	struct sockaddr_in addr;
+	int resolved;
+	int sent;							// Requests that went out, not every round's did
+	uint64_t sent_ns[NET_MAX_PINGS];	// Per round, 0 when its sendto() failed
+	float rtt[NET_MAX_PINGS];			// Round trip time in ms, < 0 if there was no reply
 };
 
 static unsigned short checksum(void *b, int len){
@@ -68,183 +78,371 @@ static unsigned short checksum(void *b, int len){
 	return result;
 }
 
-static float net_test_latency(const char * hostname){
+static int cmp_float(const void *a, const void *b){
+	const float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+static void ping_send_round(const int sd, const unsigned short id, struct ping_target *t, const int num_targets, const int round){
+	struct packet pckt;
+	int i;
+
+	for(i=0; i < num_targets; ++i){
+		if(!t[i].resolved)
+			continue;
+
+		bzero(&pckt, sizeof(pckt));
+		pckt.hdr.type = ICMP_ECHO;
+		pckt.hdr.un.echo.id = id;
+		pckt.hdr.un.echo.sequence = htons(i*NET_MAX_PINGS + round);
+		pckt.hdr.checksum = checksum(&pckt, sizeof(pckt));
+
+		t[i].sent_ns[round] = timer_now_ns();
+		if(sendto(sd, &pckt, sizeof(pckt), 0, (struct sockaddr*)&t[i].addr, sizeof(t[i].addr)) <= 0){
+			perror("sendto");
+			t[i].sent_ns[round] = 0;
+			continue;
+		}
+		t[i].sent++;
+	}
+}
+
+// Drain all pending replies from the socket, returns the number of new matched replies
+static int ping_recv_replies(const int sd, const unsigned short id, struct ping_target *t, const int num_targets){
+	char buf[sizeof(struct iphdr) + 60 + sizeof(struct packet)];
+	struct sockaddr_in from;
+	int matched = 0;
+
+	while(1){
+		socklen_t len = sizeof(from);
+		int bytes = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &len);
+		if(bytes < 0){
+			if((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				perror("recvfrom");
+			break;
+		}
+		const uint64_t now = timer_now_ns();
+
+		const struct iphdr *iph = (const struct iphdr*) buf;
+		const int hlen = iph->ihl * 4;
+		if(bytes < hlen + (int)sizeof(struct icmphdr))
+			continue;
+
+		const struct icmphdr *icmph = (const struct icmphdr*) (buf + hlen);
+		if((icmph->type != ICMP_ECHOREPLY) || (icmph->un.echo.id != id))
+			continue;
+
+		const unsigned short seq = ntohs(icmph->un.echo.sequence);
+		const int host = seq / NET_MAX_PINGS, idx = seq % NET_MAX_PINGS;
+		if((host >= num_targets) || (t[host].sent_ns[idx] == 0))
+			continue;
+		if(t[host].addr.sin_addr.s_addr != from.sin_addr.s_addr)
+			continue;
+		if(t[host].rtt[idx] >= 0.0f)	// Duplicate
+			continue;
+
+		t[host].rtt[idx] = (now - t[host].sent_ns[idx]) / 1e6f;
+		matched++;
+	}
+	return matched;
+}
+
+static void ping_summary(struct net_latency *r, const struct ping_target *t){
+	float samples[NET_MAX_PINGS];
+	int i, n = 0;
+
+	bzero(r, sizeof(struct net_latency));
+	r->loss = 1.0f;
+	if(t->sent == 0)
+		return;
 
-	struct protoent *proto = getprotobyname("ICMP");
-	struct hostent * hname = gethostbyname(hostname);
-	if(hname == NULL){
-		perror("gethostbyname");
-		return 0.0f;
+	for(i=0; i < NET_MAX_PINGS; ++i){
+		if(t->sent_ns[i] != 0 && t->rtt[i] >= 0.0f)
+			samples[n++] = t->rtt[i];
 	}
+	r->loss = (float)(t->sent - n) / (float)t->sent;
+	if(n == 0)
+		return;
+
+	qsort(samples, n, sizeof(float), cmp_float);
+	r->min = samples[0];
+	for(i=0; i < n; ++i)
+		r->avg += samples[i];
+	r->avg /= n;
+
+	int rank = (99*n + 99) / 100;	// Nearest rank
+	r->p99 = samples[rank - 1];
+}
 
+/*
+ * Probe all hosts concurrently from a single non-blocking raw socket. Rounds of
+ * echo requests are paced by a timerfd, replies are matched by echo id/sequence,
+ * so the whole test is bound by NET_PING_TIMEOUT_MS instead of a per host timeout.
+ */
+static int net_test_latency(struct net_latency *r, const char * const hostnames[], const int num_hosts){
+	struct ping_target *t;
+	int i, sd, efd, tfd;
 	const int val=255;
-	int i, sd;
-	unsigned short cnt = 0;
-	struct packet pckt;
-	struct sockaddr_in addr;
-	struct timespec ts_start[NET_MAX_PINGS], ts_end[NET_MAX_PINGS];
+	const unsigned short id = getpid() & 0xFFFF;
+
+	bzero(r, sizeof(struct net_latency)*num_hosts);
+
+	if((t = calloc(num_hosts, sizeof(struct ping_target))) == NULL){
+		perror("calloc");
+		return 1;
+	}
 
-	bzero(ts_start, sizeof(ts_start));
-	bzero(ts_end, sizeof(ts_end));
-	bzero(&addr, sizeof(addr));
+	int num_resolved = 0;
+	for(i=0; i < num_hosts; ++i){
+		struct hostent * hname = gethostbyname(hostnames[i]);
+		int p;
+		for(p=0; p < NET_MAX_PINGS; ++p)
+			t[i].rtt[p] = -1.0f;
+		r[i].loss = 1.0f;
 
-	addr.sin_family = hname->h_addrtype;
-	addr.sin_port = 0;
-	addr.sin_addr.s_addr = *(long*)hname->h_addr_list[0];
+		if((hname == NULL) || (hname->h_addrtype != AF_INET))
+			continue;
+		t[i].addr.sin_family = AF_INET;
+		memcpy(&t[i].addr.sin_addr, hname->h_addr_list[0], sizeof(t[i].addr.sin_addr));
+		t[i].resolved = 1;
+		num_resolved++;
+	}
+	if(num_resolved == 0){
+		free(t);
+		return 1;
+	}
 
-	sd = socket(PF_INET, SOCK_RAW, proto->p_proto);
+	sd = socket(PF_INET, SOCK_RAW|SOCK_NONBLOCK, IPPROTO_ICMP);
 	if ( sd < 0 ){
 		perror("socket");
-		return 0.0f;
+		free(t);
+		return 1;
 	}
 
 	if ( setsockopt(sd, SOL_IP, IP_TTL, &val, sizeof(val)) != 0)
 		perror("Set TTL option");
 
-	if ( fcntl(sd, F_SETFL, O_NONBLOCK) != 0 )
-		perror("Request nonblocking I/O");
-
-	// Send ICMP packets
-	bzero(&pckt, sizeof(pckt));
+	efd = epoll_create1(0);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if((efd == -1) || (tfd == -1)){
+		perror("epoll/timerfd");
+		goto out;
+	}
 
-	pckt.hdr.type = ICMP_ECHO;
-	pckt.hdr.un.echo.id = 1313;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = sd;
+	if(epoll_ctl(efd, EPOLL_CTL_ADD, sd, &ev) == -1){
+		perror("epoll_ctl");
+		goto out;
+	}
+	ev.data.fd = tfd;
+	if(epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev) == -1){
+		perror("epoll_ctl");
+		goto out;
+	}
 
-	pid_t pid = fork();
-	if(pid == 0){
-		for (i=0; i < NET_MAX_PINGS; ++i){
-			clock_gettime(CLOCK_REALTIME, (struct timespec*)&pckt.msg);// &ts_start[i]);
+	struct itimerspec its;
+	its.it_value.tv_sec = its.it_interval.tv_sec = 0;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = NET_PING_INTERVAL_MS * 1000000L;
+	if(timerfd_settime(tfd, 0, &its, NULL) == -1){
+		perror("timerfd_settime");
+		goto out;
+	}
 
-			pckt.hdr.un.echo.sequence = cnt++;
-			// memcpy(pckt.msg, &ts_start[i], sizeof(struct timespec));
-			pckt.hdr.checksum = 0;
-			pckt.hdr.checksum = checksum(&pckt, sizeof(pckt));
+	int round = 0, replies = 0, sent = 0, h;
+	uint64_t deadline = 0;
 
-			if ( sendto(sd, &pckt, sizeof(pckt), 0, (struct sockaddr*)&addr, sizeof(addr)) <= 0 )
-				perror("sendto");
-			usleep(100);
-		}
-		exit(0); //
-	}else if(pid == -1){
-		perror("fork");
-		return 0.0f;
-	}
-
-	// Receive replies
-	struct reply_packet reply;
-	for (i=0; i < NET_MAX_PINGS; ++i){
-
-		fd_set rfds;
-        struct timeval tv;
-
-		FD_ZERO(&rfds);
-        FD_SET(sd, &rfds);
-
-        tv.tv_sec = 1*NET_MAX_PINGS;
-        tv.tv_usec = 0;
-
-		int retval = select(sd+1, &rfds, NULL, NULL, &tv);
-        /* Don't rely on the value of tv now */
-
-	   if (retval == -1){
-		   perror("select()");
-		   break;
-	   }else if (retval){
-		   //printf("Data is available now.\n");
-		   /* FD_ISSET(sd, &rfds) will be true. */
-	   }else{
-		   // fprintf(stderr, "No data within five seconds.\n");
-		   break;
-	   }
-
-		bzero(&reply, sizeof(reply));
-		socklen_t len = sizeof(addr);
-		int bytes = recvfrom(sd, &reply, sizeof(reply), 0, (struct sockaddr*)&addr, &len);
-		if ( bytes < 0 ){
-			if((errno == EAGAIN) && (cnt > 0)){
-				--i;
-				continue;
-			}else{
-				perror("recvfrom");
+	ping_send_round(sd, id, t, num_hosts, round++);
+	while(1){
+		int timeout = -1;
+		if(round == NET_MAX_PINGS){
+			const uint64_t now = timer_now_ns();
+			const float left = now < deadline ? (deadline - now) / 1e6f : 0.0f;
+			if((left <= 0.0f) || (replies == sent))
 				break;
-			}
+			timeout = (int)left + 1;
 		}
 
+		struct epoll_event events[2];
+		int n = epoll_wait(efd, events, 2, timeout);
+		if(n == -1){
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
 
-		if ( reply.icmphdr.un.echo.id == 1313 )
-		{
-			//printf("ICMP: type[%d/%d] checksum[%d] id[%d] seq[%d]\n",
-			//	reply.icmphdr.type, reply.icmphdr.code, ntohs(reply.icmphdr.checksum),
-			//	reply.icmphdr.un.echo.id, reply.icmphdr.un.echo.sequence);
-
-			unsigned short idx = reply.icmphdr.un.echo.sequence;
-			if((idx >= 0) && (idx < NET_MAX_PINGS)){
-				clock_gettime(CLOCK_REALTIME, &ts_end[idx]);
-				memcpy(&ts_start[idx], reply.msg, sizeof(struct timespec));
-			}else{
-				//fprintf(stderr, "Error: ping with wrong idx\n");
+		for(i=0; i < n; ++i){
+			if(events[i].data.fd == sd){
+				replies += ping_recv_replies(sd, id, t, num_hosts);
+			}else if(events[i].data.fd == tfd){
+				uint64_t expirations;
+				if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;
+				if(round < NET_MAX_PINGS){
+					ping_send_round(sd, id, t, num_hosts, round++);
+					if(round == NET_MAX_PINGS){
+						timerfd_settime(tfd, 0, &(struct itimerspec){{0, 0}, {0, 0}}, NULL);
+						deadline = timer_now_ns() + NET_PING_TIMEOUT_MS * 1000000ULL;
+						for(h=0; h < num_hosts; ++h)
+							sent += t[h].sent;
+					}
+				}
 			}
 		}
-		--cnt;
 	}
 
-	// Calculate latency
-	float latency_ms = 0.0f;
-	int num_samples = 0;
-	for (i=0; i < NET_MAX_PINGS; ++i){
-		if(ts_end[i].tv_nsec == 0)
-			continue;
-		ts_end[i].tv_sec  -= ts_start[i].tv_sec;
-		ts_end[i].tv_nsec -= ts_start[i].tv_nsec;
-
-		float lat = ((float)ts_end[i].tv_sec / 100) + ((float)ts_end[i].tv_nsec / 1000000);
+	for(i=0; i < num_hosts; ++i)
+		ping_summary(&r[i], &t[i]);
 
-		latency_ms += lat;
-		num_samples++;
-	}
-	if(num_samples > 0)
-		latency_ms /= num_samples;
+out:
+	if(tfd != -1)
+		close(tfd);
+	if(efd != -1)
+		close(efd);
+	close(sd);
+	free(t);
 
-	return latency_ms;
+	return 0;
 };
 
-static float net_test_dns_query(const char * hostname){
-
-	struct timespec ts_start, ts_end;
-	unsigned char answer[1024];
+void net_bench(struct net_result * r){
+	struct pmu_session pmu;
+	bzero(r, sizeof(struct net_result));	// Also the throughput test, net_throughput() runs after
 
-	clock_gettime(CLOCK_REALTIME, &ts_start);
-	if(res_query(net_test_domains[0], C_IN, T_MX, answer, sizeof(answer)) == -1){
-		// perror("res_query");
-		return 0.0f;
-	}
-	clock_gettime(CLOCK_REALTIME, &ts_end);
+	pmu_start(&pmu);
+	net_test_latency(r->latency, net_test_domains, NET_NUM_DOMAINS);
+	pmu_stop(&pmu, &r->latency_pmu);
 
-	ts_end.tv_sec  -= ts_start.tv_sec;
-	ts_end.tv_nsec -= ts_start.tv_nsec;
+	pmu_start(&pmu);
+	r->num_resolvers = dns_bench(r->dns, DNS_MAX_RESOLVERS, net_test_domains, NET_NUM_DOMAINS);
+	pmu_stop(&pmu, &r->dns_pmu);
+};
 
-	return ((float)ts_end.tv_sec / 100) + ((float)ts_end.tv_nsec / 1000000);
+// ICMP round trip time to one host, for the monitor
+void net_ping(const char * hostname, struct net_latency * r){
+	net_test_latency(r, &hostname, 1);
 }
 
+void net_peer_rtt(struct net_result * r, const char * peer, const int busy_poll){
+	struct pmu_session pmu;
+	int p;
+
+	snprintf(r->peer, sizeof(r->peer), "%s", peer);
+	r->busy_poll = busy_poll;
+	for(p=0; p < PEER_NUM_PROTOCOLS; ++p){
+		pmu_start(&pmu);
+		if(peer_pingpong(peer, p, busy_poll, &r->rtt[p]) != 0)
+			fprintf(stderr, "net: %s ping-pong with %s failed\n", peer_protocol_name(p), peer);
+		pmu_stop(&pmu, &r->rtt_pmu[p]);
+	}
+}
 
-void net_bench(struct net_result * r){
-	bzero(r, sizeof(struct net_result));
+void net_throughput(struct net_result * r, const char * peer, const int streams){
+	const struct tcp_job job = {peer, streams, timer_scaled(TCP_TIME)};
+	struct pmu_session pmu;
 
-	int i;
-	for(i=0; i < NET_NUM_DOMAINS; i++){
-		r->latency[i]   = net_test_latency(net_test_domains[i]);
-		r->dns_query[i] = net_test_dns_query(net_test_domains[i]);
-	}
-};
+	snprintf(r->peer, sizeof(r->peer), "%s", peer);
+	pmu_start(&pmu);
+	if(tcp_throughput(&job, &r->throughput) != 0)
+		fprintf(stderr, "net: throughput test against %s failed\n", peer);
+	pmu_stop(&pmu, &r->throughput_pmu);
+	r->network_capacity = r->throughput.gbps * 1000.0f;
+}
 
 void net_report(const struct net_result * r){
 	printf("\"net\":[");
 	int i;
 	char delim = ' ';
 	for(i=0; i < NET_NUM_DOMAINS; ++i){
-		printf("%c{\"hostname\":\"%s\",\"latency\":\"%.2fms\",\"dns_query\":\"%.2fms\"}",
-				delim, net_test_domains[i], r->latency[i], r->dns_query[i]);
+		const struct net_latency *l = &r->latency[i];
+		printf("%c{\"hostname\":\"%s\",\"latency\":\"%.2fms\",\"latency_min\":\"%.2fms\",\"latency_p99\":\"%.2fms\",\"loss\":\"%.0f%%\"}",
+				delim, net_test_domains[i], l->avg, l->min, l->p99, l->loss*100.0f);
+		delim = ',';
+	}
+	printf("],");
+
+	printf("\"dns\":[");
+	delim = ' ';
+	for(i=0; i < r->num_resolvers; ++i){
+		int c;
+		printf("%c{\"resolver\":\"%s\",\"concurrency\":\"%i\"", delim, r->dns[i].resolver, DNS_INFLIGHT);
+		for(c=0; c < DNS_NUM_CACHES; ++c){
+			const struct dns_burst *b = &r->dns[i].burst[c];
+			printf(",\"%s\":{\"queries\":\"%u\",\"answered\":\"%u\",\"errors\":\"%u\",\"timeouts\":\"%u\",\"qps\":\"%.0f\",",
+				dns_cache_name(c), b->queries, b->answered, b->errors, b->timeouts, b->qps);
+			printf("\"avg\":\"%.2fms\",\"p50\":\"%.2fms\",\"p99\":\"%.2fms\",\"max\":\"%.2fms\"}", b->avg, b->p50, b->p99, b->max);
+		}
+		printf("}");
+		delim = ',';
+	}
+	printf("],");
+
+	printf("\"net_pmu\":{");
+	pmu_report("latency", &r->latency_pmu);	putchar(',');
+	pmu_report("dns", &r->dns_pmu);
+	printf("},");
+
+	printf("\"net_peer\":{\"peer\":\"%s\",\"busy_poll\":\"%ius\",\"rtt\":[", r->peer[0] ? r->peer : "none", r->busy_poll);
+	delim = ' ';
+	for(i=0; i < PEER_NUM_PROTOCOLS; ++i){
+		const struct peer_rtt *p = &r->rtt[i];
+		const struct lat_hist *h = &p->hist;
+		printf("%c{\"protocol\":\"%s\",\"size\":\"%i\",\"round_trips\":\"%lu\",\"lost\":\"%lu\",", delim, peer_protocol_name(i), PEER_MSG_SIZE, h->count, p->lost);
+		printf("\"min\":\"%.1fus\",\"avg\":\"%.1fus\",\"p50\":\"%.1fus\",\"p99\":\"%.1fus\",\"p999\":\"%.1fus\",\"max\":\"%.1fus\",",
+			h->count ? h->min / 1e3 : 0.0, hist_mean(h) / 1e3, hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+			hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+		hist_report(h);
+		putchar(',');
+		pmu_report("pmu", &r->rtt_pmu[i]);
+		printf("}");
+		delim = ',';
+	}
+	printf("]},");
+
+	const struct tcp_result *t = &r->throughput;
+	printf("\"net_throughput\":{\"peer\":\"%s\",\"capacity\":\"%.0fMbit/s\",\"streams\":\"%i\",\"sndbuf\":\"%i\",\"time\":\"%.2fs\",",
+		r->peer[0] ? r->peer : "none", r->network_capacity, t->streams, t->sndbuf, t->time_s);
+	printf("\"rate\":\"%.2fGbit/s\",\"rate_min\":\"%.2fGbit/s\",\"rate_max\":\"%.2fGbit/s\",\"cpu\":\"%.2fs\",\"cpu_per_gbit\":\"%.3fs\",\"per_stream\":[",
+		t->gbps, t->gbps_min, t->gbps_max, t->cpu_s, t->cpu_per_gbit);
+	delim = ' ';
+	for(i=0; i < t->streams; ++i){
+		printf("%c{\"rate\":\"%.2fGbit/s\",\"bytes\":\"%lu\",\"retrans\":\"%u\"}",
+			delim, t->stream[i].gbps, t->stream[i].bytes, t->stream[i].retrans);
 		delim = ',';
 	}
-	printf("]");
+	printf("],");
+	pmu_report("pmu", &r->throughput_pmu);
+	printf("}");
 };
+
+// Hosts that never answered are left out, their latency is no measurement
+void net_store(const struct net_result * r, struct store * s){
+	char name[STORE_NAME_SIZE];
+	int i, c;
+
+	for(i=0; i < NET_NUM_DOMAINS; ++i){
+		if(r->latency[i].loss >= 1.0f)
+			continue;
+		snprintf(name, sizeof(name), "net/icmp/%s", net_test_domains[i]);
+		store_add_value(s, name, "ms", STORE_LOWER, r->latency[i].avg);
+	}
+	for(i=0; i < r->num_resolvers; ++i)
+		for(c=0; c < DNS_NUM_CACHES; ++c){
+			if(r->dns[i].burst[c].answered == 0)
+				continue;
+			snprintf(name, sizeof(name), "net/dns/%s/%s/p50", r->dns[i].resolver, dns_cache_name(c));
+			store_add_value(s, name, "ms", STORE_LOWER, r->dns[i].burst[c].p50);
+		}
+	if(r->peer[0] == 0)
+		return;
+	for(i=0; i < PEER_NUM_PROTOCOLS; ++i){
+		if(r->rtt[i].hist.count == 0)
+			continue;
+		snprintf(name, sizeof(name), "net/peer/%s/p50", peer_protocol_name(i));
+		store_add_value(s, name, "us", STORE_LOWER, hist_percentile(&r->rtt[i].hist, 0.50) / 1e3);
+	}
+	if(r->throughput.streams > 0)
+		store_add_value(s, "net/throughput", "Gbit/s", STORE_HIGHER, r->throughput.gbps);
+}
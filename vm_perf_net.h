@@ -5,15 +5,45 @@
 
 #ifndef VM_PERF_NET_H
 #define VM_PERF_NET_H
+#include "vm_perf_sampler.h"
+#include "vm_perf_tcp.h"
+#include "vm_perf_peer.h"
+#include "vm_perf_dns.h"
+#include "vm_perf_store.h"
+#include "vm_perf_pmu.h"
 
 #define NET_NUM_DOMAINS 12
 
+struct net_latency{
+	float min;		// Round trip time in ms
+	float avg;
+	float p99;
+	float loss;		// Fraction of echo requests left without a reply
+};
+
 struct net_result{
-	unsigned char network_capacity;	// Megabits/s
-	float latency[NET_NUM_DOMAINS];		// Latency
-	float dns_query[NET_NUM_DOMAINS];	// Time taken for a single dns query
+	float network_capacity;		// Megabits/s, aggregate of the TCP throughput test, 0 without a peer
+	struct net_latency latency[NET_NUM_DOMAINS];	// ICMP round trip time
+	int num_resolvers;
+	struct dns_result dns[DNS_MAX_RESOLVERS];	// Concurrent cold and warm queries per resolver
+	struct pmu_counts latency_pmu, dns_pmu;
+
+	char peer[256];						// host[:port] of the responder, empty without one
+	int busy_poll;						// SO_BUSY_POLL microseconds of the ping-pong, 0 if off
+	struct peer_rtt rtt[PEER_NUM_PROTOCOLS];	// Request-response round trips to the responder
+	struct pmu_counts rtt_pmu[PEER_NUM_PROTOCOLS];
+	struct tcp_result throughput;
+	struct pmu_counts throughput_pmu;
+
+	struct sampler_window window;		// Interference seen while measuring
 };
 
+extern const char * const net_test_domains[NET_NUM_DOMAINS];
+
 void net_bench(struct net_result * r);
+void net_ping(const char * hostname, struct net_latency * r);
+void net_peer_rtt(struct net_result * r, const char * peer, const int busy_poll);
+void net_throughput(struct net_result * r, const char * peer, const int streams);
 void net_report(const struct net_result * r);
+void net_store(const struct net_result * r, struct store * s);
 #endif
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Cost of the guest kernel paths that virtualization slows down: entering
+ * the kernel, reading the clock, waking a thread and waking on a timer.
+ * Syscalls and the clock read are timed in tight loops. clock_gettime()
+ * only stays in the vDSO when the clocksource supports it, otherwise it
+ * costs as much as the syscall. Wakeups are ping-pongs between two pinned
+ * threads over a futex, a pipe and an eventfd, on one vCPU and across cores.
+ * Timer jitter is measured cyclictest style, as the lateness of absolute
+ * clock_nanosleep() wakeups of a SCHED_FIFO thread.
+ */
+
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_os.h"
+#include "vm_perf_sys.h"
+
+#define OS_CALL_BATCH 1000			// Calls between two clock reads
+
+static const char * os_call_names[OS_NUM_CALLS] = {"getpid", "clock_gettime", "clock_gettime_syscall"};
+static const char * os_mechanism_names[OS_NUM_MECHANISMS] = {"futex", "pipe", "eventfd"};
+static const char * os_placement_names[OS_NUM_PLACEMENTS] = {"same_cpu", "other_core"};
+
+struct os_pingpong{
+	enum os_mechanism mechanism;
+	int turn;						// Futex word, 1 while the responder has the ball
+	int stop;
+	int fd[2][2];					// Read and write end towards the responder [0] and back [1]
+};
+
+const char * os_call_name(const enum os_call c){
+	return os_call_names[c];
+}
+
+const char * os_mechanism_name(const enum os_mechanism m){
+	return os_mechanism_names[m];
+}
+
+const char * os_placement_name(const enum os_placement p){
+	return os_placement_names[p];
+}
+
+static double os_call_trial(void *arg){
+	const enum os_call c = *(const enum os_call*)arg;
+	const uint64_t start = timer_now_ns(), end = start + (uint64_t)(OS_CALL_TIME * 1e9);
+	unsigned long calls = 0;
+	struct timespec ts;
+	uint64_t now;
+	int i;
+
+	do{
+		switch(c){
+			case OS_GETPID:
+				for(i=0; i < OS_CALL_BATCH; ++i)
+					syscall(SYS_getpid);
+				break;
+			case OS_CLOCK_VDSO:
+				for(i=0; i < OS_CALL_BATCH; ++i)
+					clock_gettime(CLOCK_MONOTONIC, &ts);
+				break;
+			default:
+				for(i=0; i < OS_CALL_BATCH; ++i)
+					syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+				break;
+		}
+		calls += OS_CALL_BATCH;
+	}while((now = timer_now_ns()) < end);
+	return (double)(now - start) / calls;
+}
+
+static long os_futex(int *word, const int op, const int value){
+	return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+// Pass the ball in direction dir, 0 towards the responder and 1 back
+static void os_signal(struct os_pingpong *p, const int dir){
+	const uint64_t one = 1;
+
+	if(p->mechanism == OS_FUTEX){
+		__atomic_store_n(&p->turn, dir == 0, __ATOMIC_RELEASE);
+		os_futex(&p->turn, FUTEX_WAKE_PRIVATE, 1);
+	}else if(write(p->fd[dir][1], &one, sizeof(one)) != sizeof(one))
+		perror("write");
+}
+
+static void os_wait(struct os_pingpong *p, const int dir){
+	const int want = (dir == 0);
+	uint64_t v;
+
+	if(p->mechanism == OS_FUTEX){
+		while(__atomic_load_n(&p->turn, __ATOMIC_ACQUIRE) != want)
+			os_futex(&p->turn, FUTEX_WAIT_PRIVATE, !want);
+	}else if(read(p->fd[dir][0], &v, sizeof(v)) != sizeof(v))
+		perror("read");
+}
+
+static void *os_responder(void *arg){
+	struct os_pingpong *p = (struct os_pingpong*) arg;
+
+	for(;;){
+		os_wait(p, 0);
+		if(__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+			break;
+		os_signal(p, 1);
+	}
+	return NULL;
+}
+
+static int os_pin(pthread_attr_t *attr, const int cpu){
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+static int os_pingpong_open(struct os_pingpong *p){
+	int d;
+
+	for(d=0; d < 2; ++d){
+		p->fd[d][0] = p->fd[d][1] = -1;
+		if(p->mechanism == OS_PIPE){
+			if(pipe2(p->fd[d], O_CLOEXEC) != 0){
+				perror("pipe2");
+				return 1;
+			}
+		}else if(p->mechanism == OS_EVENTFD){
+			if((p->fd[d][0] = p->fd[d][1] = eventfd(0, EFD_CLOEXEC)) < 0){
+				perror("eventfd");
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void os_pingpong_close(struct os_pingpong *p){
+	int d;
+
+	for(d=0; d < 2; ++d){
+		if(p->fd[d][0] >= 0)
+			close(p->fd[d][0]);
+		if(p->fd[d][1] >= 0 && p->fd[d][1] != p->fd[d][0])
+			close(p->fd[d][1]);
+	}
+}
+
+// Round trips between this thread on cpu[0] and a responder on cpu[1] for OS_WAKEUP_TIME
+static int os_wakeup(const enum os_mechanism mechanism, struct os_wakeup *w){
+	struct os_pingpong p;
+	cpu_set_t set, saved_affinity;
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint64_t end, t0, t1;
+
+	bzero(&p, sizeof(p));
+	p.mechanism = mechanism;
+	hist_init(&w->hist);
+	if(os_pingpong_open(&p) != 0){
+		os_pingpong_close(&p);
+		return 1;
+	}
+
+	sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity);
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu[0], &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	pthread_attr_init(&attr);
+	os_pin(&attr, w->cpu[1]);
+	if(pthread_create(&thread, &attr, os_responder, &p) != 0){
+		perror("pthread_create");
+		pthread_attr_destroy(&attr);
+		sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+		os_pingpong_close(&p);
+		return 1;
+	}
+	pthread_attr_destroy(&attr);
+
+	end = timer_now_ns() + (uint64_t)(timer_scaled(OS_WAKEUP_TIME) * 1e9);
+	do{
+		t0 = timer_now_ns();
+		os_signal(&p, 0);
+		os_wait(&p, 1);
+		t1 = timer_now_ns();
+		hist_add(&w->hist, t1 - t0);
+	}while(t1 < end);
+
+	__atomic_store_n(&p.stop, 1, __ATOMIC_RELEASE);
+	os_signal(&p, 0);
+	pthread_join(thread, NULL);
+
+	sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+	os_pingpong_close(&p);
+	w->ran = 1;
+	return 0;
+}
+
+static void *os_jitter_thread(void *arg){
+	struct lat_hist *hist = (struct lat_hist*) arg;
+	const long interval = OS_JITTER_INTERVAL * 1000L;
+	const long wakeups = (long)(timer_scaled(OS_JITTER_TIME) * 1e6 / OS_JITTER_INTERVAL);
+	struct timespec next, now;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(i=0; i < wakeups; ++i){
+		next.tv_nsec += interval;
+		if(next.tv_nsec >= 1000000000L){
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const int64_t late = (int64_t)(now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec);
+		hist_add(hist, late > 0 ? late : 0);
+	}
+	return NULL;
+}
+
+// Timer wakeups on cpu as a SCHED_FIFO thread, as a normal one without the privilege
+static void os_timer_jitter(struct os_result *r, const int cpu){
+	const struct sched_param param = {OS_JITTER_PRIORITY};
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fifo;
+
+	hist_init(&r->jitter);
+	r->jitter_cpu = cpu;
+	for(fifo=1; fifo >= 0; --fifo){
+		pthread_attr_init(&attr);
+		os_pin(&attr, cpu);
+		if(fifo){
+			pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			pthread_attr_setschedparam(&attr, &param);
+		}
+		const int error = pthread_create(&thread, &attr, os_jitter_thread, &r->jitter);
+		pthread_attr_destroy(&attr);
+		if(error == 0){
+			r->jitter_fifo = fifo;
+			pthread_join(thread, NULL);
+			return;
+		}
+		if(!fifo || error != EPERM){
+			errno = error;
+			perror("pthread_create");
+			return;
+		}
+	}
+}
+
+void os_bench(struct os_result *r){
+	static enum os_call calls[OS_NUM_CALLS];		// Outlive the module, timer_topup() may run more trials
+	static int cpus[CPU_SETSIZE];
+	int c, m, num_cores;
+
+	bzero(r, sizeof(struct os_result));
+	for(c=0; c < OS_NUM_CALLS; ++c){
+		calls[c] = c;
+		timer_trials(os_call_trial, &calls[c], TIMER_WARMUP, TIMER_TRIALS, &r->call[c]);
+	}
+	r->vdso = r->call[OS_CLOCK_VDSO].median * 2.0 < r->call[OS_CLOCK_SYSCALL].median;
+
+	// One vCPU of each core, the wakeup across cores needs two of them
+	num_cores = sys_core_cpus(cpus, CPU_SETSIZE, -1);
+	if(num_cores < 1)
+		num_cores = sys_online_cpus(cpus, CPU_SETSIZE);
+	if(num_cores < 1){
+		cpus[0] = sched_getcpu();
+		num_cores = 1;
+	}
+	for(m=0; m < OS_NUM_MECHANISMS; ++m){
+		struct os_wakeup *w = r->wakeup[m];
+		w[OS_SAME_CPU].cpu[0] = w[OS_SAME_CPU].cpu[1] = cpus[0];
+		os_wakeup(m, &w[OS_SAME_CPU]);
+		if(num_cores > 1){
+			w[OS_OTHER_CORE].cpu[0] = cpus[0];
+			w[OS_OTHER_CORE].cpu[1] = cpus[1];
+			os_wakeup(m, &w[OS_OTHER_CORE]);
+		}
+	}
+
+	os_timer_jitter(r, cpus[num_cores - 1]);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_OS_H
+#define VM_PERF_OS_H
+
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+
+#define OS_CALL_TIME 0.02			// Seconds of calls per trial
+#define OS_WAKEUP_TIME 0.5			// Seconds of ping-pong per mechanism and placement
+#define OS_JITTER_INTERVAL 1000		// us between the timer wakeups, cyclictest's default
+#define OS_JITTER_TIME 2.0			// Seconds of timer wakeups
+#define OS_JITTER_PRIORITY 80		// SCHED_FIFO priority of the timer thread when allowed
+
+enum os_call{
+	OS_GETPID = 0,					// syscall(SYS_getpid), the bare cost of entering the kernel
+	OS_CLOCK_VDSO,					// clock_gettime(CLOCK_MONOTONIC) through the vDSO
+	OS_CLOCK_SYSCALL,				// Same through syscall(SYS_clock_gettime)
+	OS_NUM_CALLS
+};
+
+enum os_mechanism{
+	OS_FUTEX = 0,
+	OS_PIPE,
+	OS_EVENTFD,
+	OS_NUM_MECHANISMS
+};
+
+enum os_placement{
+	OS_SAME_CPU = 0,				// Both threads on one vCPU, every wakeup is a context switch
+	OS_OTHER_CORE,					// Threads on two cores, every wakeup is a cross vCPU IPI
+	OS_NUM_PLACEMENTS
+};
+
+struct os_wakeup{
+	int ran;
+	int cpu[2];
+	struct lat_hist hist;			// Round trips, two wakeups each
+};
+
+struct os_result{
+	struct timer_stats call[OS_NUM_CALLS];		// ns per call
+	int vdso;									// clock_gettime() stays in user space
+	struct os_wakeup wakeup[OS_NUM_MECHANISMS][OS_NUM_PLACEMENTS];
+	int jitter_fifo;							// The timer thread got SCHED_FIFO
+	int jitter_cpu;
+	struct lat_hist jitter;						// Lateness of the timer wakeups
+};
+
+void os_bench(struct os_result *r);
+const char * os_call_name(const enum os_call c);
+const char * os_mechanism_name(const enum os_mechanism m);
+const char * os_placement_name(const enum os_placement p);
+
+#endif
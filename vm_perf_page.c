@@ -0,0 +1,253 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Page size policy of the test buffers. Whether the guest kernel backs an
+ * allocation with transparent huge pages depends on its THP setting, the
+ * alignment of the region and fragmentation, and changes bandwidth and
+ * latency results between otherwise identical VMs. Every large buffer of
+ * the modules comes from here, under one policy chosen on the command line,
+ * and the report records the policy and what the guest actually handed out.
+ */
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "vm_perf_page.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+#endif
+
+static const char * page_policy_names[PAGE_NUM_POLICIES] = {
+	"default", "4K", "thp", "hugetlb_2M", "hugetlb_1G" };
+
+// Mappings of the live page_alloc() buffers, kept apart so a buffer never spills into another page
+struct page_block{
+	struct page_mapping m;
+	struct page_block *next;
+};
+
+static enum page_policy page_policy = PAGE_DEFAULT;
+static unsigned long page_allocations, page_small, page_fallbacks;
+static struct page_block *page_blocks;
+static pthread_mutex_t page_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int page_parse(enum page_policy *policy, const char *name){
+	int p;
+
+	for(p=0; p < PAGE_NUM_POLICIES; ++p){
+		if(strcasecmp(name, page_policy_names[p]) == 0){
+			*policy = p;
+			return 0;
+		}
+	}
+	// Short forms
+	if(strcasecmp(name, "2M") == 0)
+		*policy = PAGE_HUGETLB_2M;
+	else if(strcasecmp(name, "1G") == 0)
+		*policy = PAGE_HUGETLB_1G;
+	else
+		return 1;
+	return 0;
+}
+
+const char * page_policy_name(const enum page_policy policy){
+	return page_policy_names[policy];
+}
+
+void page_set_policy(const enum page_policy policy){
+	page_policy = policy;
+}
+
+enum page_policy page_get_policy(void){
+	return page_policy;
+}
+
+// Map size bytes with exactly this policy, non zero with errno set when the guest cannot
+int page_map(struct page_mapping *m, const size_t size, const enum page_policy policy){
+	const size_t huge = (policy == PAGE_HUGETLB_1G) ? (1UL << 30) : (2UL << 20);
+	const int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+	char *p, *aligned;
+
+	m->policy = policy;
+	switch(policy){
+		case PAGE_HUGETLB_1G:
+		case PAGE_HUGETLB_2M:
+			m->len = (size + huge - 1) & ~(huge - 1);
+			m->base = mmap(NULL, m->len, PROT_READ|PROT_WRITE,
+				flags | MAP_HUGETLB | ((policy == PAGE_HUGETLB_1G) ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+			if(m->base == MAP_FAILED)
+				return 1;
+			m->ptr = m->base;
+			return 0;
+		case PAGE_THP:			// Over-allocate, then trim to a 2MB aligned region whole huge pages fit in
+			m->len = (size + huge - 1) & ~(huge - 1);
+			if((p = mmap(NULL, m->len + huge, PROT_READ|PROT_WRITE, flags, -1, 0)) == MAP_FAILED)
+				return 1;
+			aligned = (char*)(((uintptr_t)p + huge - 1) & ~(huge - 1));
+			if(aligned > p)
+				munmap(p, aligned - p);
+			if(p + huge > aligned)
+				munmap(aligned + m->len, p + huge - aligned);
+			m->base = m->ptr = aligned;
+			if(madvise(m->base, m->len, MADV_HUGEPAGE) != 0){
+				const int error = errno;
+				munmap(m->base, m->len);
+				errno = error;
+				return 1;
+			}
+			return 0;
+		default:
+			m->len = (size + 4095) & ~4095UL;
+			if((m->base = mmap(NULL, m->len, PROT_READ|PROT_WRITE, flags, -1, 0)) == MAP_FAILED)
+				return 1;
+			m->ptr = m->base;
+			if(policy == PAGE_4K)
+				madvise(m->base, m->len, MADV_NOHUGEPAGE);
+			return 0;
+	}
+}
+
+void page_unmap(struct page_mapping *m){
+	munmap(m->base, m->len);
+	m->base = m->ptr = NULL;
+	m->len = 0;
+}
+
+// KB of the mapping backed by huge pages so far, from /proc/self/smaps, -1 if unknown
+long page_huge_kb(const struct page_mapping *m){
+	const uintptr_t start = (uintptr_t)m->base, end = start + m->len;
+	char line[256];
+	int inside = 0;
+	long kb = 0, v;
+	FILE *f;
+
+	if((f = fopen("/proc/self/smaps", "r")) == NULL)
+		return -1;
+	while(fgets(line, sizeof(line), f) != NULL){
+		unsigned long lo, hi;
+		if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+			inside = (lo < end) && (hi > start);		// A madvise() can split the region into several areas
+		else if(inside && (sscanf(line, "AnonHugePages: %ld kB", &v) == 1 ||
+				sscanf(line, "Private_Hugetlb: %ld kB", &v) == 1))
+			kb += v;
+	}
+	fclose(f);
+	return kb;
+}
+
+/*
+ * A page aligned buffer under the global policy, falls back to the default
+ * policy when the guest cannot provide it so the test still runs. Buffers
+ * under PAGE_HUGE_MIN of a huge page get the default policy as well, a
+ * whole huge page for each of them would drain the pool. Returns NULL with
+ * errno set on failure, like malloc().
+ */
+void * page_alloc(const size_t size){
+	const size_t huge = (page_policy == PAGE_HUGETLB_1G) ? (1UL << 30) : (2UL << 20);
+	enum page_policy policy = page_policy;
+	struct page_block *b;
+
+	if((b = malloc(sizeof(struct page_block))) == NULL)
+		return NULL;
+	__sync_fetch_and_add(&page_allocations, 1);
+	if(policy >= PAGE_THP && size < huge / PAGE_HUGE_MIN){
+		__sync_fetch_and_add(&page_small, 1);
+		policy = PAGE_DEFAULT;
+	}
+	if(page_map(&b->m, size, policy) != 0){
+		if(policy != PAGE_DEFAULT)
+			__sync_fetch_and_add(&page_fallbacks, 1);
+		if(policy == PAGE_DEFAULT || page_map(&b->m, size, PAGE_DEFAULT) != 0){
+			const int error = errno;
+			free(b);
+			errno = error;
+			return NULL;
+		}
+	}
+	pthread_mutex_lock(&page_blocks_mutex);
+	b->next = page_blocks;
+	page_blocks = b;
+	pthread_mutex_unlock(&page_blocks_mutex);
+	return b->m.ptr;
+}
+
+void page_free(void *ptr){
+	struct page_block **p, *b = NULL;
+
+	if(ptr == NULL)
+		return;
+	pthread_mutex_lock(&page_blocks_mutex);
+	for(p=&page_blocks; *p != NULL; p = &(*p)->next){
+		if((*p)->m.ptr == ptr){
+			b = *p;
+			*p = b->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&page_blocks_mutex);
+	if(b == NULL)
+		return;
+	page_unmap(&b->m);
+	free(b);
+}
+
+static void page_read_setting(const char *path, char *value, const size_t size){
+	char line[128], *open, *close;
+	FILE *f;
+
+	snprintf(value, size, "unknown");
+	if((f = fopen(path, "r")) == NULL)
+		return;
+	// The active choice is the bracketed one, "always [madvise] never"
+	if(fgets(line, sizeof(line), f) != NULL && (open = strchr(line, '[')) && (close = strchr(open, ']'))){
+		*close = 0;
+		snprintf(value, size, "%s", open + 1);
+	}
+	fclose(f);
+}
+
+static long page_read_long(const char *path){
+	long v = -1;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL)
+		return -1;
+	if(fscanf(f, "%ld", &v) != 1)
+		v = -1;
+	fclose(f);
+	return v;
+}
+
+void page_info(struct page_info *info){
+	bzero(info, sizeof(struct page_info));
+	info->policy = page_policy;
+	page_read_setting("/sys/kernel/mm/transparent_hugepage/enabled", info->thp_enabled, sizeof(info->thp_enabled));
+	page_read_setting("/sys/kernel/mm/transparent_hugepage/defrag", info->thp_defrag, sizeof(info->thp_defrag));
+	info->hugepages_2M = page_read_long("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages");
+	info->hugepages_1G = page_read_long("/sys/kernel/mm/hugepages/hugepages-1048576kB/free_hugepages");
+	info->allocations = page_allocations;
+	info->small = page_small;
+	info->fallbacks = page_fallbacks;
+}
+
+void page_report(const struct page_info *info){
+	printf("\"pages\":{\"policy\":\"%s\",\"thp_enabled\":\"%s\",\"thp_defrag\":\"%s\",\"free_hugepages_2M\":\"%li\",\"free_hugepages_1G\":\"%li\",",
+		page_policy_names[info->policy], info->thp_enabled, info->thp_defrag, info->hugepages_2M, info->hugepages_1G);
+	printf("\"allocations\":\"%lu\",\"small\":\"%lu\",\"fallbacks\":\"%lu\"}", info->allocations, info->small, info->fallbacks);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_PAGE_H
+#define VM_PERF_PAGE_H
+
+#include <stddef.h>
+
+#define PAGE_HUGE_MIN 2				// page_alloc() takes huge pages for buffers of at least 1/2 of one
+
+enum page_policy{
+	PAGE_DEFAULT = 0,			// No advice, whatever the guest kernel's THP setting gives
+	PAGE_4K,					// madvise(MADV_NOHUGEPAGE)
+	PAGE_THP,					// madvise(MADV_HUGEPAGE) on a 2MB aligned region
+	PAGE_HUGETLB_2M,			// MAP_HUGETLB|MAP_HUGE_2MB, needs reserved huge pages
+	PAGE_HUGETLB_1G,			// MAP_HUGETLB|MAP_HUGE_1GB
+	PAGE_NUM_POLICIES
+};
+
+struct page_mapping{
+	void *base;					// What to munmap
+	size_t len;
+	void *ptr;					// Aligned start of the usable region
+	enum page_policy policy;
+};
+
+// Setting of the guest and what the allocations under the global policy got
+struct page_info{
+	enum page_policy policy;
+	char thp_enabled[16];		// always, madvise or never
+	char thp_defrag[16];
+	long hugepages_2M;			// Free huge pages in the hugetlbfs pools
+	long hugepages_1G;
+	unsigned long allocations;
+	unsigned long small;		// Allocations below PAGE_HUGE_MIN of a huge page, left to PAGE_DEFAULT
+	unsigned long fallbacks;	// Allocations that got PAGE_DEFAULT because the policy failed
+};
+
+int page_parse(enum page_policy *policy, const char *name);
+const char * page_policy_name(const enum page_policy policy);
+void page_set_policy(const enum page_policy policy);
+enum page_policy page_get_policy(void);
+
+int page_map(struct page_mapping *m, const size_t size, const enum page_policy policy);
+void page_unmap(struct page_mapping *m);
+long page_huge_kb(const struct page_mapping *m);
+
+void * page_alloc(const size_t size);
+void page_free(void *ptr);
+
+void page_info(struct page_info *info);
+void page_report(const struct page_info *info);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vm_perf_peer.h"
+#include "vm_perf_timer.h"
+
+static const char * peer_protocol_names[PEER_NUM_PROTOCOLS] = {"udp", "tcp"};
+
+struct peer_msg{
+	uint32_t seq;
+	char pad[PEER_MSG_SIZE - sizeof(uint32_t)];
+};
+
+const char * peer_protocol_name(const enum peer_protocol protocol){
+	return peer_protocol_names[protocol];
+}
+
+// Connect a socket of type to host[:port] (default_port without one), "[v6addr]:port" for IPv6 literals, -1 on failure
+int peer_connect(const char *peer, const char *default_port, const int type){
+	char host[256];
+	const char *port = default_port;
+	struct addrinfo hints, *res, *ai;
+	int sd = -1, ret;
+
+	snprintf(host, sizeof(host), "%s", peer);
+	if(host[0] == '['){
+		char *end = strchr(host, ']');
+		if(end == NULL){
+			fprintf(stderr, "peer: bad address %s\n", peer);
+			return -1;
+		}
+		*end = '\0';
+		if(end[1] == ':')
+			port = peer + (end - host) + 2;
+		memmove(host, host + 1, strlen(host));
+	}else{
+		char *colon = strchr(host, ':');
+		if((colon != NULL) && (strchr(colon + 1, ':') == NULL)){	// A bare IPv6 literal has more than one
+			*colon = '\0';
+			port = peer + (colon - host) + 1;
+		}
+	}
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	if((ret = getaddrinfo(host, port, &hints, &res)) != 0){
+		fprintf(stderr, "getaddrinfo: %s: %s\n", host, gai_strerror(ret));
+		return -1;
+	}
+	for(ai = res; ai != NULL; ai = ai->ai_next){
+		if((sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if(connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sd);
+		sd = -1;
+	}
+	if(sd < 0)
+		perror("connect");
+	freeaddrinfo(res);
+	return sd;
+}
+
+static void peer_busy_poll(const int sd, const int busy_poll){
+	if(busy_poll > 0 && setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0)
+		perror("setsockopt SO_BUSY_POLL");
+}
+
+// Read or write exactly len bytes, 0 on success
+static int peer_full(const int sd, void *buf, const size_t len, const int write){
+	size_t done = 0;
+	while(done < len){
+		const ssize_t n = write ? send(sd, (char*)buf + done, len - done, MSG_NOSIGNAL) : recv(sd, (char*)buf + done, len - done, 0);
+		if(n <= 0){
+			if(n < 0 && errno == EINTR)
+				continue;
+			return 1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* Responder */
+
+struct peer_conn{
+	int sd;
+	int busy_poll;
+};
+
+static void *peer_tcp_thread(void *arg){
+	struct peer_conn c = *(struct peer_conn*) arg;
+	char buf[64*1024];
+	char mode;
+	const int one = 1;
+
+	free(arg);
+	if(recv(c.sd, &mode, 1, 0) == 1){
+		if(mode == PEER_MODE_ECHO){
+			struct peer_msg msg;
+			setsockopt(c.sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			peer_busy_poll(c.sd, c.busy_poll);
+			while(peer_full(c.sd, &msg, sizeof(msg), 0) == 0 && peer_full(c.sd, &msg, sizeof(msg), 1) == 0)
+				;
+		}else{
+			while(recv(c.sd, buf, sizeof(buf), 0) > 0)
+				;
+		}
+	}
+	close(c.sd);
+	return NULL;
+}
+
+static void *peer_udp_thread(void *arg){
+	const int sd = *(int*) arg;
+	struct sockaddr_storage from;
+	char buf[PEER_MSG_SIZE];
+
+	while(1){
+		socklen_t len = sizeof(from);
+		const ssize_t n = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &len);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			perror("recvfrom");
+			break;
+		}
+		if(sendto(sd, buf, n, 0, (struct sockaddr*)&from, len) < 0)
+			perror("sendto");
+	}
+	return NULL;
+}
+
+// Bind a dual stack socket to port, IPv4 only where IPv6 is disabled
+int peer_listen(const int type, const char *port){
+	struct addrinfo hints, *res, *ai;
+	const int one = 1, zero = 0;
+	int sd = -1, ret, pass;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_PASSIVE;
+	if((ret = getaddrinfo(NULL, port, &hints, &res)) != 0){
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return -1;
+	}
+	// The IPv6 wildcard goes first, with IPV6_V6ONLY off it accepts IPv4 as well
+	for(pass=0; pass < 2 && sd < 0; ++pass){
+		for(ai = res; ai != NULL; ai = ai->ai_next){
+			if((ai->ai_family == AF_INET6) != (pass == 0))
+				continue;
+			if((sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if(ai->ai_family == AF_INET6)
+				setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+			if(bind(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(sd);
+			sd = -1;
+		}
+	}
+	if(sd < 0)
+		perror("bind");
+	freeaddrinfo(res);
+	return sd;
+}
+
+/*
+ * Run the responder on port until killed: UDP datagrams are echoed back, TCP
+ * connections are echoed or sunk depending on their first byte.
+ */
+int peer_serve(const char *port, const int busy_poll){
+	pthread_attr_t attr;
+	pthread_t tid;
+	int usd, tsd;
+
+	signal(SIGPIPE, SIG_IGN);
+	if((usd = peer_listen(SOCK_DGRAM, port)) < 0)
+		return 1;
+	if((tsd = peer_listen(SOCK_STREAM, port)) < 0){
+		close(usd);
+		return 1;
+	}
+	if(listen(tsd, 64) != 0){
+		perror("listen");
+		close(tsd);
+		close(usd);
+		return 1;
+	}
+	peer_busy_poll(usd, busy_poll);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&tid, &attr, peer_udp_thread, &usd) != 0){
+		perror("pthread_create");
+		close(tsd);
+		close(usd);
+		return 1;
+	}
+	fprintf(stderr, "vm_perf responder on port %s\n", port);
+
+	while(1){
+		struct peer_conn *c;
+		const int sd = accept(tsd, NULL, NULL);
+		if(sd < 0){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		if((c = malloc(sizeof(struct peer_conn))) == NULL){
+			perror("malloc");
+			close(sd);
+			continue;
+		}
+		c->sd = sd;
+		c->busy_poll = busy_poll;
+		if(pthread_create(&tid, &attr, peer_tcp_thread, c) != 0){
+			perror("pthread_create");
+			close(sd);
+			free(c);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(tsd);
+	close(usd);
+	return 1;
+}
+
+/* Client */
+
+// One UDP round trip, late responses to earlier requests are skipped, 1 if the request was lost
+static int peer_udp_round(const int sd, struct peer_msg *msg, const uint32_t seq){
+	struct peer_msg reply;
+
+	msg->seq = seq;
+	if(send(sd, msg, sizeof(*msg), 0) != sizeof(*msg))
+		return 1;
+	while(1){
+		const ssize_t n = recv(sd, &reply, sizeof(reply), 0);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return 1;		// SO_RCVTIMEO expired
+		}
+		if(n == sizeof(reply) && reply.seq == seq)
+			return 0;
+	}
+}
+
+/*
+ * Request-response ping-pong with the responder on peer for PEER_TIME
+ * seconds, one PEER_MSG_SIZE message in flight at a time. With busy_poll > 0
+ * the socket spins on the device queue for that many microseconds before it
+ * sleeps, which takes the wakeup out of the round trip time.
+ */
+int peer_pingpong(const char *peer, const enum peer_protocol protocol, const int busy_poll, struct peer_rtt *r){
+	struct peer_msg msg;
+	const int one = 1;
+	uint32_t seq;
+	int sd;
+
+	bzero(r, sizeof(struct peer_rtt));
+	hist_init(&r->hist);
+	bzero(&msg, sizeof(msg));
+
+	if((sd = peer_connect(peer, PEER_DEFAULT_PORT, protocol == PEER_TCP ? SOCK_STREAM : SOCK_DGRAM)) < 0)
+		return 1;
+	peer_busy_poll(sd, busy_poll);
+
+	if(protocol == PEER_TCP){
+		const char mode = PEER_MODE_ECHO;
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(peer_full(sd, (void*)&mode, 1, 1) != 0){
+			perror("send");
+			close(sd);
+			return 1;
+		}
+	}else{
+		const struct timeval tv = {0, PEER_UDP_TIMEOUT_MS * 1000};
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	const uint64_t deadline = timer_now_ns() + (uint64_t)(timer_scaled(PEER_TIME) * 1e9);
+	for(seq=0; seq < PEER_WARMUP + PEER_MAX_PINGS; ++seq){
+		const uint64_t t0 = timer_now_ns();
+		int lost;
+
+		if(t0 >= deadline)
+			break;
+		if(protocol == PEER_TCP){
+			msg.seq = seq;
+			if(peer_full(sd, &msg, sizeof(msg), 1) != 0 || peer_full(sd, &msg, sizeof(msg), 0) != 0){
+				perror("peer");
+				break;
+			}
+			lost = 0;
+		}else{
+			lost = peer_udp_round(sd, &msg, seq);
+		}
+		const uint64_t t1 = timer_now_ns();
+
+		if(seq < PEER_WARMUP)
+			continue;
+		r->sent++;
+		if(lost)
+			r->lost++;
+		else
+			hist_add(&r->hist, t1 - t0);
+	}
+
+	close(sd);
+	return r->hist.count == 0;
+}
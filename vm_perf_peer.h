@@ -0,0 +1,40 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_PEER_H
+#define VM_PERF_PEER_H
+
+#include "vm_perf_hist.h"
+
+#define PEER_DEFAULT_PORT "5201"		// TCP and UDP
+#define PEER_MSG_SIZE 64				// Request and response size of the ping-pong
+#define PEER_TIME 2						// Seconds of ping-pong per protocol
+#define PEER_MAX_PINGS 100000
+#define PEER_WARMUP 100					// Round trips not recorded, they fill caches and ARP/flow tables
+#define PEER_UDP_TIMEOUT_MS 100			// A UDP request without a response by then is lost
+
+// First byte a TCP client sends to the responder
+#define PEER_MODE_SINK 'S'				// Read and discard until the client closes, the throughput test
+#define PEER_MODE_ECHO 'E'				// Echo PEER_MSG_SIZE messages back, the ping-pong
+
+enum peer_protocol{
+	PEER_UDP = 0,
+	PEER_TCP,
+	PEER_NUM_PROTOCOLS
+};
+
+struct peer_rtt{
+	unsigned long sent;
+	unsigned long lost;			// UDP requests without a response
+	struct lat_hist hist;		// Round trip times in ns
+};
+
+int peer_connect(const char *peer, const char *default_port, const int type);
+int peer_listen(const int type, const char *port);
+int peer_serve(const char *port, const int busy_poll);
+int peer_pingpong(const char *peer, const enum peer_protocol protocol, const int busy_poll, struct peer_rtt *r);
+const char * peer_protocol_name(const enum peer_protocol protocol);
+
+#endif
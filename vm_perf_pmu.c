@@ -0,0 +1,223 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Hardware performance counters around a test. One perf_event group per
+ * online vCPU counts everything the vCPU runs, which is the test while it
+ * saturates the guest, and also covers the OpenMP and STREAM worker threads
+ * that were created before the test started. Without the permission for
+ * that the group follows vm_perf itself and the threads it starts later,
+ * as it does when the open file limit cannot fit a group for every vCPU.
+ * Virtual PMUs often lack some events or all of them, every counter that
+ * did not open or never ran is reported as unavailable.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vm_perf_pmu.h"
+#include "vm_perf_sys.h"
+
+static const char * pmu_counter_names[PMU_NUM_COUNTERS] = {
+	"cycles", "instructions", "llc_misses", "dtlb_misses", "stalled_cycles_frontend", "stalled_cycles_backend"
+};
+
+static const char * pmu_scope_names[] = {"none", "system", "process"};
+
+static const struct{
+	uint32_t type;
+	uint64_t config;
+} pmu_events[PMU_NUM_COUNTERS] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND}
+};
+
+static int pmu_open(const int counter, const pid_t pid, const int cpu, const int group){
+	struct perf_event_attr attr;
+
+	bzero(&attr, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = pmu_events[counter].type;
+	attr.config = pmu_events[counter].config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.disabled = (group == -1);		// The leader starts the group
+	attr.inherit = (pid == 0);
+	return syscall(SYS_perf_event_open, &attr, pid, cpu, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Open a group for pid on cpu, the first counter that opens leads it
+static int pmu_open_group(struct pmu_session *s, const int i, const pid_t pid, const int cpu){
+	int c;
+
+	s->leader[i] = -1;
+	for(c=0; c < PMU_NUM_COUNTERS; ++c)
+		s->fd[i][c] = -1;
+	for(c=0; c < PMU_NUM_COUNTERS; ++c){
+		s->fd[i][c] = pmu_open(c, pid, cpu, s->leader[i]);
+		if(s->fd[i][c] >= 0 && s->leader[i] == -1)
+			s->leader[i] = s->fd[i][c];
+		else if(s->fd[i][c] < 0 && (errno == EACCES || errno == EPERM) && s->leader[i] == -1 && c == 0)
+			return -1;
+		else if(s->fd[i][c] < 0 && (errno == EMFILE || errno == ENFILE))
+			return -1;
+	}
+	return s->leader[i];
+}
+
+// One group per vCPU needs PMU_NUM_COUNTERS descriptors each, raise the soft limit towards that once
+static void pmu_rlimit(const int cpus){
+	static int raised = 0;
+	struct rlimit rl;
+	rlim_t need;
+
+	if(raised++ || getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return;
+	need = rl.rlim_cur + (rlim_t)cpus * PMU_NUM_COUNTERS;
+	if(rl.rlim_max != RLIM_INFINITY && need > rl.rlim_max)
+		need = rl.rlim_max;
+	if(need > rl.rlim_cur){
+		rl.rlim_cur = need;
+		if(setrlimit(RLIMIT_NOFILE, &rl) != 0)
+			perror("setrlimit");
+	}
+}
+
+void pmu_start(struct pmu_session *s){
+	static int cpus[CPU_SETSIZE];
+	int i;
+
+	bzero(s, sizeof(struct pmu_session));
+	s->num_cpus = sys_online_cpus(cpus, CPU_SETSIZE);
+	s->fd = malloc(s->num_cpus * sizeof(*s->fd));
+	s->leader = malloc(s->num_cpus * sizeof(int));
+	if(s->fd == NULL || s->leader == NULL){
+		perror("malloc");
+		free(s->fd);
+		free(s->leader);
+		bzero(s, sizeof(struct pmu_session));
+		return;
+	}
+	pmu_rlimit(s->num_cpus);
+	s->scope = PMU_SYSTEM;
+	for(i=0; i < s->num_cpus; ++i){
+		if(pmu_open_group(s, i, -1, cpus[i]) < 0 && (errno == EACCES || errno == EPERM || errno == EMFILE || errno == ENFILE)){
+			// Not allowed system wide or out of descriptors, close what opened and follow this process instead
+			int j, c;
+			for(j=0; j <= i; ++j)
+				for(c=0; c < PMU_NUM_COUNTERS; ++c)
+					if(s->fd[j][c] >= 0)
+						close(s->fd[j][c]);
+			s->scope = PMU_PROCESS;
+			s->num_cpus = 1;
+			pmu_open_group(s, 0, 0, -1);
+			break;
+		}
+	}
+
+	int opened = 0;
+	for(i=0; i < s->num_cpus; ++i){
+		if(s->leader[i] < 0)
+			continue;
+		ioctl(s->leader[i], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(s->leader[i], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		opened++;
+	}
+	if(opened == 0)
+		s->scope = PMU_NONE;
+}
+
+void pmu_stop(struct pmu_session *s, struct pmu_counts *c){
+	uint64_t enabled = 0, running = 0;
+	int i, k;
+
+	bzero(c, sizeof(struct pmu_counts));
+	for(i=0; i < s->num_cpus; ++i)
+		if(s->leader[i] >= 0)
+			ioctl(s->leader[i], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	c->scope = s->scope;
+	for(i=0; i < s->num_cpus; ++i){
+		for(k=0; k < PMU_NUM_COUNTERS; ++k){
+			uint64_t v[3];		// value, time enabled, time running
+			if(s->fd[i][k] < 0)
+				continue;
+			if(read(s->fd[i][k], v, sizeof(v)) == sizeof(v) && v[2] > 0){
+				c->available[k] = 1;
+				c->value[k] += (uint64_t)((double)v[0] * v[1] / v[2]);
+				if(s->fd[i][k] == s->leader[i]){
+					enabled += v[1];
+					running += v[2];
+				}
+			}
+			close(s->fd[i][k]);
+			s->fd[i][k] = -1;
+		}
+		if(s->scope == PMU_SYSTEM && s->leader[i] >= 0)
+			c->cpus++;
+	}
+	free(s->fd);
+	free(s->leader);
+	s->fd = NULL;
+	s->leader = NULL;
+	s->num_cpus = 0;
+	c->running = enabled ? (float)running / enabled : 0.0f;
+
+	const double cycles = c->value[PMU_CYCLES], instructions = c->value[PMU_INSTRUCTIONS];
+	if(c->available[PMU_CYCLES] && c->available[PMU_INSTRUCTIONS] && cycles > 0.0)
+		c->ipc = instructions / cycles;
+	if(c->available[PMU_INSTRUCTIONS] && instructions > 0.0){
+		if(c->available[PMU_LLC_MISSES])
+			c->llc_mpki = c->value[PMU_LLC_MISSES] * 1000.0 / instructions;
+		if(c->available[PMU_DTLB_MISSES])
+			c->dtlb_mpki = c->value[PMU_DTLB_MISSES] * 1000.0 / instructions;
+	}
+	if(c->available[PMU_CYCLES] && cycles > 0.0){
+		if(c->available[PMU_STALLED_FRONTEND])
+			c->frontend_stall = c->value[PMU_STALLED_FRONTEND] * 100.0 / cycles;
+		if(c->available[PMU_STALLED_BACKEND])
+			c->backend_stall = c->value[PMU_STALLED_BACKEND] * 100.0 / cycles;
+	}
+}
+
+void pmu_report(const char *name, const struct pmu_counts *c){
+	int k, n = 0;
+
+	printf("\"%s\":{\"scope\":\"%s\"", name, pmu_scope_names[c->scope]);
+	if(c->scope == PMU_SYSTEM)
+		printf(",\"cpus\":\"%i\"", c->cpus);
+	printf(",\"available\":[");
+	for(k=0; k < PMU_NUM_COUNTERS; ++k)
+		if(c->available[k])
+			printf("%s\"%s\"", n++ ? "," : "", pmu_counter_names[k]);
+	printf("]");
+	for(k=0; k < PMU_NUM_COUNTERS; ++k)
+		if(c->available[k])
+			printf(",\"%s\":\"%lu\"", pmu_counter_names[k], (unsigned long)c->value[k]);
+	if(n > 0)
+		printf(",\"running\":\"%.0f%%\"", c->running * 100.0f);
+	if(c->available[PMU_CYCLES] && c->available[PMU_INSTRUCTIONS])
+		printf(",\"ipc\":\"%.3f\"", c->ipc);
+	if(c->available[PMU_INSTRUCTIONS] && c->available[PMU_LLC_MISSES])
+		printf(",\"llc_mpki\":\"%.3f\"", c->llc_mpki);
+	if(c->available[PMU_INSTRUCTIONS] && c->available[PMU_DTLB_MISSES])
+		printf(",\"dtlb_mpki\":\"%.3f\"", c->dtlb_mpki);
+	if(c->available[PMU_CYCLES] && c->available[PMU_STALLED_FRONTEND])
+		printf(",\"frontend_stall\":\"%.1f%%\"", c->frontend_stall);
+	if(c->available[PMU_CYCLES] && c->available[PMU_STALLED_BACKEND])
+		printf(",\"backend_stall\":\"%.1f%%\"", c->backend_stall);
+	printf("}");
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_PMU_H
+#define VM_PERF_PMU_H
+
+#include <stdint.h>
+#include <sched.h>
+
+enum pmu_counter{
+	PMU_CYCLES = 0,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_DTLB_MISSES,			// Loads only
+	PMU_STALLED_FRONTEND,
+	PMU_STALLED_BACKEND,
+	PMU_NUM_COUNTERS
+};
+
+enum pmu_scope{
+	PMU_NONE = 0,				// perf_event_open() is not available at all
+	PMU_SYSTEM,					// Every online vCPU, catches worker pools created before the phase
+	PMU_PROCESS					// vm_perf and threads it creates during the phase
+};
+
+// Hardware counters over one test
+struct pmu_counts{
+	enum pmu_scope scope;
+	int cpus;					// vCPUs with a group in PMU_SYSTEM
+	int available[PMU_NUM_COUNTERS];	// Opened and scheduled at least once
+	uint64_t value[PMU_NUM_COUNTERS];	// Scaled up when the counters were multiplexed
+	float running;				// Fraction of the time the group was on the PMU
+	float ipc;					// Instructions per cycle, 0 without both counters
+	float llc_mpki;				// Misses per 1000 instructions
+	float dtlb_mpki;
+	float frontend_stall;		// % of cycles
+	float backend_stall;
+};
+
+// Sized for the online vCPUs by pmu_start(), pmu_stop() frees it
+struct pmu_session{
+	enum pmu_scope scope;
+	int num_cpus;
+	int (*fd)[PMU_NUM_COUNTERS];	// -1 where the counter did not open, [0] only in PMU_PROCESS
+	int *leader;
+};
+
+void pmu_start(struct pmu_session *s);
+void pmu_stop(struct pmu_session *s, struct pmu_counts *c);
+void pmu_report(const char *name, const struct pmu_counts *c);
+
+#endif
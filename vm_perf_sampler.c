@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Background sampler of hypervisor steal and host pressure. A thread reads
+ * /proc/stat and /proc/pressure every SAMPLER_INTERVAL_MS while a module runs,
+ * the window totals come from the first and last sample.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "vm_perf_sampler.h"
+#include "vm_perf_timer.h"
+
+enum{ STAT_USER = 0, STAT_NICE, STAT_SYSTEM, STAT_IDLE, STAT_IOWAIT, STAT_IRQ, STAT_SOFTIRQ, STAT_STEAL, STAT_NUM };
+
+struct sampler_snapshot{
+	unsigned long long stat[STAT_NUM];	// Jiffies from the aggregate cpu line
+	unsigned long long psi[SAMPLER_NUM_PSI];	// "some" total in us
+	int has_psi;
+	uint64_t ns;
+};
+
+static const char * sampler_psi_path[SAMPLER_NUM_PSI] = {
+	"/proc/pressure/cpu",
+	"/proc/pressure/memory",
+	"/proc/pressure/io"
+};
+
+static const char * sampler_psi_labels[SAMPLER_NUM_PSI] = {"cpu", "memory", "io"};
+
+static struct{
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+
+	struct sampler_snapshot first, last;
+	unsigned int samples;
+	float steal_max;
+	struct rusage ru;
+} sampler = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void sampler_read(struct sampler_snapshot *s){
+	FILE *f;
+	int i;
+
+	bzero(s, sizeof(struct sampler_snapshot));
+	s->ns = timer_now_ns();
+
+	if((f = fopen("/proc/stat", "r")) != NULL){
+		if(fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+				&s->stat[0], &s->stat[1], &s->stat[2], &s->stat[3],
+				&s->stat[4], &s->stat[5], &s->stat[6], &s->stat[7]) < STAT_NUM)
+			bzero(s->stat, sizeof(s->stat));
+		fclose(f);
+	}
+
+	s->has_psi = 1;
+	for(i=0; i < SAMPLER_NUM_PSI; ++i){
+		if((f = fopen(sampler_psi_path[i], "r")) == NULL ||
+		   fscanf(f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &s->psi[i]) != 1)
+			s->has_psi = 0;
+		if(f != NULL)
+			fclose(f);
+	}
+}
+
+static unsigned long long stat_total(const struct sampler_snapshot *s){
+	unsigned long long t = 0;
+	int i;
+	for(i=0; i < STAT_NUM; ++i)
+		t += s->stat[i];
+	return t;
+}
+
+static float stat_pct(const struct sampler_snapshot *a, const struct sampler_snapshot *b, const int field){
+	const unsigned long long total = stat_total(b) - stat_total(a);
+	return total ? 100.0f * (b->stat[field] - a->stat[field]) / total : 0.0f;
+}
+
+static void *sampler_thread(void *arg){
+	struct sampler_snapshot prev = sampler.first, cur;
+	struct timespec deadline;
+
+	(void) arg;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	pthread_mutex_lock(&sampler.mutex);
+	while(!sampler.stop){
+		deadline.tv_nsec += SAMPLER_INTERVAL_MS * 1000000L;
+		while(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec++;
+		}
+		if(pthread_cond_timedwait(&sampler.cond, &sampler.mutex, &deadline) != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&sampler.mutex);
+		sampler_read(&cur);
+		const float steal = stat_pct(&prev, &cur, STAT_STEAL);
+		prev = cur;
+		pthread_mutex_lock(&sampler.mutex);
+
+		if(steal > sampler.steal_max)
+			sampler.steal_max = steal;
+		sampler.samples++;
+	}
+	pthread_mutex_unlock(&sampler.mutex);
+
+	return NULL;
+}
+
+int sampler_start(void){
+	pthread_condattr_t attr;
+
+	if(sampler.running)
+		return 1;
+
+	sampler.stop = 0;
+	sampler.samples = 0;
+	sampler.steal_max = 0.0f;
+	getrusage(RUSAGE_SELF, &sampler.ru);
+	sampler_read(&sampler.first);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(pthread_create(&sampler.tid, NULL, sampler_thread, NULL) != 0){
+		perror("pthread_create");
+		pthread_cond_destroy(&sampler.cond);
+		return 1;
+	}
+	sampler.running = 1;
+	return 0;
+}
+
+void sampler_stop(struct sampler_window *w){
+	struct rusage ru;
+	int i;
+
+	bzero(w, sizeof(struct sampler_window));
+	if(!sampler.running)
+		return;
+
+	pthread_mutex_lock(&sampler.mutex);
+	sampler.stop = 1;
+	pthread_cond_signal(&sampler.cond);
+	pthread_mutex_unlock(&sampler.mutex);
+	pthread_join(sampler.tid, NULL);
+	pthread_cond_destroy(&sampler.cond);
+	sampler.running = 0;
+
+	sampler_read(&sampler.last);
+	getrusage(RUSAGE_SELF, &ru);
+
+	const struct sampler_snapshot *a = &sampler.first, *b = &sampler.last;
+	w->duration	 = (b->ns - a->ns) / 1e9;
+	w->samples	 = sampler.samples;
+	w->steal	 = stat_pct(a, b, STAT_STEAL);
+	w->steal_max = sampler.steal_max > w->steal ? sampler.steal_max : w->steal;
+	w->iowait	 = stat_pct(a, b, STAT_IOWAIT);
+	w->irq		 = stat_pct(a, b, STAT_IRQ) + stat_pct(a, b, STAT_SOFTIRQ);
+	w->nivcsw	 = ru.ru_nivcsw - sampler.ru.ru_nivcsw;
+
+	w->has_pressure = a->has_psi && b->has_psi;
+	if(w->has_pressure && b->ns > a->ns){
+		for(i=0; i < SAMPLER_NUM_PSI; ++i)
+			w->pressure[i] = 100.0f * (b->psi[i] - a->psi[i]) * 1000.0f / (b->ns - a->ns);
+	}
+
+	w->contended = (w->steal > SAMPLER_STEAL_LIMIT) || (w->steal_max > SAMPLER_STEAL_PEAK_LIMIT);
+	w->attempts = 1;
+}
+
+void sampler_report(const char *name, const struct sampler_window *w){
+	int i;
+
+	printf("\"%s\":{\"duration\":\"%.2fs\",\"samples\":\"%u\",\"steal\":\"%.2f%%\",\"steal_max\":\"%.2f%%\","
+		   "\"iowait\":\"%.2f%%\",\"irq\":\"%.2f%%\",\"nivcsw\":\"%li\"",
+		   name, w->duration, w->samples, w->steal, w->steal_max, w->iowait, w->irq, w->nivcsw);
+	if(w->has_pressure){
+		printf(",\"pressure\":{");
+		for(i=0; i < SAMPLER_NUM_PSI; ++i)
+			printf("%s\"%s\":\"%.2f%%\"", i ? "," : "", sampler_psi_labels[i], w->pressure[i]);
+		printf("}");
+	}
+	printf(",\"contended\":\"%s\",\"attempts\":\"%i\"}", w->contended ? "yes" : "no", w->attempts);
+}
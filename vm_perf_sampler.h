@@ -0,0 +1,39 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_SAMPLER_H
+#define VM_PERF_SAMPLER_H
+
+#define SAMPLER_INTERVAL_MS 100
+#define SAMPLER_STEAL_LIMIT 5.0f		// Mean steal % above which a window counts as contended
+#define SAMPLER_STEAL_PEAK_LIMIT 25.0f	// Same for the worst single interval
+
+enum sampler_pressure{
+	SAMPLER_PSI_CPU = 0,
+	SAMPLER_PSI_MEMORY,
+	SAMPLER_PSI_IO,
+	SAMPLER_NUM_PSI
+};
+
+// Interference seen while one module was measuring
+struct sampler_window{
+	float duration;						// Seconds
+	unsigned int samples;				// Intervals seen by the sampler thread
+	float steal;						// % of CPU time over the window
+	float steal_max;					// Worst single interval
+	float iowait;
+	float irq;							// Hard and soft interrupts
+	int has_pressure;					// /proc/pressure is available
+	float pressure[SAMPLER_NUM_PSI];	// % of the window some task was stalled
+	long nivcsw;						// Involuntary context switches of vm_perf
+	int contended;
+	int attempts;						// Runs of the module, more than one when retried
+};
+
+int sampler_start(void);
+void sampler_stop(struct sampler_window *w);
+void sampler_report(const char *name, const struct sampler_window *w);
+
+#endif
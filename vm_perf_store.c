@@ -0,0 +1,307 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Results store and the comparison of two runs. The store keeps the raw
+ * trial samples of every metric in a small binary file, written in the byte
+ * order of the machine that ran the test:
+ *
+ *   "VMPS" u32 version, char instance[256], char kernel[65], f64 time, u32 metrics
+ *   then per metric char name[64], char unit[16], u8 better, u32 n, f64 samples[n]
+ *
+ * Two stores are compared metric by metric with a two sided Mann-Whitney U
+ * test on the samples, exact for small tie free samples and normal otherwise.
+ */
+
+#include <sys/utsname.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#include "vm_perf_store.h"
+#include "vm_perf_page.h"
+
+#define STORE_EXACT_MAX 20			// Largest sample of the exact U distribution
+
+static const char * store_verdict_labels[] = {"same", "improved", "regressed", "not judged"};
+
+void store_init(struct store *s, const struct sys_result *sys){
+	struct utsname u;
+	struct timeval now;
+	char product[128] = "unknown";
+	FILE *f;
+
+	bzero(s, sizeof(struct store));
+	if((f = fopen("/sys/class/dmi/id/product_name", "r")) != NULL){
+		if(fgets(product, sizeof(product), f) != NULL)
+			product[strcspn(product, "\n")] = 0;
+		fclose(f);
+	}
+	// Runs under another page policy are not comparable, the default keeps the plain key of older stores
+	snprintf(s->instance, sizeof(s->instance), "%s, %s, %u vCPUs%s%s", product, sys->cpu_model, sys->cpu_count,
+		page_get_policy() == PAGE_DEFAULT ? "" : ", pages ", page_get_policy() == PAGE_DEFAULT ? "" : page_policy_name(page_get_policy()));
+	if(uname(&u) == 0)
+		snprintf(s->kernel, sizeof(s->kernel), "%s", u.release);
+	gettimeofday(&now, NULL);
+	s->time = now.tv_sec + now.tv_usec / 1e6;
+}
+
+void store_add(struct store *s, const char *name, const char *unit, const enum store_better better, const double *samples, const int n){
+	struct store_metric *m;
+
+	if(n <= 0)
+		return;
+	if(s->num_metrics == STORE_MAX_METRICS){
+		if(s->dropped++ == 0)
+			fprintf(stderr, "store: more than %i metrics, %s and any after it are not kept or compared\n", STORE_MAX_METRICS, name);
+		return;
+	}
+	m = &s->metric[s->num_metrics++];
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	snprintf(m->unit, sizeof(m->unit), "%s", unit);
+	m->better = better;
+	m->n = n > TIMER_MAX_TRIALS ? TIMER_MAX_TRIALS : n;
+	memcpy(m->samples, samples, m->n * sizeof(double));
+}
+
+void store_add_value(struct store *s, const char *name, const char *unit, const enum store_better better, const double value){
+	store_add(s, name, unit, better, &value, 1);
+}
+
+void store_add_stats(struct store *s, const char *name, const char *unit, const enum store_better better, const struct timer_stats *stats){
+	store_add(s, name, unit, better, stats->samples, stats->trials);
+}
+
+int store_write(const struct store *s, const char *filename){
+	const uint32_t version = STORE_VERSION, num = s->num_metrics;
+	FILE *f;
+	int i, ok;
+
+	if((f = fopen(filename, "wb")) == NULL){
+		perror(filename);
+		return 1;
+	}
+	ok = fwrite(STORE_MAGIC, 4, 1, f) && fwrite(&version, sizeof(version), 1, f) &&
+		 fwrite(s->instance, sizeof(s->instance), 1, f) && fwrite(s->kernel, sizeof(s->kernel), 1, f) &&
+		 fwrite(&s->time, sizeof(s->time), 1, f) && fwrite(&num, sizeof(num), 1, f);
+	for(i=0; ok && i < s->num_metrics; ++i){
+		const struct store_metric *m = &s->metric[i];
+		const uint8_t better = m->better;
+		const uint32_t n = m->n;
+		ok = fwrite(m->name, sizeof(m->name), 1, f) && fwrite(m->unit, sizeof(m->unit), 1, f) &&
+			 fwrite(&better, sizeof(better), 1, f) && fwrite(&n, sizeof(n), 1, f) &&
+			 fwrite(m->samples, sizeof(double), n, f) == n;
+	}
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok){
+		perror(filename);
+		return 1;
+	}
+	if(s->dropped)
+		fprintf(stderr, "%s: %i metrics of the run did not fit and are missing\n", filename, s->dropped);
+	return 0;
+}
+
+int store_read(struct store *s, const char *filename){
+	char magic[4];
+	uint32_t version, num;
+	FILE *f;
+	int i, ok;
+
+	bzero(s, sizeof(struct store));
+	if((f = fopen(filename, "rb")) == NULL){
+		perror(filename);
+		return 1;
+	}
+	ok = fread(magic, 4, 1, f) && !memcmp(magic, STORE_MAGIC, 4) &&
+		 fread(&version, sizeof(version), 1, f) && version == STORE_VERSION &&
+		 fread(s->instance, sizeof(s->instance), 1, f) && fread(s->kernel, sizeof(s->kernel), 1, f) &&
+		 fread(&s->time, sizeof(s->time), 1, f) && fread(&num, sizeof(num), 1, f) && num <= STORE_MAX_METRICS;
+	for(i=0; ok && i < (int)num; ++i){
+		struct store_metric *m = &s->metric[i];
+		uint8_t better;
+		uint32_t n;
+		ok = fread(m->name, sizeof(m->name), 1, f) && fread(m->unit, sizeof(m->unit), 1, f) &&
+			 fread(&better, sizeof(better), 1, f) && fread(&n, sizeof(n), 1, f) && n <= TIMER_MAX_TRIALS &&
+			 fread(m->samples, sizeof(double), n, f) == n;
+		m->name[sizeof(m->name) - 1] = m->unit[sizeof(m->unit) - 1] = 0;
+		m->better = better ? STORE_LOWER : STORE_HIGHER;
+		m->n = n;
+	}
+	fclose(f);
+	if(!ok){
+		fprintf(stderr, "%s: not a vm_perf %i results store\n", filename, STORE_VERSION);
+		return 1;
+	}
+	s->instance[sizeof(s->instance) - 1] = s->kernel[sizeof(s->kernel) - 1] = 0;
+	s->num_metrics = num;
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b){
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+double store_median(const struct store_metric *m){
+	double sorted[TIMER_MAX_TRIALS];
+
+	memcpy(sorted, m->samples, m->n * sizeof(double));
+	qsort(sorted, m->n, sizeof(double), cmp_double);
+	return (m->n % 2) ? sorted[m->n / 2] : (sorted[m->n / 2 - 1] + sorted[m->n / 2]) / 2.0;
+}
+
+/*
+ * P(U <= u) for samples of m and n without ties. The number of orderings with
+ * a given U is the coefficient of the Gaussian binomial [m+n choose m] in q,
+ * built as the product of (1 - q^(n+k)) / (1 - q^k) for k = 1..m.
+ */
+static double mw_exact_cdf(const int m, const int n, const int u){
+	double c[STORE_EXACT_MAX * STORE_EXACT_MAX + 1];
+	double total = 0.0, below = 0.0;
+	const int len = m * n + 1;
+	int k, i;
+
+	bzero(c, sizeof(c));
+	c[0] = 1.0;
+	for(k=1; k <= m; ++k){
+		for(i=len-1; i >= n+k; --i)
+			c[i] -= c[i - n - k];
+		for(i=k; i < len; ++i)
+			c[i] += c[i - k];
+	}
+	for(i=0; i < len; ++i){
+		total += c[i];
+		if(i <= u)
+			below += c[i];
+	}
+	return below / total;
+}
+
+// Two sided p value of the Mann-Whitney U test of a against b
+static double mann_whitney(const double *a, const int m, const double *b, const int n){
+	double all[2 * TIMER_MAX_TRIALS];
+	double u = 0.0, ties = 0.0;
+	int i, j;
+
+	for(i=0; i < m; ++i)
+		for(j=0; j < n; ++j)
+			u += (a[i] > b[j]) ? 1.0 : (a[i] == b[j]) ? 0.5 : 0.0;
+
+	memcpy(all, a, m * sizeof(double));
+	memcpy(all + m, b, n * sizeof(double));
+	qsort(all, m + n, sizeof(double), cmp_double);
+	for(i=0; i < m + n; i = j){
+		for(j=i+1; j < m + n && all[j] == all[i]; ++j)
+			;
+		ties += (double)(j - i) * (j - i) * (j - i) - (j - i);
+	}
+
+	if(ties == 0.0 && m <= STORE_EXACT_MAX && n <= STORE_EXACT_MAX){
+		const int lo = (int)u, hi = m * n - (int)u;		// U and its mirror under symmetry
+		const double p = 2.0 * mw_exact_cdf(m, n, lo < hi ? lo : hi);
+		return p > 1.0 ? 1.0 : p;
+	}
+
+	const double N = m + n;
+	const double mu = m * n / 2.0;
+	const double sigma = sqrt(m * n / 12.0 * ((N + 1.0) - ties / (N * (N - 1.0))));
+	if(sigma <= 0.0)
+		return 1.0;
+	const double z = (fabs(u - mu) - 0.5) / sigma;
+	return z <= 0.0 ? 1.0 : erfc(z / sqrt(2.0));
+}
+
+static const struct store_metric * store_find(const struct store *s, const char *name){
+	int i;
+	for(i=0; i < s->num_metrics; ++i)
+		if(strcmp(s->metric[i].name, name) == 0)
+			return &s->metric[i];
+	return NULL;
+}
+
+/*
+ * Compare every metric of the baseline with the same metric of the current
+ * run. Metrics of single runs rather than trials, the disk, network, memory
+ * latency and wakeup tests, are not judged and cannot fail a compare.
+ * Returns 1 when the two stores come from different instance types.
+ */
+int store_compare(const struct store *base, const struct store *cur, struct store_compare *c){
+	int i;
+
+	bzero(c, sizeof(struct store_compare));
+	if(strcmp(base->instance, cur->instance) != 0){
+		fprintf(stderr, "Baseline is from \"%s\", this run from \"%s\"\n", base->instance, cur->instance);
+		return 1;
+	}
+
+	for(i=0; i < base->num_metrics; ++i){
+		const struct store_metric *b = &base->metric[i];
+		const struct store_metric *m = store_find(cur, b->name);
+		struct store_delta *d;
+
+		if(m == NULL){
+			c->missing++;
+			continue;
+		}
+		d = &c->delta[c->num_deltas++];
+		d->base = b;
+		d->cur = m;
+		d->base_median = store_median(b);
+		d->cur_median = store_median(m);
+		d->change = d->base_median != 0.0 ? (d->cur_median - d->base_median) / fabs(d->base_median) * 100.0 : 0.0f;
+		if(b->better == STORE_LOWER)
+			d->change = -d->change;
+
+		if(b->n < 2 || m->n < 2){
+			d->p = -1.0;
+			d->verdict = STORE_UNJUDGED;
+			c->unjudged++;
+			continue;
+		}
+		d->p = mann_whitney(m->samples, m->n, b->samples, b->n);
+		if(d->p < STORE_ALPHA && fabsf(d->change) >= STORE_MIN_CHANGE){
+			d->verdict = d->change < 0.0f ? STORE_REGRESSED : STORE_IMPROVED;
+			if(d->verdict == STORE_REGRESSED)
+				c->regressions++;
+			else
+				c->improvements++;
+		}
+	}
+	return 0;
+}
+
+static void store_run_report(const char *name, const struct store *s){
+	printf("\"%s\":{\"instance\":\"%s\",\"kernel\":\"%s\",\"time\":\"%.0f\",\"metrics\":\"%i\",\"dropped\":\"%i\"}",
+		name, s->instance, s->kernel, s->time, s->num_metrics, s->dropped);
+}
+
+void store_report(const struct store *base, const struct store *cur, const struct store_compare *c){
+	int i;
+	char delim = ' ';
+
+	printf("\"compare\":{");
+	store_run_report("baseline", base);	putchar(',');
+	store_run_report("current", cur);	putchar(',');
+	printf("\"alpha\":\"%.2f\",\"min_change\":\"%.1f%%\",\"regressions\":\"%i\",\"improvements\":\"%i\",\"missing\":\"%i\",\"not_judged\":\"%i\",\"metrics\":[",
+		STORE_ALPHA, STORE_MIN_CHANGE, c->regressions, c->improvements, c->missing, c->unjudged);
+	for(i=0; i < c->num_deltas; ++i){
+		const struct store_delta *d = &c->delta[i];
+		printf("%c{\"name\":\"%s\",\"baseline\":\"%.3f%s\",\"current\":\"%.3f%s\",\"trials\":\"%i/%i\",\"change\":\"%+.2f%%\",",
+			delim, d->base->name, d->base_median, d->base->unit, d->cur_median, d->cur->unit, d->base->n, d->cur->n, d->change);
+		if(d->p >= 0.0)
+			printf("\"p\":\"%.4f\",", d->p);
+		else
+			printf("\"p\":\"n/a\",");
+		printf("\"verdict\":\"%s\"}", store_verdict_labels[d->verdict]);
+		delim = ',';
+	}
+	printf("]}");
+}
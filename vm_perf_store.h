@@ -0,0 +1,80 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_STORE_H
+#define VM_PERF_STORE_H
+
+#include "vm_perf_timer.h"
+#include "vm_perf_sys.h"
+
+#define STORE_MAGIC "VMPS"
+#define STORE_VERSION 1
+#define STORE_MAX_METRICS 1024		// All modules store about 550 at most, 11 of them per disk for up to 32 disks
+#define STORE_NAME_SIZE 64
+#define STORE_UNIT_SIZE 16
+#define STORE_ALPHA 0.05			// Significance level of the Mann-Whitney test
+#define STORE_MIN_CHANGE 2.0f		// % a significant change must move by to count as a regression
+#define STORE_EXIT_REGRESSION 3		// vm_perf exit status when the compare finds a regression
+
+enum store_better{
+	STORE_HIGHER = 0,			// Rates, loops/s, IOPS
+	STORE_LOWER					// Times and latencies
+};
+
+// One measured quantity, several samples when it came from repeated trials
+struct store_metric{
+	char name[STORE_NAME_SIZE];
+	char unit[STORE_UNIT_SIZE];
+	enum store_better better;
+	int n;
+	double samples[TIMER_MAX_TRIALS];
+};
+
+struct store{
+	char instance[256];			// DMI product, CPU model and vCPU count, baselines only compare within one
+	char kernel[65];
+	double time;				// Unix time of the run
+	int num_metrics;
+	int dropped;				// Metrics beyond STORE_MAX_METRICS, not kept
+	struct store_metric metric[STORE_MAX_METRICS];
+};
+
+enum store_verdict{
+	STORE_SAME = 0,				// No significant change
+	STORE_IMPROVED,
+	STORE_REGRESSED,
+	STORE_UNJUDGED				// A single sample on either side, no test can tell, never a regression
+};
+
+struct store_delta{
+	const struct store_metric *base, *cur;
+	double base_median, cur_median;
+	float change;				// % of the baseline median, positive is better
+	double p;					// Two sided Mann-Whitney p value, < 0 without enough samples
+	enum store_verdict verdict;
+};
+
+struct store_compare{
+	int num_deltas;
+	struct store_delta delta[STORE_MAX_METRICS];
+	int missing;				// Baseline metrics the current run does not have
+	int unjudged;
+	int regressions;
+	int improvements;
+};
+
+void store_init(struct store *s, const struct sys_result *sys);
+void store_add(struct store *s, const char *name, const char *unit, const enum store_better better, const double *samples, const int n);
+void store_add_value(struct store *s, const char *name, const char *unit, const enum store_better better, const double value);
+void store_add_stats(struct store *s, const char *name, const char *unit, const enum store_better better, const struct timer_stats *stats);
+double store_median(const struct store_metric *m);
+
+int store_write(const struct store *s, const char *filename);
+int store_read(struct store *s, const char *filename);
+
+int store_compare(const struct store *base, const struct store *cur, struct store_compare *c);
+void store_report(const struct store *base, const struct store *cur, const struct store_compare *c);
+
+#endif
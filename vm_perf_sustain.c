@@ -0,0 +1,347 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Sustained load. Every other test is a burst short enough for a burstable
+ * instance to serve from its CPU credits or disk burst bucket. Here C-RAY
+ * frames of fixed size run back to back over every usable CPU while a
+ * thread keeps a fixed queue depth of random writes in flight, for the whole
+ * window. Both throughputs, the CPU frequency and steal are recorded once a
+ * second, and the series of each load is fitted with two levels to find the
+ * step down where the credits ran out.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vm_perf_sustain.h"
+#include "vm_perf_aio.h"
+#include "vm_perf_sys.h"
+#include "vm_perf_timer.h"
+#include "dep/c-ray.h"
+
+static const char * sustain_load_names[SUSTAIN_NUM_LOADS] = {"cpu", "disk"};
+static const char * sustain_load_units[SUSTAIN_NUM_LOADS] = {"Mpx/s", "MB/s"};
+
+static volatile sig_atomic_t sustain_stop = 0;
+
+struct sustain_disk{
+	int fd;
+	uint64_t start;
+	int num_points;
+	struct sustain_result *r;
+	pthread_t tid;
+};
+
+static void sustain_signal(int sig){
+	sustain_stop = 1;
+}
+
+static long sustain_read_long(const char *path){
+	long v = 0;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL)
+		return 0;
+	if(fscanf(f, "%ld", &v) != 1)
+		v = 0;
+	fclose(f);
+	return v;
+}
+
+// Mean current frequency of the CPUs in MHz, 0 without cpufreq
+static float sustain_freq(const int *cpus, const int num_cpus){
+	char path[PATH_MAX];
+	long sum = 0;
+	int i, n = 0;
+
+	for(i=0; i < num_cpus; ++i){
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cpufreq/scaling_cur_freq", cpus[i]);
+		const long khz = sustain_read_long(path);
+		if(khz > 0){
+			sum += khz;
+			n++;
+		}
+	}
+	return n ? sum / 1000.0f / n : 0.0f;
+}
+
+static void sustain_cpufreq_info(struct sustain_result *r, const int cpu){
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(r->governor, sizeof(r->governor), "none");
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cpufreq/scaling_governor", cpu);
+	if((f = fopen(path, "r")) != NULL){
+		if(fgets(r->governor, sizeof(r->governor), f) != NULL)
+			r->governor[strcspn(r->governor, "\n")] = '\0';
+		fclose(f);
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cpufreq/cpuinfo_max_freq", cpu);
+	r->freq_max = sustain_read_long(path) / 1000.0f;
+}
+
+// One aio_run() per second, each ending on the second boundary so the points line up with the CPU series
+static void *sustain_disk_thread(void *arg){
+	struct sustain_disk *d = (struct sustain_disk*) arg;
+	struct aio_job_result res;
+	struct aio_job job;
+	int k;
+
+	bzero(&job, sizeof(job));
+	job.fd = d->fd;
+	job.write = 1;
+	job.random = 1;
+	job.block_size = SUSTAIN_DISK_BLOCK;
+	job.queue_depth = SUSTAIN_DISK_DEPTH;
+	job.size = SUSTAIN_DISK_FILE_SIZE;
+	job.max_bytes = ULONG_MAX;
+
+	for(k=0; k < d->num_points && !sustain_stop; ++k){
+		const uint64_t end = d->start + (uint64_t)(k + 1) * 1000000000ULL, now = timer_now_ns();
+		if(now >= end)
+			continue;
+		job.max_time = (end - now) / 1e9;
+		if(aio_run(&job, &res) != 0){
+			fprintf(stderr, "sustain: disk load failed after %is\n", k);
+			d->r->step[SUSTAIN_DISK].failed = 1;
+			break;
+		}
+		d->r->point[k].rate[SUSTAIN_DISK] = res.rate;
+		d->r->point[k].measured[SUSTAIN_DISK] = 1;
+	}
+	return NULL;
+}
+
+// Preallocated like the other write tests, -1 without a disk load
+static int sustain_disk_open(char *filename){
+	char *home;
+	int fd;
+
+	if((home = getenv("HOME")) == NULL){
+		fprintf(stderr, "sustain: HOME is not set, no disk load\n");
+		return -1;
+	}
+	snprintf(filename, PATH_MAX, "%s/vm_perf.sustain", home);
+	if((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1){
+		perror("open");
+		return -1;
+	}
+	if(posix_fallocate(fd, 0, SUSTAIN_DISK_FILE_SIZE) != 0)
+		perror("posix_fallocate");
+	close(fd);
+	if((fd = open(filename, O_WRONLY|O_DIRECT)) == -1){
+		perror("open O_DIRECT");
+		unlink(filename);
+	}
+	return fd;
+}
+
+static int cmp_float(const void *a, const void *b){
+	const float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+static float sustain_median(const float *rate, const int from, const int to){
+	static float v[SUSTAIN_MAX_POINTS];
+
+	if(to <= from)
+		return 0.0f;
+	memcpy(v, rate + from, (to - from) * sizeof(float));
+	qsort(v, to - from, sizeof(float), cmp_float);
+	return ((to - from) % 2) ? v[(to - from) / 2] : (v[(to - from) / 2 - 1] + v[(to - from) / 2]) / 2.0f;
+}
+
+/*
+ * The split of the measured points of the series into two constant levels
+ * with the least squared error, at least SUSTAIN_HOLD points on either
+ * side. It is a throttle when the mean after is SUSTAIN_DROP below the mean
+ * before. Seconds without a measurement are left out, not taken as 0.
+ */
+static void sustain_detect(const struct sustain_result *r, const int load, struct sustain_step *s){
+	static double sum[SUSTAIN_MAX_POINTS + 1], sq[SUSTAIN_MAX_POINTS + 1];
+	static float rate[SUSTAIN_MAX_POINTS];
+	static int second[SUSTAIN_MAX_POINTS];
+	double best = INFINITY;
+	int i, k, n = 0, split = 0;
+
+	for(i=0; i < r->num_points; ++i)
+		if(r->point[i].measured[load]){
+			rate[n] = r->point[i].rate[load];
+			second[n++] = i;
+		}
+	s->points = n;
+	s->burst = s->baseline = sustain_median(rate, 0, n);
+	s->throttled = 0;
+	s->time_to_throttle = 0.0f;
+	if(n < 2 * SUSTAIN_HOLD)
+		return;
+
+	for(i=0; i < n; ++i){
+		sum[i + 1] = sum[i] + rate[i];
+		sq[i + 1] = sq[i] + (double)rate[i] * rate[i];
+	}
+	for(k=SUSTAIN_HOLD; k <= n - SUSTAIN_HOLD; ++k){
+		const double before = sq[k] - sum[k] * sum[k] / k;
+		const double after = (sq[n] - sq[k]) - (sum[n] - sum[k]) * (sum[n] - sum[k]) / (n - k);
+		if(before + after < best){
+			best = before + after;
+			split = k;
+		}
+	}
+	if((sum[n] - sum[split]) / (n - split) < (1.0 - SUSTAIN_DROP) * sum[split] / split){
+		s->throttled = 1;
+		s->burst = sustain_median(rate, 0, split);
+		s->baseline = sustain_median(rate, split, n);
+		s->time_to_throttle = second[split];
+	}
+}
+
+// Frame size that takes about SUSTAIN_FRAME_TIME now, fixed for the rest of the run
+static void sustain_calibrate(struct sustain_result *r, const int *cpus){
+	r->xres = 320;
+	r->yres = 180;
+	const uint64_t t0 = timer_now_ns();
+	cray_mt(r->threads, cpus, r->xres, r->yres, 1, NULL);
+	const double t = (timer_now_ns() - t0) / 1e9;
+	if(t > 0.0){
+		const double scale = sqrt(SUSTAIN_FRAME_TIME / t);
+		r->xres = (int)(r->xres * scale);
+		r->yres = (int)(r->yres * scale);
+	}
+	if(r->xres < 32)
+		r->xres = 32;
+	if(r->yres < 18)
+		r->yres = 18;
+}
+
+/*
+ * Run both loads for window seconds, or until SIGINT/SIGTERM. Frames are
+ * spread over the seconds they overlap, so a frame longer than a second
+ * does not leave empty points behind it.
+ */
+int sustain_run(const float window, struct sustain_result *r){
+	static int cpus[CPU_SETSIZE];
+	struct sustain_disk disk;
+	char filename[PATH_MAX];
+	struct sigaction sa;
+	int closed = 0, b, disk_started = 0;
+
+	bzero(r, sizeof(struct sustain_result));
+	r->window = window;
+	if((r->threads = sys_online_cpus(cpus, CPU_SETSIZE)) < 1){
+		cpus[0] = 0;
+		r->threads = 1;
+	}
+	sustain_cpufreq_info(r, cpus[0]);
+
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = sustain_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	int num_points = (int)window;
+	if(num_points > SUSTAIN_MAX_POINTS)
+		num_points = SUSTAIN_MAX_POINTS;
+	sustain_calibrate(r, cpus);
+
+	const double pixels = (double)r->xres * r->yres / 1e6;
+	const uint64_t start = timer_now_ns();
+	bzero(&disk, sizeof(disk));
+	disk.start = start;
+	disk.num_points = num_points;
+	disk.r = r;
+	if((disk.fd = sustain_disk_open(filename)) != -1){
+		if(pthread_create(&disk.tid, NULL, sustain_disk_thread, &disk) == 0)
+			disk_started = 1;
+		else
+			perror("pthread_create");
+	}
+	r->step[SUSTAIN_CPU].ran = 1;
+	r->step[SUSTAIN_DISK].ran = disk_started;
+
+	sampler_start();
+	double t0 = 0.0;
+	while(closed < num_points && !sustain_stop){
+		cray_mt(r->threads, cpus, r->xres, r->yres, 1, NULL);
+		const double t1 = (timer_now_ns() - start) / 1e9, rate = pixels / (t1 - t0);
+
+		for(b=(int)t0; b <= (int)t1 && b < num_points; ++b){
+			const double overlap = fmin(t1, b + 1.0) - fmax(t0, b);
+			r->point[b].rate[SUSTAIN_CPU] += rate * overlap;
+			r->point[b].measured[SUSTAIN_CPU] = 1;
+		}
+		// Seconds the frame finished are final
+		while(closed < num_points && closed + 1 <= t1){
+			struct sampler_window w;
+			sampler_stop(&w);
+			sampler_start();
+			r->point[closed].steal = w.steal;
+			r->point[closed].freq = sustain_freq(cpus, r->threads);
+			closed++;
+		}
+		t0 = t1;
+	}
+	struct sampler_window w;
+	sampler_stop(&w);
+
+	sustain_stop = 1;
+	if(disk_started)
+		pthread_join(disk.tid, NULL);
+	if(disk.fd != -1){
+		close(disk.fd);
+		unlink(filename);
+	}
+	r->num_points = closed;
+	r->time = (timer_now_ns() - start) / 1e9;
+
+	for(b=0; b < SUSTAIN_NUM_LOADS; ++b)
+		if(r->step[b].ran)
+			sustain_detect(r, b, &r->step[b]);
+	return 0;
+}
+
+void sustain_report(const struct sustain_result *r){
+	char delim = ' ';
+	int l, p;
+
+	printf("\"sustained\":{\"window\":\"%.0fs\",\"time\":\"%.1fs\",\"threads\":\"%i\",\"frame\":\"%ix%i\",",
+		r->window, r->time, r->threads, r->xres, r->yres);
+	printf("\"disk_block_size\":\"%ib\",\"disk_queue_depth\":\"%i\",\"governor\":\"%s\",\"freq_max\":\"%.0fMHz\",",
+		SUSTAIN_DISK_BLOCK, SUSTAIN_DISK_DEPTH, r->governor, r->freq_max);
+	for(l=0; l < SUSTAIN_NUM_LOADS; ++l){
+		const struct sustain_step *s = &r->step[l];
+		if(!s->ran)
+			continue;
+		printf("\"%s\":{\"failed\":\"%s\",\"throttled\":\"%s\",\"burst\":\"%.2f%s\",\"baseline\":\"%.2f%s\",", sustain_load_names[l],
+			s->failed ? "yes" : "no", s->throttled ? "yes" : "no", s->burst, sustain_load_units[l], s->baseline, sustain_load_units[l]);
+		if(s->throttled)
+			printf("\"time_to_throttle\":\"%.0fs\",\"drop\":\"%.0f%%\",", s->time_to_throttle,
+				s->burst > 0.0f ? (1.0f - s->baseline / s->burst) * 100.0f : 0.0f);
+		printf("\"points\":\"%i\"},", s->points);
+	}
+	printf("\"series\":[");
+	for(p=0; p < r->num_points; ++p){
+		const struct sustain_point *pt = &r->point[p];
+		printf("%c{\"t\":\"%is\",\"cpu\":\"%.2fMpx/s\",", delim, p + 1, pt->rate[SUSTAIN_CPU]);
+		if(r->step[SUSTAIN_DISK].ran && pt->measured[SUSTAIN_DISK])
+			printf("\"disk\":\"%.2fMB/s\",", pt->rate[SUSTAIN_DISK]);
+		printf("\"freq\":\"%.0fMHz\",\"steal\":\"%.1f%%\"}", pt->freq, pt->steal);
+		delim = ',';
+	}
+	printf("]}");
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_SUSTAIN_H
+#define VM_PERF_SUSTAIN_H
+
+#include "vm_perf_sampler.h"
+
+#define SUSTAIN_WINDOW 900					// Default seconds of sustained load
+#define SUSTAIN_MAX_POINTS 86400			// One point per second, a day at most
+#define SUSTAIN_FRAME_TIME 0.25				// Seconds the calibrated C-RAY frame takes at the start
+#define SUSTAIN_DISK_FILE_SIZE (256*1024*1024)
+#define SUSTAIN_DISK_BLOCK 16384			// Small enough that a burst bucket counted in IOPS binds
+#define SUSTAIN_DISK_DEPTH 32
+#define SUSTAIN_DROP 0.25f					// A step down by at least this share of the burst rate is throttling
+#define SUSTAIN_HOLD 10						// Points either side of the step needs
+
+enum sustain_load{
+	SUSTAIN_CPU = 0,			// C-RAY frames of fixed size over every usable CPU
+	SUSTAIN_DISK,				// 16KB random O_DIRECT writes at a fixed queue depth
+	SUSTAIN_NUM_LOADS
+};
+
+struct sustain_point{
+	float rate[SUSTAIN_NUM_LOADS];	// Mpixels/s and MB/s
+	int measured[SUSTAIN_NUM_LOADS];	// The rate of this second was measured, a skipped or failed second has none
+	float freq;					// Mean scaling_cur_freq of the CPUs in MHz, 0 without cpufreq
+	float steal;				// % over the second
+};
+
+// The step drop of one load, found as the best two level fit of its series
+struct sustain_step{
+	int ran;
+	int failed;					// The load stopped on an error before the end
+	int points;					// Measured ones, the fit is over these only
+	int throttled;
+	float burst;				// Median rate before the step, over the whole series without one
+	float baseline;				// Median rate after the step
+	float time_to_throttle;		// Seconds from the start to the step
+};
+
+struct sustain_result{
+	float window;				// Seconds asked for
+	float time;					// Seconds it ran, shorter when interrupted
+	int threads;
+	int xres, yres;				// Of the calibrated frame
+	char governor[32];
+	float freq_max;				// cpuinfo_max_freq in MHz, 0 without cpufreq
+	int num_points;
+	struct sustain_point point[SUSTAIN_MAX_POINTS];
+	struct sustain_step step[SUSTAIN_NUM_LOADS];
+};
+
+int sustain_run(const float window, struct sustain_result *r);
+void sustain_report(const struct sustain_result *r);
+
+#endif
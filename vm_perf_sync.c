@@ -0,0 +1,179 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_sync.h"
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_page.h"
+
+static const char * sync_mode_names[SYNC_NUM_MODES] = {"fdatasync", "o_dsync"};
+
+struct sync_writer{
+	pthread_t tid;
+	int fd;
+	const struct sync_job *job;
+	volatile int *stop;
+
+	unsigned long commits;
+	struct lat_hist hist;
+};
+
+static int sync_start = 0;
+static pthread_mutex_t sync_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_start_cond = PTHREAD_COND_INITIALIZER;
+
+const char * sync_mode_name(const enum sync_mode mode){
+	return sync_mode_names[mode];
+}
+
+static void *sync_thread(void *arg){
+	struct sync_writer *w = (struct sync_writer*) arg;
+	const struct sync_job *job = w->job;
+	const size_t group = (size_t)job->record_size * job->batch;
+	off_t off = 0;
+	char *buffer;
+	unsigned int i;
+
+	if((buffer = page_alloc(group)) == NULL){
+		perror("mmap");
+		return NULL;
+	}
+	memset(buffer, 'v', group);
+
+	pthread_mutex_lock(&sync_start_mutex);
+	while(!sync_start) {
+		pthread_cond_wait(&sync_start_cond, &sync_start_mutex);
+	}
+	pthread_mutex_unlock(&sync_start_mutex);
+
+	while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+		if(off + group > SYNC_MAX_FILE_SIZE){
+			if(ftruncate(w->fd, 0) != 0){
+				perror("ftruncate");
+				break;
+			}
+			off = 0;
+		}
+
+		const uint64_t t0 = timer_now_ns();
+		if(job->mode == SYNC_ODSYNC){
+			// The group goes down as one write, O_DSYNC makes it durable before returning
+			if(pwrite(w->fd, buffer, group, off) != (ssize_t)group){
+				perror("pwrite");
+				break;
+			}
+		}else{
+			for(i=0; i < job->batch; ++i){
+				if(pwrite(w->fd, buffer + i * job->record_size, job->record_size, off + i * job->record_size) != (ssize_t)job->record_size)
+					break;
+			}
+			if(i < job->batch){
+				perror("pwrite");
+				break;
+			}
+			if(fdatasync(w->fd) != 0){
+				perror("fdatasync");
+				break;
+			}
+		}
+		hist_add(&w->hist, timer_now_ns() - t0);
+		w->commits += job->batch;
+		off += group;
+	}
+
+	page_free(buffer);
+	return NULL;
+}
+
+/*
+ * job->writers threads append job->record_size records to their own log
+ * file for job->max_time seconds, making every job->batch records durable
+ * together. The logs start empty, so every fdatasync() also commits the new
+ * file size the way an appending log (Kafka, a fresh WAL segment) does.
+ */
+int sync_run(const struct sync_job *job, struct sync_result *r){
+	char filename[PATH_MAX];
+	struct sync_writer *w;
+	volatile int stop = 0;
+	const int flags = (job->mode == SYNC_ODSYNC) ? O_DSYNC : 0;
+	unsigned int i, opened = 0, started = 0;
+
+	bzero(r, sizeof(struct sync_result));
+	if(job->writers < 1 || job->writers > SYNC_MAX_WRITERS || job->batch < 1)
+		return 1;
+
+	if((w = calloc(job->writers, sizeof(struct sync_writer))) == NULL){
+		perror("calloc");
+		return 1;
+	}
+	for(i=0; i < job->writers; ++i){
+		snprintf(filename, PATH_MAX, "%s/vm_perf.sync.%u", job->dir, i);
+		if((w[i].fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|flags, 0666)) == -1){
+			perror("open");
+			break;
+		}
+		unlink(filename);		// Gone once the descriptor is closed
+		w[i].job = job;
+		w[i].stop = &stop;
+		hist_init(&w[i].hist);
+		opened++;
+	}
+
+	sync_start = 0;
+	for(i=0; i < opened; ++i){
+		if(pthread_create(&w[i].tid, NULL, sync_thread, &w[i]) != 0){
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	pthread_mutex_lock(&sync_start_mutex);
+	const uint64_t t0 = timer_now_ns();
+	sync_start = 1;
+	pthread_cond_broadcast(&sync_start_cond);
+	pthread_mutex_unlock(&sync_start_mutex);
+
+	struct timespec ts = {(time_t)job->max_time, (long)((job->max_time - (time_t)job->max_time) * 1e9)};
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	struct lat_hist hist;
+	hist_init(&hist);
+	for(i=0; i < started; ++i){
+		pthread_join(w[i].tid, NULL);
+		hist_merge(&hist, &w[i].hist);
+		r->commits += w[i].commits;
+	}
+	const double elapsed = (timer_now_ns() - t0) / 1e9;
+
+	r->commits_s = r->commits / elapsed;
+	r->syncs_s	 = hist.count / elapsed;
+	r->rate		 = r->commits * (double)job->record_size / elapsed / (1024*1024);
+	r->lat_avg	 = hist_mean(&hist) / 1e6;
+	r->lat_p50	 = hist_percentile(&hist, 0.50)  / 1e6;
+	r->lat_p99	 = hist_percentile(&hist, 0.99)  / 1e6;
+	r->lat_p999	 = hist_percentile(&hist, 0.999) / 1e6;
+
+	for(i=0; i < opened; ++i)
+		close(w[i].fd);
+	free(w);
+	return started == 0;
+}
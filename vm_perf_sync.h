@@ -0,0 +1,41 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_SYNC_H
+#define VM_PERF_SYNC_H
+
+#define SYNC_MAX_WRITERS 64
+#define SYNC_MAX_FILE_SIZE (64*1024*1024)	// A writer truncates its log back to 0 past this size
+
+enum sync_mode{
+	SYNC_FDATASYNC = 0,			// Buffered appends, then fdatasync()
+	SYNC_ODSYNC,				// Appends through an O_DSYNC descriptor, durable when write() returns
+	SYNC_NUM_MODES
+};
+
+struct sync_job{
+	const char *dir;			// Every writer appends to its own log file in dir
+	enum sync_mode mode;
+	unsigned int record_size;
+	unsigned int batch;			// Records made durable together, the group commit size
+	unsigned int writers;
+	float max_time;				// Seconds
+};
+
+struct sync_result{
+	unsigned long commits;		// Records made durable
+	float commits_s;
+	float syncs_s;				// Durable operations per second, commits_s / batch
+	float rate;					// MB/s
+	float lat_avg;				// Commit latency in ms, from the first append of a group to it being durable
+	float lat_p50;
+	float lat_p99;
+	float lat_p999;
+};
+
+int sync_run(const struct sync_job *job, struct sync_result *r);
+const char * sync_mode_name(const enum sync_mode mode);
+
+#endif
@@ -15,16 +15,20 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/sysinfo.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "vm_perf_sys.h"
+#include "vm_perf_store.h"
 
 static const char * info_path[NUM_INFO_PATHS] = {
-	"/proc/version",
-	"/proc/cpuinfo"
+	"/proc/version"
+	//"/proc/cpuinfo", parsed once into the topology
 	//"/proc/meminfo",
 	//"/proc/scsi/scsi",
 };
 
+// Whole file, grown geometrically
 static char* proc_get_info(const char * path){
 	int fd = open(path, O_RDONLY);
 	if(fd == -1){
@@ -37,12 +41,15 @@ static char* proc_get_info(const char * path){
 	char * info = NULL;
 	while(1){
 		if(offset >= size){
-			size += 100;
-			info = (char*) realloc(info, sizeof(char)*size);
-			if(info == NULL){
+			size = size ? size * 2 : 4096;
+			char * grown = (char*) realloc(info, sizeof(char)*size);
+			if(grown == NULL){
 				perror("malloc");
+				free(info);
+				close(fd);
 				return strdup("error");
 			}
+			info = grown;
 		}
 
 		int bytes = read(fd, &info[offset], size-offset);
@@ -55,51 +62,267 @@ static char* proc_get_info(const char * path){
 		offset+= bytes;
 	}
 	close(fd);
-	info[offset-1] = '\0';
+	info[offset ? offset-1 : 0] = '\0';
 
 	return info;
 }
 
-
-static int enumerate_cpus(struct sys_result *r){
+// CPU model and flags of the first processor in /proc/cpuinfo, "Features" on ARM
+static void sys_read_cpuinfo(struct sys_topology *t){
 	FILE * fin = fopen("/proc/cpuinfo", "r");
+	size_t line_size = 0;
+	char * line = NULL;
+
 	if(fin == NULL){
 		perror("fopen");
-		return 1;
-	}
-	size_t line_size = 100;
-	char * line = malloc(line_size*sizeof(char));
-	if(line == NULL){
-		perror("malloc");
-		return 1;
+		return;
 	}
-
-	bzero(r->cpu_model, sizeof(r->cpu_model));
-	r->cpu_count = 0;
 	while(getline(&line, &line_size, fin) > 0){
-		int len = strlen(line);
-		line[len-1] = '\0';
-		if(strncmp(line, "model name", 10) == 0){
-			if(r->cpu_model[0] == 0){
-				char * model = strchr(line, ':');
-				if(++model){
-					while(*model == ' '){
-						model++;
-					}
-					strncpy(r->cpu_model, model, sizeof(r->cpu_model));
-				}
-			}
-			r->cpu_count++;
-		}
+		char * value = strchr(line, ':');
+		if(value == NULL)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		for(++value; *value == ' '; ++value)
+			;
+		if(t->model[0] == 0 && strncmp(line, "model name", 10) == 0)
+			snprintf(t->model, sizeof(t->model), "%s", value);
+		else if(t->flags[0] == 0 && (strncmp(line, "flags", 5) == 0 || strncmp(line, "Features", 8) == 0))
+			snprintf(t->flags, sizeof(t->flags), "%s", value);
+		if(t->model[0] && t->flags[0])
+			break;
 	}
 	fclose(fin);
 	free(line);
-	return 0;
-};
+}
+
+// First line of a sysfs file without trailing blanks, "unknown" when it cannot be read
+static void sys_read_line(const char *path, char *value, const size_t size){
+	FILE * fin = fopen(path, "r");
+	size_t len;
+
+	snprintf(value, size, "unknown");
+	if(fin == NULL)
+		return;
+	if(fgets(value, size, fin) == NULL)
+		snprintf(value, size, "unknown");
+	fclose(fin);
+	for(len = strlen(value); len > 0 && (value[len - 1] == '\n' || value[len - 1] == ' '); --len)
+		value[len - 1] = 0;
+}
+
+// Parse a kernel cpulist/nodelist such as "0-3,8,10-11"
+static int sys_read_list(const char *path, int *list, const int max){
+	char buf[4096], *ptr;
+	int n = 0;
+
+	FILE * fin = fopen(path, "r");
+	if(fin == NULL)
+		return 0;
+	if(fgets(buf, sizeof(buf), fin) == NULL){
+		fclose(fin);
+		return 0;
+	}
+	fclose(fin);
+
+	ptr = buf;
+	while((*ptr != '\0') && (*ptr != '\n')){
+		char *end;
+		int lo = strtol(ptr, &end, 10), hi = lo;
+		if(end == ptr)
+			break;
+		if(*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for(; (lo <= hi) && (n < max); ++lo)
+			list[n++] = lo;
+		ptr = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+static int sys_read_int(const char *path, const int fallback){
+	int v;
+	FILE * fin = fopen(path, "r");
+	if(fin == NULL)
+		return fallback;
+	if(fscanf(fin, "%i", &v) != 1)
+		v = fallback;
+	fclose(fin);
+	return v;
+}
+
+// Lowest of the n CPUs in list that vm_perf may run on, self when there is none
+static int sys_lowest_allowed(const int *list, const int n, const cpu_set_t *allowed, const int self){
+	int i, lowest = self;
+
+	for(i=0; i < n; ++i)
+		if(CPU_ISSET(list[i], allowed) && list[i] < lowest)
+			lowest = list[i];
+	return lowest;
+}
+
+// Levels, sizes and sharing of the caches of the first CPU, instances counted over those allowed
+static void sys_read_caches(struct sys_topology *t, const cpu_set_t *allowed){
+	static int list[CPU_SETSIZE];
+	char path[PATH_MAX], dir[128];
+	int idx, c, shared[CPU_SETSIZE];
+
+	t->llc = -1;
+	for(idx=0; idx < SYS_MAX_CACHES; ++idx){
+		struct sys_cache *cache = &t->cache[idx];
+		unsigned long size;
+
+		snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%i/cache/index%i", t->cpu[0].id, idx);
+		snprintf(path, sizeof(path), "%s/level", dir);
+		if((cache->level = sys_read_int(path, 0)) == 0)
+			break;
+		snprintf(path, sizeof(path), "%s/type", dir);
+		sys_read_line(path, cache->type, sizeof(cache->type));
+		snprintf(path, sizeof(path), "%s/size", dir);
+		FILE * fin = fopen(path, "r");
+		if(fin != NULL){
+			if(fscanf(fin, "%luK", &size) == 1)
+				cache->size = size;
+			fclose(fin);
+		}
+		snprintf(path, sizeof(path), "%s/coherency_line_size", dir);
+		cache->line_size = sys_read_int(path, 0);
+		snprintf(path, sizeof(path), "%s/ways_of_associativity", dir);
+		cache->ways = sys_read_int(path, 0);
+		snprintf(path, sizeof(path), "%s/shared_cpu_list", dir);
+		sys_read_line(path, cache->shared_cpus, sizeof(cache->shared_cpus));
+		cache->num_shared = sys_read_list(path, shared, CPU_SETSIZE);
+
+		// One instance per group of sharing CPUs, counted at its lowest allowed CPU
+		for(c=0; c < t->num_cpus; ++c){
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/shared_cpu_list", t->cpu[c].id, idx);
+			if(sys_lowest_allowed(list, sys_read_list(path, list, CPU_SETSIZE), allowed, t->cpu[c].id) == t->cpu[c].id)
+				cache->instances++;
+		}
+		if(cache->level >= (t->llc >= 0 ? t->cache[t->llc].level : 1) && strcmp(cache->type, "Instruction") != 0)
+			t->llc = idx;
+		t->num_caches++;
+	}
+}
+
+/*
+ * Online CPUs vm_perf may run on, with their package, core, SMT siblings and
+ * NUMA node from sysfs, the caches and the CPU flags. NUMA nodes are indexed
+ * 0..num_nodes-1 in the order of their ids, which need not be contiguous.
+ */
+static void sys_discover(struct sys_topology *t){
+	static int online[CPU_SETSIZE], list[CPU_SETSIZE];
+	char path[PATH_MAX];
+	cpu_set_t allowed;
+	int i, j, n, num_online;
+
+	bzero(t, sizeof(struct sys_topology));
+	if((num_online = sys_read_list("/sys/devices/system/cpu/online", online, CPU_SETSIZE)) == 0){
+		num_online = sysconf(_SC_NPROCESSORS_ONLN);
+		for(i=0; i < num_online && i < CPU_SETSIZE; ++i)
+			online[i] = i;
+	}
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+		CPU_ZERO(&allowed);
+		for(i=0; i < num_online; ++i)
+			CPU_SET(online[i], &allowed);
+	}
+
+	for(i=0; i < num_online && i < CPU_SETSIZE; ++i){
+		struct sys_cpu *cpu = &t->cpu[t->num_cpus];
+		if(!CPU_ISSET(online[i], &allowed))
+			continue;
+		cpu->id = online[i];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/physical_package_id", cpu->id);
+		cpu->package = sys_read_int(path, 0);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/core_id", cpu->id);
+		cpu->core = sys_read_int(path, cpu->id);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/thread_siblings_list", cpu->id);
+		n = sys_read_list(path, list, CPU_SETSIZE);
+		cpu->sibling = sys_lowest_allowed(list, n, &allowed, cpu->id);		// A sibling outside the cpuset leaves this one to lead the core
+		if(n > t->threads_per_core)
+			t->threads_per_core = n;
+		if(cpu->sibling == cpu->id)
+			t->num_cores++;
+		for(j=0; j < t->num_cpus && t->cpu[j].package != cpu->package; ++j)
+			;
+		if(j == t->num_cpus)
+			t->num_packages++;
+		t->num_cpus++;
+	}
+	if(t->threads_per_core == 0)
+		t->threads_per_core = 1;
+
+	t->num_nodes = sys_read_list("/sys/devices/system/node/has_cpu", t->node_id, SYS_MAX_NODES);
+	for(i=0; i < t->num_nodes; ++i){
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", t->node_id[i]);
+		n = sys_read_list(path, list, CPU_SETSIZE);
+		for(j=0; j < t->num_cpus; ++j){
+			int k;
+			for(k=0; k < n; ++k)
+				if(list[k] == t->cpu[j].id)
+					t->cpu[j].node = i;
+		}
+	}
+	if(t->num_nodes == 0){
+		t->num_nodes = 1;
+		t->node_id[0] = 0;
+	}
+
+	if(t->num_cpus > 0)
+		sys_read_caches(t, &allowed);
+	sys_read_cpuinfo(t);
+}
+
+static struct sys_topology sys_layout;
+static pthread_once_t sys_layout_once = PTHREAD_ONCE_INIT;
+
+static void sys_discover_once(void){
+	sys_discover(&sys_layout);
+}
+
+// Discovered on the first call, sys_info() makes that happen before any module pins the calling thread
+const struct sys_topology * sys_topology(void){
+	pthread_once(&sys_layout_once, sys_discover_once);
+	return &sys_layout;
+}
+
+int sys_num_nodes(void){
+	return sys_topology()->num_nodes;
+}
+
+int sys_online_cpus(int *cpus, const int max){
+	const struct sys_topology *t = sys_topology();
+	int i, n = 0;
+
+	for(i=0; (i < t->num_cpus) && (n < max); ++i)
+		cpus[n++] = t->cpu[i].id;
+	return n;
+}
+
+/*
+ * One CPU per physical core (its lowest allowed SMT sibling), restricted to
+ * the NUMA node of that index unless node is -1.
+ */
+int sys_core_cpus(int *cpus, const int max, const int node){
+	const struct sys_topology *t = sys_topology();
+	int i, n = 0;
+
+	for(i=0; (i < t->num_cpus) && (n < max); ++i){
+		if(t->cpu[i].sibling != t->cpu[i].id || (node >= 0 && t->cpu[i].node != node))
+			continue;
+		cpus[n++] = t->cpu[i].id;
+	}
+	return n;
+}
 
 void sys_info(struct sys_result * r){
+	const struct sys_topology *t = sys_topology();
 	bzero(r, sizeof(struct sys_result));
 
+	snprintf(r->cpu_model, sizeof(r->cpu_model), "%s", t->model);
+	r->cpu_count = t->num_cpus;
+	r->llc_size = t->llc >= 0 ? t->cache[t->llc].size : 0;
+
 	int i;
 	for(i=0; i < NUM_INFO_PATHS; ++i)
 		r->info[i] = proc_get_info(info_path[i]);
@@ -117,7 +340,76 @@ void sys_info(struct sys_result * r){
 	r->totalRAM = mi.totalram / (1024 * 1024);
 	r->freeRAM  = mi.freeram  / (1024 * 1024);
 
-	enumerate_cpus(r);
+	sys_read_line("/sys/devices/system/clocksource/clocksource0/current_clocksource", r->clocksource, sizeof(r->clocksource));
+	sys_read_line("/sys/devices/system/clocksource/clocksource0/available_clocksource", r->clocksources, sizeof(r->clocksources));
+}
+
+void sys_bench(struct sys_result * r){
+	os_bench(&r->os);
+	r->os_ran = 1;
+}
+
+static void sys_hist_report(const struct lat_hist *h){
+	printf("\"count\":\"%lu\",\"min\":\"%.2fus\",\"avg\":\"%.2fus\",\"p50\":\"%.2fus\",\"p99\":\"%.2fus\",\"p999\":\"%.2fus\",\"max\":\"%.2fus\",",
+		h->count, h->count ? h->min / 1e3 : 0.0, hist_mean(h) / 1e3, hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+		hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+	hist_report(h);
+}
+
+static void sys_os_report(const struct os_result *os){
+	char delim = ' ';
+	int c, m, p;
+
+	printf(",\"syscalls\":[");
+	for(c=0; c < OS_NUM_CALLS; ++c){
+		printf("%c{\"call\":\"%s\",\"result\":\"%.1fns\",", delim, os_call_name(c), os->call[c].median);
+		timer_report(&os->call[c], "ns");
+		printf("}");
+		delim = ',';
+	}
+	printf("],\"vdso\":\"%s\",\"wakeups\":[", os->vdso ? "yes" : "no");
+	delim = ' ';
+	for(m=0; m < OS_NUM_MECHANISMS; ++m){
+		for(p=0; p < OS_NUM_PLACEMENTS; ++p){
+			const struct os_wakeup *w = &os->wakeup[m][p];
+			if(!w->ran)
+				continue;
+			printf("%c{\"mechanism\":\"%s\",\"placement\":\"%s\",\"cpus\":\"%i,%i\",",
+				delim, os_mechanism_name(m), os_placement_name(p), w->cpu[0], w->cpu[1]);
+			sys_hist_report(&w->hist);
+			printf("}");
+			delim = ',';
+		}
+	}
+	printf("],\"timer_jitter\":{\"interval\":\"%ius\",\"sched\":\"%s\",\"cpu\":\"%i\",",
+		OS_JITTER_INTERVAL, os->jitter_fifo ? "fifo" : "other", os->jitter_cpu);
+	sys_hist_report(&os->jitter);
+	printf("}");
+}
+
+static void sys_topology_report(const struct sys_topology *t){
+	char delim = ' ';
+	int i, c;
+
+	printf(",\"topology\":{\"cpus\":\"%i\",\"packages\":\"%i\",\"cores\":\"%i\",\"threads_per_core\":\"%i\",\"nodes\":[",
+		t->num_cpus, t->num_packages, t->num_cores, t->threads_per_core);
+	for(i=0; i < t->num_nodes; ++i){
+		int cpus = 0;
+		for(c=0; c < t->num_cpus; ++c)
+			cpus += (t->cpu[c].node == i);
+		printf("%c{\"node\":\"%i\",\"cpus\":\"%i\"}", delim, t->node_id[i], cpus);
+		delim = ',';
+	}
+	printf("],\"caches\":[");
+	delim = ' ';
+	for(i=0; i < t->num_caches; ++i){
+		const struct sys_cache *k = &t->cache[i];
+		printf("%c{\"level\":\"%i\",\"type\":\"%s\",\"size\":\"%luKB\",\"line_size\":\"%ib\",\"ways\":\"%i\",",
+			delim, k->level, k->type, k->size, k->line_size, k->ways);
+		printf("\"shared_cpus\":\"%s\",\"sharing\":\"%i\",\"instances\":\"%i\"}", k->shared_cpus, k->num_shared, k->instances);
+		delim = ',';
+	}
+	printf("],\"flags\":\"%s\"}", t->flags);
 }
 
 void sys_report(const struct sys_result * r){
@@ -127,6 +419,33 @@ void sys_report(const struct sys_result * r){
 		printf("\"cpu_model\":\"%s\",", r->cpu_model);
 		printf("\"cpu_count\":\"%hu\",", r->cpu_count);
 		printf("\"ram_total\":\"%luMB\",", r->totalRAM);
-		printf("\"ram_free\":\"%luMB\"", r->freeRAM);
+		printf("\"ram_free\":\"%luMB\",", r->freeRAM);
+		printf("\"llc_size\":\"%luKB\",", r->llc_size);
+		printf("\"clocksource\":\"%s\",", r->clocksource);
+		printf("\"clocksources\":\"%s\"", r->clocksources);
+		sys_topology_report(sys_topology());
+		if(r->os_ran)
+			sys_os_report(&r->os);
 	printf("}");
 }
+
+void sys_store(const struct sys_result * r, struct store * s){
+	char name[STORE_NAME_SIZE];
+	int c, m, p;
+
+	if(!r->os_ran)
+		return;
+	for(c=0; c < OS_NUM_CALLS; ++c){
+		snprintf(name, sizeof(name), "sys/syscall/%s", os_call_name(c));
+		store_add_stats(s, name, "ns", STORE_LOWER, &r->os.call[c]);
+	}
+	for(m=0; m < OS_NUM_MECHANISMS; ++m){
+		for(p=0; p < OS_NUM_PLACEMENTS; ++p){
+			if(!r->os.wakeup[m][p].ran)
+				continue;
+			snprintf(name, sizeof(name), "sys/wakeup/%s/%s/p50", os_mechanism_name(m), os_placement_name(p));
+			store_add_value(s, name, "us", STORE_LOWER, hist_percentile(&r->os.wakeup[m][p].hist, 0.50) / 1e3);
+		}
+	}
+	store_add_value(s, "sys/timer_jitter/p99", "us", STORE_LOWER, hist_percentile(&r->os.jitter, 0.99) / 1e3);
+}
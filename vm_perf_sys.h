@@ -6,8 +6,50 @@
 #ifndef VM_PERF_SYS_H
 #define VM_PERF_SYS_H
 #include <limits.h>
+#include <sched.h>
+#include "vm_perf_sampler.h"
+#include "vm_perf_os.h"
 
-#define NUM_INFO_PATHS 2
+#define NUM_INFO_PATHS 1
+#define SYS_MAX_CACHES 8
+#define SYS_MAX_NODES 64
+
+struct store;
+
+struct sys_cpu{
+	int id;						// Kernel CPU number
+	int package;				// physical_package_id
+	int core;					// core_id, unique within its package
+	int node;					// Index into sys_topology.node_id
+	int sibling;				// Lowest CPU of its SMT siblings, itself for the first thread of a core
+};
+
+struct sys_cache{
+	int level;
+	char type[16];				// Data, Instruction or Unified
+	unsigned long size;			// KB
+	int line_size;				// Bytes
+	int ways;
+	char shared_cpus[64];		// shared_cpu_list of the first CPU
+	int num_shared;				// CPUs sharing one instance
+	int instances;				// Instances over all usable CPUs
+};
+
+// Layout of the CPUs vm_perf may run on: online and in its affinity mask
+struct sys_topology{
+	int num_cpus;
+	struct sys_cpu cpu[CPU_SETSIZE];
+	int num_packages;
+	int num_cores;
+	int threads_per_core;		// Most SMT siblings of any core
+	int num_nodes;
+	int node_id[SYS_MAX_NODES];	// NUMA node ids with CPUs, in order
+	int num_caches;
+	struct sys_cache cache[SYS_MAX_CACHES];	// Of the first CPU
+	int llc;					// Index of the last level data cache in cache[], -1 without cache information
+	char model[100];
+	char flags[4096];			// From /proc/cpuinfo
+};
 
 struct sys_result{
 	char * info[NUM_INFO_PATHS];
@@ -16,9 +58,23 @@ struct sys_result{
 	unsigned short cpu_count;
 	unsigned long totalRAM;
 	unsigned long freeRAM;
+	unsigned long llc_size;		// Last level cache size in KB
+	char clocksource[32];		// tsc, kvm-clock, xen, hyperv_clocksource_tsc_page...
+	char clocksources[128];		// Available ones
+
+	int os_ran;
+	struct os_result os;		// Syscall, wakeup and timer costs, only when the sys module ran
+	struct sampler_window window;		// Interference seen while measuring
 };
 
 void sys_info(struct sys_result * r);
+void sys_bench(struct sys_result * r);
 void sys_report(const struct sys_result * r);
+void sys_store(const struct sys_result * r, struct store * s);
+
+const struct sys_topology * sys_topology(void);
+int sys_online_cpus(int *cpus, const int max);
+int sys_core_cpus(int *cpus, const int max, const int node);
+int sys_num_nodes(void);
 
 #endif
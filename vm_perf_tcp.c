@@ -0,0 +1,219 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_tcp.h"
+#include "vm_perf_peer.h"
+#include "vm_perf_timer.h"
+
+#define TCP_FILE_SIZE (4*TCP_CHUNK)		// Page cache backed source of every stream
+
+struct tcp_worker{
+	pthread_t tid;
+	int sd;
+	int fd;
+	volatile int *stop;
+
+	unsigned long bytes;
+	double time_s;
+	double cpu_s;
+	unsigned int retrans;
+};
+
+static int tcp_start = 0;
+static pthread_mutex_t tcp_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tcp_start_cond = PTHREAD_COND_INITIALIZER;
+
+static double tcp_cpu_s(void){
+	struct rusage ru;
+	if(getrusage(RUSAGE_THREAD, &ru) != 0)
+		return 0.0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void *tcp_thread(void *arg){
+	struct tcp_worker *w = (struct tcp_worker*) arg;
+	off_t off = 0;
+
+	pthread_mutex_lock(&tcp_start_mutex);
+	while(!tcp_start) {
+		pthread_cond_wait(&tcp_start_cond, &tcp_start_mutex);
+	}
+	pthread_mutex_unlock(&tcp_start_mutex);
+
+	const double cpu0 = tcp_cpu_s();
+	const uint64_t t0 = timer_now_ns();
+	while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+		// sendfile() moves page cache pages to the socket, the payload is never copied from user space
+		const ssize_t n = sendfile(w->sd, w->fd, &off, TCP_CHUNK);
+		if(n < 0){
+			if((errno == EAGAIN) || (errno == EINTR))	// SO_SNDTIMEO, look at stop again
+				continue;
+			perror("sendfile");
+			break;
+		}
+		w->bytes += n;
+		if(off >= TCP_FILE_SIZE)
+			off = 0;
+	}
+	w->time_s = (timer_now_ns() - t0) / 1e9;
+	w->cpu_s = tcp_cpu_s() - cpu0;
+
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if(getsockopt(w->sd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+		w->retrans = info.tcpi_total_retrans;
+
+	return NULL;
+}
+
+// Page cache backed source for sendfile(), filled so no stream sends the shared zero page
+static int tcp_source(void){
+	char *buf;
+	int fd, i;
+
+	if((fd = memfd_create("vm_perf_tcp", 0)) < 0){
+		perror("memfd_create");
+		return -1;
+	}
+	if((buf = malloc(TCP_CHUNK)) == NULL){
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+	for(i=0; i < TCP_CHUNK; ++i)
+		buf[i] = (char)(i * 2654435761u >> 24);
+	for(i=0; i < TCP_FILE_SIZE / TCP_CHUNK; ++i){
+		if(write(fd, buf, TCP_CHUNK) != TCP_CHUNK){
+			perror("write");
+			free(buf);
+			close(fd);
+			return -1;
+		}
+	}
+	free(buf);
+	return fd;
+}
+
+/*
+ * Transmit to job->peer over job->streams parallel TCP connections for
+ * job->time_s seconds. Per flow caps show up as streams that stop at the same
+ * rate, an instance cap as an aggregate that does not grow with the streams.
+ */
+int tcp_throughput(const struct tcp_job *job, struct tcp_result *r){
+	struct tcp_worker *w;
+	volatile int stop = 0;
+	const int num_streams = job->streams > TCP_MAX_STREAMS ? TCP_MAX_STREAMS : job->streams;
+	const int sndbuf = TCP_SNDBUF;
+	const struct timeval sndtimeo = {0, 200000};
+	int i, fd, connected = 0, started = 0;
+
+	bzero(r, sizeof(struct tcp_result));
+	if(num_streams < 1)
+		return 1;
+	signal(SIGPIPE, SIG_IGN);		// sendfile() has no MSG_NOSIGNAL
+
+	if((fd = tcp_source()) < 0)
+		return 1;
+
+	if((w = calloc(num_streams, sizeof(struct tcp_worker))) == NULL){
+		perror("calloc");
+		close(fd);
+		return 1;
+	}
+
+	// Connect every stream before the clock starts, handshakes are not part of the rate
+	for(i=0; i < num_streams; ++i){
+		const char mode = PEER_MODE_SINK;		// Generic sinks discard it with the rest
+		if((w[i].sd = peer_connect(job->peer, PEER_DEFAULT_PORT, SOCK_STREAM)) < 0)
+			break;
+		if(send(w[i].sd, &mode, 1, MSG_NOSIGNAL) != 1){
+			perror("send");
+			close(w[i].sd);
+			break;
+		}
+		if(setsockopt(w[i].sd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0)
+			perror("setsockopt SO_SNDBUF");
+		setsockopt(w[i].sd, SOL_SOCKET, SO_SNDTIMEO, &sndtimeo, sizeof(sndtimeo));
+		w[i].fd = fd;
+		w[i].stop = &stop;
+		connected++;
+	}
+	if(connected == 0){
+		free(w);
+		close(fd);
+		return 1;
+	}
+
+	socklen_t len = sizeof(r->sndbuf);
+	getsockopt(w[0].sd, SOL_SOCKET, SO_SNDBUF, &r->sndbuf, &len);
+
+	tcp_start = 0;
+	for(i=0; i < connected; ++i){
+		if(pthread_create(&w[i].tid, NULL, tcp_thread, &w[i]) != 0){
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	pthread_mutex_lock(&tcp_start_mutex);
+	const uint64_t t0 = timer_now_ns();
+	tcp_start = 1;
+	pthread_cond_broadcast(&tcp_start_cond);
+	pthread_mutex_unlock(&tcp_start_mutex);
+
+	struct timespec ts = {(time_t)job->time_s, (long)((job->time_s - (time_t)job->time_s) * 1e9)};
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	unsigned long bytes = 0;
+	r->gbps_min = -1.0f;
+	for(i=0; i < started; ++i){
+		struct tcp_stream *s = &r->stream[i];
+		pthread_join(w[i].tid, NULL);
+
+		s->bytes = w[i].bytes;
+		s->gbps = w[i].time_s > 0.0 ? w[i].bytes * 8 / w[i].time_s / 1e9 : 0.0f;
+		s->retrans = w[i].retrans;
+		if((r->gbps_min < 0.0f) || (s->gbps < r->gbps_min)) r->gbps_min = s->gbps;
+		if(s->gbps > r->gbps_max) r->gbps_max = s->gbps;
+
+		bytes += w[i].bytes;
+		r->cpu_s += w[i].cpu_s;
+	}
+	r->time_s = (timer_now_ns() - t0) / 1e9;
+	r->streams = started;
+	if(r->gbps_min < 0.0f)
+		r->gbps_min = 0.0f;
+	r->gbps = r->time_s > 0.0f ? bytes * 8 / r->time_s / 1e9 : 0.0f;
+	r->cpu_per_gbit = bytes > 0 ? r->cpu_s / (bytes * 8 / 1e9) : 0.0f;
+
+	for(i=0; i < connected; ++i)
+		close(w[i].sd);
+	free(w);
+	close(fd);
+
+	return started == 0;
+}
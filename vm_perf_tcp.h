@@ -0,0 +1,41 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_TCP_H
+#define VM_PERF_TCP_H
+
+#define TCP_MAX_STREAMS 64
+#define TCP_DEFAULT_STREAMS 4
+#define TCP_TIME 10						// Seconds the streams transmit for
+#define TCP_SNDBUF (8*1024*1024)		// Requested socket send buffer, the kernel caps it at wmem_max
+#define TCP_CHUNK (1024*1024)			// Bytes handed to one sendfile call
+
+struct tcp_job{
+	const char *peer;			// host[:port] of a vm_perf responder or any TCP sink that reads and discards
+	int streams;
+	float time_s;
+};
+
+struct tcp_stream{
+	unsigned long bytes;
+	float gbps;
+	unsigned int retrans;		// Segments retransmitted, from TCP_INFO
+};
+
+struct tcp_result{
+	int streams;				// Streams that connected
+	int sndbuf;					// Send buffer the kernel actually granted
+	float time_s;
+	float gbps;					// Aggregate
+	float gbps_min;				// Slowest and fastest stream
+	float gbps_max;
+	float cpu_s;				// User + system time of the sending threads
+	float cpu_per_gbit;			// CPU seconds per Gbit sent
+	struct tcp_stream stream[TCP_MAX_STREAMS];
+};
+
+int tcp_throughput(const struct tcp_job *job, struct tcp_result *r);
+
+#endif
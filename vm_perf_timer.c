@@ -0,0 +1,272 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+/*
+ * Common clock and trial statistics of all modules. Time comes from
+ * CLOCK_MONOTONIC_RAW, which NTP does not slew, falling back to CLOCK_MONOTONIC
+ * on kernels without it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "vm_perf_timer.h"
+
+// Two sided 95% Student t quantiles for 1..30 degrees of freedom
+static const double timer_t95[30] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+/*
+ * Time budget of the run. main() hands every module a slice of what is left
+ * of it, timer_trials() stops adding trials when the slice runs out and fixed
+ * length tests shrink to the share of their nominal time the slice covers.
+ */
+static uint64_t timer_deadline;		// End of the current slice, 0 without a budget
+static double timer_scale = 1.0;
+
+/*
+ * timer_trials() calls that ran out of slice before they converged. Their
+ * trial and arg must outlive the module, timer_topup() runs more of their
+ * trials at the end of the run with whatever budget the modules left.
+ */
+struct timer_pending{
+	timer_trial_fn trial;
+	void *arg;
+	struct timer_stats *s;
+	double scale;				// Of the slice the trials ran under, so extra ones measure the same thing
+	uint64_t cost;				// ns of one trial
+	int failed;					// A trial of the top-up failed, no more of them
+};
+
+static struct timer_pending timer_pending[TIMER_MAX_PENDING];
+static int timer_num_pending;
+
+static clockid_t timer_clock(void){
+	static clockid_t clock = -1;
+	struct timespec ts;
+
+	if(clock == -1)
+		clock = (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0) ? CLOCK_MONOTONIC_RAW : CLOCK_MONOTONIC;
+	return clock;
+}
+
+uint64_t timer_now_ns(void){
+	struct timespec ts;
+	clock_gettime(timer_clock(), &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double timer_now(void){
+	return timer_now_ns() / 1e9;
+}
+
+const char * timer_clock_name(void){
+	return timer_clock() == CLOCK_MONOTONIC_RAW ? "monotonic_raw" : "monotonic";
+}
+
+long timer_resolution_ns(void){
+	struct timespec ts;
+	if(clock_getres(timer_clock(), &ts) != 0)
+		return -1;
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Cost of one timer_now_ns() call, the floor of anything measured with it
+double timer_overhead_ns(void){
+	const int n = 100000;
+	int i;
+
+	const uint64_t t0 = timer_now_ns();
+	for(i=0; i < n; ++i)
+		timer_now_ns();
+	return (double)(timer_now_ns() - t0) / n;
+}
+
+static int cmp_double(const void *a, const void *b){
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void timer_stats(struct timer_stats *s, const double *samples, const int n){
+	double sorted[TIMER_MAX_TRIALS];
+	int i;
+
+	memset(s, 0, sizeof(struct timer_stats));
+	if(n <= 0)
+		return;
+
+	s->trials = n > TIMER_MAX_TRIALS ? TIMER_MAX_TRIALS : n;
+	memcpy(s->samples, samples, s->trials * sizeof(double));
+	memcpy(sorted, samples, s->trials * sizeof(double));
+	qsort(sorted, s->trials, sizeof(double), cmp_double);
+
+	s->min = sorted[0];
+	s->median = (s->trials % 2) ? sorted[s->trials / 2] : (sorted[s->trials / 2 - 1] + sorted[s->trials / 2]) / 2.0;
+	for(i=0; i < s->trials; ++i)
+		s->mean += sorted[i];
+	s->mean /= s->trials;
+
+	if(s->trials > 1){
+		for(i=0; i < s->trials; ++i)
+			s->stddev += (sorted[i] - s->mean) * (sorted[i] - s->mean);
+		s->stddev = sqrt(s->stddev / (s->trials - 1));
+
+		const double t = (s->trials - 1 <= 30) ? timer_t95[s->trials - 2] : 1.960;
+		s->ci95 = t * s->stddev / sqrt(s->trials);
+		s->converged = s->ci95 <= TIMER_TARGET_CI * fabs(s->mean);
+	}
+}
+
+// Remember an unconverged call for timer_topup(), a rerun of the same call replaces its entry
+static void timer_keep(timer_trial_fn trial, void *arg, struct timer_stats *s, const uint64_t cost){
+	int i;
+
+	for(i=0; i < timer_num_pending && timer_pending[i].s != s; ++i)
+		;
+	if(i == TIMER_MAX_PENDING)
+		return;
+	if(i == timer_num_pending)
+		timer_num_pending++;
+	timer_pending[i].trial = trial;
+	timer_pending[i].arg = arg;
+	timer_pending[i].s = s;
+	timer_pending[i].scale = timer_scale;
+	timer_pending[i].cost = cost;
+	timer_pending[i].failed = 0;
+}
+
+/*
+ * Run warmup untimed trials, then timed ones until the confidence interval
+ * narrows to TIMER_TARGET_CI of the mean. Without a budget that takes at
+ * least trials and at most twice as many. Under a budget it takes at least
+ * TIMER_MIN_TRIALS, one once the slice is spent, and stops adding trials when
+ * the next would overrun TIMER_CALL_SHARE of what is left of the slice, so
+ * tests that converge quickly leave their time to the noisy ones after them.
+ * Failed trials are dropped. Returns the number of trials that succeeded.
+ */
+int timer_trials(timer_trial_fn trial, void *arg, const int warmup, const int trials, struct timer_stats *s){
+	double samples[TIMER_MAX_TRIALS];
+	uint64_t start, now, deadline = 0;
+	int i, n = 0, min = trials, max = 2 * trials, spent = 0;
+
+	if(timer_deadline){
+		now = timer_now_ns();
+		spent = (now >= timer_deadline);
+		min = spent ? 1 : TIMER_MIN_TRIALS;
+		max = TIMER_MAX_TRIALS;
+		if(!spent)
+			deadline = now + (uint64_t)((timer_deadline - now) * TIMER_CALL_SHARE);
+	}
+	if(min > trials)
+		min = trials;
+	if(max > TIMER_MAX_TRIALS)
+		max = TIMER_MAX_TRIALS;
+
+	for(i=0; i < warmup && !spent; ++i)
+		trial(arg);
+
+	start = timer_now_ns();
+	for(i=0; i < max; ++i){
+		if(i >= min){
+			timer_stats(s, samples, n);
+			if(s->converged)
+				break;
+			// Stop when the next trial, as long as the mean one so far, would overrun
+			now = timer_now_ns();
+			if(timer_deadline && now + (now - start) / i > deadline)
+				break;
+		}
+		const double v = trial(arg);
+		if(v >= 0.0)
+			samples[n++] = v;
+	}
+
+	timer_stats(s, samples, n);
+	if(timer_deadline && !s->converged && n > 0)
+		timer_keep(trial, arg, s, (timer_now_ns() - start) / (i > 0 ? i : 1));
+	return n;
+}
+
+/*
+ * Spend up to seconds on extra trials of the calls that did not converge,
+ * one trial at a time to the one with the widest confidence interval
+ * relative to its mean, until all converged, are full or the next trial
+ * would overrun. Returns the number of trials added.
+ */
+int timer_topup(const double seconds){
+	const uint64_t deadline = timer_now_ns() + (uint64_t)((seconds > 0.0 ? seconds : 0.0) * 1e9);
+	double samples[TIMER_MAX_TRIALS];
+	int i, added = 0;
+
+	for(;;){
+		struct timer_pending *p = NULL;
+		double width = 0.0;
+		const uint64_t now = timer_now_ns();
+
+		for(i=0; i < timer_num_pending; ++i){
+			const struct timer_stats *s = timer_pending[i].s;
+			const double w = s->mean != 0.0 ? s->ci95 / fabs(s->mean) : 0.0;
+			if(timer_pending[i].failed || s->converged || s->trials >= TIMER_MAX_TRIALS || now + timer_pending[i].cost > deadline)
+				continue;
+			if(p == NULL || w > width){
+				p = &timer_pending[i];
+				width = w;
+			}
+		}
+		if(p == NULL)
+			break;
+
+		const double scale = timer_scale;
+		const uint64_t t0 = timer_now_ns();
+		timer_scale = p->scale;
+		const double v = p->trial(p->arg);
+		timer_scale = scale;
+		p->cost = timer_now_ns() - t0;
+		if(v < 0.0){
+			p->failed = 1;
+			continue;
+		}
+		memcpy(samples, p->s->samples, p->s->trials * sizeof(double));
+		samples[p->s->trials] = v;
+		timer_stats(p->s, samples, p->s->trials + 1);
+		added++;
+	}
+	timer_num_pending = 0;
+	return added;
+}
+
+// Start a slice of seconds for a module that takes nominal seconds without a budget
+void timer_slice(const double seconds, const double nominal){
+	timer_deadline = timer_now_ns() + (uint64_t)((seconds > 0.0 ? seconds : 0.0) * 1e9);
+	timer_scale = (nominal > seconds) ? seconds / nominal : 1.0;
+	if(timer_scale < TIMER_MIN_SCALE)
+		timer_scale = TIMER_MIN_SCALE;
+}
+
+void timer_slice_end(void){
+	timer_deadline = 0;
+	timer_scale = 1.0;
+}
+
+// Length of a fixed length test under the current slice
+double timer_scaled(const double seconds){
+	return seconds * timer_scale;
+}
+
+// Whether a step of seconds still fits in the current slice, always without a budget
+int timer_fits(const double seconds){
+	return !timer_deadline || timer_now_ns() + (uint64_t)(seconds > 0.0 ? seconds * 1e9 : 0.0) <= timer_deadline;
+}
+
+void timer_report(const struct timer_stats *s, const char *unit){
+	printf("\"stats\":{\"trials\":\"%i\",\"min\":\"%.3f%s\",\"median\":\"%.3f%s\",\"mean\":\"%.3f%s\",\"stddev\":\"%.3f%s\",\"ci95\":\"%.3f%s\",\"converged\":\"%s\"}",
+		s->trials, s->min, unit, s->median, unit, s->mean, unit, s->stddev, unit, s->ci95, unit, s->converged ? "yes" : "no");
+}
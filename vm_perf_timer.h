@@ -0,0 +1,50 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_TIMER_H
+#define VM_PERF_TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_WARMUP 1			// Untimed runs before the trials
+#define TIMER_TRIALS 5
+#define TIMER_MAX_TRIALS 64
+#define TIMER_MIN_TRIALS 3		// Under a time budget, before convergence is judged
+#define TIMER_TARGET_CI 0.02	// Converged once the 95% confidence interval is within 2% of the mean
+#define TIMER_CALL_SHARE 0.25	// Share of what is left of a slice one timer_trials() may spend on extra trials
+#define TIMER_MIN_SCALE 0.05	// Shortest fraction of their nominal time fixed length tests shrink to
+#define TIMER_MAX_PENDING 64	// Unconverged timer_trials() calls kept for timer_topup()
+
+struct timer_stats{
+	int trials;
+	double min;
+	double median;
+	double mean;
+	double stddev;				// Sample standard deviation
+	double ci95;				// Half width of the 95% confidence interval of the mean
+	int converged;				// ci95 reached TIMER_TARGET_CI of the mean
+	double samples[TIMER_MAX_TRIALS];	// In trial order, kept for comparing runs
+};
+
+// One trial of a benchmark, returns its measurement, < 0 on failure
+typedef double (*timer_trial_fn)(void *arg);
+
+uint64_t timer_now_ns(void);
+double timer_now(void);
+const char * timer_clock_name(void);
+long timer_resolution_ns(void);
+double timer_overhead_ns(void);
+
+void timer_stats(struct timer_stats *s, const double *samples, const int n);
+int timer_trials(timer_trial_fn trial, void *arg, const int warmup, const int trials, struct timer_stats *s);
+
+void timer_slice(const double seconds, const double nominal);
+void timer_slice_end(void);
+double timer_scaled(const double seconds);
+int timer_fits(const double seconds);
+int timer_topup(const double seconds);
+void timer_report(const struct timer_stats *s, const char *unit);
+
+#endif
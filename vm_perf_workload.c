@@ -0,0 +1,400 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm_perf_workload.h"
+#include "vm_perf_hist.h"
+#include "vm_perf_timer.h"
+#include "vm_perf_page.h"
+
+#define WORKLOAD_FILL_SIZE (1024*1024)
+
+static const char * workload_dir_names[WORKLOAD_NUM_DIRS] = {"read", "write"};
+
+// Offset permutation shared by all threads, block i of the sequence is (a * i + c) mod n with gcd(a, n) = 1
+struct workload_perm{
+	uint64_t n, a, c;
+	uint64_t next;				// Taken with an atomic add
+};
+
+struct workload_thread{
+	pthread_t tid;
+	int fd;
+	const struct workload_job *job;
+	struct workload_perm *perm;
+	uint64_t t0;
+	int num_points;
+	volatile int *stop;
+	unsigned int seed;
+
+	struct lat_hist total[WORKLOAD_NUM_DIRS];
+	struct lat_hist *point;		// num_points * WORKLOAD_NUM_DIRS
+};
+
+static int workload_start = 0;
+static pthread_mutex_t workload_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workload_start_cond = PTHREAD_COND_INITIALIZER;
+
+const char * workload_dir_name(const enum workload_dir dir){
+	return workload_dir_names[dir];
+}
+
+void workload_defaults(struct workload_job *job){
+	bzero(job, sizeof(struct workload_job));
+	job->threads = WORKLOAD_THREADS;
+	job->read_pct = WORKLOAD_READ_PCT;
+	job->block_size = WORKLOAD_BLOCK_SIZE;
+	job->time_s = WORKLOAD_TIME;
+	job->interval_s = WORKLOAD_INTERVAL;
+}
+
+static int workload_size(const char *s, unsigned long long *v){
+	char *end;
+	*v = strtoull(s, &end, 10);
+	switch(*end){
+		case 'k': case 'K': *v <<= 10; end++; break;
+		case 'm': case 'M': *v <<= 20; end++; break;
+		case 'g': case 'G': *v <<= 30; end++; break;
+		case 't': case 'T': *v <<= 40; end++; break;
+	}
+	return (end == s) || (*end != '\0' && *end != ',');
+}
+
+// size[,threads[,read%[,block_size]]], e.g. "64G,16,70,4k", size 0 keeps twice the RAM
+int workload_parse(struct workload_job *job, const char *spec){
+	unsigned long long v;
+	const char *p = spec;
+	int field;
+
+	for(field=0; p != NULL && *p != '\0'; ++field){
+		if(workload_size(p, &v) != 0)
+			return 1;
+		switch(field){
+			case 0: job->size = v;						 break;
+			case 1: job->threads = v;					 break;
+			case 2: job->read_pct = v;					 break;
+			case 3: job->block_size = v;				 break;
+			default: return 1;
+		}
+		if((p = strchr(p, ',')) != NULL)
+			p++;
+	}
+	return (job->threads < 1) || (job->threads > WORKLOAD_MAX_THREADS) || (job->read_pct > 100) ||
+		   (job->block_size < 512) || (job->block_size % 512 != 0);
+}
+
+static uint64_t workload_gcd(uint64_t a, uint64_t b){
+	while(b){
+		const uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static void workload_perm_init(struct workload_perm *p, const uint64_t n, unsigned int *seed){
+	p->n = n;
+	p->a = (uint64_t)(n * 0.6180339887) | 1;	// Far from 1 so consecutive operations land far apart
+	while(workload_gcd(p->a, n) != 1)
+		p->a += 2;
+	p->c = (((uint64_t)rand_r(seed) << 31) | rand_r(seed)) % n;
+	p->next = 0;
+}
+
+static inline uint64_t workload_perm_next(struct workload_perm *p){
+	const uint64_t i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->n;
+	return (uint64_t)(((unsigned __int128)p->a * i + p->c) % p->n);
+}
+
+static void *workload_thread(void *arg){
+	struct workload_thread *w = (struct workload_thread*) arg;
+	const struct workload_job *job = w->job;
+	const uint64_t interval_ns = job->interval_s * 1e9;
+	uint64_t deadline;
+	void *buffer;
+
+	if((buffer = page_alloc(job->block_size)) == NULL){
+		perror("mmap");
+		return NULL;
+	}
+	memset(buffer, 'w', job->block_size);
+
+	pthread_mutex_lock(&workload_start_mutex);
+	while(!workload_start) {
+		pthread_cond_wait(&workload_start_cond, &workload_start_mutex);
+	}
+	pthread_mutex_unlock(&workload_start_mutex);
+	deadline = w->t0 + (uint64_t)(job->time_s * 1e9);
+
+	while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+		const off_t off = (off_t)workload_perm_next(w->perm) * job->block_size;
+		const int dir = (unsigned int)(rand_r(&w->seed) % 100) < job->read_pct ? WORKLOAD_READ : WORKLOAD_WRITE;
+
+		const uint64_t t0 = timer_now_ns();
+		const ssize_t n = (dir == WORKLOAD_READ) ? pread(w->fd, buffer, job->block_size, off) : pwrite(w->fd, buffer, job->block_size, off);
+		const uint64_t t1 = timer_now_ns();
+		if(n != (ssize_t)job->block_size){
+			perror(dir == WORKLOAD_READ ? "pread" : "pwrite");
+			break;
+		}
+		if(t1 > deadline)		// Finished after the window, in no interval of it
+			break;
+
+		int point = (t1 - w->t0) / interval_ns;
+		if(point >= w->num_points)
+			point = w->num_points - 1;
+		hist_add(&w->total[dir], t1 - t0);
+		hist_add(&w->point[point * WORKLOAD_NUM_DIRS + dir], t1 - t0);
+	}
+
+	page_free(buffer);
+	return NULL;
+}
+
+/*
+ * Write every block once so reads are not served from unwritten extents,
+ * then drop the file from the page cache. Once the fill would leave less
+ * than reserve seconds of the time budget the file is cut to what it
+ * wrote, in whole blocks. Returns MB/s, < 0 on error.
+ */
+static float workload_fill(const int fd, off_t *size, const unsigned int block_size, const double reserve){
+	char *buffer;
+	off_t off;
+
+	if((buffer = page_alloc(WORKLOAD_FILL_SIZE)) == NULL){
+		perror("mmap");
+		return -1.0f;
+	}
+	memset(buffer, 'f', WORKLOAD_FILL_SIZE);
+
+	const uint64_t t0 = timer_now_ns();
+	for(off=0; off < *size; off += WORKLOAD_FILL_SIZE){
+		const size_t len = (*size - off < WORKLOAD_FILL_SIZE) ? *size - off : WORKLOAD_FILL_SIZE;
+		if(off - off % block_size >= block_size && !timer_fits(reserve)){
+			fprintf(stderr, "workload: filled %lluMB of %lluMB to fit the time budget\n", (unsigned long long)off >> 20, (unsigned long long)*size >> 20);
+			*size = off - off % block_size;
+			if(ftruncate(fd, *size) != 0)
+				perror("ftruncate");
+			break;
+		}
+		if(pwrite(fd, buffer, len, off) != (ssize_t)len){
+			perror("pwrite");
+			page_free(buffer);
+			return -1.0f;
+		}
+	}
+	if(fdatasync(fd) != 0)
+		perror("fdatasync");
+	const double elapsed = (timer_now_ns() - t0) / 1e9;
+	posix_fadvise(fd, 0, *size, POSIX_FADV_DONTNEED);
+
+	page_free(buffer);
+	return elapsed > 0.0 ? *size / elapsed / (1024*1024) : 0.0f;
+}
+
+// Twice the RAM unless configured, at most WORKLOAD_FREE_PCT of the free space, in whole blocks
+static off_t workload_resolve_size(const struct workload_job *job, const char *dir){
+	struct statvfs vfs;
+	off_t size = job->size;
+
+	if(size == 0)
+		size = 2 * (off_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	if(statvfs(dir, &vfs) == 0){
+		const off_t limit = (off_t)vfs.f_bavail * vfs.f_frsize / 100 * WORKLOAD_FREE_PCT;
+		if(size > limit){
+			fprintf(stderr, "workload: %lluMB does not fit, using %lluMB\n", (unsigned long long)size >> 20, (unsigned long long)limit >> 20);
+			size = limit;
+		}
+	}
+	return size - size % job->block_size;
+}
+
+static void workload_io_summary(struct workload_io *io, const struct lat_hist *h, const unsigned int block_size, const double elapsed){
+	io->ops		= h->count;
+	io->iops	= h->count / elapsed;
+	io->rate	= h->count * (double)block_size / elapsed / (1024*1024);
+	io->lat_avg = hist_mean(h) / 1e6;
+	io->lat_p50 = hist_percentile(h, 0.50)  / 1e6;
+	io->lat_p99 = hist_percentile(h, 0.99)  / 1e6;
+	io->lat_p999= hist_percentile(h, 0.999) / 1e6;
+}
+
+/*
+ * A descriptor of the filled file that bypasses the page cache, so writes
+ * complete on the device rather than in memory, or fd itself on filesystems
+ * without O_DIRECT or when the block size is below their alignment.
+ */
+static int workload_open_direct(const char *filename, const int fd, const unsigned int block_size, void *buffer){
+	int direct;
+
+	if((direct = open(filename, O_RDWR|O_DIRECT)) == -1)
+		return fd;
+	if(pread(direct, buffer, block_size, 0) != (ssize_t)block_size){
+		close(direct);
+		return fd;
+	}
+	return direct;
+}
+
+/*
+ * job->threads threads issue a read/write mix of job->block_size operations
+ * at offsets from one permutation of the file's blocks, so no block is hit
+ * twice until all of them were, for job->time_s seconds. The file is sized
+ * beyond the page cache and opened with O_DIRECT so the mix reaches the
+ * device. Operations completing after the window are not counted. Under a
+ * time budget the window and its points shrink with the slice, and the file
+ * is only filled as far as leaves time for the window.
+ */
+int workload_run(const struct workload_job *asked, struct workload_result *r){
+	struct workload_job scaled = *asked;
+	const struct workload_job *job = &scaled;
+	struct workload_thread *w;
+	struct workload_perm perm;
+	volatile int stop = 0;
+	unsigned int seed = (unsigned int) timer_now_ns();
+	char dir[4096];
+	unsigned int i, started = 0;
+	int fd, p;
+
+	scaled.time_s = timer_scaled(asked->time_s);
+	scaled.interval_s = timer_scaled(asked->interval_s);
+	bzero(r, sizeof(struct workload_result));
+	r->job = *job;
+
+	snprintf(dir, sizeof(dir), "%s", job->filename);
+	if(strrchr(dir, '/') != NULL)
+		*strrchr(dir, '/') = '\0';
+	else
+		snprintf(dir, sizeof(dir), ".");
+	if((r->job.size = workload_resolve_size(job, dir)) < job->block_size)
+		return 1;
+
+	r->num_points = (int)(job->time_s / job->interval_s + 0.5);
+	if(r->num_points < 1) r->num_points = 1;
+	if(r->num_points > WORKLOAD_MAX_POINTS) r->num_points = WORKLOAD_MAX_POINTS;
+
+	if((fd = open(job->filename, O_RDWR|O_CREAT|O_TRUNC, 0666)) == -1){
+		perror("open");
+		return 1;
+	}
+	if((errno = posix_fallocate(fd, 0, r->job.size)) != 0){
+		perror("posix_fallocate");
+		unlink(job->filename);
+		close(fd);
+		return 1;
+	}
+	if((r->fill_rate = workload_fill(fd, &r->job.size, job->block_size, job->time_s)) < 0.0f){
+		unlink(job->filename);
+		close(fd);
+		return 1;
+	}
+
+	// Reopened by name, so the file goes only once the test holds it
+	void *probe;
+	int io_fd = fd;
+	if((probe = page_alloc(job->block_size)) != NULL){
+		io_fd = workload_open_direct(job->filename, fd, job->block_size, probe);
+		page_free(probe);
+	}
+	unlink(job->filename);
+	if(io_fd != fd){
+		close(fd);
+		fd = io_fd;
+		r->direct = 1;
+	}else
+		fprintf(stderr, "workload: no O_DIRECT on %s, write latency is of the page cache\n", dir);
+
+	if((w = calloc(job->threads, sizeof(struct workload_thread))) == NULL){
+		perror("calloc");
+		close(fd);
+		return 1;
+	}
+	workload_perm_init(&perm, r->job.size / job->block_size, &seed);
+
+	workload_start = 0;
+	for(i=0; i < job->threads; ++i){
+		w[i].fd = fd;
+		w[i].job = job;
+		w[i].perm = &perm;
+		w[i].num_points = r->num_points;
+		w[i].stop = &stop;
+		w[i].seed = seed + i;
+		hist_init(&w[i].total[WORKLOAD_READ]);
+		hist_init(&w[i].total[WORKLOAD_WRITE]);
+		if((w[i].point = malloc(r->num_points * WORKLOAD_NUM_DIRS * sizeof(struct lat_hist))) == NULL){
+			perror("malloc");
+			break;
+		}
+		for(p=0; p < r->num_points * WORKLOAD_NUM_DIRS; ++p)
+			hist_init(&w[i].point[p]);
+		if(pthread_create(&w[i].tid, NULL, workload_thread, &w[i]) != 0){
+			perror("pthread_create");
+			free(w[i].point);
+			break;
+		}
+		started++;
+	}
+
+	pthread_mutex_lock(&workload_start_mutex);
+	const uint64_t start = timer_now_ns();
+	for(i=0; i < started; ++i)
+		w[i].t0 = start;		// Read by the threads only after the barrier
+	workload_start = 1;
+	pthread_cond_broadcast(&workload_start_cond);
+	pthread_mutex_unlock(&workload_start_mutex);
+
+	struct timespec ts = {(time_t)job->time_s, (long)((job->time_s - (time_t)job->time_s) * 1e9)};
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	struct lat_hist total[WORKLOAD_NUM_DIRS];
+	hist_init(&total[WORKLOAD_READ]);
+	hist_init(&total[WORKLOAD_WRITE]);
+	for(i=0; i < started; ++i)
+		pthread_join(w[i].tid, NULL);
+	double elapsed = (timer_now_ns() - start) / 1e9;
+	if(elapsed > job->time_s)
+		elapsed = job->time_s;
+
+	for(p=0; p < r->num_points; ++p){
+		struct workload_point *pt = &r->point[p];
+		int d;
+		pt->t = (p + 1) * job->interval_s;
+		for(d=0; d < WORKLOAD_NUM_DIRS; ++d){
+			struct lat_hist h;
+			hist_init(&h);
+			for(i=0; i < started; ++i)
+				hist_merge(&h, &w[i].point[p * WORKLOAD_NUM_DIRS + d]);
+			pt->iops[d] = h.count / job->interval_s;
+			pt->rate[d] = h.count * (double)job->block_size / job->interval_s / (1024*1024);
+			pt->lat_p99[d] = hist_percentile(&h, 0.99) / 1e6;
+		}
+	}
+	for(i=0; i < started; ++i){
+		hist_merge(&total[WORKLOAD_READ], &w[i].total[WORKLOAD_READ]);
+		hist_merge(&total[WORKLOAD_WRITE], &w[i].total[WORKLOAD_WRITE]);
+		free(w[i].point);
+	}
+	workload_io_summary(&r->io[WORKLOAD_READ], &total[WORKLOAD_READ], job->block_size, elapsed);
+	workload_io_summary(&r->io[WORKLOAD_WRITE], &total[WORKLOAD_WRITE], job->block_size, elapsed);
+
+	free(w);
+	close(fd);
+	return started == 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2015 Loading Deck Limited - https://www.loadingdeck.com/
+ * Use of this program or parts thereof is subject to the GPLv3 licence
+ */
+
+#ifndef VM_PERF_WORKLOAD_H
+#define VM_PERF_WORKLOAD_H
+
+#include <sys/types.h>
+
+#define WORKLOAD_MAX_THREADS 64
+#define WORKLOAD_MAX_POINTS 120
+#define WORKLOAD_THREADS 8
+#define WORKLOAD_READ_PCT 70
+#define WORKLOAD_BLOCK_SIZE 16384
+#define WORKLOAD_TIME 30.0f				// Seconds
+#define WORKLOAD_INTERVAL 1.0f			// Seconds per point of the time series
+#define WORKLOAD_FREE_PCT 50			// Never take more than this much of the free space
+
+enum workload_dir{
+	WORKLOAD_READ = 0,
+	WORKLOAD_WRITE,
+	WORKLOAD_NUM_DIRS
+};
+
+struct workload_job{
+	const char *filename;
+	off_t size;					// 0 for twice the RAM
+	unsigned int threads;
+	unsigned int read_pct;		// Share of the operations that are reads
+	unsigned int block_size;
+	float time_s;
+	float interval_s;
+};
+
+struct workload_io{
+	unsigned long ops;
+	float iops;
+	float rate;					// MB/s
+	float lat_avg;				// ms
+	float lat_p50;
+	float lat_p99;
+	float lat_p999;
+};
+
+struct workload_point{
+	float t;					// End of the interval in seconds from the start
+	float iops[WORKLOAD_NUM_DIRS];
+	float rate[WORKLOAD_NUM_DIRS];
+	float lat_p99[WORKLOAD_NUM_DIRS];
+};
+
+struct workload_result{
+	struct workload_job job;	// As run, with the size resolved
+	float fill_rate;			// MB/s of the sequential pass that writes every block before the test
+	int direct;					// O_DIRECT, writes through the page cache only where the filesystem refuses it
+	struct workload_io io[WORKLOAD_NUM_DIRS];
+	int num_points;
+	struct workload_point point[WORKLOAD_MAX_POINTS];
+};
+
+void workload_defaults(struct workload_job *job);
+int workload_parse(struct workload_job *job, const char *spec);
+int workload_run(const struct workload_job *job, struct workload_result *r);
+const char * workload_dir_name(const enum workload_dir dir);
+
+#endif